@@ -54,6 +54,10 @@ typedef enum FfxCborStatus {
    // The CBOR data contains an unsupported value type(e.g. tags)
    FfxCborStatusUnsupportedType   = -52,
 
+   // The CBOR data is malformed (e.g. has trailing data after the
+   // root item)
+   FfxCborStatusMalformed         = -53,
+
    // Value represented does not fit within a uint64
    FfxCborStatusOverflow          = -55,
 } FfxCborStatus;
@@ -82,6 +86,33 @@ typedef struct FfxCborCursor {
 } FfxCborCursor;
 
 
+/**
+ *  A contiguous run of bytes within a segmented builder.
+ */
+typedef struct FfxCborSegment {
+    const uint8_t *data;
+    size_t length;
+} FfxCborSegment;
+
+/**
+ *  The granularity an arena-backed builder grows by.
+ */
+#define FFX_CBOR_ARENA_BLOCK_SIZE   (128)
+
+/**
+ *  A memory pool handed out to builders in fixed-size blocks, which
+ *  is released all at once with [[ffx_cbor_resetArena]].
+ *
+ *  This should not be modified directly! Only use the provided API.
+ */
+typedef struct FfxCborArena {
+    uint8_t *data;
+    size_t blockCount;
+
+    // The number of blocks handed out
+    size_t used;
+} FfxCborArena;
+
 /**
  *  A builder used to create and write CBOR-encoded data.
  *
@@ -97,9 +128,150 @@ typedef struct FfxCborBuilder {
     // be used for intermediate data during transform.
     bool sparse;
 
+    // A segmented builder records references to external buffers
+    // instead of copying them; headers are still written to data.
+    FfxCborSegment *segments;
+    size_t segmentCount;
+    size_t maxSegments;
+
+    // The offset within data the current inline segment began
+    size_t segmentStart;
+
+    // The total length of all referenced buffers
+    size_t refLength;
+
+    // An arena-backed builder grows as needed
+    FfxCborArena *arena;
+
     FfxCborStatus status;
 } FfxCborBuilder;
 
+/**
+ *  Callback used to stream the segments of a builder.
+ */
+typedef void (*FfxCborWriteFunc)(void *arg, const uint8_t *data,
+  size_t length);
+
+
+/**
+ *  The maximum length of a pre-encoded key, so that its length fits
+ *  within its header byte.
+ */
+#define FFX_CBOR_MAX_KEY_LENGTH     (23)
+
+/**
+ *  A String pre-encoded along with its header, for Map keys which
+ *  are used frequently. Declare one using FFX_CBOR_KEY, e.g.
+ *
+ *    static const FfxCborKey keyId = FFX_CBOR_KEY("id");
+ *
+ *  The encoded bytes are the header followed by the key, so they can
+ *  be appended or compared against the wire with a single memcpy or
+ *  memcmp.
+ */
+typedef struct FfxCborKey {
+    uint8_t header;
+    char key[FFX_CBOR_MAX_KEY_LENGTH];
+} FfxCborKey;
+
+// Fails to compile if the key is longer than FFX_CBOR_MAX_KEY_LENGTH
+#define FFX_CBOR_KEY(k)    { \
+    .header = (3 << 5) | (sizeof(char[(sizeof(k) <= \
+      FFX_CBOR_MAX_KEY_LENGTH + 1) ? sizeof(k): -1]) - 1), \
+    .key = k \
+}
+
+/**
+ *  The maximum nesting of Arrays and Maps the validator supports.
+ */
+#define FFX_CBOR_MAX_DEPTH          (16)
+
+/**
+ *  The maximum number of root Map entries the validator indexes.
+ */
+#define FFX_CBOR_MAX_INDEX          (8)
+
+/**
+ *  A resumable validator, which consumes CBOR-encoded data in chunks
+ *  of any size as they arrive, rejecting malformed data as early as
+ *  possible.
+ *
+ *  The offset of each key in a root Map is indexed along the way, so
+ *  they can be followed once complete without re-scanning the data.
+ *
+ *  This should not be modified directly! Only use the provided API.
+ */
+typedef struct FfxCborValidator {
+    // The total expected length (0 if unknown) and the number of
+    // bytes consumed so far
+    size_t length;
+    size_t offset;
+
+    // The header of the current item and the pending bytes for its
+    // header value or its Data or String payload
+    uint8_t header;
+    uint8_t pendingHeader;
+    uint64_t value;
+    size_t pendingData;
+
+    // The number of items remaining in each open container
+    size_t depth;
+    uint32_t remaining[FFX_CBOR_MAX_DEPTH];
+
+    // The number of entries in the root Map and their key offsets
+    int32_t rootCount;
+    size_t indexCount;
+    size_t index[FFX_CBOR_MAX_INDEX];
+
+    bool done;
+    FfxCborStatus status;
+} FfxCborValidator;
+
+
+/**
+ *  The maximum number of steps in a compiled query path.
+ */
+#define FFX_CBOR_QUERY_MAX_STEPS    (8)
+
+/**
+ *  The maximum number of queries resolved together.
+ */
+#define FFX_CBOR_QUERY_MAX_COUNT    (32)
+
+/**
+ *  A single step of a query path. The key references the original
+ *  path, which must remain valid while the query is used.
+ */
+typedef struct FfxCborQueryStep {
+    const char *key;
+    size_t length;
+
+    // The Array index for a numeric step, otherwise -1
+    int32_t index;
+} FfxCborQueryStep;
+
+/**
+ *  A dotted path (e.g. "params.0.to") compiled into steps, which can
+ *  be resolved along with other queries in a single traversal.
+ *
+ *  This should not be modified directly! Only use the provided API.
+ */
+typedef struct FfxCborQuery {
+    size_t stepCount;
+    FfxCborQueryStep steps[FFX_CBOR_QUERY_MAX_STEPS];
+} FfxCborQuery;
+
+/**
+ *  A query of the single (non-numeric) Map key %%k%%, compiled at build
+ *  time, e.g.
+ *
+ *    static const FfxCborQuery queryTo = FFX_CBOR_QUERY_KEY("to");
+ */
+#define FFX_CBOR_QUERY_KEY(k)    { \
+    .stepCount = 1, \
+    .steps = { { .key = k, .length = sizeof(k) - 1, .index = -1 } } \
+}
+
 
 // Detects if an error occurred during crawl or build... @TODO
 FfxCborStatus ffx_cbor_getStatus(FfxCborCursor *cursor);
@@ -148,6 +320,23 @@ FfxCborStatus ffx_cbor_getLength(FfxCborCursor *cursor, size_t *count);
  */
 FfxCborStatus ffx_cbor_followKey(FfxCborCursor *cursor, const char *key);
 
+/**
+ *  Moves the %%cursor%% to the value for the pre-encoded %%key%%
+ *  within a Map.
+ *
+ *  Keys are compared in their encoded form, so only keys using the
+ *  shortest (canonical) String header match.
+ *
+ *  If the Map does not have %%key%%, returns CborStatusNotFound.
+ */
+FfxCborStatus ffx_cbor_followEncodedKey(FfxCborCursor *cursor,
+  const FfxCborKey *key);
+
+/**
+ *  Returns true if the item at %%cursor%% is the pre-encoded %%key%%.
+ */
+bool ffx_cbor_matchKey(FfxCborCursor *cursor, const FfxCborKey *key);
+
 /**
  *  Moves the %%cursor%% to the %%index%% value within an Array.
  *
@@ -187,9 +376,108 @@ FfxCborStatus _ffx_cbor_next(FfxCborCursor *cursor);
 void ffx_cbor_dump(FfxCborCursor *cursor);
 
 
+/**
+ *  Initialize a validator for %%length%% bytes of CBOR data. If the
+ *  length is not known, use 0.
+ */
+void ffx_cbor_initValidator(FfxCborValidator *validator, size_t length);
+
+/**
+ *  Validate the next %%length%% bytes of %%data%%.
+ *
+ *  Once an error is encountered, all further calls return it.
+ */
+FfxCborStatus ffx_cbor_updateValidator(FfxCborValidator *validator,
+  const uint8_t *data, size_t length);
+
+/**
+ *  Completes validation, returning an error if the root item is not
+ *  complete or any error was encountered during validation.
+ */
+FfxCborStatus ffx_cbor_finalValidator(FfxCborValidator *validator);
+
+/**
+ *  Moves the %%cursor%%, which must be at the root of the validated
+ *  data, to the value for %%key%% within the root Map, using the
+ *  index built by %%validator%%.
+ *
+ *  If the Map does not have %%key%%, returns CborStatusNotFound.
+ */
+FfxCborStatus ffx_cbor_followValidatedKey(FfxCborValidator *validator,
+  FfxCborCursor *cursor, const FfxCborKey *key);
+
+
+/**
+ *  Compile the dotted %%path%% into %%query%%.
+ *
+ *  Each step follows a Map key, or for a numeric step, an Array index
+ *  (a numeric step on a Map follows the key with that name).
+ */
+FfxCborStatus ffx_cbor_compileQuery(FfxCborQuery *query, const char *path);
+
+/**
+ *  Resolve %%count%% %%queries%% against the container at %%cursor%%
+ *  in a single forward traversal, where queries sharing a parent only
+ *  scan it once and each container is only scanned until all the
+ *  queries within it are found.
+ *
+ *  Each of %%results%% is moved to the value for its query, with the
+ *  matching entry in %%statuses%% set to FfxCborStatusOK, or to
+ *  FfxCborStatusNotFound if the path does not exist (including a path
+ *  through a value which is not a Map or Array).
+ */
+FfxCborStatus ffx_cbor_resolveQueries(FfxCborCursor *cursor,
+  const FfxCborQuery *queries, size_t count, FfxCborCursor *results,
+  FfxCborStatus *statuses);
+
+
 // Initialize a CBOR builder.
 void ffx_cbor_build(FfxCborBuilder *builder, uint8_t *data, size_t length);
 
+/**
+ *  Initialize a segmented CBOR builder, which writes headers and
+ *  small values to %%data%%, but only records references to buffers
+ *  appended with [[ffx_cbor_appendDataRef]] or nested builders,
+ *  using up to %%count%% %%segments%%.
+ *
+ *  Referenced buffers must remain valid until the builder has been
+ *  written using [[ffx_cbor_writeSegments]].
+ */
+void ffx_cbor_buildSegmented(FfxCborBuilder *builder, uint8_t *data,
+  size_t length, FfxCborSegment *segments, size_t count);
+
+/**
+ *  Streams the encoded data to %%write%%, one segment at a time,
+ *  without flattening it. For a non-segmented builder, this is
+ *  called once for the entire buffer.
+ */
+void ffx_cbor_writeSegments(FfxCborBuilder *builder, FfxCborWriteFunc write,
+  void *arg);
+
+/**
+ *  Initialize an arena with the memory %%data%%, which is divided
+ *  into FFX_CBOR_ARENA_BLOCK_SIZE blocks.
+ */
+void ffx_cbor_initArena(FfxCborArena *arena, uint8_t *data, size_t length);
+
+/**
+ *  Release every block handed out by %%arena%%. Any builder using it
+ *  must no longer be used.
+ */
+void ffx_cbor_resetArena(FfxCborArena *arena);
+
+/**
+ *  Initialize a CBOR builder backed by %%arena%%, which grows a block
+ *  at a time as data is appended, so its size need not be known in
+ *  advance. Only the most recently initialized builder of an arena
+ *  can grow.
+ *
+ *  If %%segments%% is not NULL, the builder is also segmented (see
+ *  [[ffx_cbor_buildSegmented]]).
+ */
+void ffx_cbor_buildArena(FfxCborBuilder *builder, FfxCborArena *arena,
+  FfxCborSegment *segments, size_t count);
+
 // Initialize a CBOR builder.
 void ffx_cbor_buildSparse(FfxCborBuilder *builder, uint8_t *data,
   size_t length);
@@ -209,6 +497,14 @@ FfxCborStatus ffx_cbor_appendNumber(FfxCborBuilder *builder, uint64_t value);
 FfxCborStatus ffx_cbor_appendData(FfxCborBuilder *builder, uint8_t *data,
   size_t length);
 
+// Append data, by reference for a segmented builder.
+FfxCborStatus ffx_cbor_appendDataRef(FfxCborBuilder *builder,
+  const uint8_t *data, size_t length);
+
+// Append a pre-encoded key; this is a single copy.
+FfxCborStatus ffx_cbor_appendKey(FfxCborBuilder *builder,
+  const FfxCborKey *key);
+
 // Append a string.
 FfxCborStatus ffx_cbor_appendString(FfxCborBuilder *builder, char* str);
 
@@ -244,6 +540,8 @@ FfxCborStatus ffx_cbor_appendCborRaw(FfxCborBuilder *builder, uint8_t *data,
 
 /**
  *  Append an entire CborBuilder %%src%% to an entry in %%dst%%.
+ *
+ *  If %%dst%% is segmented, %%src%% is referenced rather than copied.
  */
 FfxCborStatus ffx_cbor_appendCborBuilder(FfxCborBuilder *dst,
   FfxCborBuilder *src);
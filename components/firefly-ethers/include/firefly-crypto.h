@@ -26,6 +26,11 @@ extern "C" {
 bool ffx_pk_signSecp256k1(uint8_t *privkey, uint8_t *digest,
   uint8_t *signature);
 
+// Whether %%signature%% (its r and s) of %%digest%% is by %%pubkey%%
+// (uncompressed, without the prefix)
+bool ffx_pk_verifySecp256k1(uint8_t *pubkey, uint8_t *digest,
+  uint8_t *signature);
+
 bool ffx_pk_recoverPubkeySecp256k1(uint8_t *digest,
   uint8_t *signature, uint8_t *pubkey);
 
@@ -35,6 +40,10 @@ bool ffx_pk_computePubkeySecp256k1(uint8_t *privkey,
 void ffx_pk_compressPubkeySecp256k1(uint8_t *pubkey, uint8_t *compPubkey);
 void ffx_pk_decompressPubkeySecp256k1(uint8_t *compPubkey, uint8_t *pubkey);
 
+// Whether the (uncompressed) pubkey is a point on the curve; check
+// untrusted keys before using them in a shared secret
+bool ffx_pk_isValidPubkeySecp256k1(uint8_t *pubkey);
+
 bool ffx_pk_computeSharedSecretSecp256k1(uint8_t *privkey,
   uint8_t *otherPubkey, uint8_t *sharedSecret);
 
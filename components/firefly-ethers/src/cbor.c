@@ -1,3 +1,4 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -360,43 +361,63 @@ FfxCborStatus ffx_cbor_nextValue(FfxCborCursor *cursor, FfxCborCursor *key) {
     return FfxCborStatusOK;
 }
 
-static bool _keyCompare(const char *key, FfxCborCursor *cursor) {
-    size_t sLen = strlen(key);
+// Compares the String (or Data) at cursor to key, without copying
+static bool _keyCompare(const char *key, size_t length,
+  FfxCborCursor *cursor) {
 
+    uint8_t *data = NULL;
     size_t cLen = 0;
-    ffx_cbor_getLength(cursor, &cLen);
+    if (ffx_cbor_getData(cursor, &data, &cLen)) { return false; }
 
-    if (sLen != cLen) { return false; }
+    if (length != cLen) { return false; }
 
-    char cStr[cLen];
-    ffx_cbor_copyData(cursor, (uint8_t*)cStr, cLen);
-
-    for (int i = 0; i < sLen; i++) {
-        if (key[i] != cStr[i]) { return false; }
-    }
+    return (memcmp(key, data, length) == 0);
+}
 
-    return true;
+bool ffx_cbor_matchKey(FfxCborCursor *cursor, const FfxCborKey *key) {
+    size_t length = 1 + (key->header & 0x1f);
+    if (cursor->offset >= cursor->length) { return false; }
+    if (cursor->length - cursor->offset < length) { return false; }
+    return (memcmp(key, &cursor->data[cursor->offset], length) == 0);
 }
 
 FfxCborStatus ffx_cbor_followKey(FfxCborCursor *cursor, const char *key) {
     FfxCborType type = ffx_cbor_getType(cursor);
     if (type != FfxCborTypeMap) { return FfxCborStatusInvalidOperation; }
 
+    size_t length = strlen(key);
+
     FfxCborCursor follow, followKey;
     ffx_cbor_clone(&follow, cursor);
 
     FfxCborStatus status = ffx_cbor_firstValue(&follow, &followKey);
-    if (_keyCompare(key, &followKey)) {
-        ffx_cbor_clone(cursor, &follow);
-        return FfxCborStatusOK;
+    while (status == FfxCborStatusOK) {
+        if (_keyCompare(key, length, &followKey)) {
+            ffx_cbor_clone(cursor, &follow);
+            return FfxCborStatusOK;
+        }
+        status = ffx_cbor_nextValue(&follow, &followKey);
     }
 
-    while(status == 0) {
-        status = ffx_cbor_nextValue(&follow, &followKey);
-        if (_keyCompare(key, &followKey)) {
+    return FfxCborStatusNotFound;
+}
+
+FfxCborStatus ffx_cbor_followEncodedKey(FfxCborCursor *cursor,
+  const FfxCborKey *key) {
+
+    FfxCborType type = ffx_cbor_getType(cursor);
+    if (type != FfxCborTypeMap) { return FfxCborStatusInvalidOperation; }
+
+    FfxCborCursor follow, followKey;
+    ffx_cbor_clone(&follow, cursor);
+
+    FfxCborStatus status = ffx_cbor_firstValue(&follow, &followKey);
+    while (status == FfxCborStatusOK) {
+        if (ffx_cbor_matchKey(&followKey, key)) {
             ffx_cbor_clone(cursor, &follow);
             return FfxCborStatusOK;
         }
+        status = ffx_cbor_nextValue(&follow, &followKey);
     }
 
     return FfxCborStatusNotFound;
@@ -438,7 +459,7 @@ static void _dump(FfxCborCursor *cursor) {
         case FfxCborTypeNumber: {
             uint64_t value;
             ffx_cbor_getValue(cursor, &value);
-            printf("%lld", value);
+            printf("%" PRIu64, value);
             break;
         }
 
@@ -520,16 +541,392 @@ void ffx_cbor_dump(FfxCborCursor *cursor) {
     printf("\n");
 }
 
+///////////////////////////////
+// Validator
+
+static FfxCborStatus _validatorFail(FfxCborValidator *validator,
+  FfxCborStatus status) {
+    validator->status = status;
+    return status;
+}
+
+// Marks the current item complete, closing any containers it completes
+static void _validatorComplete(FfxCborValidator *validator) {
+    while (validator->depth) {
+        if (--validator->remaining[validator->depth - 1]) { return; }
+        validator->depth--;
+    }
+    validator->done = true;
+}
+
+// Called once the header of the current item (and its value) is read
+static FfxCborStatus _validatorItem(FfxCborValidator *validator) {
+    uint64_t value = validator->value;
+
+    size_t safe = (size_t)-1;
+    if (validator->length) { safe = validator->length - validator->offset; }
+
+    switch (validator->header >> 5) {
+        case 0:
+            _validatorComplete(validator);
+            break;
+
+        case 2: case 3:
+            if (value > 0xffffffff) { return FfxCborStatusOverflow; }
+            if (value > safe) { return FfxCborStatusBufferOverrun; }
+            validator->pendingData = value;
+            if (value == 0) { _validatorComplete(validator); }
+            break;
+
+        case 4: case 5: {
+            if (value > 0xffffff) { return FfxCborStatusOverflow; }
+
+            bool isMap = ((validator->header >> 5) == 5);
+            uint32_t count = isMap ? 2 * value: value;
+
+            // Each item requires at least one byte
+            if (count > safe) { return FfxCborStatusBufferOverrun; }
+
+            if (validator->depth == 0 && isMap) {
+                validator->rootCount = value;
+            }
+
+            if (count == 0) {
+                _validatorComplete(validator);
+                break;
+            }
+
+            if (validator->depth == FFX_CBOR_MAX_DEPTH) {
+                return FfxCborStatusOverflow;
+            }
+
+            validator->remaining[validator->depth++] = count;
+            break;
+        }
+
+        default:
+            return FfxCborStatusUnsupportedType;
+    }
+
+    return FfxCborStatusOK;
+}
+
+void ffx_cbor_initValidator(FfxCborValidator *validator, size_t length) {
+    memset(validator, 0, sizeof(FfxCborValidator));
+    validator->length = length;
+}
+
+FfxCborStatus ffx_cbor_updateValidator(FfxCborValidator *validator,
+  const uint8_t *data, size_t length) {
+
+    if (validator->status) { return validator->status; }
+
+    size_t i = 0;
+    while (i < length) {
+
+        // Any data after the root item is complete is junk
+        if (validator->done) {
+            return _validatorFail(validator, FfxCborStatusMalformed);
+        }
+
+        // Skip over the Data or String payload
+        if (validator->pendingData) {
+            size_t count = length - i;
+            if (count > validator->pendingData) {
+                count = validator->pendingData;
+            }
+
+            i += count;
+            validator->offset += count;
+            validator->pendingData -= count;
+
+            if (validator->pendingData == 0) {
+                _validatorComplete(validator);
+            }
+            continue;
+        }
+
+        uint8_t byte = data[i++];
+        validator->offset++;
+
+        // Reading the big-endian value bytes following the header
+        if (validator->pendingHeader) {
+            validator->value = (validator->value << 8) | byte;
+            if (--validator->pendingHeader) { continue; }
+
+            FfxCborStatus status = _validatorItem(validator);
+            if (status) { return _validatorFail(validator, status); }
+            continue;
+        }
+
+        // A new item; index the keys of a root Map
+        if (validator->depth == 1 && validator->rootCount &&
+          (validator->remaining[0] % 2) == 0 &&
+          validator->indexCount < FFX_CBOR_MAX_INDEX) {
+            validator->index[validator->indexCount++] = validator->offset - 1;
+        }
+
+        validator->header = byte;
+        validator->value = 0;
+
+        uint8_t count = byte & 0x1f;
+
+        switch (byte >> 5) {
+            // Negative numbers and tags are not currently supported
+            case 1: case 6:
+                return _validatorFail(validator,
+                  FfxCborStatusUnsupportedType);
+
+            case 7:
+                if (count < 20 || count > 22) {
+                    return _validatorFail(validator,
+                      FfxCborStatusUnsupportedType);
+                }
+                _validatorComplete(validator);
+                continue;
+        }
+
+        // Short value
+        if (count <= 23) {
+            validator->value = count;
+            FfxCborStatus status = _validatorItem(validator);
+            if (status) { return _validatorFail(validator, status); }
+            continue;
+        }
+
+        // Indefinite lengths are not currently supported
+        if (count > 27) {
+            return _validatorFail(validator, FfxCborStatusUnsupportedType);
+        }
+
+        // 24 => 1, 25 => 2, 26 => 4, 27 => 8
+        validator->pendingHeader = 1 << (count - 24);
+    }
+
+    return FfxCborStatusOK;
+}
+
+FfxCborStatus ffx_cbor_finalValidator(FfxCborValidator *validator) {
+    if (validator->status) { return validator->status; }
+
+    if (!validator->done) {
+        return _validatorFail(validator, FfxCborStatusBufferOverrun);
+    }
+
+    if (validator->length && validator->offset != validator->length) {
+        return _validatorFail(validator, FfxCborStatusMalformed);
+    }
+
+    return FfxCborStatusOK;
+}
+
+FfxCborStatus ffx_cbor_followValidatedKey(FfxCborValidator *validator,
+  FfxCborCursor *cursor, const FfxCborKey *key) {
+
+    if (validator->status || !validator->done) {
+        return FfxCborStatusInvalidOperation;
+    }
+
+    // Not every key was indexed; fallback onto scanning
+    if (validator->indexCount < validator->rootCount) {
+        return ffx_cbor_followEncodedKey(cursor, key);
+    }
+
+    if (ffx_cbor_getType(cursor) != FfxCborTypeMap) {
+        return FfxCborStatusInvalidOperation;
+    }
+
+    FfxCborCursor follow;
+    for (int i = 0; i < validator->indexCount; i++) {
+        ffx_cbor_clone(&follow, cursor);
+        follow.offset = validator->index[i];
+        follow.containerCount = 0;
+        follow.containerIndex = 0;
+
+        if (!ffx_cbor_matchKey(&follow, key)) { continue; }
+
+        FfxCborStatus status = _ffx_cbor_next(&follow);
+        if (status) { return status; }
+
+        follow.containerCount = -validator->rootCount;
+        follow.containerIndex = i;
+        ffx_cbor_clone(cursor, &follow);
+
+        return FfxCborStatusOK;
+    }
+
+    return FfxCborStatusNotFound;
+}
+
+
+///////////////////////////////
+// Query
+
+FfxCborStatus ffx_cbor_compileQuery(FfxCborQuery *query, const char *path) {
+    query->stepCount = 0;
+
+    const char *key = path;
+    while (1) {
+        const char *end = key;
+        while (*end && *end != '.') { end++; }
+
+        if (end == key) { return FfxCborStatusInvalidOperation; }
+
+        if (query->stepCount == FFX_CBOR_QUERY_MAX_STEPS) {
+            return FfxCborStatusOverflow;
+        }
+
+        FfxCborQueryStep *step = &query->steps[query->stepCount++];
+        step->key = key;
+        step->length = end - key;
+
+        // Numeric steps may also follow an Array index
+        step->index = 0;
+        for (const char *c = key; c < end; c++) {
+            if (*c < '0' || *c > '9' || step->index > 0xffffff) {
+                step->index = -1;
+                break;
+            }
+            step->index = (step->index * 10) + (*c - '0');
+        }
+
+        if (*end == 0) { break; }
+        key = end + 1;
+    }
+
+    return FfxCborStatusOK;
+}
+
+static FfxCborStatus _resolve(FfxCborCursor *cursor, size_t depth,
+  uint32_t active, const FfxCborQuery *queries, size_t count,
+  FfxCborCursor *results, FfxCborStatus *statuses) {
+
+    // Nothing to follow; the paths through here do not exist (and
+    // their statuses are already NotFound)
+    FfxCborType type = ffx_cbor_getType(cursor);
+    if (type != FfxCborTypeMap && type != FfxCborTypeArray) {
+        return FfxCborStatusOK;
+    }
+
+    FfxCborCursor follow, followKey;
+    ffx_cbor_clone(&follow, cursor);
+
+    FfxCborStatus status = ffx_cbor_firstValue(&follow,
+      (type == FfxCborTypeMap) ? &followKey: NULL);
+
+    for (size_t index = 0; status == FfxCborStatusOK && active; index++) {
+
+        // Find all the queries which match this entry
+        uint32_t matched = 0;
+        for (int i = 0; i < count; i++) {
+            if (!(active & (1U << i))) { continue; }
+
+            const FfxCborQueryStep *step = &queries[i].steps[depth];
+
+            if (type == FfxCborTypeArray) {
+                if (step->index != index) { continue; }
+            } else if (!_keyCompare(step->key, step->length, &followKey)) {
+                continue;
+            }
+
+            matched |= (1U << i);
+        }
+
+        active &= ~matched;
+
+        // Complete any matched queries ending here, and descend once
+        // for all the others
+        uint32_t descend = 0;
+        for (int i = 0; i < count; i++) {
+            if (!(matched & (1U << i))) { continue; }
+
+            if (queries[i].stepCount == depth + 1) {
+                ffx_cbor_clone(&results[i], &follow);
+                statuses[i] = FfxCborStatusOK;
+            } else {
+                descend |= (1U << i);
+            }
+        }
+
+        if (descend) {
+            FfxCborStatus error = _resolve(&follow, depth + 1, descend,
+              queries, count, results, statuses);
+            if (error) { return error; }
+        }
+
+        if (!active) { break; }
+
+        status = ffx_cbor_nextValue(&follow,
+          (type == FfxCborTypeMap) ? &followKey: NULL);
+    }
+
+    // Ran out of entries (or the container is empty)
+    if (status == FfxCborStatusNotFound) { status = FfxCborStatusOK; }
+
+    return status;
+}
+
+FfxCborStatus ffx_cbor_resolveQueries(FfxCborCursor *cursor,
+  const FfxCborQuery *queries, size_t count, FfxCborCursor *results,
+  FfxCborStatus *statuses) {
+
+    if (count > FFX_CBOR_QUERY_MAX_COUNT) { return FfxCborStatusOverflow; }
+
+    uint32_t active = 0;
+    for (int i = 0; i < count; i++) {
+        statuses[i] = FfxCborStatusNotFound;
+
+        // An empty query is the root itself
+        if (queries[i].stepCount == 0) {
+            ffx_cbor_clone(&results[i], cursor);
+            statuses[i] = FfxCborStatusOK;
+            continue;
+        }
+
+        active |= (1U << i);
+    }
+
+    if (!active) { return FfxCborStatusOK; }
+
+    return _resolve(cursor, 0, active, queries, count, results, statuses);
+}
+
+
 ///////////////////////////////
 // Builder - utils
 
+// Ensures there is space for count more bytes, growing the builder
+// within its arena if possible
+static FfxCborStatus _reserve(FfxCborBuilder *builder, size_t count) {
+    size_t remaining = builder->length - builder->offset;
+    if (remaining >= count) { return FfxCborStatusOK; }
+
+    FfxCborArena *arena = builder->arena;
+    if (arena == NULL) { return FfxCborStatusBufferOverrun; }
+
+    // Only the most recent allocation within an arena can grow
+    uint8_t *tail = &arena->data[arena->used * FFX_CBOR_ARENA_BLOCK_SIZE];
+    if (&builder->data[builder->length] != tail) {
+        return FfxCborStatusBufferOverrun;
+    }
+
+    size_t blocks = (count - remaining + FFX_CBOR_ARENA_BLOCK_SIZE - 1) /
+      FFX_CBOR_ARENA_BLOCK_SIZE;
+    if (arena->used + blocks > arena->blockCount) {
+        return FfxCborStatusBufferOverrun;
+    }
+
+    arena->used += blocks;
+    builder->length += blocks * FFX_CBOR_ARENA_BLOCK_SIZE;
+
+    return FfxCborStatusOK;
+}
+
 static FfxCborStatus _appendHeader(FfxCborBuilder *builder, FfxCborType type,
   uint64_t value) {
 
-    size_t remaining = builder->length - builder->offset;
-
     if (value < 23) {
-        if (remaining < 1) { return FfxCborStatusBufferOverrun; }
+        if (_reserve(builder, 1)) { return FfxCborStatusBufferOverrun; }
         builder->data[builder->offset++] = (type << 5) | value;
         return FfxCborStatusOK;
     }
@@ -548,7 +945,9 @@ static FfxCborStatus _appendHeader(FfxCborBuilder *builder, FfxCborType type,
     uint8_t count = counts[inset];
     inset = 8 - (1 << (count - 24));
 
-    if (remaining < 1 + (8 - inset)) { return FfxCborStatusBufferOverrun; }
+    if (_reserve(builder, 1 + (8 - inset))) {
+        return FfxCborStatusBufferOverrun;
+    }
 
     size_t offset = builder->offset;
     builder->data[offset++] = (type << 5) | count;
@@ -568,15 +967,61 @@ void ffx_cbor_build(FfxCborBuilder *builder, uint8_t *data, size_t length) {
     builder->data = data;
     builder->length = length;
     builder->offset = 0;
+    builder->segments = NULL;
+    builder->segmentCount = 0;
+    builder->maxSegments = 0;
+    builder->segmentStart = 0;
+    builder->refLength = 0;
+    builder->arena = NULL;
+}
+
+void ffx_cbor_buildSegmented(FfxCborBuilder *builder, uint8_t *data,
+  size_t length, FfxCborSegment *segments, size_t count) {
+    ffx_cbor_build(builder, data, length);
+    builder->segments = segments;
+    builder->maxSegments = count;
+}
+
+void ffx_cbor_initArena(FfxCborArena *arena, uint8_t *data, size_t length) {
+    arena->data = data;
+    arena->blockCount = length / FFX_CBOR_ARENA_BLOCK_SIZE;
+    arena->used = 0;
+}
+
+void ffx_cbor_resetArena(FfxCborArena *arena) {
+    arena->used = 0;
+}
+
+void ffx_cbor_buildArena(FfxCborBuilder *builder, FfxCborArena *arena,
+  FfxCborSegment *segments, size_t count) {
+
+    // Begins empty at the end of the arena and grows on demand
+    uint8_t *tail = &arena->data[arena->used * FFX_CBOR_ARENA_BLOCK_SIZE];
+    ffx_cbor_buildSegmented(builder, tail, 0, segments, count);
+    builder->arena = arena;
 }
 
 size_t ffx_cbor_getBuildLength(FfxCborBuilder *builder) {
-    return builder->offset;
+    return builder->offset + builder->refLength;
+}
+
+void ffx_cbor_writeSegments(FfxCborBuilder *builder, FfxCborWriteFunc write,
+  void *arg) {
+
+    for (int i = 0; i < builder->segmentCount; i++) {
+        FfxCborSegment *segment = &builder->segments[i];
+        if (segment->length) { write(arg, segment->data, segment->length); }
+    }
+
+    // Any inline data since the last referenced segment
+    size_t start = builder->segmentStart;
+    if (builder->offset > start) {
+        write(arg, &builder->data[start], builder->offset - start);
+    }
 }
 
 FfxCborStatus ffx_cbor_appendBoolean(FfxCborBuilder *builder, bool value) {
-    size_t remaining = builder->length - builder->offset;
-    if (remaining < 1) { return FfxCborStatusBufferOverrun; }
+    if (_reserve(builder, 1)) { return FfxCborStatusBufferOverrun; }
     size_t offset = builder->offset;
     builder->data[offset++] = (7 << 5) | (value ? 21: 20);
     builder->offset = offset;
@@ -584,8 +1029,7 @@ FfxCborStatus ffx_cbor_appendBoolean(FfxCborBuilder *builder, bool value) {
 }
 
 FfxCborStatus ffx_cbor_appendNull(FfxCborBuilder *builder) {
-    size_t remaining = builder->length - builder->offset;
-    if (remaining < 1) { return FfxCborStatusBufferOverrun; }
+    if (_reserve(builder, 1)) { return FfxCborStatusBufferOverrun; }
     size_t offset = builder->offset;
     builder->data[offset++] = (7 << 5) | 22;
     builder->offset = offset;
@@ -600,8 +1044,7 @@ FfxCborStatus ffx_cbor_appendData(FfxCborBuilder *builder, uint8_t *data, size_t
     FfxCborStatus status = _appendHeader(builder, 2, length);
     if (status) { return status; }
 
-    size_t remaining = builder->length - builder->offset;
-    if (remaining < length) { return FfxCborStatusBufferOverrun; }
+    if (_reserve(builder, length)) { return FfxCborStatusBufferOverrun; }
 
     memmove(&builder->data[builder->offset], data, length);
     builder->offset += length;
@@ -609,14 +1052,73 @@ FfxCborStatus ffx_cbor_appendData(FfxCborBuilder *builder, uint8_t *data, size_t
     return FfxCborStatusOK;
 }
 
+// Appends raw bytes, by reference if the builder is segmented
+static FfxCborStatus _appendRef(FfxCborBuilder *builder, const uint8_t *data,
+  size_t length) {
+
+    if (builder->segments == NULL) {
+        if (_reserve(builder, length)) { return FfxCborStatusBufferOverrun; }
+
+        memmove(&builder->data[builder->offset], data, length);
+        builder->offset += length;
+
+        return FfxCborStatusOK;
+    }
+
+    if (length == 0) { return FfxCborStatusOK; }
+
+    // Close the current inline segment (if any) before the reference
+    size_t start = builder->segmentStart;
+    size_t required = (builder->offset > start) ? 2: 1;
+    if (builder->maxSegments - builder->segmentCount < required) {
+        return FfxCborStatusBufferOverrun;
+    }
+
+    if (builder->offset > start) {
+        FfxCborSegment *segment = &builder->segments[builder->segmentCount++];
+        segment->data = &builder->data[start];
+        segment->length = builder->offset - start;
+    }
+
+    FfxCborSegment *segment = &builder->segments[builder->segmentCount++];
+    segment->data = data;
+    segment->length = length;
+
+    builder->segmentStart = builder->offset;
+    builder->refLength += length;
+
+    return FfxCborStatusOK;
+}
+
+FfxCborStatus ffx_cbor_appendDataRef(FfxCborBuilder *builder,
+  const uint8_t *data, size_t length) {
+
+    FfxCborStatus status = _appendHeader(builder, 2, length);
+    if (status) { return status; }
+
+    return _appendRef(builder, data, length);
+}
+
+FfxCborStatus ffx_cbor_appendKey(FfxCborBuilder *builder,
+  const FfxCborKey *key) {
+
+    size_t length = 1 + (key->header & 0x1f);
+
+    if (_reserve(builder, length)) { return FfxCborStatusBufferOverrun; }
+
+    memcpy(&builder->data[builder->offset], key, length);
+    builder->offset += length;
+
+    return FfxCborStatusOK;
+}
+
 FfxCborStatus ffx_cbor_appendString(FfxCborBuilder *builder, char* str) {
     size_t length = strlen(str);
 
     FfxCborStatus status = _appendHeader(builder, 3, length);
     if (status) { return status; }
 
-    size_t remaining = builder->length - builder->offset;
-    if (remaining < length) { return FfxCborStatusBufferOverrun; }
+    if (_reserve(builder, length)) { return FfxCborStatusBufferOverrun; }
 
     memmove(&builder->data[builder->offset], str, length);
     builder->offset += length;
@@ -633,8 +1135,7 @@ FfxCborStatus ffx_cbor_appendMap(FfxCborBuilder *builder, size_t count) {
 }
 
 FfxCborStatus ffx_cbor_appendArrayMutable(FfxCborBuilder *builder, FfxCborBuilderTag *tag) {
-    size_t remaining = builder->length - builder->offset;
-    if (remaining < 3) { return FfxCborStatusBufferOverrun; }
+    if (_reserve(builder, 3)) { return FfxCborStatusBufferOverrun; }
 
     builder->data[builder->offset++] = (4 << 5) | 25;
 
@@ -647,8 +1148,7 @@ FfxCborStatus ffx_cbor_appendArrayMutable(FfxCborBuilder *builder, FfxCborBuilde
 }
 
 FfxCborStatus ffx_cbor_appendMapMutable(FfxCborBuilder *builder, FfxCborBuilderTag *tag) {
-    size_t remaining = builder->length - builder->offset;
-    if (remaining < 3) { return FfxCborStatusBufferOverrun; }
+    if (_reserve(builder, 3)) { return FfxCborStatusBufferOverrun; }
 
     builder->data[builder->offset++] = (5 << 5) | 25;
 
@@ -669,8 +1169,7 @@ void ffx_cbor_adjustCount(FfxCborBuilder *builder, FfxCborBuilderTag tag,
 FfxCborStatus ffx_cbor_appendCborRaw(FfxCborBuilder *builder, uint8_t *data,
   size_t length) {
 
-    size_t remaining = builder->length - builder->offset;
-    if (remaining < length) { return FfxCborStatusBufferOverrun; }
+    if (_reserve(builder, length)) { return FfxCborStatusBufferOverrun; }
 
     size_t offset = builder->offset;
     memmove(&builder->data[offset], data, length);
@@ -680,6 +1179,19 @@ FfxCborStatus ffx_cbor_appendCborRaw(FfxCborBuilder *builder, uint8_t *data,
 }
 
 FfxCborStatus ffx_cbor_appendCborBuilder(FfxCborBuilder *dst, FfxCborBuilder *src) {
-    return ffx_cbor_appendCborRaw(dst, src->data, src->offset);
+    if (src->segments == NULL && dst->segments == NULL) {
+        return ffx_cbor_appendCborRaw(dst, src->data, src->offset);
+    }
+
+    FfxCborStatus status = FfxCborStatusOK;
+
+    for (int i = 0; i < src->segmentCount; i++) {
+        FfxCborSegment *segment = &src->segments[i];
+        status = _appendRef(dst, segment->data, segment->length);
+        if (status) { return status; }
+    }
+
+    size_t start = src->segmentStart;
+    return _appendRef(dst, &src->data[start], src->offset - start);
 }
 
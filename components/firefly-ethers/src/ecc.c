@@ -1824,8 +1824,10 @@ bool ffx_pk_signSecp256k1(uint8_t *privkey, uint8_t *digest,
       uECC_secp256k1());
 }
 
-//int32_t secp256k1_verify(uint8_t *digest, uint8_t *signature, uint8_t *publicKey) {
-//}
+bool ffx_pk_verifySecp256k1(uint8_t *pubkey, uint8_t *digest,
+  uint8_t *signature) {
+    return uECC_verify(pubkey, digest, 32, signature, uECC_secp256k1());
+}
 
 bool ffx_pk_computePubkeySecp256k1(uint8_t *privkey,
   uint8_t *pubkey) {
@@ -1840,6 +1842,10 @@ void ffx_pk_decompressPubkeySecp256k1(uint8_t *compPubkey, uint8_t *pubkey) {
     uECC_decompress(compPubkey, pubkey, uECC_secp256k1());
 }
 
+bool ffx_pk_isValidPubkeySecp256k1(uint8_t *pubkey) {
+    return uECC_valid_public_key(pubkey, uECC_secp256k1());
+}
+
 bool ffx_pk_computeSharedSecretSecp256k1(uint8_t *privkey,
   uint8_t *otherPubkey, uint8_t *sharedSecret) {
     return uECC_shared_secret(otherPubkey, privkey, sharedSecret,
@@ -35,24 +35,46 @@ typedef enum Format {
     FormatNullableAddress,
 } Format;
 
-static FfxTxStatus append(FfxRlpBuilder *rlp, Format format, FfxCborCursor *tx,
-  const char* key) {
+// The EIP-1559 fields, in RLP order; their queries are compiled at
+// build time
+static const FfxCborQuery queries[] = {
+    FFX_CBOR_QUERY_KEY("chainId"),
+    FFX_CBOR_QUERY_KEY("nonce"),
+    FFX_CBOR_QUERY_KEY("maxPriorityFeePerGas"),
+    FFX_CBOR_QUERY_KEY("maxFeePerGas"),
+    FFX_CBOR_QUERY_KEY("gasLimit"),
+    FFX_CBOR_QUERY_KEY("to"),
+    FFX_CBOR_QUERY_KEY("value"),
+    FFX_CBOR_QUERY_KEY("data"),
+};
+
+static const Format formats[] = {
+    FormatNumber,
+    FormatNumber,
+    FormatNumber,
+    FormatNumber,
+    FormatNumber,
+    FormatNullableAddress,
+    FormatNumber,
+    FormatData,
+};
+
+#define FIELD_COUNT     (sizeof(queries) / sizeof(FfxCborQuery))
 
-    FfxCborCursor value;
-    ffx_cbor_clone(&value, tx);
+static FfxTxStatus append(FfxRlpBuilder *rlp, Format format,
+  FfxCborCursor *value, FfxCborStatus status) {
 
-    FfxCborStatus status = ffx_cbor_followKey(&value, key);
     if (status == FfxCborStatusNotFound) {
         return mungeStatus(ffx_rlp_appendData(rlp, NULL, 0));
     }
 
-    if (status || ffx_cbor_getType(&value) != FfxCborTypeData) {
+    if (status || ffx_cbor_getType(value) != FfxCborTypeData) {
         return FfxTxStatusBadData;
     }
 
     size_t length = 0;
     uint8_t *data = NULL;
-    status = ffx_cbor_getData(&value, &data, &length);
+    status = ffx_cbor_getData(value, &data, &length);
     if (status) { return FfxTxStatusBadData; }
 
     // Consume any leading 0 bytes
@@ -91,31 +113,22 @@ FfxTxStatus ffx_tx_serializeUnsigned(FfxCborCursor *tx, uint8_t *data, size_t *_
     FfxRlpStatus rlpStatus = ffx_rlp_appendArray(&rlp, 9);
     if (rlpStatus) { return mungeStatus(rlpStatus); }
 
-    FfxTxStatus status = FfxTxStatusOK;
-
-    status = append(&rlp, FormatNumber, tx, "chainId");
-    if (status) { return status; }
-
-    status = append(&rlp, FormatNumber, tx, "nonce");
-    if (status) { return status; }
-
-    status = append(&rlp, FormatNumber, tx, "maxPriorityFeePerGas");
-    if (status) { return status; }
+    if (ffx_cbor_getType(tx) != FfxCborTypeMap) { return FfxTxStatusBadData; }
 
-    status = append(&rlp, FormatNumber, tx, "maxFeePerGas");
-    if (status) { return status; }
+    // Find all the fields in a single pass over the transaction
+    FfxCborCursor values[FIELD_COUNT];
+    FfxCborStatus statuses[FIELD_COUNT];
 
-    status = append(&rlp, FormatNumber, tx, "gasLimit");
-    if (status) { return status; }
+    FfxCborStatus cborStatus = ffx_cbor_resolveQueries(tx, queries,
+      FIELD_COUNT, values, statuses);
+    if (cborStatus) { return FfxTxStatusBadData; }
 
-    status = append(&rlp, FormatNullableAddress, tx, "to");
-    if (status) { return status; }
-
-    status = append(&rlp, FormatNumber, tx, "value");
-    if (status) { return status; }
+    FfxTxStatus status = FfxTxStatusOK;
 
-    status = append(&rlp, FormatData, tx, "data");
-    if (status) { return status; }
+    for (int i = 0; i < FIELD_COUNT; i++) {
+        status = append(&rlp, formats[i], &values[i], statuses[i]);
+        if (status) { return status; }
+    }
 
     rlpStatus = ffx_rlp_appendArray(&rlp, 0);
     if (rlpStatus) { return mungeStatus(rlpStatus); }
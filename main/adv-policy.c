@@ -0,0 +1,93 @@
+#include "adv-policy.h"
+
+
+// How long to advertise fast once prompted (ms); the 30s Apple's
+// accessory guidelines ask for
+#define FAST_DURATION       (30000)
+
+// Parameters for each mode; both intervals are among those Apple's
+// accessory guidelines recommend (20ms, and 1022.5ms once idle)
+static const AdvParams modeParams[] = {
+    [AdvModeOff] = { 0 },
+
+    // 20ms to 30ms
+    [AdvModeFast] = { .intervalMin = 32, .intervalMax = 48 },
+
+    // 1022.5ms to 1100ms
+    [AdvModeSlow] = { .intervalMin = 1636, .intervalMax = 1760 },
+};
+
+
+void adv_init(AdvPolicy *adv, uint32_t now) {
+    *adv = (AdvPolicy){
+        .mode = AdvModeOff,
+        .reason = AdvReasonBoot,
+        .boostTime = now,
+    };
+}
+
+// The mode advertising should be in
+static AdvMode desiredMode(const AdvPolicy *adv, bool available,
+  uint32_t now) {
+    if (!available) { return AdvModeOff; }
+    if (now - adv->boostTime < FAST_DURATION) { return AdvModeFast; }
+    return AdvModeSlow;
+}
+
+bool adv_boost(AdvPolicy *adv, AdvReason reason, uint32_t now) {
+    adv->reason = reason;
+    adv->boostTime = now;
+    adv->boosts++;
+    return (adv->mode != AdvModeFast);
+}
+
+void adv_stopped(AdvPolicy *adv) {
+    adv->mode = AdvModeOff;
+}
+
+uint32_t adv_poll(AdvPolicy *adv, bool available, uint32_t now,
+  AdvParams *params) {
+
+    AdvMode mode = desiredMode(adv, available, now);
+    if (mode == adv->mode) { return AdvActionNone; }
+
+    uint32_t actions = AdvActionNone;
+
+    // The interval cannot change while advertising
+    if (adv->mode != AdvModeOff) {
+        actions |= AdvActionStop;
+        adv->mode = AdvModeOff;
+    }
+
+    if (mode != AdvModeOff) {
+        *params = modeParams[mode];
+        actions |= AdvActionStart;
+
+        adv->mode = mode;
+        adv->startTime = now;
+        adv->starts++;
+    }
+
+    return actions;
+}
+
+uint32_t adv_timeout(const AdvPolicy *adv, uint32_t now) {
+    // Fast; falls back to slow once the prompt expires
+    if (adv->mode == AdvModeFast) {
+        uint32_t elapsed = now - adv->boostTime;
+        if (elapsed >= FAST_DURATION) { return 0; }
+        return FAST_DURATION - elapsed;
+    }
+
+    // Nothing changes until prompted (or availability changes)
+    return 0xffffffff;
+}
+
+const char* adv_modeName(AdvMode mode) {
+    switch (mode) {
+        case AdvModeOff: return "off";
+        case AdvModeFast: return "fast";
+        case AdvModeSlow: return "slow";
+    }
+    return "unknown";
+}
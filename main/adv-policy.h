@@ -0,0 +1,119 @@
+#ifndef __ADV_POLICY_H__
+#define __ADV_POLICY_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ *  Advertising schedule.
+ *
+ *  For a while after boot, a disconnect or a button press (when a user
+ *  is likely trying to connect) the device advertises at a short
+ *  interval, so it is discovered quickly. After that it falls back to
+ *  a long interval, so an idle device costs little radio time.
+ *
+ *  Like the link policy (see link-policy.h) this only decides. The BLE
+ *  task reports when advertising stops, calls [[adv_poll]] whenever
+ *  something may have changed (and after [[adv_timeout]]) and does
+ *  whatever it returns.
+ *
+ *  Intervals are in 0.625ms units (as on the air).
+ */
+
+typedef enum AdvMode {
+    // Not advertising; not synced or no room for another connection
+    AdvModeOff = 0,
+
+    // Short interval; recently prompted
+    AdvModeFast,
+
+    // Long interval
+    AdvModeSlow,
+} AdvMode;
+
+typedef enum AdvReason {
+    AdvReasonBoot = 0,
+    AdvReasonDisconnect,
+    AdvReasonButton,
+} AdvReason;
+
+typedef enum AdvAction {
+    AdvActionNone            = 0,
+
+    // Stop advertising (before starting again with new parameters)
+    AdvActionStop            = (1 << 0),
+
+    // Start advertising with the parameters returned by [[adv_poll]]
+    AdvActionStart           = (1 << 1),
+} AdvAction;
+
+typedef struct AdvParams {
+    uint16_t intervalMin;
+    uint16_t intervalMax;
+} AdvParams;
+
+typedef struct AdvPolicy {
+    // The mode advertising was last started in (Off if stopped)
+    AdvMode mode;
+
+    // When and why fast advertising was last prompted
+    AdvReason reason;
+    uint32_t boostTime;
+
+    // When advertising was last started
+    uint32_t startTime;
+
+    // Times advertising was started, and prompted to be fast
+    uint16_t starts;
+    uint16_t boosts;
+} AdvPolicy;
+
+
+/**
+ *  Initializes %%adv%% at boot (%%now%% in ms); advertising begins
+ *  fast.
+ */
+void adv_init(AdvPolicy *adv, uint32_t now);
+
+/**
+ *  Prompts fast advertising for %%reason%%. Returns true if the policy
+ *  should be polled soon (advertising is not already fast).
+ */
+bool adv_boost(AdvPolicy *adv, AdvReason reason, uint32_t now);
+
+/**
+ *  Advertising stopped without being asked to; a central connected, or
+ *  the stack gave up (or was reset).
+ */
+void adv_stopped(AdvPolicy *adv);
+
+/**
+ *  Returns the [[AdvAction]] flags to perform now; %%available%% is
+ *  whether advertising is possible (synced, with room for another
+ *  connection). If it includes AdvActionStart, %%params%% is populated.
+ *
+ *  If starting fails, the caller must report it with [[adv_stopped]].
+ */
+uint32_t adv_poll(AdvPolicy *adv, bool available, uint32_t now,
+  AdvParams *params);
+
+/**
+ *  Returns the number of milliseconds until [[adv_poll]] may have
+ *  something new to do, without further prompting.
+ */
+uint32_t adv_timeout(const AdvPolicy *adv, uint32_t now);
+
+const char* adv_modeName(AdvMode mode);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __ADV_POLICY_H__ */
@@ -0,0 +1,317 @@
+#include <string.h>
+
+#include "aead.h"
+
+
+///////////////////////////////
+// Utilities
+
+static uint32_t readLE32(const uint8_t *data) {
+    return data[0] | (data[1] << 8) | (data[2] << 16) |
+      ((uint32_t)data[3] << 24);
+}
+
+static void writeLE32(uint8_t *output, uint32_t value) {
+    output[0] = value;
+    output[1] = value >> 8;
+    output[2] = value >> 16;
+    output[3] = value >> 24;
+}
+
+static void writeLE64(uint8_t *output, uint64_t value) {
+    writeLE32(output, value);
+    writeLE32(&output[4], value >> 32);
+}
+
+
+///////////////////////////////
+// ChaCha20
+
+#define ROTL(v, n)      (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTER_ROUND(a, b, c, d) \
+    do { \
+        a += b; d ^= a; d = ROTL(d, 16); \
+        c += d; b ^= c; b = ROTL(b, 12); \
+        a += b; d ^= a; d = ROTL(d, 8); \
+        c += d; b ^= c; b = ROTL(b, 7); \
+    } while (0)
+
+static void chachaInit(uint32_t *state, const uint8_t *key,
+  const uint8_t *nonce, uint32_t counter) {
+
+    // "expand 32-byte k"
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+
+    for (int i = 0; i < 8; i++) { state[4 + i] = readLE32(&key[4 * i]); }
+
+    state[12] = counter;
+    state[13] = readLE32(&nonce[0]);
+    state[14] = readLE32(&nonce[4]);
+    state[15] = readLE32(&nonce[8]);
+}
+
+// Computes the keystream block for the state's counter, then advances it
+static void chachaBlock(uint32_t *state, uint8_t *output) {
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++) { writeLE32(&output[4 * i], x[i] + state[i]); }
+
+    state[12]++;
+}
+
+static void chachaXor(uint32_t *state, uint8_t *data, size_t length) {
+    uint8_t block[64];
+
+    while (length) {
+        chachaBlock(state, block);
+
+        size_t count = (length < 64) ? length: 64;
+        for (size_t i = 0; i < count; i++) { data[i] ^= block[i]; }
+
+        data += count;
+        length -= count;
+    }
+
+    memset(block, 0, sizeof(block));
+}
+
+
+///////////////////////////////
+// Poly1305
+
+// The accumulator and key are kept in 26-bit limbs, so each product
+// fits a 64-bit multiply.
+typedef struct Poly1305 {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+
+    uint8_t buffer[16];
+    size_t buffered;
+} Poly1305;
+
+static void polyInit(Poly1305 *poly, const uint8_t *key) {
+    memset(poly, 0, sizeof(Poly1305));
+
+    // Clamped r
+    poly->r[0] = (readLE32(&key[0])) & 0x3ffffff;
+    poly->r[1] = (readLE32(&key[3]) >> 2) & 0x3ffff03;
+    poly->r[2] = (readLE32(&key[6]) >> 4) & 0x3ffc0ff;
+    poly->r[3] = (readLE32(&key[9]) >> 6) & 0x3f03fff;
+    poly->r[4] = (readLE32(&key[12]) >> 8) & 0x00fffff;
+
+    for (int i = 0; i < 4; i++) { poly->pad[i] = readLE32(&key[16 + 4 * i]); }
+}
+
+// Adds a 16-byte block (with the high bit, 2^128, set for full blocks)
+// and multiplies by r
+static void polyBlock(Poly1305 *poly, const uint8_t *block, uint32_t hibit) {
+    const uint32_t mask = 0x3ffffff;
+
+    uint32_t r0 = poly->r[0], r1 = poly->r[1], r2 = poly->r[2];
+    uint32_t r3 = poly->r[3], r4 = poly->r[4];
+    uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+
+    uint32_t h0 = poly->h[0], h1 = poly->h[1], h2 = poly->h[2];
+    uint32_t h3 = poly->h[3], h4 = poly->h[4];
+
+    h0 += (readLE32(&block[0])) & mask;
+    h1 += (readLE32(&block[3]) >> 2) & mask;
+    h2 += (readLE32(&block[6]) >> 4) & mask;
+    h3 += (readLE32(&block[9]) >> 6) & mask;
+    h4 += (readLE32(&block[12]) >> 8) | hibit;
+
+    uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 +
+      (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+    uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 +
+      (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+    uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 +
+      (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+    uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 +
+      (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+    uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 +
+      (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+    uint32_t c = d0 >> 26; h0 = d0 & mask;
+    d1 += c; c = d1 >> 26; h1 = d1 & mask;
+    d2 += c; c = d2 >> 26; h2 = d2 & mask;
+    d3 += c; c = d3 >> 26; h3 = d3 & mask;
+    d4 += c; c = d4 >> 26; h4 = d4 & mask;
+    h0 += c * 5; c = h0 >> 26; h0 &= mask;
+    h1 += c;
+
+    poly->h[0] = h0; poly->h[1] = h1; poly->h[2] = h2;
+    poly->h[3] = h3; poly->h[4] = h4;
+}
+
+static void polyUpdate(Poly1305 *poly, const uint8_t *data, size_t length) {
+    if (poly->buffered) {
+        size_t count = 16 - poly->buffered;
+        if (count > length) { count = length; }
+        memcpy(&poly->buffer[poly->buffered], data, count);
+        poly->buffered += count;
+        data += count;
+        length -= count;
+
+        if (poly->buffered < 16) { return; }
+        polyBlock(poly, poly->buffer, 1 << 24);
+        poly->buffered = 0;
+    }
+
+    while (length >= 16) {
+        polyBlock(poly, data, 1 << 24);
+        data += 16;
+        length -= 16;
+    }
+
+    if (length) {
+        memcpy(poly->buffer, data, length);
+        poly->buffered = length;
+    }
+}
+
+// Pads the data so far with zeros to a multiple of 16 bytes
+static void polyPad(Poly1305 *poly) {
+    if (poly->buffered == 0) { return; }
+    static const uint8_t zeros[16] = { 0 };
+    polyUpdate(poly, zeros, 16 - poly->buffered);
+}
+
+static void polyFinal(Poly1305 *poly, uint8_t *tag) {
+    const uint32_t mask = 0x3ffffff;
+
+    // A partial block ends with a 1 byte instead of the high bit
+    if (poly->buffered) {
+        poly->buffer[poly->buffered] = 1;
+        for (size_t i = poly->buffered + 1; i < 16; i++) {
+            poly->buffer[i] = 0;
+        }
+        polyBlock(poly, poly->buffer, 0);
+    }
+
+    uint32_t h0 = poly->h[0], h1 = poly->h[1], h2 = poly->h[2];
+    uint32_t h3 = poly->h[3], h4 = poly->h[4];
+
+    // Fully carry h
+    uint32_t c = h1 >> 26; h1 &= mask;
+    h2 += c; c = h2 >> 26; h2 &= mask;
+    h3 += c; c = h3 >> 26; h3 &= mask;
+    h4 += c; c = h4 >> 26; h4 &= mask;
+    h0 += c * 5; c = h0 >> 26; h0 &= mask;
+    h1 += c;
+
+    // g = h - p (h + 5 - 2^130); use it if h >= p, in constant time
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= mask;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= mask;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= mask;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= mask;
+    uint32_t g4 = h4 + c - (1 << 26);
+
+    uint32_t select = (g4 >> 31) - 1;
+    g0 &= select; g1 &= select; g2 &= select; g3 &= select; g4 &= select;
+    select = ~select;
+    h0 = (h0 & select) | g0;
+    h1 = (h1 & select) | g1;
+    h2 = (h2 & select) | g2;
+    h3 = (h3 & select) | g3;
+    h4 = (h4 & select) | g4;
+
+    // h = (h + pad) % 2^128
+    h0 = h0 | (h1 << 26);
+    h1 = (h1 >> 6) | (h2 << 20);
+    h2 = (h2 >> 12) | (h3 << 14);
+    h3 = (h3 >> 18) | (h4 << 8);
+
+    uint64_t f = (uint64_t)h0 + poly->pad[0];
+    writeLE32(&tag[0], f);
+    f = (uint64_t)h1 + poly->pad[1] + (f >> 32);
+    writeLE32(&tag[4], f);
+    f = (uint64_t)h2 + poly->pad[2] + (f >> 32);
+    writeLE32(&tag[8], f);
+    f = (uint64_t)h3 + poly->pad[3] + (f >> 32);
+    writeLE32(&tag[12], f);
+
+    memset(poly, 0, sizeof(Poly1305));
+}
+
+
+///////////////////////////////
+// AEAD
+
+// The tag over the AAD and ciphertext; the one-time Poly1305 key is the
+// first half of keystream block 0
+static void computeTag(const uint8_t *key, const uint8_t *nonce,
+  const uint8_t *aad, size_t aadLength, const uint8_t *data, size_t length,
+  uint8_t *tag) {
+
+    uint32_t state[16];
+    chachaInit(state, key, nonce, 0);
+
+    uint8_t block[64];
+    chachaBlock(state, block);
+
+    Poly1305 poly;
+    polyInit(&poly, block);
+    memset(block, 0, sizeof(block));
+
+    if (aadLength) {
+        polyUpdate(&poly, aad, aadLength);
+        polyPad(&poly);
+    }
+
+    polyUpdate(&poly, data, length);
+    polyPad(&poly);
+
+    uint8_t lengths[16];
+    writeLE64(&lengths[0], aadLength);
+    writeLE64(&lengths[8], length);
+    polyUpdate(&poly, lengths, sizeof(lengths));
+
+    polyFinal(&poly, tag);
+}
+
+void aead_seal(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad,
+  size_t aadLength, uint8_t *data, size_t length, uint8_t *tag) {
+
+    uint32_t state[16];
+    chachaInit(state, key, nonce, 1);
+    chachaXor(state, data, length);
+    memset(state, 0, sizeof(state));
+
+    computeTag(key, nonce, aad, aadLength, data, length, tag);
+}
+
+bool aead_open(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad,
+  size_t aadLength, uint8_t *data, size_t length, const uint8_t *tag) {
+
+    uint8_t expected[AEAD_TAG_LENGTH];
+    computeTag(key, nonce, aad, aadLength, data, length, expected);
+
+    // Constant time; do not leak how much of the tag matched
+    uint8_t diff = 0;
+    for (int i = 0; i < AEAD_TAG_LENGTH; i++) { diff |= expected[i] ^ tag[i]; }
+    if (diff) { return false; }
+
+    uint32_t state[16];
+    chachaInit(state, key, nonce, 1);
+    chachaXor(state, data, length);
+    memset(state, 0, sizeof(state));
+
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef __AEAD_H__
+#define __AEAD_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ *  ChaCha20-Poly1305 (RFC 8439) authenticated encryption.
+ *
+ *  Only a few 32-bit additions, rotations and multiplications per byte,
+ *  so it is fast in software on a core without AES instructions, and
+ *  it runs in constant time. Data is encrypted (or decrypted) in place.
+ *
+ *  A nonce must never be used twice with the same key.
+ */
+
+#define AEAD_KEY_LENGTH             (32)
+#define AEAD_NONCE_LENGTH           (12)
+#define AEAD_TAG_LENGTH             (16)
+
+
+/**
+ *  Encrypts the %%length%% bytes of %%data%% in place and writes the
+ *  tag authenticating them (and %%aad%%, which may be NULL) to %%tag%%.
+ */
+void aead_seal(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad,
+  size_t aadLength, uint8_t *data, size_t length, uint8_t *tag);
+
+/**
+ *  Verifies %%tag%% and decrypts the %%length%% bytes of %%data%% in
+ *  place. Returns false (leaving %%data%% unchanged) if the tag does
+ *  not match.
+ */
+bool aead_open(const uint8_t *key, const uint8_t *nonce, const uint8_t *aad,
+  size_t aadLength, uint8_t *data, size_t length, const uint8_t *tag);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __AEAD_H__ */
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "host/ble_hs.h"
+#include "store/config/ble_store_config.h"
+
+#include "bond-store.h"
+
+
+// Security material (ours and the peer's) for each bond, and every CCCD
+#define MAX_ENTRIES     (2 * CONFIG_BT_NIMBLE_MAX_BONDS + \
+                         CONFIG_BT_NIMBLE_MAX_CCCDS)
+
+
+typedef struct Entry {
+    // BLE_STORE_OBJ_TYPE_*; 0 if unused
+    int type;
+
+    union ble_store_value value;
+
+    // When the entry was last used, relative to the others
+    uint32_t generation;
+} Entry;
+
+typedef struct Stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writes;
+    uint32_t skipped;
+} Stats;
+
+// Only used from the NimBLE host task (the store callbacks)
+static Entry entries[MAX_ENTRIES] = { 0 };
+static uint32_t nextGeneration = 1;
+
+static Stats stats = { 0 };
+
+
+///////////////////////////////
+// Entries
+
+static bool isCached(int type) {
+    switch (type) {
+        case BLE_STORE_OBJ_TYPE_OUR_SEC:
+        case BLE_STORE_OBJ_TYPE_PEER_SEC:
+        case BLE_STORE_OBJ_TYPE_CCCD:
+            return true;
+    }
+    return false;
+}
+
+// Whether %%a%% and %%b%% are stored under the same key (the same peer,
+// and for a CCCD the same characteristic)
+static bool isSameKey(int type, const union ble_store_value *a,
+  const union ble_store_value *b) {
+
+    if (type == BLE_STORE_OBJ_TYPE_CCCD) {
+        return (ble_addr_cmp(&a->cccd.peer_addr, &b->cccd.peer_addr) == 0 &&
+          a->cccd.chr_val_handle == b->cccd.chr_val_handle);
+    }
+
+    return (ble_addr_cmp(&a->sec.peer_addr, &b->sec.peer_addr) == 0);
+}
+
+// Whether storing %%b%% over %%a%% would change anything
+static bool isSameValue(int type, const union ble_store_value *a,
+  const union ble_store_value *b) {
+
+    if (type == BLE_STORE_OBJ_TYPE_CCCD) {
+        return (a->cccd.flags == b->cccd.flags &&
+          a->cccd.value_changed == b->cccd.value_changed);
+    }
+
+    const struct ble_store_value_sec *sa = &a->sec, *sb = &b->sec;
+    if (sa->key_size != sb->key_size || sa->ediv != sb->ediv ||
+      sa->rand_num != sb->rand_num || sa->authenticated != sb->authenticated ||
+      sa->sc != sb->sc) {
+        return false;
+    }
+
+    if (sa->ltk_present != sb->ltk_present ||
+      sa->irk_present != sb->irk_present ||
+      sa->csrk_present != sb->csrk_present) {
+        return false;
+    }
+
+    return (memcmp(sa->ltk, sb->ltk, sizeof(sa->ltk)) == 0 &&
+      memcmp(sa->irk, sb->irk, sizeof(sa->irk)) == 0 &&
+      memcmp(sa->csrk, sb->csrk, sizeof(sa->csrk)) == 0);
+}
+
+static Entry* findEntry(int type, const union ble_store_value *value) {
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        Entry *entry = &entries[i];
+        if (entry->type != type) { continue; }
+        if (isSameKey(type, &entry->value, value)) { return entry; }
+    }
+    return NULL;
+}
+
+// Finds the entry a lookup of %%key%% would return. Only lookups of a
+// specific peer (and characteristic) are answered; wildcards,
+// iteration and lookups by EDIV and random number go to the store.
+static Entry* findKey(int type, const union ble_store_key *key) {
+    const ble_addr_t *addr;
+    if (type == BLE_STORE_OBJ_TYPE_CCCD) {
+        if (key->cccd.idx || key->cccd.chr_val_handle == 0) { return NULL; }
+        addr = &key->cccd.peer_addr;
+    } else {
+        if (key->sec.idx || key->sec.ediv_rand_present) { return NULL; }
+        addr = &key->sec.peer_addr;
+    }
+
+    if (ble_addr_cmp(addr, BLE_ADDR_ANY) == 0) { return NULL; }
+
+    for (int i = 0; i < MAX_ENTRIES; i++) {
+        Entry *entry = &entries[i];
+        if (entry->type != type) { continue; }
+
+        if (type == BLE_STORE_OBJ_TYPE_CCCD) {
+            if (entry->value.cccd.chr_val_handle != key->cccd.chr_val_handle) {
+                continue;
+            }
+            if (ble_addr_cmp(&entry->value.cccd.peer_addr, addr)) { continue; }
+        } else if (ble_addr_cmp(&entry->value.sec.peer_addr, addr)) {
+            continue;
+        }
+
+        return entry;
+    }
+
+    return NULL;
+}
+
+// Stores %%value%% in its entry, otherwise in a free (or the least
+// recently used) one
+static void cacheValue(int type, const union ble_store_value *value) {
+    Entry *entry = findEntry(type, value);
+
+    if (entry == NULL) {
+        for (int i = 0; i < MAX_ENTRIES; i++) {
+            Entry *e = &entries[i];
+            if (e->type == 0) {
+                entry = e;
+                break;
+            }
+            if (entry == NULL ||
+              (int32_t)(e->generation - entry->generation) < 0) {
+                entry = e;
+            }
+        }
+    }
+
+    entry->type = type;
+    entry->value = *value;
+    entry->generation = nextGeneration++;
+}
+
+
+///////////////////////////////
+// Store callbacks
+
+int bond_read(int type, const union ble_store_key *key,
+  union ble_store_value *value) {
+
+    if (!isCached(type)) { return ble_store_config_read(type, key, value); }
+
+    Entry *entry = findKey(type, key);
+    if (entry) {
+        entry->generation = nextGeneration++;
+        *value = entry->value;
+        stats.hits++;
+        return 0;
+    }
+
+    stats.misses++;
+
+    int rc = ble_store_config_read(type, key, value);
+    if (rc == 0) { cacheValue(type, value); }
+    return rc;
+}
+
+int bond_write(int type, const union ble_store_value *value) {
+    if (!isCached(type)) { return ble_store_config_write(type, value); }
+
+    // Unchanged; nothing to persist
+    Entry *entry = findEntry(type, value);
+    if (entry && isSameValue(type, &entry->value, value)) {
+        entry->generation = nextGeneration++;
+        stats.skipped++;
+        return 0;
+    }
+
+    stats.writes++;
+
+    int rc = ble_store_config_write(type, value);
+    if (rc == 0) {
+        cacheValue(type, value);
+    } else if (entry) {
+        // The store may hold either value now
+        entry->type = 0;
+    }
+
+    return rc;
+}
+
+int bond_delete(int type, const union ble_store_key *key) {
+
+    // Deletes may match several entries (e.g. every CCCD of a peer);
+    // forget all of this type, they are read again on demand
+    if (isCached(type)) {
+        for (int i = 0; i < MAX_ENTRIES; i++) {
+            if (entries[i].type == type) { entries[i].type = 0; }
+        }
+    }
+
+    return ble_store_config_delete(type, key);
+}
+
+void bond_init() {
+    memset(entries, 0, sizeof(entries));
+
+    ble_hs_cfg.store_read_cb = bond_read;
+    ble_hs_cfg.store_write_cb = bond_write;
+    ble_hs_cfg.store_delete_cb = bond_delete;
+}
+
+void bond_dumpStats() {
+    printf("[ble] bond store: hits=%lu misses=%lu writes=%lu skipped=%lu\n",
+      (unsigned long)stats.hits, (unsigned long)stats.misses,
+      (unsigned long)stats.writes, (unsigned long)stats.skipped);
+}
@@ -0,0 +1,48 @@
+#ifndef __BOND_STORE_H__
+#define __BOND_STORE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include "host/ble_hs.h"
+
+
+/**
+ *  A RAM cache in front of the NimBLE bond store (ble_store_config,
+ *  persisted to NVS).
+ *
+ *  A returning host re-encrypts and usually rewrites its CCCDs on every
+ *  connection; each of those would otherwise be an NVS write (and
+ *  commit) on the NimBLE host task, delaying the first message.
+ *  Security material and CCCDs are kept here once read or written, so
+ *  lookups for a known peer are served from RAM and a write that does
+ *  not change anything never reaches NVS. Real changes are written
+ *  through immediately, so nothing is lost on a reset.
+ *
+ *  Install with [[bond_init]] after ble_store_config_init.
+ */
+
+/**
+ *  Installs the cache as the NimBLE store callbacks.
+ */
+void bond_init();
+
+// The NimBLE store callbacks (ble_hs_cfg.store_*_cb)
+
+int bond_read(int obj_type, const union ble_store_key *key,
+  union ble_store_value *value);
+int bond_write(int obj_type, const union ble_store_value *value);
+int bond_delete(int obj_type, const union ble_store_key *key);
+
+/**
+ *  Prints the cache statistics.
+ */
+void bond_dumpStats();
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __BOND_STORE_H__ */
@@ -0,0 +1,173 @@
+#include <string.h>
+
+#include "compress.h"
+
+
+static uint32_t hash(const uint8_t *data) {
+    uint32_t v = (data[0] << 16) | (data[1] << 8) | data[2];
+    return ((v * 2654435761U) >> 16) & (COMPRESS_HASH_SIZE - 1);
+}
+
+void compress_initEncoder(CompressEncoder *encoder) {
+    memset(encoder, 0, sizeof(CompressEncoder));
+}
+
+// Finds the longest match for the data at %%offset%% using the hash
+// table candidate, returning its length (0 if none) and distance.
+static size_t findMatch(CompressEncoder *encoder, const uint8_t *data,
+  size_t offset, size_t length, size_t *distance) {
+
+    if (offset + COMPRESS_MIN_MATCH > length) { return 0; }
+
+    uint32_t h = hash(&data[offset]);
+    size_t candidate = encoder->table[h];
+    encoder->table[h] = offset;
+
+    // Stale or out of reach
+    if (candidate >= offset) { return 0; }
+    if (offset - candidate > COMPRESS_WINDOW_SIZE) { return 0; }
+
+    size_t limit = length - offset;
+    if (limit > COMPRESS_MAX_MATCH) { limit = COMPRESS_MAX_MATCH; }
+
+    size_t count = 0;
+    while (count < limit && data[candidate + count] == data[offset + count]) {
+        count++;
+    }
+
+    if (count < COMPRESS_MIN_MATCH) { return 0; }
+
+    *distance = offset - candidate;
+    return count;
+}
+
+size_t compress_store(const uint8_t *data, size_t offset, size_t length,
+  uint8_t *output, size_t outputLength, size_t *consumed) {
+
+    if (outputLength < 2) {
+        *consumed = 0;
+        return 0;
+    }
+
+    size_t count = length - offset;
+    if (count > outputLength - 1) { count = outputLength - 1; }
+
+    output[0] = COMPRESS_MODE_STORED;
+    memcpy(&output[1], &data[offset], count);
+
+    *consumed = count;
+    return 1 + count;
+}
+
+size_t compress_encode(CompressEncoder *encoder, const uint8_t *data,
+  size_t offset, size_t length, uint8_t *output, size_t outputLength,
+  size_t *consumed) {
+
+    size_t start = offset;
+    size_t written = 0;
+
+    if (outputLength < 2) {
+        *consumed = 0;
+        return 0;
+    }
+
+    output[written++] = COMPRESS_MODE_LZSS;
+
+    // Each group needs its control byte and at least one literal; each
+    // item is only added if it fits, so the last group may be short
+    while (offset < length && written + 2 <= outputLength) {
+        uint8_t *control = &output[written++];
+        *control = 0;
+
+        for (int i = 0; i < 8 && offset < length; i++) {
+            size_t distance = 0;
+            size_t count = findMatch(encoder, data, offset, length,
+              &distance);
+
+            if (count && written + 2 > outputLength) { count = 0; }
+
+            if (count == 0) {
+                if (written == outputLength) { break; }
+                output[written++] = data[offset++];
+                continue;
+            }
+
+            *control |= (1 << i);
+
+            uint16_t token = ((distance - 1) << 4) |
+              (count - COMPRESS_MIN_MATCH);
+            output[written++] = token >> 8;
+            output[written++] = token & 0xff;
+
+            // Index the matched bytes too, for later matches
+            for (size_t j = 1; j < count; j++) {
+                if (offset + j + COMPRESS_MIN_MATCH > length) { break; }
+                encoder->table[hash(&data[offset + j])] = offset + j;
+            }
+
+            offset += count;
+        }
+    }
+
+    // Not smaller; stored carries at least as much in the same space
+    if (written > offset - start) {
+        return compress_store(data, start, length, output, outputLength,
+          consumed);
+    }
+
+    *consumed = offset - start;
+    return written;
+}
+
+CompressStatus compress_decode(const uint8_t *input, size_t inputLength,
+  uint8_t *data, size_t offset, size_t length, size_t *decoded) {
+
+    size_t start = offset;
+
+    if (inputLength == 0) { return CompressStatusBadMode; }
+
+    if (input[0] == COMPRESS_MODE_STORED) {
+        size_t count = inputLength - 1;
+        if (offset + count > length) { return CompressStatusOverrun; }
+        memcpy(&data[offset], &input[1], count);
+        *decoded = count;
+        return CompressStatusOK;
+    }
+
+    if (input[0] != COMPRESS_MODE_LZSS) { return CompressStatusBadMode; }
+
+    size_t index = 1;
+
+    while (index < inputLength) {
+        uint8_t control = input[index++];
+
+        for (int i = 0; i < 8 && index < inputLength; i++) {
+            if ((control & (1 << i)) == 0) {
+                if (offset >= length) { return CompressStatusOverrun; }
+                data[offset++] = input[index++];
+                continue;
+            }
+
+            if (index + 2 > inputLength) { return CompressStatusTruncated; }
+
+            uint16_t token = (input[index] << 8) | input[index + 1];
+            index += 2;
+
+            size_t distance = (token >> 4) + 1;
+            size_t count = (token & 0x0f) + COMPRESS_MIN_MATCH;
+
+            if (distance > offset) { return CompressStatusBadReference; }
+            if (offset + count > length) { return CompressStatusOverrun; }
+
+            // Byte-by-byte; the source and destination may overlap
+            const uint8_t *source = &data[offset - distance];
+            for (size_t j = 0; j < count; j++) {
+                data[offset + j] = source[j];
+            }
+            offset += count;
+        }
+    }
+
+    *decoded = offset - start;
+    return CompressStatusOK;
+}
@@ -0,0 +1,103 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ *  A small LZSS codec for FSP message chunks.
+ *
+ *  Each chunk begins with its mode. A stored chunk is followed by the
+ *  data as is, which is used whenever compressing would not make the
+ *  chunk smaller (e.g. random data or ciphertext). Otherwise the chunk
+ *  is a sequence of groups; a control byte whose bits (LSB first)
+ *  describe up to 8 items, each either a literal byte (bit clear) or a
+ *  2-byte back-reference (bit set) encoding the distance (12 bits,
+ *  minus 1) and length (4 bits, minus 3). The last group of a chunk may
+ *  have fewer items.
+ *
+ *  Chunks are independent in framing but not in content; a reference
+ *  may reach back into data decoded from earlier chunks (up to the
+ *  window size), so the decoded message must be contiguous. No state
+ *  is kept between chunks, so any chunk can be (re-)encoded from its
+ *  offset alone.
+ */
+
+#define COMPRESS_WINDOW_SIZE        (4096)
+#define COMPRESS_MIN_MATCH          (3)
+#define COMPRESS_MAX_MATCH          (18)
+
+#define COMPRESS_MODE_STORED        (0x00)
+#define COMPRESS_MODE_LZSS          (0x01)
+
+#define COMPRESS_HASH_SIZE          (1 << 10)
+
+
+typedef enum CompressStatus {
+    CompressStatusOK                = 0,
+
+    // A reference reaches before the start of the data
+    CompressStatusBadReference      = -1,
+
+    // The decoded data would exceed the buffer
+    CompressStatusOverrun           = -2,
+
+    // The chunk ends within a reference
+    CompressStatusTruncated         = -3,
+
+    // The chunk is empty or its mode is unknown
+    CompressStatusBadMode           = -4,
+} CompressStatus;
+
+typedef struct CompressEncoder {
+    // The most recent offset of each hashed 3-byte sequence; entries
+    // are only hints and are verified before use, so the table never
+    // needs to be cleared between messages.
+    uint16_t table[COMPRESS_HASH_SIZE];
+} CompressEncoder;
+
+
+void compress_initEncoder(CompressEncoder *encoder);
+
+/**
+ *  Compresses %%data%% starting at %%offset%% (up to %%length%%) into
+ *  %%output%%, writing at most %%outputLength%% bytes. The bytes before
+ *  %%offset%% may be referenced. If that is not smaller, the chunk is
+ *  stored instead.
+ *
+ *  Returns the number of bytes written to %%output%% and sets
+ *  %%consumed%% to the number of bytes of %%data%% they represent.
+ */
+size_t compress_encode(CompressEncoder *encoder, const uint8_t *data,
+  size_t offset, size_t length, uint8_t *output, size_t outputLength,
+  size_t *consumed);
+
+/**
+ *  Like [[compress_encode]], but always stores the chunk; for data that
+ *  is known not to compress.
+ */
+size_t compress_store(const uint8_t *data, size_t offset, size_t length,
+  uint8_t *output, size_t outputLength, size_t *consumed);
+
+/**
+ *  Decompresses a chunk produced by [[compress_encode]] into %%data%%
+ *  at %%offset%%, without writing past %%length%%. The bytes before
+ *  %%offset%% must hold the previously decoded data.
+ *
+ *  On success, %%decoded%% is set to the number of bytes written.
+ */
+CompressStatus compress_decode(const uint8_t *input, size_t inputLength,
+  uint8_t *data, size_t offset, size_t length, size_t *decoded);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __COMPRESS_H__ */
@@ -8,6 +8,11 @@ extern "C" {
 
 #define BOARD_REV         (5)
 
+// Dump each FSP message (its bytes and CBOR) to the console; slow
+// (seconds for a large message, on the worker before it replies), so
+// only for debugging
+#define DUMP_MESSAGES     (0)
+
 
 #if BOARD_REV == 2
 // The rev.2 board used the CS0 pin for the display. The rev.3
@@ -7,6 +7,7 @@
 #include "esp_random.h"
 #include "nvs_flash.h"
 
+#include "firefly-crypto.h"
 #include "firefly-hash.h"
 
 #include "device-info.h"
@@ -28,6 +29,10 @@ static uint8_t attestProof[64] = { 0 };
 static uint8_t pubkeyN[384] = { 0 };
 esp_ds_data_t *cipherdata = NULL;
 
+// Derived from the attestation key on first use
+static uint8_t sessionKey[FFX_PRIVKEY_LENGTH] = { 0 };
+static bool sessionReady = false;
+
 static void reverseBytes(uint8_t *data, size_t length) {
     for (int i = 0; i < length / 2; i++) {
         uint8_t tmp = data[i];
@@ -211,3 +216,60 @@ DeviceStatus device_attest(uint8_t *challenge, DeviceAttestation *attest) {
 
     return DeviceStatusOk;
 }
+
+// The session key is SHA-256 of the attestation (RSA) signature of a
+// fixed label; the signature is deterministic, so is the key
+static DeviceStatus loadSessionKey() {
+    if (sessionReady) { return DeviceStatusOk; }
+    if (ready != DeviceStatusOk) { return ready; }
+
+    static const char label[] = "firefly session key";
+
+    uint8_t hash[384] = { 0 };
+    FfxSha256Context ctx;
+    ffx_hash_initSha256(&ctx);
+    ffx_hash_updateSha256(&ctx, (const uint8_t*)label, strlen(label));
+    ffx_hash_finalSha256(&ctx, hash);
+    reverseBytes(hash, 32);
+
+    uint8_t sig[384] = { 0 };
+    int ret = esp_ds_sign(hash, cipherdata, ATTEST_HMAC_KEY, sig);
+    if (ret) { return DeviceStatusFailed; }
+
+    ffx_hash_initSha256(&ctx);
+    ffx_hash_updateSha256(&ctx, sig, sizeof(sig));
+    ffx_hash_finalSha256(&ctx, sessionKey);
+    memset(sig, 0, sizeof(sig));
+
+    // Outside [1, n - 1]; astronomically unlikely
+    uint8_t pubkey[64];
+    if (!ffx_pk_computePubkeySecp256k1(sessionKey, pubkey)) {
+        memset(sessionKey, 0, sizeof(sessionKey));
+        return DeviceStatusFailed;
+    }
+
+    sessionReady = true;
+    return DeviceStatusOk;
+}
+
+DeviceStatus device_getSessionPubkey(uint8_t *pubkey) {
+    DeviceStatus status = loadSessionKey();
+    if (status != DeviceStatusOk) { return status; }
+
+    uint8_t point[64];
+    ffx_pk_computePubkeySecp256k1(sessionKey, point);
+    ffx_pk_compressPubkeySecp256k1(point, pubkey);
+
+    return DeviceStatusOk;
+}
+
+DeviceStatus device_signSession(const uint8_t *digest, uint8_t *signature) {
+    DeviceStatus status = loadSessionKey();
+    if (status != DeviceStatusOk) { return status; }
+
+    if (!ffx_pk_signSecp256k1(sessionKey, (uint8_t*)digest, signature)) {
+        return DeviceStatusFailed;
+    }
+
+    return DeviceStatusOk;
+}
@@ -81,6 +81,18 @@ typedef struct DeviceAttestation {
  */
 DeviceStatus device_attest(uint8_t *challenge, DeviceAttestation *attest);
 
+/**
+ *  The session key signs each new FSP encrypted session, binding its
+ *  ephemeral key to this device. It is a secp256k1 key derived from
+ *  (so only available to) the attestation key; a host learns it once
+ *  from an attestation whose challenge is SHA-256 of the (compressed)
+ *  %%pubkey%%, then checks each handshake against it.
+ *
+ *  The %%signature%% is 65 bytes (r, s, v) over the 32 byte %%digest%%.
+ */
+DeviceStatus device_getSessionPubkey(uint8_t *pubkey);
+DeviceStatus device_signSession(const uint8_t *digest, uint8_t *signature);
+
 
 #ifdef __cplusplus
 }
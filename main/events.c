@@ -51,10 +51,12 @@ void events_clearFilters(PanelContext *panel) {
 ///////////////////////////////
 // API
 
-void panel_emitEvent(EventName eventName, EventPayloadProps props) {
+bool panel_emitEvent(EventName eventName, EventPayloadProps props) {
 
      EventDispatch event = { 0 };
 
+     bool queued = false;
+
      xSemaphoreTake(lockEvents, portMAX_DELAY);
 
     static uint32_t countOk = 0, countFail = 0;
@@ -124,7 +126,9 @@ void panel_emitEvent(EventName eventName, EventPayloadProps props) {
 
         QueueHandle_t events = filter->panel->events;
         BaseType_t status = xQueueSendToBack(events, &event, 0);
-        if (status != pdTRUE) {
+        if (status == pdTRUE) {
+            queued = true;
+        } else {
             printf("FAILED TO QUEUE EVENT: %02x", eventName);
         /*
             countFail++;
@@ -141,6 +145,8 @@ void panel_emitEvent(EventName eventName, EventPayloadProps props) {
     }
 
     xSemaphoreGive(lockEvents);
+
+    return queued;
 }
 
 // Caller must own the lockEvents mutex
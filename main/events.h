@@ -114,7 +114,8 @@ typedef struct EventPayload {
 
 typedef void (*EventCallback)(EventPayload event, void* arg);
 
-void panel_emitEvent(EventName eventName, EventPayloadProps props);
+// Returns whether the event was queued for any panel
+bool panel_emitEvent(EventName eventName, EventPayloadProps props);
 int panel_onEvent(EventName event, EventCallback cb, void* arg);
 void panel_offEvent(int eventId);
 
@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "firefly-crypto.h"
+#include "firefly-hash.h"
+
+#include "fsp-secure.h"
+
+
+// Resumption secrets kept for tickets
+#define MAX_TICKETS         (4)
+
+#define SHA256_BLOCK_LENGTH (64)
+#define SHA256_LENGTH       (32)
+
+
+typedef struct Ticket {
+    bool valid;
+
+    uint8_t ticket[FSP_SECURE_TICKET_LENGTH];
+    uint8_t secret[FSP_SECURE_SECRET_LENGTH];
+
+    // The bonded peer the ticket was issued to, if any
+    bool bonded;
+    uint8_t peer[FSP_SECURE_PEER_LENGTH];
+
+    // When the ticket was issued, relative to the others
+    uint32_t generation;
+} Ticket;
+
+static uint32_t (*randomSource)(void) = NULL;
+static FspSecureAttestFunc attestSource = NULL;
+
+static Ticket tickets[MAX_TICKETS] = { 0 };
+static uint32_t nextGeneration = 1;
+
+
+///////////////////////////////
+// Utilities
+
+static void fillRandom(uint8_t *output, size_t length) {
+    while (length) {
+        uint32_t v = randomSource();
+        for (int i = 0; i < 4 && length; i++) {
+            *output++ = v;
+            v >>= 8;
+            length--;
+        }
+    }
+}
+
+// Constant time; does not leak how much matched
+static bool isEqual(const uint8_t *a, const uint8_t *b, size_t length) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < length; i++) { diff |= a[i] ^ b[i]; }
+    return (diff == 0);
+}
+
+
+///////////////////////////////
+// HMAC-SHA256 and HKDF (RFC 2104, RFC 5869)
+
+typedef struct Hmac {
+    FfxSha256Context inner;
+    uint8_t outerPad[SHA256_BLOCK_LENGTH];
+} Hmac;
+
+static void hmacInit(Hmac *hmac, const uint8_t *key, size_t length) {
+    uint8_t block[SHA256_BLOCK_LENGTH] = { 0 };
+
+    if (length > SHA256_BLOCK_LENGTH) {
+        FfxSha256Context ctx;
+        ffx_hash_initSha256(&ctx);
+        ffx_hash_updateSha256(&ctx, key, length);
+        ffx_hash_finalSha256(&ctx, block);
+    } else {
+        memcpy(block, key, length);
+    }
+
+    uint8_t innerPad[SHA256_BLOCK_LENGTH];
+    for (int i = 0; i < SHA256_BLOCK_LENGTH; i++) {
+        innerPad[i] = block[i] ^ 0x36;
+        hmac->outerPad[i] = block[i] ^ 0x5c;
+    }
+
+    ffx_hash_initSha256(&hmac->inner);
+    ffx_hash_updateSha256(&hmac->inner, innerPad, SHA256_BLOCK_LENGTH);
+
+    memset(block, 0, sizeof(block));
+    memset(innerPad, 0, sizeof(innerPad));
+}
+
+static void hmacUpdate(Hmac *hmac, const uint8_t *data, size_t length) {
+    ffx_hash_updateSha256(&hmac->inner, data, length);
+}
+
+static void hmacFinal(Hmac *hmac, uint8_t *mac) {
+    uint8_t digest[SHA256_LENGTH];
+    ffx_hash_finalSha256(&hmac->inner, digest);
+
+    FfxSha256Context outer;
+    ffx_hash_initSha256(&outer);
+    ffx_hash_updateSha256(&outer, hmac->outerPad, SHA256_BLOCK_LENGTH);
+    ffx_hash_updateSha256(&outer, digest, SHA256_LENGTH);
+    ffx_hash_finalSha256(&outer, mac);
+
+    memset(hmac, 0, sizeof(Hmac));
+}
+
+static void hkdfExtract(const uint8_t *salt, size_t saltLength,
+  const uint8_t *ikm, size_t ikmLength, uint8_t *prk) {
+
+    Hmac hmac;
+    hmacInit(&hmac, salt, saltLength);
+    hmacUpdate(&hmac, ikm, ikmLength);
+    hmacFinal(&hmac, prk);
+}
+
+static void hkdfExpand(const uint8_t *prk, const uint8_t *info,
+  size_t infoLength, uint8_t *output, size_t length) {
+
+    uint8_t block[SHA256_LENGTH];
+    uint8_t counter = 0;
+
+    for (size_t offset = 0; offset < length; offset += SHA256_LENGTH) {
+        Hmac hmac;
+        hmacInit(&hmac, prk, SHA256_LENGTH);
+        if (counter) { hmacUpdate(&hmac, block, SHA256_LENGTH); }
+        hmacUpdate(&hmac, info, infoLength);
+        counter++;
+        hmacUpdate(&hmac, &counter, 1);
+        hmacFinal(&hmac, block);
+
+        size_t count = length - offset;
+        if (count > SHA256_LENGTH) { count = SHA256_LENGTH; }
+        memcpy(&output[offset], block, count);
+    }
+
+    memset(block, 0, sizeof(block));
+}
+
+// Expands a single block (32 bytes) of output for a label
+static void expandLabel(const uint8_t *prk, const char *label,
+  uint8_t *output) {
+    hkdfExpand(prk, (const uint8_t*)label, strlen(label), output,
+      SHA256_LENGTH);
+}
+
+void fsp_secure_hkdf(const uint8_t *salt, size_t saltLength,
+  const uint8_t *ikm, size_t ikmLength, const uint8_t *info,
+  size_t infoLength, uint8_t *output, size_t length) {
+
+    uint8_t prk[SHA256_LENGTH];
+    hkdfExtract(salt, saltLength, ikm, ikmLength, prk);
+    hkdfExpand(prk, info, infoLength, output, length);
+    memset(prk, 0, sizeof(prk));
+}
+
+
+///////////////////////////////
+// Key schedule
+
+void fsp_secure_derive(FspSecure *secure, const uint8_t *secret,
+  const uint8_t *hostNonce, const uint8_t *deviceNonce, bool host,
+  uint8_t *resumption) {
+
+    // HKDF-Extract; the salt is both nonces
+    uint8_t salt[2 * FSP_SECURE_NONCE_LENGTH];
+    memcpy(salt, hostNonce, FSP_SECURE_NONCE_LENGTH);
+    memcpy(&salt[FSP_SECURE_NONCE_LENGTH], deviceNonce,
+      FSP_SECURE_NONCE_LENGTH);
+
+    uint8_t prk[SHA256_LENGTH];
+    hkdfExtract(salt, sizeof(salt), secret, FSP_SECURE_SECRET_LENGTH, prk);
+
+    memset(secure, 0, sizeof(FspSecure));
+    expandLabel(prk, "fsp host", host ? secure->keyOut: secure->keyIn);
+    expandLabel(prk, "fsp device", host ? secure->keyIn: secure->keyOut);
+    expandLabel(prk, "fsp resume", resumption);
+    secure->established = true;
+
+    memset(prk, 0, sizeof(prk));
+}
+
+void fsp_secure_computeBinder(const uint8_t *resumption,
+  const uint8_t *ticket, const uint8_t *hostNonce, uint8_t *binder) {
+
+    static const char label[] = "fsp binder";
+
+    uint8_t mac[SHA256_LENGTH];
+    Hmac hmac;
+    hmacInit(&hmac, resumption, FSP_SECURE_SECRET_LENGTH);
+    hmacUpdate(&hmac, (const uint8_t*)label, strlen(label));
+    hmacUpdate(&hmac, ticket, FSP_SECURE_TICKET_LENGTH);
+    hmacUpdate(&hmac, hostNonce, FSP_SECURE_NONCE_LENGTH);
+    hmacFinal(&hmac, mac);
+
+    memcpy(binder, mac, FSP_SECURE_BINDER_LENGTH);
+}
+
+void fsp_secure_computeTranscript(const uint8_t *hostPubkey,
+  const uint8_t *hostNonce, const uint8_t *pubkey, const uint8_t *nonce,
+  const uint8_t *ticket, uint8_t *digest) {
+
+    static const char label[] = "fsp attest";
+
+    FfxSha256Context ctx;
+    ffx_hash_initSha256(&ctx);
+    ffx_hash_updateSha256(&ctx, (const uint8_t*)label, strlen(label));
+    ffx_hash_updateSha256(&ctx, hostPubkey, FSP_SECURE_PUBKEY_LENGTH);
+    ffx_hash_updateSha256(&ctx, hostNonce, FSP_SECURE_NONCE_LENGTH);
+    ffx_hash_updateSha256(&ctx, pubkey, FSP_SECURE_PUBKEY_LENGTH);
+    ffx_hash_updateSha256(&ctx, nonce, FSP_SECURE_NONCE_LENGTH);
+    ffx_hash_updateSha256(&ctx, ticket, FSP_SECURE_TICKET_LENGTH);
+    ffx_hash_finalSha256(&ctx, digest);
+}
+
+
+///////////////////////////////
+// Tickets
+
+// The slot for a new ticket; the peer's own (so each bonded peer has at
+// most one), otherwise a free one, otherwise the oldest, preferring
+// those of unbonded links
+static Ticket* claimTicket(const uint8_t *peer) {
+    Ticket *oldest = NULL;
+    for (int i = 0; i < MAX_TICKETS; i++) {
+        Ticket *ticket = &tickets[i];
+        if (!ticket->valid) { return ticket; }
+
+        if (peer && ticket->bonded &&
+          memcmp(ticket->peer, peer, FSP_SECURE_PEER_LENGTH) == 0) {
+            return ticket;
+        }
+
+        if (oldest == NULL || (oldest->bonded && !ticket->bonded) ||
+          (oldest->bonded == ticket->bonded &&
+          (int32_t)(ticket->generation - oldest->generation) < 0)) {
+            oldest = ticket;
+        }
+    }
+
+    return oldest;
+}
+
+// Stores %%ticket%% (new and random) for %%resumption%% in %%slot%%
+static void issueTicket(Ticket *slot, const uint8_t *peer,
+  const uint8_t *resumption, const uint8_t *ticket) {
+
+    memset(slot, 0, sizeof(Ticket));
+
+    memcpy(slot->ticket, ticket, FSP_SECURE_TICKET_LENGTH);
+    memcpy(slot->secret, resumption, FSP_SECURE_SECRET_LENGTH);
+
+    if (peer) {
+        slot->bonded = true;
+        memcpy(slot->peer, peer, FSP_SECURE_PEER_LENGTH);
+    }
+
+    slot->generation = nextGeneration++;
+    slot->valid = true;
+}
+
+bool fsp_secure_hasTicket(const uint8_t *peer) {
+    for (int i = 0; i < MAX_TICKETS; i++) {
+        if (!tickets[i].valid || !tickets[i].bonded) { continue; }
+        if (memcmp(tickets[i].peer, peer, FSP_SECURE_PEER_LENGTH)) {
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+static Ticket* findTicket(const uint8_t *ticket) {
+    for (int i = 0; i < MAX_TICKETS; i++) {
+        if (!tickets[i].valid) { continue; }
+        if (memcmp(tickets[i].ticket, ticket, FSP_SECURE_TICKET_LENGTH)) {
+            continue;
+        }
+        return &tickets[i];
+    }
+    return NULL;
+}
+
+
+///////////////////////////////
+// Handshakes
+
+void fsp_secure_init(uint32_t (*random)(void), FspSecureAttestFunc attest) {
+    randomSource = random;
+    attestSource = attest;
+    memset(tickets, 0, sizeof(tickets));
+}
+
+bool fsp_secure_accept(FspSecure *secure, const uint8_t *peer,
+  const uint8_t *hostPubkey, const uint8_t *hostNonce, uint8_t *pubkey,
+  uint8_t *nonce, uint8_t *ticket, uint8_t *signature) {
+
+    if (randomSource == NULL || attestSource == NULL) { return false; }
+
+    if (hostPubkey[0] != 0x02 && hostPubkey[0] != 0x03) { return false; }
+
+    // Reject points off the curve, which could leak the private key
+    uint8_t hostPoint[64];
+    ffx_pk_decompressPubkeySecp256k1((uint8_t*)hostPubkey, hostPoint);
+    if (!ffx_pk_isValidPubkeySecp256k1(hostPoint)) { return false; }
+
+    // A key outside [1, n - 1] is rejected; draw another
+    uint8_t privkey[FFX_PRIVKEY_LENGTH];
+    uint8_t point[64];
+    do {
+        fillRandom(privkey, sizeof(privkey));
+    } while (!ffx_pk_computePubkeySecp256k1(privkey, point));
+
+    uint8_t secret[FFX_SHARED_SECRET_LENGTH];
+    bool success = ffx_pk_computeSharedSecretSecp256k1(privkey, hostPoint,
+      secret);
+    memset(privkey, 0, sizeof(privkey));
+
+    // The ticket is only issued once the transcript is signed, so an
+    // unattested session cannot be resumed
+    if (success) {
+        ffx_pk_compressPubkeySecp256k1(point, pubkey);
+        fillRandom(nonce, FSP_SECURE_NONCE_LENGTH);
+        fillRandom(ticket, FSP_SECURE_TICKET_LENGTH);
+
+        uint8_t digest[FSP_SECURE_DIGEST_LENGTH];
+        fsp_secure_computeTranscript(hostPubkey, hostNonce, pubkey, nonce,
+          ticket, digest);
+        success = attestSource(digest, signature);
+        if (!success) { printf("[fsp] handshake attestation failed\n"); }
+    }
+
+    if (success) {
+        uint8_t resumption[FSP_SECURE_SECRET_LENGTH];
+        fsp_secure_derive(secure, secret, hostNonce, nonce, false,
+          resumption);
+        issueTicket(claimTicket(peer), peer, resumption, ticket);
+        memset(resumption, 0, sizeof(resumption));
+    }
+
+    memset(secret, 0, sizeof(secret));
+
+    return success;
+}
+
+bool fsp_secure_resume(FspSecure *secure, const uint8_t *peer,
+  const uint8_t *ticket, const uint8_t *hostNonce, const uint8_t *binder,
+  uint8_t *nonce, uint8_t *newTicket) {
+
+    if (randomSource == NULL) { return false; }
+
+    Ticket *slot = findTicket(ticket);
+    if (slot == NULL) {
+        printf("[fsp] unknown ticket\n");
+        return false;
+    }
+
+    if (slot->bonded && (peer == NULL ||
+      memcmp(slot->peer, peer, FSP_SECURE_PEER_LENGTH))) {
+        printf("[fsp] ticket bound to another peer\n");
+        return false;
+    }
+
+    uint8_t expected[FSP_SECURE_BINDER_LENGTH];
+    fsp_secure_computeBinder(slot->secret, slot->ticket, hostNonce,
+      expected);
+    if (!isEqual(expected, binder, FSP_SECURE_BINDER_LENGTH)) {
+        printf("[fsp] bad ticket binder\n");
+        return false;
+    }
+
+    fillRandom(nonce, FSP_SECURE_NONCE_LENGTH);
+
+    uint8_t resumption[FSP_SECURE_SECRET_LENGTH];
+    fsp_secure_derive(secure, slot->secret, hostNonce, nonce, false,
+      resumption);
+
+    // Single-use; the new ticket replaces it (keeping its binding)
+    fillRandom(newTicket, FSP_SECURE_TICKET_LENGTH);
+    uint8_t bound[FSP_SECURE_PEER_LENGTH];
+    memcpy(bound, slot->peer, FSP_SECURE_PEER_LENGTH);
+    issueTicket(slot, slot->bonded ? bound: NULL, resumption, newTicket);
+    memset(resumption, 0, sizeof(resumption));
+
+    return true;
+}
+
+
+///////////////////////////////
+// Messages
+
+// The AEAD nonce for message %%count%%
+static void messageNonce(uint64_t count, uint8_t *nonce) {
+    memset(nonce, 0, AEAD_NONCE_LENGTH);
+    for (int i = 0; i < 8; i++) { nonce[4 + i] = count >> (56 - 8 * i); }
+}
+
+void fsp_secure_seal(FspSecure *secure, uint8_t *data, size_t length) {
+    uint8_t nonce[AEAD_NONCE_LENGTH];
+    messageNonce(secure->countOut++, nonce);
+    aead_seal(secure->keyOut, nonce, NULL, 0, data, length, &data[length]);
+}
+
+bool fsp_secure_open(FspSecure *secure, uint8_t *data, size_t length) {
+    if (length < FSP_SECURE_TAG_LENGTH) { return false; }
+    length -= FSP_SECURE_TAG_LENGTH;
+
+    uint8_t nonce[AEAD_NONCE_LENGTH];
+    messageNonce(secure->countIn, nonce);
+    if (!aead_open(secure->keyIn, nonce, NULL, 0, data, length,
+      &data[length])) {
+        return false;
+    }
+
+    secure->countIn++;
+    return true;
+}
+
+void fsp_secure_clear(FspSecure *secure) {
+    memset(secure, 0, sizeof(FspSecure));
+}
@@ -0,0 +1,186 @@
+#ifndef __FSP_SECURE_H__
+#define __FSP_SECURE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "aead.h"
+
+
+/**
+ *  Encrypted FSP sessions.
+ *
+ *  A host establishes a session with an ephemeral ECDH (secp256k1)
+ *  handshake, after which every message in either direction is
+ *  encrypted and authenticated (see aead.h). The ECDH takes a few
+ *  hundred milliseconds on the device, so a host that reconnects
+ *  resumes with the ticket it was given instead, which costs a couple
+ *  of hashes.
+ *
+ *  Handshakes (CMD_SESSION, see fsp.c):
+ *    - new: the host sends its (compressed) ephemeral public key and a
+ *      nonce; the device replies with its own ephemeral public key, a
+ *      nonce, a ticket and its attestation; secret = ECDH(device, host)
+ *    - resume: the host sends a ticket, a nonce and its binder; the
+ *      device replies with a nonce and a new ticket; secret = the
+ *      ticket's resumption secret
+ *
+ *  Keys (HKDF-SHA256):
+ *    prk = HKDF-Extract(salt = hostNonce || deviceNonce, secret)
+ *    hostKey = HKDF-Expand(prk, "fsp host", 32)       host to device
+ *    deviceKey = HKDF-Expand(prk, "fsp device", 32)   device to host
+ *    resumption = HKDF-Expand(prk, "fsp resume", 32)
+ *    binder = HMAC-SHA256(resumption, "fsp binder" || ticket ||
+ *      hostNonce), truncated to 16 bytes
+ *
+ *  Each direction counts its messages from 0; the AEAD nonce is 4 zero
+ *  bytes followed by the count (64-bit big-endian). A message that
+ *  fails to authenticate is dropped without advancing the count, so
+ *  the host must start a new session (or resume) if it gets no reply.
+ *
+ *  The device keeps the resumption secrets of the last few tickets
+ *  (one per bonded peer). Each ticket is single-use; resuming replaces
+ *  it. A ticket issued over a bonded link only resumes over a link
+ *  bonded to the same peer.
+ *
+ *  Attestation; the device signs (secp256k1; r, s and v) the
+ *  transcript of a new handshake with its attestation key:
+ *    transcript = SHA-256("fsp attest" || hostPubkey || hostNonce ||
+ *      devicePubkey || deviceNonce || ticket)
+ *  The host must abort unless it verifies against the key it knows for
+ *  the device (see device_signSession). A resumed session is
+ *  authenticated by the resumption secret, which only the device of
+ *  the attested handshake has.
+ */
+
+#define FSP_SECURE_PUBKEY_LENGTH        (33)
+#define FSP_SECURE_NONCE_LENGTH         (16)
+#define FSP_SECURE_TICKET_LENGTH        (8)
+#define FSP_SECURE_BINDER_LENGTH        (16)
+#define FSP_SECURE_SECRET_LENGTH        (32)
+#define FSP_SECURE_DIGEST_LENGTH        (32)
+#define FSP_SECURE_SIGNATURE_LENGTH     (65)
+
+// A BLE identity address; type followed by the address
+#define FSP_SECURE_PEER_LENGTH          (7)
+
+// Overhead each encrypted message adds
+#define FSP_SECURE_TAG_LENGTH           (AEAD_TAG_LENGTH)
+
+
+typedef struct FspSecure {
+    bool established;
+
+    // Keys for each direction
+    uint8_t keyIn[AEAD_KEY_LENGTH];
+    uint8_t keyOut[AEAD_KEY_LENGTH];
+
+    // Messages opened and sealed so far
+    uint64_t countIn;
+    uint64_t countOut;
+} FspSecure;
+
+
+// Signs %%digest%% with the device's attestation key, writing
+// FSP_SECURE_SIGNATURE_LENGTH bytes to %%signature%%
+typedef bool (*FspSecureAttestFunc)(const uint8_t *digest,
+  uint8_t *signature);
+
+/**
+ *  Initializes the ticket cache; %%random%% provides the keys, nonces
+ *  and tickets, so must be cryptographically secure. New handshakes are
+ *  signed with %%attest%%; without it (or %%random%%) they fail.
+ */
+void fsp_secure_init(uint32_t (*random)(void), FspSecureAttestFunc attest);
+
+/**
+ *  Completes a new handshake as the device: computes the shared secret
+ *  with %%hostPubkey%% (compressed) using a new ephemeral key and
+ *  populates %%secure%%, writing the device's public key (compressed),
+ *  nonce, ticket and the signature of the transcript for the reply. If
+ *  %%peer%% is not NULL, the ticket is bound to that (bonded) peer.
+ *
+ *  Returns false if %%hostPubkey%% is not a valid key or the transcript
+ *  could not be signed.
+ */
+bool fsp_secure_accept(FspSecure *secure, const uint8_t *peer,
+  const uint8_t *hostPubkey, const uint8_t *hostNonce, uint8_t *pubkey,
+  uint8_t *nonce, uint8_t *ticket, uint8_t *signature);
+
+/**
+ *  Resumes the session of %%ticket%% as the device, populating
+ *  %%secure%% and writing the nonce and new ticket for the reply.
+ *
+ *  Returns false if the ticket is unknown (or already used, or bound
+ *  to another peer) or the binder does not match.
+ */
+bool fsp_secure_resume(FspSecure *secure, const uint8_t *peer,
+  const uint8_t *ticket, const uint8_t *hostNonce, const uint8_t *binder,
+  uint8_t *nonce, uint8_t *newTicket);
+
+/**
+ *  Derives the session keys from %%secret%% and the nonces, as the
+ *  host if %%host%% (otherwise the device), and writes the resumption
+ *  secret to %%resumption%%.
+ *
+ *  Hosts use this (and [[fsp_secure_computeBinder]]) to implement
+ *  their side of the handshake.
+ */
+void fsp_secure_derive(FspSecure *secure, const uint8_t *secret,
+  const uint8_t *hostNonce, const uint8_t *deviceNonce, bool host,
+  uint8_t *resumption);
+
+void fsp_secure_computeBinder(const uint8_t *resumption,
+  const uint8_t *ticket, const uint8_t *hostNonce, uint8_t *binder);
+
+/**
+ *  HKDF-SHA256 (RFC 5869) of %%ikm%%, writing %%length%% (at most
+ *  255 * 32) bytes to %%output%%. The key schedule is built on this;
+ *  it is exposed so hosts can check it against the RFC's vectors.
+ */
+void fsp_secure_hkdf(const uint8_t *salt, size_t saltLength,
+  const uint8_t *ikm, size_t ikmLength, const uint8_t *info,
+  size_t infoLength, uint8_t *output, size_t length);
+
+/**
+ *  Computes the transcript of a new handshake, which the device's
+ *  attestation signs.
+ */
+void fsp_secure_computeTranscript(const uint8_t *hostPubkey,
+  const uint8_t *hostNonce, const uint8_t *pubkey, const uint8_t *nonce,
+  const uint8_t *ticket, uint8_t *digest);
+
+/**
+ *  Returns whether %%peer%% (bonded) holds a ticket, so has established
+ *  an encrypted session since the device started.
+ */
+bool fsp_secure_hasTicket(const uint8_t *peer);
+
+/**
+ *  Encrypts the %%length%% bytes of %%data%% in place and appends the
+ *  tag (FSP_SECURE_TAG_LENGTH bytes) after them.
+ */
+void fsp_secure_seal(FspSecure *secure, uint8_t *data, size_t length);
+
+/**
+ *  Verifies and decrypts %%data%% in place; %%length%% includes the
+ *  tag. Returns false if it does not authenticate.
+ */
+bool fsp_secure_open(FspSecure *secure, uint8_t *data, size_t length);
+
+/**
+ *  Forgets the keys of %%secure%%.
+ */
+void fsp_secure_clear(FspSecure *secure);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __FSP_SECURE_H__ */
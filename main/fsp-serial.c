@@ -0,0 +1,119 @@
+#include <string.h>
+
+#include "firefly-hash.h"
+
+#include "fsp-serial.h"
+
+
+typedef enum DecoderState {
+    DecoderStateMagic0 = 0,
+    DecoderStateMagic1,
+    DecoderStateLength0,
+    DecoderStateLength1,
+    DecoderStateFrame
+} DecoderState;
+
+
+void fsp_serial_encodePrefix(uint8_t *prefix, size_t length) {
+    prefix[0] = FSP_SERIAL_MAGIC0;
+    prefix[1] = FSP_SERIAL_MAGIC1;
+    prefix[2] = length >> 8;
+    prefix[3] = length & 0xff;
+}
+
+void fsp_serial_encodeSuffix(uint8_t *suffix, const uint8_t *header,
+  size_t headerLength, const uint8_t *payload, size_t payloadLength) {
+
+    FfxSha256Context ctx;
+    ffx_hash_initSha256(&ctx);
+    ffx_hash_updateSha256(&ctx, header, headerLength);
+    if (payloadLength) {
+        ffx_hash_updateSha256(&ctx, payload, payloadLength);
+    }
+    ffx_hash_finalSha256(&ctx, suffix);
+}
+
+void fsp_serial_initDecoder(FspSerialDecoder *decoder) {
+    memset(decoder, 0, sizeof(FspSerialDecoder));
+}
+
+// The entire frame and its checksum have arrived
+static void completeFrame(FspSerialDecoder *decoder,
+  FspSerialFrameFunc onFrame, void *arg) {
+
+    decoder->state = DecoderStateMagic0;
+
+    uint8_t checksum[FSP_SERIAL_SUFFIX_LENGTH];
+    fsp_serial_encodeSuffix(checksum, decoder->frame, decoder->length,
+      NULL, 0);
+
+    if (memcmp(checksum, &decoder->frame[decoder->length],
+      FSP_SERIAL_SUFFIX_LENGTH)) {
+        decoder->dropped++;
+        return;
+    }
+
+    onFrame(arg, decoder->frame, decoder->length);
+}
+
+void fsp_serial_decode(FspSerialDecoder *decoder, const uint8_t *data,
+  size_t length, FspSerialFrameFunc onFrame, void *arg) {
+
+    size_t i = 0;
+    while (i < length) {
+
+        // Copy as much of the frame as is available at once
+        if (decoder->state == DecoderStateFrame) {
+            size_t total = decoder->length + FSP_SERIAL_SUFFIX_LENGTH;
+            size_t count = total - decoder->offset;
+            if (count > length - i) { count = length - i; }
+
+            memcpy(&decoder->frame[decoder->offset], &data[i], count);
+            decoder->offset += count;
+            i += count;
+
+            if (decoder->offset == total) {
+                completeFrame(decoder, onFrame, arg);
+            }
+            continue;
+        }
+
+        uint8_t byte = data[i++];
+
+        switch (decoder->state) {
+            case DecoderStateMagic0:
+                if (byte == FSP_SERIAL_MAGIC0) {
+                    decoder->state = DecoderStateMagic1;
+                }
+                break;
+
+            case DecoderStateMagic1:
+                if (byte == FSP_SERIAL_MAGIC1) {
+                    decoder->state = DecoderStateLength0;
+                } else if (byte != FSP_SERIAL_MAGIC0) {
+                    decoder->state = DecoderStateMagic0;
+                }
+                break;
+
+            case DecoderStateLength0:
+                decoder->length = byte << 8;
+                decoder->state = DecoderStateLength1;
+                break;
+
+            case DecoderStateLength1:
+                decoder->length |= byte;
+                decoder->offset = 0;
+
+                // Not a frame (or a corrupt one); resume scanning
+                if (decoder->length == 0 ||
+                  decoder->length > FSP_MAX_FRAME) {
+                    decoder->dropped++;
+                    decoder->state = DecoderStateMagic0;
+                    break;
+                }
+
+                decoder->state = DecoderStateFrame;
+                break;
+        }
+    }
+}
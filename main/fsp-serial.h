@@ -0,0 +1,82 @@
+#ifndef __FSP_SERIAL_H__
+#define __FSP_SERIAL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fsp.h"
+
+
+/**
+ *  Byte-stream framing of FSP, for links without their own framing
+ *  (e.g. USB serial).
+ *
+ *  Each FSP frame (a command, response or message chunk) is sent as:
+ *    - magic (2 bytes; 0xf5 0x50)
+ *    - length of the FSP frame (2 bytes, big-endian)
+ *    - the FSP frame
+ *    - SHA-256 of the FSP frame (32 bytes)
+ *
+ *  A receiver scans for the magic, so any noise between frames (such
+ *  as boot messages) is skipped, and a frame whose checksum does not
+ *  match is dropped. The first magic byte is not valid ASCII (or
+ *  UTF-8), so console text is never mistaken for the start of a frame.
+ */
+
+#define FSP_SERIAL_MAGIC0           (0xf5)
+#define FSP_SERIAL_MAGIC1           (0x50)
+
+#define FSP_SERIAL_PREFIX_LENGTH    (4)
+#define FSP_SERIAL_SUFFIX_LENGTH    (32)
+#define FSP_SERIAL_OVERHEAD         (FSP_SERIAL_PREFIX_LENGTH + \
+                                     FSP_SERIAL_SUFFIX_LENGTH)
+
+typedef void (*FspSerialFrameFunc)(void *arg, const uint8_t *frame,
+  size_t length);
+
+typedef struct FspSerialDecoder {
+    uint8_t state;
+
+    // The length of the current frame and the bytes of it (and its
+    // checksum) received so far
+    size_t length;
+    size_t offset;
+    uint8_t frame[FSP_MAX_FRAME + FSP_SERIAL_SUFFIX_LENGTH];
+
+    // Frames dropped for a bad length or checksum
+    uint32_t dropped;
+} FspSerialDecoder;
+
+
+/**
+ *  Writes the prefix of a frame %%length%% bytes long.
+ */
+void fsp_serial_encodePrefix(uint8_t *prefix, size_t length);
+
+/**
+ *  Writes the suffix (the checksum) of the frame made of %%header%%
+ *  followed by %%payload%% (which may be NULL).
+ */
+void fsp_serial_encodeSuffix(uint8_t *suffix, const uint8_t *header,
+  size_t headerLength, const uint8_t *payload, size_t payloadLength);
+
+void fsp_serial_initDecoder(FspSerialDecoder *decoder);
+
+/**
+ *  Feeds received bytes to %%decoder%%, calling %%onFrame%% for each
+ *  complete and valid frame.
+ */
+void fsp_serial_decode(FspSerialDecoder *decoder, const uint8_t *data,
+  size_t length, FspSerialFrameFunc onFrame, void *arg);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __FSP_SERIAL_H__ */
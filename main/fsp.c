@@ -0,0 +1,2149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "firefly-cbor.h"
+#include "firefly-hash.h"
+
+#include "compress.h"
+
+#include "fsp.h"
+
+
+// Length of the SHA-256 checksum prefixed to each message
+#define CHECKSUM_LENGTH     (32)
+
+// Maximum outgoing chunks in flight during a windowed transfer
+#define MAX_WINDOW          (6)
+
+// Un-acked chunks of a windowed transfer are resent after this (ms)
+#define ACK_TIMEOUT         (1000)
+
+// Without acknowledgements to pace it, a streamed transfer whose
+// transport could not take a chunk is retried after this (ms)
+#define RETRY_TIMEOUT       (20)
+
+// With nothing in flight, how often the sender checks anyway (ms)
+#define IDLE_TIMEOUT        (3000)
+
+// How long the requests of a detached connection are kept for the host
+// to resume them (ms)
+#define SESSION_TIMEOUT     (30000)
+
+// A request emitted to the panels which none accepts in this time is
+// answered with an error (ms)
+#define ACCEPT_TIMEOUT      (2000)
+
+
+///////////////////////////////
+// Protocol Description
+
+#define CMD_QUERY                                   (0x03)
+#define CMD_RESET                                   (0x02)
+#define CMD_START_MESSAGE                           (0x06)
+#define CMD_CONTINUE_MESSAGE                        (0x07)
+#define CMD_ACK                                     (0x08)
+#define CMD_SESSION                                 (0x09)
+
+// Capabilities; a host requests them with CMD_QUERY [ caps, window ]
+// and the supported and enabled caps (and window) are appended to the
+// response.
+//
+// CAPS_WINDOWED: replies are sent as notifications, with up to window
+//   chunks in flight. The host grants credits (one per chunk) and
+//   periodically acks the contiguous offset received, using
+//   CMD_ACK [ offset (2 bytes), credits ]. The transfer completes once
+//   the entire reply is acked; if no ack arrives in time, sending
+//   resumes from the last acked offset.
+//
+// CAPS_COMPRESSED: the payload of each message chunk (in both
+//   directions) is compressed (see compress.h). Lengths, offsets and
+//   acks still refer to the uncompressed message, and each chunk
+//   decompresses to the bytes starting at its offset. Chunks which do
+//   not compress, such as those of encrypted messages, are stored.
+//
+// Capabilities can only change while no request is in flight.
+#define CAPS_WINDOWED                               (1 << 0)
+#define CAPS_COMPRESSED                             (1 << 1)
+#define CAPS_SUPPORTED                              (CAPS_WINDOWED | CAPS_COMPRESSED)
+
+// Sessions; each connection has a session ID, included in the CMD_QUERY
+// response. If the link drops with requests in flight, they are kept
+// for SESSION_TIMEOUT. On its new connection the host sends
+// CMD_QUERY [ caps, window, session (4 bytes) ] to resume them; the
+// response then carries the old session ID (otherwise a new one) and
+// the state, offset and length of the request in progress. Only the
+// peer bonded on the old link, or a host resuming an encrypted session
+// on an unbonded one, may resume it; anyone else gets a new session.
+//
+// - receiving; the upload continues with CMD_CONTINUE_MESSAGE from the
+//   offset (the contiguous bytes received)
+// - processing; the reply follows once the panel sends it
+// - sending; the reply waits until the host sends
+//   CMD_CONTINUE_MESSAGE [ offset ] (without a payload) with the
+//   contiguous bytes it has (0 restarts the reply)
+//
+// A reply can also be rewound that way at any other time.
+#define QUERY_STATE_NONE                            (0x00)
+#define QUERY_STATE_RECEIVING                       (0x01)
+#define QUERY_STATE_PROCESSING                      (0x02)
+#define QUERY_STATE_SENDING                         (0x03)
+
+// Counters; CMD_QUERY [ QUERY_COUNTERS ] (exactly one byte, so it is
+// never mistaken for the capabilities) responds [ status, CMD_QUERY,
+// QUERY_COUNTERS, counters ] instead, where the counters are a CBOR Map
+// of what the connection has done since it was opened (see FspCounters
+// and the transport's own entries, such as the MTU). Counters only
+// grow; a host polling them takes the difference.
+#define QUERY_COUNTERS                              (0x10)
+
+// Encrypted sessions (see fsp-secure.h); once established, every message
+// in either direction is the checksum, the ciphertext of the CBOR and a
+// 16 byte tag (the checksum covers the ciphertext and tag). A handshake
+// can only run while no request is in flight.
+//
+// - CMD_SESSION [ SESSION_NEW, hostPubkey (33 bytes), hostNonce (16) ]
+//   responds [ status, CMD_SESSION, devicePubkey (33), deviceNonce (16),
+//   ticket (8), attestation (65) ]; the host must check the attestation
+//   signed the transcript before trusting the session
+// - CMD_SESSION [ SESSION_RESUME, ticket (8), hostNonce (16),
+//   binder (16) ] responds [ status, CMD_SESSION, deviceNonce (16),
+//   ticket (8) ]
+//
+// If the handshake fails (ERROR_SESSION_FAILED), the previous session
+// (if any) is ended. That never reverts to plaintext; once a session was
+// established on the connection (or the bonded peer holds a ticket),
+// CMD_START_MESSAGE with a plaintext message responds
+// ERROR_SESSION_FAILED until a new session is established, as it does
+// on any link the platform's FspPlaintext policy excludes.
+#define SESSION_NEW                                 (0x01)
+#define SESSION_RESUME                              (0x02)
+
+#define STATUS_OK                                   (0x00)
+#define ERROR_BUSY                                  (0x91)
+#define ERROR_UNSUPPORTED_VERSION                   (0x81)
+#define ERROR_BAD_COMMAND                           (0x82)
+#define ERROR_BUFFER_OVERRUN                        (0x84)
+#define ERROR_MISSING_MESSAGE                       (0x85)
+#define ERROR_INVALID_MESSAGE                       (0x86)
+#define ERROR_SESSION_FAILED                        (0x87)
+#define ERROR_UNKNOWN                               (0x8f)
+
+// Internal value used to skip responding; must not collide with
+// any other STATUS_* or ERROR_*. The ERROR bit is clear.
+#define STATUS_SKIP                                  (0x7f)
+
+// The error code replied to a request no panel accepted (e.g. none is
+// listening for messages); the codes of panels' errors are below this
+#define REPLY_NOT_ACCEPTED                          (0x100)
+
+
+// Partial replies; a panel may answer a request with any number of
+// partial replies { v, id, partial, result } (partial counting from 0)
+// before its reply { v, id, result } (or error). Each is sent as its own
+// message (with its own checksum), in order, and the host keeps
+// waiting for the reply. So a long-running request (e.g. signing a
+// batch) can stream its results as they complete.
+
+// Pre-encoded keys of the message envelope
+static const FfxCborKey keyV = FFX_CBOR_KEY("v");
+static const FfxCborKey keyId = FFX_CBOR_KEY("id");
+static const FfxCborKey keyMethod = FFX_CBOR_KEY("method");
+static const FfxCborKey keyParams = FFX_CBOR_KEY("params");
+static const FfxCborKey keyResult = FFX_CBOR_KEY("result");
+static const FfxCborKey keyPartial = FFX_CBOR_KEY("partial");
+static const FfxCborKey keyError = FFX_CBOR_KEY("error");
+static const FfxCborKey keyCode = FFX_CBOR_KEY("code");
+static const FfxCborKey keyMessage = FFX_CBOR_KEY("message");
+
+
+static const FspPlatform *platform = NULL;
+
+static uint32_t nextMessageId = 1;
+static uint32_t nextSession = 1;
+
+static FspConnection connections[FSP_MAX_CONNECTIONS] = { 0 };
+
+// The blocks of %%size%% bytes
+#define BLOCKS(size)        (((size) + FSP_BLOCK_SIZE - 1) / FSP_BLOCK_SIZE)
+
+// A full-size message buffer, and the space a reply is built in
+#define MESSAGE_BLOCKS      BLOCKS(sizeof(FspMessageBuffer) + \
+                              MAX_MESSAGE_SIZE + FSP_CBOR_HEADER)
+#define HEADER_BLOCKS       BLOCKS(sizeof(FspReplyHeader))
+#define ARENA_BLOCKS        BLOCKS(sizeof(FspResultArena))
+
+// The block pool; first the message buffers, enough for the limit of
+// FSP_MESSAGE_BUFFERS full-size messages plus one (so a reply larger
+// than its message can still be moved), then the reply spaces, one for
+// each connection (only a connection's head request is replied to)
+#define MESSAGE_POOL_BLOCKS ((FSP_MESSAGE_BUFFERS + 1) * MESSAGE_BLOCKS)
+#define POOL_BLOCKS         (MESSAGE_POOL_BLOCKS + FSP_MAX_CONNECTIONS * \
+                              (HEADER_BLOCKS + ARENA_BLOCKS))
+
+static uint64_t pool[POOL_BLOCKS][FSP_BLOCK_SIZE / sizeof(uint64_t)];
+static bool blockTaken[POOL_BLOCKS] = { 0 };
+
+// Blocks held by all message buffers
+static size_t blocksInUse = 0;
+
+// Compresses outgoing chunks; only used by the sender (fsp_poll)
+static CompressEncoder encoder;
+
+
+///////////////////////////////
+// Utilities
+
+static void dumpBuffer(char *header, uint8_t *buffer, size_t length) {
+    printf("%s (length=%zu)", header, length);
+    for (int i = 0; i < length; i++) {
+        if ((i % 16) == 0) { printf("\n    "); }
+        printf("%02x", buffer[i]);
+        if ((i % 4) == 3) { printf("  "); }
+    }
+    printf("\n");
+}
+
+static void lock() {
+    if (platform->lock) { platform->lock(); }
+}
+
+static void unlock() {
+    if (platform->unlock) { platform->unlock(); }
+}
+
+static int connIndex(FspConnection *conn) {
+    return conn - connections;
+}
+
+
+///////////////////////////////
+// Requests
+
+// Finds the request (and its connection) a panel message belongs to;
+// message IDs are unique across all connections. This includes doomed
+// requests, whose connection may be closed. The caller must hold the
+// lock.
+static FspRequest* findRequest(uint32_t id, FspConnection **_conn) {
+    if (id == 0) { return NULL; }
+    for (int i = 0; i < FSP_MAX_CONNECTIONS; i++) {
+        FspConnection *conn = &connections[i];
+        for (int j = 0; j < FSP_MAX_REQUESTS; j++) {
+            FspRequest *request = &conn->requests[j];
+            if (request->messageState == FspMessageStateReady) { continue; }
+            if (request->messageId != id) { continue; }
+            if (_conn) { *_conn = conn; }
+            return request;
+        }
+    }
+    return NULL;
+}
+
+// The oldest request; its reply is the next one sent
+static FspRequest* headRequest(FspConnection *conn) {
+    if (conn->count == 0) { return NULL; }
+    return &conn->requests[conn->head];
+}
+
+// The request whose message is currently being received
+static FspRequest* incomingRequest(FspConnection *conn) {
+    if (!conn->receiving) { return NULL; }
+    return &conn->requests[(conn->head + conn->count) % FSP_MAX_REQUESTS];
+}
+
+// Takes a run of %%count%% contiguous blocks from the pool, between
+// blocks %%first%% and %%last%% (first fit), returning NULL if there is
+// none.
+//
+// The caller must hold the lock.
+static void* takeBlocks(size_t first, size_t last, size_t count) {
+    size_t run = 0;
+    for (size_t i = first; i < last; i++) {
+        run = blockTaken[i] ? 0: run + 1;
+        if (run < count) { continue; }
+
+        size_t start = i + 1 - count;
+        memset(&blockTaken[start], true, count);
+        return pool[start];
+    }
+
+    return NULL;
+}
+
+// The caller must hold the lock.
+static void giveBlocks(void *data, size_t count) {
+    size_t start = ((uint8_t*)data - (uint8_t*)pool) / FSP_BLOCK_SIZE;
+    memset(&blockTaken[start], false, count);
+}
+
+// The blocks of a buffer holding %%capacity%% bytes of data
+static size_t bufferBlocks(size_t capacity) {
+    return BLOCKS(sizeof(FspMessageBuffer) + capacity);
+}
+
+// Takes a buffer for at least %%capacity%% bytes of data, returning NULL
+// if it would exceed the block limit (if %%limited%%) or the pool is
+// exhausted.
+//
+// The caller must hold the lock.
+static FspMessageBuffer* allocBuffer(size_t capacity, bool limited) {
+    size_t blocks = bufferBlocks(capacity);
+
+    size_t maxBlocks = FSP_MESSAGE_BUFFERS * MESSAGE_BLOCKS;
+    if (limited && blocksInUse + blocks > maxBlocks) { return NULL; }
+
+    FspMessageBuffer *buffer = takeBlocks(0, MESSAGE_POOL_BLOCKS, blocks);
+    if (buffer == NULL) {
+        printf("[fsp] out of memory: blocks=%zu inUse=%zu\n", blocks,
+          blocksInUse);
+        return NULL;
+    }
+
+    buffer->blocks = blocks;
+    buffer->capacity = blocks * FSP_BLOCK_SIZE - sizeof(FspMessageBuffer);
+
+    blocksInUse += blocks;
+
+    return buffer;
+}
+
+// The caller must hold the lock.
+static void freeBuffer(FspMessageBuffer *buffer) {
+    blocksInUse -= buffer->blocks;
+    giveBlocks(buffer, buffer->blocks);
+}
+
+// Attaches a buffer for a message of %%length%% bytes to %%request%%,
+// returning false if there is not enough memory available.
+//
+// The caller must hold the lock.
+static bool acquireBuffer(FspRequest *request, size_t length) {
+    FspMessageBuffer *buffer = allocBuffer(length, true);
+    if (buffer == NULL) { return false; }
+
+    request->buffer = buffer;
+    request->data = buffer->data;
+    return true;
+}
+
+// Takes the reply header of %%request%% from the pool, if it has none
+// yet, returning NULL if the pool is exhausted.
+//
+// The caller must hold the lock.
+static FspReplyHeader* takeReplyHeader(FspRequest *request) {
+    if (request->replyHeader == NULL) {
+        request->replyHeader = takeBlocks(MESSAGE_POOL_BLOCKS, POOL_BLOCKS,
+          HEADER_BLOCKS);
+    }
+    return request->replyHeader;
+}
+
+// Takes the result arena of %%request%% from the pool, if it has none
+// yet, returning NULL if the pool is exhausted.
+//
+// The caller must hold the lock.
+static FspResultArena* takeResultArena(FspRequest *request) {
+    if (request->resultArena == NULL) {
+        FspResultArena *arena = takeBlocks(MESSAGE_POOL_BLOCKS, POOL_BLOCKS,
+          ARENA_BLOCKS);
+        if (arena == NULL) { return NULL; }
+
+        ffx_cbor_initArena(&arena->arena, arena->data, FSP_ARENA_SIZE);
+        request->resultArena = arena;
+    }
+    return request->resultArena;
+}
+
+// Returns the space the reply of %%request%% was built in to the pool.
+//
+// The caller must hold the lock.
+static void releaseReplySpace(FspRequest *request) {
+    if (request->replyHeader) {
+        giveBlocks(request->replyHeader, HEADER_BLOCKS);
+        request->replyHeader = NULL;
+    }
+
+    if (request->resultArena) {
+        giveBlocks(request->resultArena, ARENA_BLOCKS);
+        request->resultArena = NULL;
+    }
+}
+
+// The caller must hold the lock.
+static void releaseBuffer(FspRequest *request) {
+    releaseReplySpace(request);
+
+    if (request->buffer == NULL) { return; }
+    freeBuffer(request->buffer);
+    request->buffer = NULL;
+    request->data = NULL;
+}
+
+static void resetRequest(FspRequest *request) {
+    releaseBuffer(request);
+    request->messageId = 0;
+    request->replyId = 0;
+    request->offset = 0;
+    request->length = 0;
+    request->partial = false;
+    request->partials = 0;
+    request->doomed = false;
+    request->messageState = FspMessageStateReady;
+}
+
+// Whether the message worker or a panel may still be using the buffer
+// of %%request%%, so it cannot be freed yet. A request which was only
+// emitted is not; a panel reads nothing before it accepts, which then
+// fails if the request was discarded.
+static bool isHeld(FspRequest *request) {
+    switch (request->messageState) {
+        case FspMessageStateVerifying:
+        case FspMessageStateProcessing:
+            return true;
+        case FspMessageStateSending:
+            // The panel still has the rest to reply with
+            return request->partial;
+        default:
+            break;
+    }
+    return false;
+}
+
+// Claims the next request slot (and a buffer) for an incoming message
+// of %%length%% bytes, returning NULL if the queue is full or there is
+// not enough memory available.
+static FspRequest* startRequest(FspConnection *conn, size_t length) {
+    lock();
+
+    FspRequest *request = NULL;
+    do {
+        if (conn->receiving || conn->count == FSP_MAX_REQUESTS) { break; }
+
+        FspRequest *next = &conn->requests[(conn->head + conn->count) %
+          FSP_MAX_REQUESTS];
+        if (!acquireBuffer(next, length)) { break; }
+
+        request = next;
+        request->offset = 0;
+        request->length = length;
+        request->emitted = false;
+        request->messageState = FspMessageStateReceiving;
+        conn->receiving = true;
+    } while (0);
+
+    unlock();
+
+    return request;
+}
+
+// Discards the partially received message, if any; queued requests
+// are unaffected.
+static void resetMessage(FspConnection *conn) {
+    lock();
+
+    FspRequest *request = incomingRequest(conn);
+    if (request) {
+        resetRequest(request);
+        conn->receiving = false;
+    }
+
+    unlock();
+}
+
+// Discards every request. Those still held are doomed instead; they
+// keep their buffers (and the connection cannot be reused) until the
+// message worker or panel lets go. The caller must hold the lock.
+static void clearRequests(FspConnection *conn) {
+    for (int i = 0; i < FSP_MAX_REQUESTS; i++) {
+        FspRequest *request = &conn->requests[i];
+        if (isHeld(request)) {
+            request->doomed = true;
+        } else {
+            resetRequest(request);
+        }
+    }
+    conn->head = 0;
+    conn->count = 0;
+    conn->receiving = false;
+}
+
+// Discards every request, such as on disconnect.
+static void resetRequests(FspConnection *conn) {
+    lock();
+    clearRequests(conn);
+    unlock();
+}
+
+// A request picked by advanceRequests to hand to the panels once the
+// lock is released. Its method and params are passed by reference; they
+// outlive the event, and a panel only reads them once it has accepted
+// the request (which fails if the slot was reused meanwhile).
+typedef struct Emit {
+    uint32_t id;
+    FspRequest *request;
+} Emit;
+
+// Drops requests which failed (and were reset) from the head of the
+// queue, then picks the head to hand to the panels once it is verified.
+// Panels are given requests one at a time, in the order they were
+// received.
+//
+// The caller must hold the lock, and call emitRequest after releasing
+// it.
+static void advanceRequests(FspConnection *conn, Emit *emit) {
+    emit->id = 0;
+
+    while (conn->count) {
+        FspRequest *request = &conn->requests[conn->head];
+        if (request->messageState != FspMessageStateReady) { break; }
+
+        conn->head = (conn->head + 1) % FSP_MAX_REQUESTS;
+        conn->count--;
+    }
+
+    FspRequest *request = headRequest(conn);
+    if (request == NULL || request->emitted) { return; }
+    if (request->messageState != FspMessageStateReceived) { return; }
+
+    request->emitted = true;
+    request->emitTime = platform->now();
+
+    emit->id = request->messageId;
+    emit->request = request;
+}
+
+static void emitRequest(Emit *emit);
+
+// Answers a request no panel accepted with an error, which frees its
+// slot (and buffer) for the next one once sent. Does nothing if it was
+// accepted (or discarded) meanwhile.
+static void failRequest(uint32_t id) {
+    if (!fsp_acceptMessage(id, NULL)) { return; }
+
+    printf("[fsp] request not accepted: id=%ld\n", (long)id);
+
+    if (fsp_sendErrorReply(id, REPLY_NOT_ACCEPTED, "not accepted")) {
+        return;
+    }
+
+    // Not even the error could be sent; drop it instead
+    FspConnection *conn = NULL;
+    Emit emit = { 0 };
+
+    lock();
+
+    FspRequest *request = findRequest(id, &conn);
+    if (request) {
+        resetRequest(request);
+        advanceRequests(conn, &emit);
+    }
+
+    unlock();
+
+    emitRequest(&emit);
+}
+
+// Hands the request picked by advanceRequests (if any) to the panels.
+// This is done without the lock, as delivering the event takes the
+// panels' own locks and may block; a panel must accept the request
+// before reading its params. If no panel was given it, it fails.
+static void emitRequest(Emit *emit) {
+    if (emit->id == 0) { return; }
+    FspRequest *request = emit->request;
+    if (platform->emit(emit->id, request->method, &request->params)) {
+        return;
+    }
+    failRequest(emit->id);
+}
+
+// Discards the partially received message (if any) and every queued
+// request no panel has accepted yet; only the head can have been, so
+// these are the rest of the queue. A request still being verified is
+// doomed instead, and released by the message worker.
+static void discardQueued(FspConnection *conn) {
+    Emit emit = { 0 };
+
+    lock();
+
+    FspRequest *incoming = incomingRequest(conn);
+    if (incoming) {
+        resetRequest(incoming);
+        conn->receiving = false;
+    }
+
+    for (int i = conn->count - 1; i >= 0; i--) {
+        FspRequest *request = &conn->requests[(conn->head + i) %
+          FSP_MAX_REQUESTS];
+
+        if (request->messageState == FspMessageStateVerifying) {
+            request->doomed = true;
+            continue;
+        }
+
+        if (request->messageState != FspMessageStateReceived) { continue; }
+
+        resetRequest(request);
+
+        // Free the slot now if it is the last in the queue
+        if (i == conn->count - 1) { conn->count--; }
+    }
+
+    advanceRequests(conn, &emit);
+
+    unlock();
+
+    emitRequest(&emit);
+}
+
+// The incoming message is complete; queue it for the message worker,
+// so the (comparatively slow) checksum and parsing happens off the
+// transport's task.
+static void queueMessage(FspConnection *conn) {
+    lock();
+
+    FspRequest *request = incomingRequest(conn);
+    request->messageState = FspMessageStateVerifying;
+    conn->receiving = false;
+    conn->count++;
+
+    unlock();
+
+    platform->process(conn, request);
+}
+
+// Feeds newly received message bytes to the checksum and validator,
+// skipping over the checksum prefix. Chunks arrive strictly in order,
+// so each byte is hashed once, while it is still in cache.
+static FfxCborStatus validateChunk(FspConnection *conn, size_t offset,
+  size_t length) {
+
+    if (offset + length <= CHECKSUM_LENGTH) { return FfxCborStatusOK; }
+
+    if (offset < CHECKSUM_LENGTH) {
+        length -= CHECKSUM_LENGTH - offset;
+        offset = CHECKSUM_LENGTH;
+    }
+
+    FspRequest *request = incomingRequest(conn);
+    ffx_hash_updateSha256(&request->checksum, &request->data[offset], length);
+
+    // Ciphertext; validated once decrypted
+    if (request->encrypted) { return FfxCborStatusOK; }
+
+    return ffx_cbor_updateValidator(&request->validator,
+      &request->data[offset], length);
+}
+
+// Copies (or decompresses) a chunk into the incoming message at its
+// current offset and feeds the new bytes to the checksum and validator,
+// returning false if the chunk is invalid.
+static bool receiveChunk(FspConnection *conn, FspRequest *request,
+  const uint8_t *data, size_t length) {
+
+    size_t offset = request->offset;
+
+    size_t count = length;
+    if (conn->caps & CAPS_COMPRESSED) {
+        CompressStatus status = compress_decode(data, length, request->data,
+          offset, request->length, &count);
+        if (status) {
+            printf("[fsp] decompress failed: status=%d\n", status);
+            return false;
+        }
+    } else {
+        memcpy(&request->data[offset], data, length);
+    }
+
+    request->offset += count;
+    conn->counters.chunksIn++;
+
+    // Reject malformed CBOR as early as possible
+    return (validateChunk(conn, offset, count) == FfxCborStatusOK);
+}
+
+// Decrypts an encrypted message in place (dropping its tag) and
+// validates the CBOR, returning false if either fails.
+static bool openMessage(FspConnection *conn, FspRequest *request) {
+    uint8_t *data = &request->data[CHECKSUM_LENGTH];
+    size_t length = request->length - CHECKSUM_LENGTH;
+
+    if (!fsp_secure_open(&conn->secure, data, length)) {
+        printf("[fsp] message failed to authenticate\n");
+        return false;
+    }
+
+    request->length -= FSP_SECURE_TAG_LENGTH;
+    length -= FSP_SECURE_TAG_LENGTH;
+
+    ffx_cbor_initValidator(&request->validator, length);
+    ffx_cbor_updateValidator(&request->validator, data, length);
+    return true;
+}
+
+// Verifies the checksum of a received message (decrypting it if
+// encrypted) and extracts its envelope, returning the id to reply with
+// (or 0 if invalid). This runs on the message worker.
+static uint32_t processMessage(FspConnection *conn, FspRequest *request) {
+    request->messageId = nextMessageId++;
+
+    if (platform->dump) {
+        dumpBuffer("Process Message", request->data, request->length);
+    }
+
+    // The message was hashed as each chunk arrived
+    uint8_t checksum[32];
+    ffx_hash_finalSha256(&request->checksum, checksum);
+
+    for (int i = 0; i < 32; i++) {
+        if (checksum[i] != request->data[i]) {
+            printf("BAD CHECKSUM!\n");
+            conn->counters.badChecksums++;
+            return 0;
+        }
+    }
+
+    if (request->encrypted && !openMessage(conn, request)) { return 0; }
+
+    // The CBOR was validated as each chunk arrived (or just now, if
+    // encrypted); this only confirms the root item completed
+    FfxCborStatus status = ffx_cbor_finalValidator(&request->validator);
+    if (status) {
+        printf("[fsp] invalid message: status=%d\n", status);
+        return 0;
+    }
+
+    ffx_cbor_init(&request->message, &request->data[CHECKSUM_LENGTH],
+      request->length - CHECKSUM_LENGTH);
+
+    // Dump the CBOR data to the console
+    if (platform->dump) { ffx_cbor_dump(&request->message); }
+
+    uint32_t replyId = 0;
+    do {
+        FfxCborCursor cursor;
+        ffx_cbor_clone(&cursor, &request->message);
+
+        FfxCborStatus status = ffx_cbor_followValidatedKey(&request->validator,
+          &cursor, &keyId);
+        if (status || ffx_cbor_getType(&cursor) != FfxCborTypeNumber) {
+            break;
+        }
+
+        uint64_t value;
+        status = ffx_cbor_getValue(&cursor, &value);
+        if (value == 0 || value > 0x7fffffff) { break; }
+
+        replyId = value;
+    } while(0);
+
+    do {
+        if (replyId == 0) { break; }
+
+        FfxCborCursor cursor;
+        ffx_cbor_clone(&cursor, &request->message);
+
+        FfxCborStatus status = ffx_cbor_followValidatedKey(&request->validator,
+          &cursor, &keyMethod);
+        if (status || ffx_cbor_getType(&cursor) != FfxCborTypeString) {
+            replyId = 0;
+            break;
+        }
+
+        // The method stays NUL-terminated; an empty or truncated
+        // (too long) method is invalid
+        memset(request->method, 0, FSP_METHOD_LENGTH);
+        status = ffx_cbor_copyData(&cursor, (uint8_t*)request->method,
+          FSP_METHOD_LENGTH - 1);
+
+        if (status || request->method[0] == 0) {
+            replyId = 0;
+            break;
+        }
+    } while(0);
+
+    do {
+        if (replyId == 0) { break; }
+
+        FfxCborCursor *cursor = &request->params;
+        ffx_cbor_clone(cursor, &request->message);
+
+        FfxCborStatus status = ffx_cbor_followValidatedKey(&request->validator,
+          cursor, &keyParams);
+        if (status || (ffx_cbor_getType(cursor) != FfxCborTypeArray &&
+          ffx_cbor_getType(cursor) != FfxCborTypeMap)) {
+            replyId = 0;
+            break;
+        }
+    } while (0);
+
+    return replyId;
+}
+
+static void processHandshake(FspConnection *conn);
+
+void fsp_processRequest(FspConnection *conn, FspRequest *request) {
+    if (request == NULL) {
+        processHandshake(conn);
+        return;
+    }
+
+    uint32_t start = platform->now();
+    uint32_t replyId = processMessage(conn, request);
+
+    FspCounters *counters = &conn->counters;
+    uint32_t elapsed = platform->now() - start;
+    counters->processed++;
+    counters->processTime += elapsed;
+    if (elapsed > counters->processMax) { counters->processMax = elapsed; }
+
+    Emit emit = { 0 };
+
+    lock();
+
+    // Discarded while processing (e.g. its session expired or the host
+    // reset the queue)
+    if (request->doomed) {
+        resetRequest(request);
+        advanceRequests(conn, &emit);
+
+    } else {
+        if (replyId) {
+            request->replyId = replyId;
+            request->messageState = FspMessageStateReceived;
+        } else {
+            resetRequest(request);
+        }
+
+        advanceRequests(conn, &emit);
+    }
+
+    unlock();
+
+    emitRequest(&emit);
+}
+
+
+///////////////////////////////
+// Connections
+
+void fsp_init(const FspPlatform *_platform) {
+    platform = _platform;
+    compress_initEncoder(&encoder);
+    fsp_secure_init(platform->random, platform->attest);
+}
+
+static uint32_t newSession() {
+    uint32_t session = 0;
+    while (session == 0) {
+        session = platform->random ? platform->random(): nextSession++;
+    }
+    return session;
+}
+
+// Whether %%conn%% can be claimed for a new connection; a closed one
+// once none of its requests are doomed, or a detached one (giving up
+// its session) if nothing holds its requests. The caller must hold the
+// lock.
+static bool isReusable(FspConnection *conn) {
+    if (conn->open && !conn->detached) { return false; }
+    for (int i = 0; i < FSP_MAX_REQUESTS; i++) {
+        FspRequest *request = &conn->requests[i];
+        if (request->doomed || (conn->open && isHeld(request))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A free connection, otherwise the detached connection closest to
+// expiring (whose session is given up). The caller must hold the lock.
+static FspConnection* claimConnection() {
+    FspConnection *oldest = NULL;
+    for (int i = 0; i < FSP_MAX_CONNECTIONS; i++) {
+        FspConnection *conn = &connections[i];
+        if (!isReusable(conn)) { continue; }
+        if (!conn->open) { return conn; }
+        if (oldest == NULL ||
+          (int32_t)(conn->detachTime - oldest->detachTime) < 0) {
+            oldest = conn;
+        }
+    }
+
+    if (oldest) {
+        printf("[fsp] session dropped: conn=%d session=%08lx\n",
+          connIndex(oldest), (unsigned long)oldest->session);
+        clearRequests(oldest);
+    }
+
+    return oldest;
+}
+
+FspConnection* fsp_openConnection(const FspTransport *transport,
+  void *context, size_t chunkSize, bool confirmed) {
+
+    // Transports open connections from their own tasks
+    lock();
+
+    FspConnection *conn = claimConnection();
+    if (conn) {
+        memset(conn, 0, sizeof(FspConnection));
+        conn->transport = transport;
+        conn->context = context;
+        conn->chunkSize = chunkSize;
+        conn->confirmed = confirmed;
+        conn->session = newSession();
+        conn->open = true;
+    }
+
+    unlock();
+
+    return conn;
+}
+
+void fsp_closeConnection(FspConnection *conn) {
+    resetRequests(conn);
+    conn->open = false;
+    conn->detached = false;
+    conn->paused = false;
+    conn->caps = 0;
+    conn->transport = NULL;
+    conn->context = NULL;
+    conn->handshaking = false;
+    conn->secured = false;
+    conn->bonded = false;
+    fsp_secure_clear(&conn->secure);
+}
+
+void fsp_detachConnection(FspConnection *conn) {
+    lock();
+
+    bool pending = (conn->receiving || conn->count);
+    if (pending) {
+        conn->detached = true;
+        conn->detachTime = platform->now();
+        conn->transport = NULL;
+        conn->context = NULL;
+        conn->stalled = false;
+        conn->awaiting = false;
+    }
+
+    unlock();
+
+    if (!pending) {
+        fsp_closeConnection(conn);
+        return;
+    }
+
+    printf("[fsp] session detached: conn=%d session=%08lx\n",
+      connIndex(conn), (unsigned long)conn->session);
+}
+
+bool fsp_hasFreeConnection() {
+    lock();
+
+    bool free = false;
+    for (int i = 0; i < FSP_MAX_CONNECTIONS && !free; i++) {
+        free = isReusable(&connections[i]);
+    }
+
+    unlock();
+
+    return free;
+}
+
+// Moves the transport of %%conn%% (a new connection) to the detached
+// connection with %%session%%, closing %%conn%%. Returns the connection
+// now carrying the transport. The caller must hold the lock.
+static FspConnection* resumeSession(FspConnection *conn, uint32_t session) {
+    if (session == 0 || session == conn->session) { return conn; }
+
+    // Only a new connection (with nothing of its own) can resume
+    if (conn->receiving || conn->count) { return conn; }
+
+    FspConnection *resumed = NULL;
+    for (int i = 0; i < FSP_MAX_CONNECTIONS; i++) {
+        FspConnection *detached = &connections[i];
+        if (!detached->open || !detached->detached) { continue; }
+        if (detached->session != session) { continue; }
+        resumed = detached;
+        break;
+    }
+
+    if (resumed == NULL) { return conn; }
+
+    // The session id alone is not a credential; a session only moves to
+    // the peer that opened it (the same bond), or, on an unbonded link,
+    // when it is encrypted (so only the holder of its keys can use it)
+    bool samePeer = (resumed->bonded && conn->bonded &&
+      memcmp(resumed->peer, conn->peer, FSP_SECURE_PEER_LENGTH) == 0);
+    bool keyed = (!resumed->bonded && resumed->secure.established);
+    if (!samePeer && !keyed) {
+        printf("[fsp] session resume refused: conn=%d session=%08lx\n",
+          connIndex(conn), (unsigned long)session);
+        return conn;
+    }
+
+    resumed->transport = conn->transport;
+    resumed->context = conn->context;
+    resumed->chunkSize = conn->chunkSize;
+    resumed->confirmed = conn->confirmed;
+    resumed->stalled = conn->stalled;
+    resumed->awaiting = false;
+
+    // The host says where to continue the reply from
+    FspRequest *request = headRequest(resumed);
+    resumed->paused = (request &&
+      request->messageState == FspMessageStateSending);
+
+    resumed->detached = false;
+
+    conn->open = false;
+    conn->transport = NULL;
+    conn->context = NULL;
+
+    printf("[fsp] session resumed: conn=%d session=%08lx\n",
+      connIndex(resumed), (unsigned long)session);
+
+    return resumed;
+}
+
+void fsp_confirm(FspConnection *conn) {
+    lock();
+
+    if (conn->awaiting) {
+        FspCounters *counters = &conn->counters;
+
+        uint32_t rtt = platform->now() - conn->confirmTime;
+        if (rtt > counters->rttMax) { counters->rttMax = rtt; }
+
+        int bucket = 0;
+        while (bucket < FSP_RTT_BUCKETS - 1 && rtt >= (8 << bucket)) {
+            bucket++;
+        }
+        counters->rtt[bucket]++;
+    }
+
+    conn->awaiting = false;
+
+    unlock();
+}
+
+// Records the host's request to continue the reply being sent from
+// %%offset%%, for the sender to apply (see takeHostUpdates). The caller
+// must hold the lock.
+static uint8_t rewindReply(FspConnection *conn, size_t offset) {
+    FspRequest *request = headRequest(conn);
+    if (request == NULL ||
+      request->messageState != FspMessageStateSending) {
+        return ERROR_BUSY;
+    }
+
+    if (offset > request->length) { return ERROR_BUFFER_OVERRUN; }
+
+    conn->rewinding = true;
+    conn->rewindOffset = offset;
+    conn->acking = false;
+    conn->ackOffset = offset;
+    conn->ackCredits = 0;
+    conn->paused = false;
+
+    return STATUS_OK;
+}
+
+// Records the host's cumulative ack of the reply being sent (and the
+// credits it grants), for the sender to apply. The caller must hold the
+// lock.
+static uint8_t ackReply(FspConnection *conn, size_t offset,
+  uint8_t credits) {
+
+    FspRequest *request = headRequest(conn);
+    if (request == NULL ||
+      request->messageState != FspMessageStateSending ||
+      !(conn->caps & CAPS_WINDOWED)) {
+        return ERROR_BUSY;
+    }
+
+    // Acks are cumulative and cannot go backwards
+    if (offset < conn->ackOffset || offset > request->length) {
+        return ERROR_MISSING_MESSAGE;
+    }
+
+    conn->acking = true;
+    conn->ackOffset = offset;
+    conn->ackCredits += credits;
+
+    return STATUS_OK;
+}
+
+void fsp_restartReply(FspConnection *conn) {
+    lock();
+    bool rewound = (rewindReply(conn, 0) == STATUS_OK);
+    unlock();
+
+    if (rewound) { fsp_wake(); }
+}
+
+void fsp_wake() {
+    if (platform->wake) { platform->wake(); }
+}
+
+// Sends a frame using the connection's transport, noting when it must
+// be acknowledged before the next chunk.
+static int sendFrame(FspConnection *conn, const uint8_t *header,
+  size_t headerLength, const uint8_t *payload, size_t payloadLength,
+  bool confirm) {
+
+    // Detached; kept for a host to resume
+    if (conn->transport == NULL) { return -1; }
+
+    // Set before sending, as the acknowledgement (fsp_confirm) may
+    // arrive before the transport returns
+    bool awaiting = (confirm && conn->confirmed);
+    if (awaiting) {
+        lock();
+        conn->awaiting = true;
+        conn->confirmTime = platform->now();
+        unlock();
+    }
+
+    int rc = conn->transport->send(conn, header, headerLength, payload,
+      payloadLength, confirm);
+    if (rc) {
+        if (awaiting) {
+            lock();
+            conn->awaiting = false;
+            unlock();
+        }
+
+        conn->counters.stalls++;
+        return rc;
+    }
+
+    conn->counters.framesOut++;
+    conn->counters.bytesOut += headerLength + payloadLength;
+
+    return rc;
+}
+
+
+///////////////////////////////
+// Commands
+
+// The state of the request reported by CMD_QUERY
+static uint8_t queryState(FspRequest *request) {
+    if (request == NULL) { return QUERY_STATE_NONE; }
+    switch (request->messageState) {
+        case FspMessageStateReady:
+            return QUERY_STATE_NONE;
+        case FspMessageStateReceiving:
+            return QUERY_STATE_RECEIVING;
+        case FspMessageStateSending:
+            return QUERY_STATE_SENDING;
+        default:
+            break;
+    }
+    return QUERY_STATE_PROCESSING;
+}
+
+static void appendCounter(FfxCborBuilder *builder, char *key,
+  uint32_t value) {
+    ffx_cbor_appendString(builder, key);
+    ffx_cbor_appendNumber(builder, value);
+}
+
+// Encodes the counters of %%conn%% (and the transport's entries) as a
+// CBOR Map, returning its length
+static size_t encodeCounters(FspConnection *conn, uint8_t *output,
+  size_t length) {
+
+    const FspCounters *counters = &conn->counters;
+
+    FfxCborBuilder builder;
+    ffx_cbor_build(&builder, output, length);
+
+    FfxCborBuilderTag tag;
+    ffx_cbor_appendMapMutable(&builder, &tag);
+
+    size_t count = 0;
+
+    appendCounter(&builder, "framesIn", counters->framesIn);
+    appendCounter(&builder, "framesOut", counters->framesOut);
+    appendCounter(&builder, "bytesIn", counters->bytesIn);
+    appendCounter(&builder, "bytesOut", counters->bytesOut);
+    appendCounter(&builder, "chunksIn", counters->chunksIn);
+    appendCounter(&builder, "chunksOut", counters->chunksOut);
+    appendCounter(&builder, "stalls", counters->stalls);
+    appendCounter(&builder, "busy", counters->busy);
+    appendCounter(&builder, "badChecksums", counters->badChecksums);
+    appendCounter(&builder, "resends", counters->resends);
+    count += 10;
+
+    ffx_cbor_appendString(&builder, "rtt");
+    ffx_cbor_appendArray(&builder, FSP_RTT_BUCKETS);
+    for (int i = 0; i < FSP_RTT_BUCKETS; i++) {
+        ffx_cbor_appendNumber(&builder, counters->rtt[i]);
+    }
+    appendCounter(&builder, "rttMax", counters->rttMax);
+    count += 2;
+
+    appendCounter(&builder, "processed", counters->processed);
+    appendCounter(&builder, "processTime", counters->processTime);
+    appendCounter(&builder, "processMax", counters->processMax);
+    count += 3;
+
+    // Anything the transport adds (e.g. the MTU and PHY)
+    if (conn->transport->counters) {
+        count += conn->transport->counters(conn, &builder);
+    }
+
+    ffx_cbor_adjustCount(&builder, tag, count);
+
+    return ffx_cbor_getBuildLength(&builder);
+}
+
+// Runs the handshake received by CMD_SESSION and responds. The ECDH of
+// a new session is slow, so this runs on the message worker.
+static void processHandshake(FspConnection *conn) {
+    // The connection was closed since
+    if (!conn->handshaking) { return; }
+
+    const uint8_t *req = conn->handshake;
+    const uint8_t *peer = conn->bonded ? conn->peer: NULL;
+
+    uint8_t resp[2 + FSP_SECURE_PUBKEY_LENGTH + FSP_SECURE_NONCE_LENGTH +
+      FSP_SECURE_TICKET_LENGTH + FSP_SECURE_SIGNATURE_LENGTH];
+    resp[0] = STATUS_OK;
+    resp[1] = CMD_SESSION;
+    size_t offset = 2;
+
+    FspSecure secure;
+    bool success = false;
+
+    if (req[1] == SESSION_NEW) {
+        const uint8_t *hostPubkey = &req[2];
+        const uint8_t *hostNonce = &hostPubkey[FSP_SECURE_PUBKEY_LENGTH];
+
+        uint8_t *pubkey = &resp[offset];
+        uint8_t *nonce = &pubkey[FSP_SECURE_PUBKEY_LENGTH];
+        uint8_t *ticket = &nonce[FSP_SECURE_NONCE_LENGTH];
+        uint8_t *signature = &ticket[FSP_SECURE_TICKET_LENGTH];
+
+        success = fsp_secure_accept(&secure, peer, hostPubkey, hostNonce,
+          pubkey, nonce, ticket, signature);
+        offset += FSP_SECURE_PUBKEY_LENGTH + FSP_SECURE_NONCE_LENGTH +
+          FSP_SECURE_TICKET_LENGTH + FSP_SECURE_SIGNATURE_LENGTH;
+
+    } else {
+        const uint8_t *ticket = &req[2];
+        const uint8_t *hostNonce = &ticket[FSP_SECURE_TICKET_LENGTH];
+        const uint8_t *binder = &hostNonce[FSP_SECURE_NONCE_LENGTH];
+
+        uint8_t *nonce = &resp[offset];
+        uint8_t *newTicket = &nonce[FSP_SECURE_NONCE_LENGTH];
+
+        success = fsp_secure_resume(&secure, peer, ticket, hostNonce,
+          binder, nonce, newTicket);
+        offset += FSP_SECURE_NONCE_LENGTH + FSP_SECURE_TICKET_LENGTH;
+    }
+
+    lock();
+
+    conn->handshaking = false;
+    if (success) {
+        conn->secure = secure;
+        conn->secured = true;
+    } else {
+        fsp_secure_clear(&conn->secure);
+    }
+
+    unlock();
+
+    fsp_secure_clear(&secure);
+
+    printf("[fsp] session %s: conn=%d type=%d\n",
+      success ? "established": "failed", connIndex(conn), req[1]);
+
+    if (!success) {
+        resp[0] = ERROR_SESSION_FAILED;
+        offset = 2;
+    }
+
+    sendFrame(conn, resp, offset, NULL, 0, true);
+}
+
+// Whether %%conn%% may carry a plaintext message (see FspPlaintext)
+static bool allowsPlaintext(FspConnection *conn) {
+    switch (platform->plaintext) {
+        case FspPlaintextAny:
+            return true;
+        case FspPlaintextBonded:
+            return (conn->bonded && !conn->secured &&
+              !fsp_secure_hasTicket(conn->peer));
+        default:
+            break;
+    }
+    return false;
+}
+
+FspConnection* fsp_receive(FspConnection *conn, const uint8_t *req,
+  size_t length) {
+
+    if (length > FSP_MAX_FRAME) {
+        printf("[fsp] command too long: length=%zu\n", length);
+        return conn;
+    }
+
+    conn->counters.framesIn++;
+    conn->counters.bytesIn += length;
+
+    // Response; maximum length is 26 bytes, plus the transport's fields
+    uint8_t resp[64] = { 0 };
+    resp[0] = STATUS_SKIP;
+    size_t offset = 1;
+
+    // The counters, if queried; sent after the response
+    size_t countersLength = 0;
+
+    do {
+        // No data to work with at all
+        if (length < 1) {
+            resp[0] = ERROR_BUFFER_OVERRUN;
+            break;
+        }
+
+        uint8_t cmd = req[0];
+
+        bool compressed = (conn->caps & CAPS_COMPRESSED);
+
+        resp[offset++] = cmd;
+
+        if (cmd == CMD_QUERY && length == 2) {
+            if (req[1] != QUERY_COUNTERS) {
+                resp[0] = ERROR_BAD_COMMAND;
+                break;
+            }
+
+            resp[0] = STATUS_OK;
+            resp[offset++] = QUERY_COUNTERS;
+
+            countersLength = encodeCounters(conn, conn->countersData,
+              sizeof(conn->countersData));
+
+        } else if (cmd == CMD_QUERY) {
+            resp[0] = STATUS_OK;
+
+            // Resume the requests of a dropped connection
+            if (length >= 7) {
+                uint32_t session = (req[3] << 24) | (req[4] << 16) |
+                  (req[5] << 8) | req[6];
+
+                lock();
+                conn = resumeSession(conn, session);
+                unlock();
+            }
+
+            resp[offset++] = CMD_QUERY;
+            resp[offset++] = 0x01;
+
+            // The message being received, otherwise the one sent next
+            FspRequest *request = incomingRequest(conn);
+            if (request == NULL) { request = headRequest(conn); }
+
+            size_t msgOffset = request ? request->offset: 0;
+            resp[offset++] = msgOffset >> 8;
+            resp[offset++] = msgOffset & 0xff;
+
+            size_t msgLen = request ? request->length: 0;
+            resp[offset++] = msgLen >> 8;
+            resp[offset++] = msgLen & 0xff;
+
+            uint32_t v = platform->modelNumber;
+            resp[offset++] = (v >> 24) & 0xff;
+            resp[offset++] = (v >> 16) & 0xff;
+            resp[offset++] = (v >> 8) & 0xff;
+            resp[offset++] = v & 0xff;
+
+            v = platform->serialNumber;
+            resp[offset++] = (v >> 24) & 0xff;
+            resp[offset++] = (v >> 16) & 0xff;
+            resp[offset++] = (v >> 8) & 0xff;
+            resp[offset++] = v & 0xff;
+
+            // Negotiate capabilities; not while a request is in flight
+            if (length >= 3 && conn->count == 0 && !conn->receiving) {
+                conn->caps = req[1] & CAPS_SUPPORTED;
+
+                conn->window = req[2];
+                if (conn->window == 0) { conn->window = 1; }
+                if (conn->window > MAX_WINDOW) { conn->window = MAX_WINDOW; }
+            }
+
+            resp[offset++] = CAPS_SUPPORTED;
+            resp[offset++] = conn->caps;
+            resp[offset++] = conn->window;
+
+            // Requests the host may have in flight, and how many are
+            resp[offset++] = FSP_MAX_REQUESTS;
+            resp[offset++] = conn->count;
+
+            // The session and the state of the request reported above
+            v = conn->session;
+            resp[offset++] = (v >> 24) & 0xff;
+            resp[offset++] = (v >> 16) & 0xff;
+            resp[offset++] = (v >> 8) & 0xff;
+            resp[offset++] = v & 0xff;
+
+            resp[offset++] = queryState(request);
+
+            // Anything the transport adds (e.g. the L2CAP PSM)
+            if (conn->transport->query) {
+                offset += conn->transport->query(conn, &resp[offset],
+                  sizeof(resp) - offset);
+            }
+
+        } else if (cmd == CMD_RESET) {
+
+            // The message being received and any queued requests not
+            // yet accepted are discarded; the request a panel is
+            // processing (or replying to) is still answered
+            discardQueued(conn);
+
+        } else if (cmd == CMD_START_MESSAGE) {
+
+            // A message is already started, the queue is full or a
+            // handshake is running
+            if (conn->receiving || conn->count == FSP_MAX_REQUESTS ||
+              conn->handshaking) {
+                resp[0] = ERROR_BUSY;
+                break;
+            }
+
+            // Missing length parameter
+            if (length < 3) {
+                resp[0] = ERROR_BUFFER_OVERRUN;
+                break;
+            }
+
+            uint16_t msgLen = (req[1] << 8) | req[2];
+
+            // No message
+            if (msgLen == 0 || length < 4) {
+                resp[0] = ERROR_MISSING_MESSAGE;
+                break;
+            }
+
+            // Never downgraded to plaintext
+            bool encrypted = conn->secure.established;
+            if (!encrypted && !allowsPlaintext(conn)) {
+                resp[0] = ERROR_SESSION_FAILED;
+                break;
+            }
+
+            size_t overhead = CHECKSUM_LENGTH +
+              (encrypted ? FSP_SECURE_TAG_LENGTH: 0);
+
+            // Message (or this chunk) will not fit
+            if (msgLen > MAX_MESSAGE_SIZE + overhead ||
+              (!compressed && length - 1 - 2 > msgLen)) {
+                resp[0] = ERROR_BUFFER_OVERRUN;
+                break;
+            }
+
+            // Too short to contain a checksum (and tag) and any CBOR
+            if (msgLen <= overhead) {
+                resp[0] = ERROR_INVALID_MESSAGE;
+                break;
+            }
+
+            // Other requests hold too much of the message memory
+            FspRequest *request = startRequest(conn, msgLen);
+            if (request == NULL) {
+                resp[0] = ERROR_BUSY;
+                break;
+            }
+
+            request->encrypted = encrypted;
+            ffx_cbor_initValidator(&request->validator,
+              msgLen - CHECKSUM_LENGTH);
+            ffx_hash_initSha256(&request->checksum);
+
+            if (!receiveChunk(conn, request, &req[3], length - 1 - 2)) {
+                resetMessage(conn);
+                resp[0] = ERROR_INVALID_MESSAGE;
+                break;
+            }
+
+            // Message ready to process!
+            if (request->offset == request->length) {
+                queueMessage(conn);
+            }
+
+        } else if (cmd == CMD_CONTINUE_MESSAGE && length == 3) {
+
+            // Continue (or rewind) the reply from the host's offset
+            uint16_t msgOffset = (req[1] << 8) | req[2];
+
+            lock();
+            resp[0] = rewindReply(conn, msgOffset);
+            unlock();
+
+            if (resp[0]) { break; }
+
+            fsp_wake();
+
+        } else if (cmd == CMD_CONTINUE_MESSAGE) {
+            FspRequest *request = incomingRequest(conn);
+            if (request == NULL) {
+                resp[0] = ERROR_BUSY;
+                break;
+            }
+
+            // Missing length parameter
+            if (length < 3) {
+                resp[0] = ERROR_BUFFER_OVERRUN;
+                break;
+            }
+
+            // No message to continue
+            if (request->offset == 0) {
+                resp[0] = ERROR_MISSING_MESSAGE;
+                break;
+            }
+
+            uint16_t msgOffset = (req[1] << 8) | req[2];
+
+            // Message offset is out of sync
+            if (length < 4 || msgOffset != request->offset) {
+                resp[0] = ERROR_MISSING_MESSAGE;
+                break;
+            }
+
+            // Chunk extends past the message
+            if (!compressed &&
+              msgOffset + length - 1 - 2 > request->length) {
+                resp[0] = ERROR_BUFFER_OVERRUN;
+                break;
+            }
+
+            // Update the message
+            if (!receiveChunk(conn, request, &req[3], length - 1 - 2)) {
+                resetMessage(conn);
+                resp[0] = ERROR_INVALID_MESSAGE;
+                break;
+            }
+
+            // Message ready to process!
+            if (request->offset == request->length) {
+                queueMessage(conn);
+            }
+
+        } else if (cmd == CMD_SESSION) {
+
+            // Keys only change between requests
+            if (conn->receiving || conn->count || conn->handshaking) {
+                resp[0] = ERROR_BUSY;
+                break;
+            }
+
+            size_t expected = 0;
+            if (length >= 2 && req[1] == SESSION_NEW) {
+                expected = 2 + FSP_SECURE_PUBKEY_LENGTH +
+                  FSP_SECURE_NONCE_LENGTH;
+            } else if (length >= 2 && req[1] == SESSION_RESUME) {
+                expected = 2 + FSP_SECURE_TICKET_LENGTH +
+                  FSP_SECURE_NONCE_LENGTH + FSP_SECURE_BINDER_LENGTH;
+            }
+
+            // Without a random source there are no secure keys
+            if (expected == 0 || platform->random == NULL) {
+                resp[0] = ERROR_BAD_COMMAND;
+                break;
+            }
+
+            if (length != expected) {
+                resp[0] = ERROR_BUFFER_OVERRUN;
+                break;
+            }
+
+            // The worker responds once the handshake completes
+            lock();
+            memcpy(conn->handshake, req, length);
+            conn->handshaking = true;
+            unlock();
+
+            platform->process(conn, NULL);
+
+        } else if (cmd == CMD_ACK) {
+
+            // Missing offset or credits
+            if (length < 4) {
+                resp[0] = ERROR_BUFFER_OVERRUN;
+                break;
+            }
+
+            uint16_t ackOffset = (req[1] << 8) | req[2];
+
+            lock();
+            resp[0] = ackReply(conn, ackOffset, req[3]);
+            unlock();
+
+            if (resp[0]) { break; }
+
+            fsp_wake();
+
+        } else {
+            resp[0] = ERROR_BAD_COMMAND;
+        }
+
+    } while (0);
+
+    if (resp[0] == ERROR_BUSY) { conn->counters.busy++; }
+
+    // Send response if there is a response or error.
+    if (resp[0] != STATUS_SKIP) {
+        sendFrame(conn, resp, offset,
+          countersLength ? conn->countersData: NULL, countersLength, true);
+    }
+
+    return conn;
+}
+
+
+///////////////////////////////
+// Panel API
+
+bool fsp_acceptMessage(uint32_t id, FfxCborCursor *params) {
+    lock();
+
+    bool accepted = false;
+    do {
+        FspConnection *conn = NULL;
+        FspRequest *request = findRequest(id, &conn);
+        if (request == NULL || request->doomed) { break; }
+
+        if (request != headRequest(conn)) { break; }
+        if (request->messageState != FspMessageStateReceived) { break; }
+
+        request->messageState = FspMessageStateProcessing;
+
+        if (params) { ffx_cbor_clone(params, &request->message); }
+
+        accepted = true;
+    } while (0);
+
+    unlock();
+
+    return accepted;
+}
+
+// A doomed request still builds its reply (its buffer is kept until
+// the panel sends it); the send fails and releases it.
+bool fsp_buildReply(uint32_t id, FfxCborBuilder *result) {
+    lock();
+
+    FspRequest *request = findRequest(id, NULL);
+    FspResultArena *arena = NULL;
+    if (request && request->messageState == FspMessageStateProcessing) {
+        arena = takeResultArena(request);
+    }
+
+    unlock();
+
+    if (arena == NULL) { return false; }
+
+    ffx_cbor_buildArena(result, &arena->arena, arena->segments,
+      FSP_REPLY_SEGMENTS - 2);
+
+    return true;
+}
+
+
+// Releases everything built in the result arena of %%request%% (if it
+// has one), so the panel can build another reply.
+static void resetResultArena(FspRequest *request) {
+    if (request->resultArena == NULL) { return; }
+    ffx_cbor_resetArena(&request->resultArena->arena);
+}
+
+typedef struct ReplyWriter {
+    FfxSha256Context ctx;
+    uint8_t *data;
+    size_t offset;
+
+    // Hash as each segment is copied; otherwise the reply is hashed
+    // once encrypted
+    bool hashing;
+} ReplyWriter;
+
+// Copies each reply segment into the transport buffer, hashing it
+// along the way.
+static void writeReply(void *arg, const uint8_t *data, size_t length) {
+    ReplyWriter *writer = arg;
+
+    memcpy(&writer->data[writer->offset], data, length);
+    if (writer->hashing) { ffx_hash_updateSha256(&writer->ctx, data, length); }
+
+    writer->offset += length;
+}
+
+// Writes (and seals) the reply in %%builder%% to the buffer of
+// %%request%% and starts sending it. The request stays held until then,
+// so its buffer is not freed underneath; if it was doomed meanwhile it
+// is released instead and this fails.
+static bool sendMessage(FspConnection *conn, FspRequest *request,
+  FfxCborBuilder *builder, bool partial) {
+
+    // The reply to an encrypted request is encrypted
+    bool encrypted = request->encrypted;
+
+    size_t cborLength = ffx_cbor_getBuildLength(builder);
+    size_t length = cborLength + CHECKSUM_LENGTH +
+      (encrypted ? FSP_SECURE_TAG_LENGTH: 0);
+
+    // On failure the panel may build another reply (e.g. an error)
+    if (length > MAX_MESSAGE_SIZE + FSP_CBOR_HEADER) {
+        resetResultArena(request);
+        return false;
+    }
+
+    // The reply is larger than the message; the builder may reference
+    // the current buffer (e.g. the params), so it is only freed once the
+    // reply has been copied to a new one
+    FspMessageBuffer *previous = NULL;
+    if (length > request->buffer->capacity) {
+        lock();
+        FspMessageBuffer *buffer = allocBuffer(length, false);
+        unlock();
+        if (buffer == NULL) {
+            resetResultArena(request);
+            return false;
+        }
+
+        previous = request->buffer;
+        request->buffer = buffer;
+        request->data = buffer->data;
+    }
+
+    ReplyWriter writer = { 0 };
+    writer.data = request->data;
+    writer.offset = CHECKSUM_LENGTH;
+    writer.hashing = !encrypted;
+    ffx_hash_initSha256(&writer.ctx);
+    ffx_cbor_writeSegments(builder, writeReply, &writer);
+
+    if (encrypted) {
+        fsp_secure_seal(&conn->secure, &request->data[CHECKSUM_LENGTH],
+          cborLength);
+        ffx_hash_updateSha256(&writer.ctx, &request->data[CHECKSUM_LENGTH],
+          cborLength + FSP_SECURE_TAG_LENGTH);
+    }
+
+    ffx_hash_finalSha256(&writer.ctx, request->data);
+
+    lock();
+
+    // The reply (and result, if in the arena) has been copied
+    releaseReplySpace(request);
+    if (previous) { freeBuffer(previous); }
+
+    bool doomed = request->doomed;
+    if (doomed) {
+        resetRequest(request);
+
+    } else {
+        request->length = length;
+        request->partial = partial;
+        request->messageState = FspMessageStateSending;
+
+        // Panels may still reply once a partial reply is sent
+        if (!partial) { request->messageId = 0; }
+
+        conn->credits = conn->window;
+        conn->acked = 0;
+        conn->ackTime = platform->now();
+
+        conn->rewinding = false;
+        conn->acking = false;
+        conn->ackOffset = 0;
+        conn->ackCredits = 0;
+    }
+
+    unlock();
+
+    if (doomed) { return false; }
+
+    uint8_t resetMessage[] = { CMD_RESET };
+    sendFrame(conn, resetMessage, sizeof(resetMessage), NULL, 0, true);
+
+    fsp_wake();
+
+    return true;
+}
+
+// Begins the reply envelope of %%request%% in its reply header,
+// returning false if the pool is exhausted.
+static bool prepareReply(FspRequest *request, FfxCborBuilder *builder,
+  bool partial) {
+
+    lock();
+    FspReplyHeader *header = takeReplyHeader(request);
+    unlock();
+
+    if (header == NULL) { return false; }
+
+    ffx_cbor_buildSegmented(builder, header->data, FSP_CBOR_HEADER,
+      header->segments, FSP_REPLY_SEGMENTS);
+
+    ffx_cbor_appendMap(builder, partial ? 4: 3);
+    {
+        ffx_cbor_appendKey(builder, &keyV);
+        ffx_cbor_appendNumber(builder, 1);
+
+        ffx_cbor_appendKey(builder, &keyId);
+        ffx_cbor_appendNumber(builder, request->replyId);
+
+        if (partial) {
+            ffx_cbor_appendKey(builder, &keyPartial);
+            ffx_cbor_appendNumber(builder, request->partials);
+        }
+    }
+
+    request->offset = 0;
+
+    return true;
+}
+
+// The request a panel is replying to, if it is processing. A doomed
+// request is released instead, as the panel is done with it.
+static FspRequest* replyingRequest(uint32_t id, FspConnection **_conn) {
+    lock();
+
+    FspRequest *request = findRequest(id, _conn);
+    if (request && request->doomed) {
+        resetRequest(request);
+        request = NULL;
+    } else if (request &&
+      request->messageState != FspMessageStateProcessing) {
+        request = NULL;
+    }
+
+    unlock();
+
+    return request;
+}
+
+bool fsp_sendErrorReply(uint32_t id, uint32_t code, char *message) {
+    FspConnection *conn = NULL;
+    FspRequest *request = replyingRequest(id, &conn);
+    if (request == NULL) { return false; }
+
+    size_t length = strlen(message);
+    if (length > 128) { return false; }
+
+    FfxCborBuilder builder;
+    if (!prepareReply(request, &builder, false)) { return false; }
+
+    // Append the Error payload (error: { code, message })
+    ffx_cbor_appendKey(&builder, &keyError);
+    ffx_cbor_appendMap(&builder, 2);
+    {
+        ffx_cbor_appendKey(&builder, &keyCode);
+        ffx_cbor_appendNumber(&builder, code);
+
+        ffx_cbor_appendKey(&builder, &keyMessage);
+        ffx_cbor_appendString(&builder, message);
+    }
+
+    return sendMessage(conn, request, &builder, false);
+}
+
+static bool sendResult(uint32_t id, FfxCborBuilder *result, bool partial) {
+    FspConnection *conn = NULL;
+    FspRequest *request = replyingRequest(id, &conn);
+    if (request == NULL) { return false; }
+
+    if (ffx_cbor_getBuildLength(result) > MAX_MESSAGE_SIZE) { return false; }
+
+    FfxCborBuilder builder;
+    if (!prepareReply(request, &builder, partial)) { return false; }
+
+    // Append the payload (by reference)
+    ffx_cbor_appendKey(&builder, &keyResult);
+    FfxCborStatus status = ffx_cbor_appendCborBuilder(&builder, result);
+    if (status) { return false; }
+
+    return sendMessage(conn, request, &builder, partial);
+}
+
+bool fsp_sendReply(uint32_t id, FfxCborBuilder *result) {
+    return sendResult(id, result, false);
+}
+
+bool fsp_sendPartialReply(uint32_t id, FfxCborBuilder *result) {
+    return sendResult(id, result, true);
+}
+
+bool fsp_isSendingReply(uint32_t id) {
+    lock();
+    FspRequest *request = findRequest(id, NULL);
+    bool sending = (request && !request->doomed &&
+      request->messageState == FspMessageStateSending);
+    unlock();
+
+    return sending;
+}
+
+
+///////////////////////////////
+// Sending
+
+// The reply to the head request is complete; its buffer is available
+// to any request again and the next queued request (if any) is handed
+// to the panels. After a partial reply, the request instead goes back
+// to its panel (keeping its buffer) for the rest.
+static void finishSend(FspConnection *conn) {
+    Emit emit = { 0 };
+
+    lock();
+
+    FspRequest *request = headRequest(conn);
+    if (request->partial) {
+        request->partial = false;
+        request->partials++;
+        request->offset = 0;
+        request->length = 0;
+        request->messageState = FspMessageStateProcessing;
+    } else {
+        resetRequest(request);
+        advanceRequests(conn, &emit);
+    }
+
+    unlock();
+
+    emitRequest(&emit);
+}
+
+// Sends the next chunk of the outgoing message. The offset is only
+// advanced once the transport accepts the chunk, so a failed chunk is
+// retried.
+//
+// The payload is passed to the transport directly from the message
+// buffer, so it is copied once (by the transport, into its own
+// buffers). Compressed chunks are encoded on the stack first, starting
+// at the chunk offset, so a resent chunk is simply compressed again.
+static int sendChunk(FspConnection *conn, FspRequest *request,
+  bool confirm) {
+
+    size_t chunkSize = conn->chunkSize;
+    if (chunkSize > FSP_MAX_CHUNK_SIZE) { chunkSize = FSP_MAX_CHUNK_SIZE; }
+
+    size_t length = request->length - request->offset;
+    if (length > chunkSize) { length = chunkSize; }
+
+    uint8_t header[3];
+    if (request->offset == 0) {
+        header[0] = CMD_START_MESSAGE;
+        header[1] = request->length >> 8;
+        header[2] = request->length & 0xff;
+
+    } else {
+        header[0] = CMD_CONTINUE_MESSAGE;
+        header[1] = request->offset >> 8;
+        header[2] = request->offset & 0xff;
+    }
+
+    const uint8_t *payload = &request->data[request->offset];
+    size_t payloadLength = length;
+
+    // Ciphertext does not compress; it is only stored
+    uint8_t compressed[FSP_MAX_CHUNK_SIZE];
+    if ((conn->caps & CAPS_COMPRESSED) && request->encrypted) {
+        payloadLength = compress_store(request->data, request->offset,
+          request->length, compressed, chunkSize, &length);
+        payload = compressed;
+    } else if (conn->caps & CAPS_COMPRESSED) {
+        payloadLength = compress_encode(&encoder, request->data,
+          request->offset, request->length, compressed, chunkSize, &length);
+        payload = compressed;
+    }
+
+    int rc = sendFrame(conn, header, sizeof(header), payload, payloadLength,
+      confirm);
+    if (rc == 0) {
+        request->offset += length;
+        conn->counters.chunksOut++;
+    }
+
+    return rc;
+}
+
+// Applies what the host asked of the reply being sent (recorded by
+// rewindReply and ackReply) on the sender, which alone changes the
+// reply's offset, acked offset and credits while it is sent.
+static void takeHostUpdates(FspConnection *conn, FspRequest *request) {
+    lock();
+
+    if (conn->rewinding) {
+        conn->rewinding = false;
+
+        if (conn->rewindOffset < request->offset) {
+            conn->counters.resends++;
+        }
+
+        request->offset = conn->rewindOffset;
+        conn->acked = conn->rewindOffset;
+        conn->credits = conn->window;
+        conn->ackTime = platform->now();
+        conn->awaiting = false;
+    }
+
+    if (conn->acking) {
+        conn->acking = false;
+
+        // The host has data sent before a resend began
+        if (conn->ackOffset > request->offset) {
+            request->offset = conn->ackOffset;
+        }
+
+        conn->acked = conn->ackOffset;
+        conn->ackTime = platform->now();
+
+        conn->credits += conn->ackCredits;
+        if (conn->credits > 0xff) { conn->credits = 0xff; }
+        conn->ackCredits = 0;
+    }
+
+    unlock();
+}
+
+// Advances the outgoing reply of %%conn%%, if any.
+static void sendPending(FspConnection *conn, bool woken) {
+    if (conn->detached || conn->paused) { return; }
+
+    FspRequest *request = headRequest(conn);
+    if (request == NULL) { return; }
+    if (request->messageState != FspMessageStateSending) { return; }
+
+    takeHostUpdates(conn, request);
+
+    // Streamed; send as fast as the transport allows
+    if (!conn->confirmed) {
+        while (request->offset < request->length && !conn->stalled) {
+            if (sendChunk(conn, request, false)) { break; }
+        }
+
+        if (request->offset == request->length) { finishSend(conn); }
+        return;
+    }
+
+    if (!(conn->caps & CAPS_WINDOWED)) {
+        // Each chunk is sent once the previous one is acknowledged
+        if (conn->awaiting) { return; }
+
+        if (request->offset == request->length) {
+            finishSend(conn);
+            return;
+        }
+
+        sendChunk(conn, request, true);
+        return;
+    }
+
+    // The host has acked the entire reply
+    if (conn->acked == request->length) {
+        finishSend(conn);
+        return;
+    }
+
+    // No ack in time; resend from the last acked offset
+    if (!woken && platform->now() - conn->ackTime >= ACK_TIMEOUT) {
+        printf("[fsp] ack timeout: conn=%d offset=%zu acked=%zu\n",
+          connIndex(conn), request->offset, conn->acked);
+        request->offset = conn->acked;
+        conn->credits = conn->window;
+        conn->ackTime = platform->now();
+        conn->counters.resends++;
+    }
+
+    // Fill the window, as far as the host's credits allow
+    while (request->offset < request->length && conn->credits &&
+      request->offset - conn->acked < conn->window * conn->chunkSize) {
+        if (sendChunk(conn, request, false)) { break; }
+        conn->credits--;
+    }
+}
+
+uint32_t fsp_poll(bool woken) {
+    uint32_t timeout = IDLE_TIMEOUT;
+
+    for (int i = 0; i < FSP_MAX_CONNECTIONS; i++) {
+        FspConnection *conn = &connections[i];
+        if (!conn->open) { continue; }
+
+        // The panels were given the head request but none accepted it
+        // in time (e.g. the event was lost)
+        uint32_t unaccepted = 0;
+
+        lock();
+
+        FspRequest *head = headRequest(conn);
+        if (head && head->emitted &&
+          head->messageState == FspMessageStateReceived) {
+            uint32_t elapsed = platform->now() - head->emitTime;
+            if (elapsed >= ACCEPT_TIMEOUT) {
+                unaccepted = head->messageId;
+            } else if (timeout > ACCEPT_TIMEOUT - elapsed) {
+                timeout = ACCEPT_TIMEOUT - elapsed;
+            }
+        }
+
+        unlock();
+
+        if (unaccepted) { failRequest(unaccepted); }
+
+        // The host did not resume the session in time; checked under
+        // the lock, as a transport may be resuming it
+        if (conn->detached) {
+            lock();
+
+            uint32_t elapsed = platform->now() - conn->detachTime;
+            bool expired = (conn->detached && elapsed >= SESSION_TIMEOUT);
+            if (expired) {
+                clearRequests(conn);
+                conn->detached = false;
+                conn->open = false;
+                conn->secured = false;
+                fsp_secure_clear(&conn->secure);
+            }
+
+            unlock();
+
+            if (expired) {
+                printf("[fsp] session expired: conn=%d session=%08lx\n",
+                  connIndex(conn), (unsigned long)conn->session);
+            } else if (elapsed < SESSION_TIMEOUT &&
+              timeout > SESSION_TIMEOUT - elapsed) {
+                timeout = SESSION_TIMEOUT - elapsed;
+            }
+            continue;
+        }
+
+        sendPending(conn, woken);
+
+        // Windowed and streamed transfers must notice a missing ack or
+        // a transport with room again sooner
+        FspRequest *request = headRequest(conn);
+        if (request == NULL) { continue; }
+        if (request->messageState != FspMessageStateSending) { continue; }
+
+        if (!conn->confirmed) {
+            if (!conn->stalled && timeout > RETRY_TIMEOUT) {
+                timeout = RETRY_TIMEOUT;
+            }
+        } else if ((conn->caps & CAPS_WINDOWED) && timeout > ACK_TIMEOUT) {
+            timeout = ACK_TIMEOUT;
+        }
+    }
+
+    return timeout;
+}
@@ -0,0 +1,487 @@
+#ifndef __FSP_H__
+#define __FSP_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "firefly-cbor.h"
+#include "firefly-hash.h"
+
+#include "fsp-secure.h"
+
+
+/**
+ *  Firefly Serial Protocol
+ *
+ *  The framing and request state machine, independent of the link it
+ *  is carried over. A transport (GATT, an L2CAP channel, a simulated
+ *  link, ...) opens an [[FspConnection]] for each peer, feeds each
+ *  frame received from it to [[fsp_receive]] and sends the frames FSP
+ *  produces using its [[FspTransport]].
+ *
+ *  Anything that depends on the runtime (locking, the message worker,
+ *  handing messages to panels and the clock) is provided once by the
+ *  [[FspPlatform]] passed to [[fsp_init]].
+ */
+
+// 16kb
+#define MAX_MESSAGE_SIZE        (1 << 14)
+
+// Largest frame in either direction; a 3 byte command (or chunk)
+// header and its payload
+#define FSP_MAX_FRAME           (1024)
+#define FSP_MAX_CHUNK_SIZE      (FSP_MAX_FRAME - 3)
+
+// Concurrent connections, across all transports (the BLE connections
+// and the USB link)
+#define FSP_MAX_CONNECTIONS     (4)
+
+// Requests a connection may have in flight; the host may upload the
+// next request while earlier ones are processed or replied to (both
+// the maximum and the current count are included in CMD_QUERY)
+#define FSP_MAX_REQUESTS        (2)
+
+// Message buffers are taken from a fixed pool of blocks (as a run of
+// contiguous blocks) when a message starts, enough for its declared
+// length, and returned once its reply is sent; as is the space a reply
+// is built in, while it is built. So the heap is never fragmented.
+#define FSP_BLOCK_SIZE          (512)
+
+// The blocks held by all requests together are limited to those of
+// this many full-size messages; a message that would exceed it is
+// refused (ERROR_BUSY)
+#define FSP_MESSAGE_BUFFERS     (2)
+
+// Length of CBOR overhead for replys (@TODO: too big, resize)
+#define FSP_CBOR_HEADER         (128)
+
+#define FSP_METHOD_LENGTH       (32)
+
+// Maximum number of segments in a reply (the header and any buffers
+// referenced by the result)
+#define FSP_REPLY_SEGMENTS      (16)
+
+// Size of the per-request arena reply results are built in
+#define FSP_ARENA_SIZE          (4096)
+
+// Largest CMD_SESSION handshake
+#define FSP_HANDSHAKE_LENGTH    (64)
+
+// Buckets of the confirmation round-trip histogram; bucket i counts
+// round trips under 8 << i ms, the last one everything longer
+#define FSP_RTT_BUCKETS         (8)
+
+// Largest encoded counters (see CMD_QUERY), including the transport's
+#define FSP_COUNTERS_LENGTH     (384)
+
+
+typedef enum FspMessageState {
+    // Ready to receive data (a free request slot)
+    FspMessageStateReady     = 0,
+
+    // Receiving data; data = rx
+    FspMessageStateReceiving,
+
+    // Received data, waiting for the message worker; data = rx
+    FspMessageStateVerifying,
+
+    // Received data, queued for the panel; data = rx
+    FspMessageStateReceived,
+
+    // Processing data; data = tx
+    FspMessageStateProcessing,
+
+    // Sending data; data = tx
+    FspMessageStateSending
+} FspMessageState;
+
+typedef struct FspMessageBuffer {
+    // Blocks taken for this buffer (including this header), and the
+    // bytes of data they hold
+    size_t blocks;
+    size_t capacity;
+
+    // The incoming message, and later the outgoing reply (if it fits,
+    // otherwise it is moved to a larger buffer)
+    uint8_t data[];
+} FspMessageBuffer;
+
+// The reply header is built here and the result is referenced, until
+// both are streamed into the message buffer when the reply is sent;
+// taken from the pool once a panel replies
+typedef struct FspReplyHeader {
+    uint8_t data[FSP_CBOR_HEADER];
+    FfxCborSegment segments[FSP_REPLY_SEGMENTS];
+} FspReplyHeader;
+
+// Memory for building the result of a request; taken from the pool once
+// a panel builds a result, and returned all at once when the reply is
+// sent
+typedef struct FspResultArena {
+    FfxCborArena arena;
+    FfxCborSegment segments[FSP_REPLY_SEGMENTS - 2];
+    uint8_t data[FSP_ARENA_SIZE];
+} FspResultArena;
+
+// A message from the host, from its first chunk until its reply is
+// sent; each connection keeps a ring of these, served in order
+typedef struct FspRequest {
+    FspMessageState messageState;
+
+    // Unique id for each message (across all connections)
+    uint32_t messageId;
+
+    // An ID to reply with
+    uint32_t replyId;
+
+    FfxCborCursor message;
+    char method[FSP_METHOD_LENGTH];
+    FfxCborCursor params;
+
+    // The buffer holding the message and later its reply
+    FspMessageBuffer *buffer;
+    uint8_t *data;
+
+    // Where a panel builds the reply, while it does (NULL otherwise)
+    FspReplyHeader *replyHeader;
+    FspResultArena *resultArena;
+
+    // Next offset to receive (or send) and the total message size
+    size_t offset;
+    size_t length;
+
+    // Validates and hashes the incoming message as each chunk arrives
+    FfxCborValidator validator;
+    FfxSha256Context checksum;
+
+    // The message is encrypted (the connection has a secure session);
+    // it is only validated once decrypted
+    bool encrypted;
+
+    // Whether panels have been given the request yet, and when
+    bool emitted;
+    uint32_t emitTime;
+
+    // Discarded (e.g. its session expired) while the message worker or
+    // a panel still held it; its buffer is released once they let go
+    bool doomed;
+
+    // The reply being sent is partial; once sent, the request goes back
+    // to its panel for the rest. And how many have been sent.
+    bool partial;
+    uint16_t partials;
+} FspRequest;
+
+// What a connection has done since it was opened; reported to the host
+// by CMD_QUERY [ QUERY_COUNTERS ] (see fsp.c). These are updated from
+// several tasks without the lock, so are only approximate.
+typedef struct FspCounters {
+    // Frames (commands, responses and chunks) and their bytes
+    uint32_t framesIn;
+    uint32_t framesOut;
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+
+    // Message chunks received and sent
+    uint32_t chunksIn;
+    uint32_t chunksOut;
+
+    // Frames the transport could not take yet (retried later)
+    uint32_t stalls;
+
+    // Commands refused with ERROR_BUSY
+    uint32_t busy;
+
+    // Messages dropped for a bad checksum
+    uint32_t badChecksums;
+
+    // Times a reply went back to an earlier offset (an ack timeout, the
+    // host rewinding it or the transport restarting it)
+    uint32_t resends;
+
+    // Round trips of confirmed frames (e.g. indications), in ms
+    uint32_t rtt[FSP_RTT_BUCKETS];
+    uint32_t rttMax;
+
+    // Messages verified and parsed by the message worker, and the total
+    // and longest time it took (ms)
+    uint32_t processed;
+    uint32_t processTime;
+    uint32_t processMax;
+} FspCounters;
+
+struct FspConnection;
+
+typedef struct FspTransport {
+    // A name for logging
+    const char *name;
+
+    /**
+     *  Sends a frame made of %%header%% followed by %%payload%% (which
+     *  may be NULL). If %%confirm%%, the frame is one the peer must
+     *  acknowledge (e.g. an indication) when the connection is
+     *  confirmed.
+     *
+     *  Returns 0 if the frame was sent (or queued by the transport),
+     *  otherwise it is retried later.
+     */
+    int (*send)(struct FspConnection *conn, const uint8_t *header,
+      size_t headerLength, const uint8_t *payload, size_t payloadLength,
+      bool confirm);
+
+    /**
+     *  Optionally appends transport-specific fields to the CMD_QUERY
+     *  response, returning the number of bytes written (at most
+     *  %%length%%).
+     */
+    size_t (*query)(struct FspConnection *conn, uint8_t *output,
+      size_t length);
+
+    /**
+     *  Optionally appends transport-specific entries (e.g. the MTU) to
+     *  the counters Map, returning the number of entries appended.
+     */
+    size_t (*counters)(struct FspConnection *conn, FfxCborBuilder *builder);
+} FspTransport;
+
+typedef struct FspConnection {
+    bool open;
+
+    const FspTransport *transport;
+    void *context;
+
+    // Payload bytes per outgoing chunk; set by the transport
+    size_t chunkSize;
+
+    // Whether frames sent with confirm are acknowledged by the peer
+    // (and [[fsp_confirm]] is called); each chunk of a reply then waits
+    // for the previous one. Otherwise chunks are streamed, as fast as
+    // the transport allows. Set by the transport.
+    bool confirmed;
+
+    // The transport cannot accept another frame yet; it clears this
+    // (and calls [[fsp_wake]]) once it can
+    bool stalled;
+
+    // A confirmed frame is awaiting its acknowledgement
+    bool awaiting;
+
+    // Requests; the head is the oldest (the one panels see, and whose
+    // reply is sent next), followed by count - 1 queued requests and
+    // then the incoming request (if receiving)
+    FspRequest requests[FSP_MAX_REQUESTS];
+    uint8_t head;
+    uint8_t count;
+    bool receiving;
+
+    // Capabilities negotiated by the host through CMD_QUERY
+    uint8_t caps;
+
+    // Windowed transfers; the maximum chunks in flight, the credits
+    // granted by the host, and its last cumulative ack (and when). Only
+    // the sender changes these (and the reply's offset) once sending.
+    uint8_t window;
+    uint32_t credits;
+    size_t acked;
+    uint32_t ackTime;
+
+    // What the host asked of the reply being sent; recorded under the
+    // lock by the transport's task and applied by the sender. A rewind
+    // (CMD_CONTINUE_MESSAGE [ offset ] or fsp_restartReply) drops any
+    // ack recorded before it; acks (CMD_ACK) accumulate credits.
+    bool rewinding;
+    size_t rewindOffset;
+    bool acking;
+    size_t ackOffset;
+    uint32_t ackCredits;
+
+    // Identifies the requests of this connection, so a host can resume
+    // them on a new connection after the link drops (see CMD_QUERY)
+    uint32_t session;
+
+    // The transport went away with requests in flight; they are kept
+    // (without a transport) until the session is resumed or expires
+    bool detached;
+    uint32_t detachTime;
+
+    // A resumed reply waits for the host to say where to continue
+    bool paused;
+
+    // The encrypted session, if the host established one (see
+    // fsp-secure.h); a handshake received is run on the message worker
+    FspSecure secure;
+    bool handshaking;
+    uint8_t handshake[FSP_HANDSHAKE_LENGTH];
+
+    // A session was established; messages are never plaintext again,
+    // even if a later handshake fails
+    bool secured;
+
+    // The identity of the peer, if the link is bonded; set by the
+    // transport, so session tickets can be bound to it
+    bool bonded;
+    uint8_t peer[FSP_SECURE_PEER_LENGTH];
+
+    // Transport telemetry, and when the frame being awaited was sent
+    FspCounters counters;
+    uint32_t confirmTime;
+
+    // The encoded counters of a CMD_QUERY [ QUERY_COUNTERS ] response;
+    // kept here rather than on the (small) stack of the transport's task
+    uint8_t countersData[FSP_COUNTERS_LENGTH];
+} FspConnection;
+
+// Which links may carry plaintext (unencrypted) messages; any other
+// plaintext message is refused (ERROR_SESSION_FAILED)
+typedef enum FspPlaintext {
+    // A bonded link whose peer has never established an encrypted
+    // session (holds no ticket), on a connection that has not either
+    FspPlaintextBonded = 0,
+
+    // None; every message must be encrypted
+    FspPlaintextNever,
+
+    // Any; only for tests
+    FspPlaintextAny
+} FspPlaintext;
+
+typedef struct FspPlatform {
+    // Reported to the host by CMD_QUERY
+    uint32_t modelNumber;
+    uint32_t serialNumber;
+
+    // Dump each received message to the console (slow; debug only)
+    bool dump;
+
+    // Milliseconds, from any monotonic clock
+    uint32_t (*now)(void);
+
+    // Random session IDs, which a host must know to resume a session,
+    // and the keys of encrypted sessions; may be NULL (sequential IDs
+    // and no encrypted sessions; only for tests)
+    uint32_t (*random)(void);
+
+    // Signs the transcript of each new encrypted session with the
+    // device's attestation key (see fsp-secure.h); may be NULL (no
+    // encrypted sessions; only for tests)
+    FspSecureAttestFunc attest;
+
+    FspPlaintext plaintext;
+
+    // Protects the request queues, which may be changed from the
+    // transport, the sender, the message worker and the panels (both
+    // may be NULL if everything runs on one task)
+    void (*lock)(void);
+    void (*unlock)(void);
+
+    // A received message (or a CMD_SESSION handshake, if %%request%% is
+    // NULL) is complete; [[fsp_processRequest]] must be called for it
+    // (ideally off the transport's task)
+    void (*process)(FspConnection *conn, FspRequest *request);
+
+    // There is something to send; [[fsp_poll]] should be called soon
+    void (*wake)(void);
+
+    // Hands a verified request to the panels, returning whether one was
+    // given it; that panel must accept it (see [[fsp_acceptMessage]])
+    // within the accept timeout, otherwise the request fails
+    bool (*emit)(uint32_t id, const char *method, FfxCborCursor *params);
+} FspPlatform;
+
+
+/**
+ *  Initializes FSP; %%platform%% must remain valid.
+ */
+void fsp_init(const FspPlatform *platform);
+
+/**
+ *  Returns a new connection carried over %%transport%%, or NULL if
+ *  all connections are in use.
+ */
+FspConnection* fsp_openConnection(const FspTransport *transport,
+  void *context, size_t chunkSize, bool confirmed);
+
+/**
+ *  Discards every request of %%conn%% and releases it.
+ */
+void fsp_closeConnection(FspConnection *conn);
+
+/**
+ *  The transport of %%conn%% went away (e.g. a disconnect). If any
+ *  requests are in flight they are kept, so the host can resume the
+ *  session on a new connection, otherwise %%conn%% is closed. Either
+ *  way the transport must not use %%conn%% again.
+ */
+void fsp_detachConnection(FspConnection *conn);
+
+/**
+ *  Returns whether another connection can be opened.
+ */
+bool fsp_hasFreeConnection();
+
+/**
+ *  Handles a frame (command or message chunk) received from the host.
+ *
+ *  Returns the connection the transport now carries; this is a
+ *  different one if the host resumed a detached session (and %%conn%%
+ *  was closed).
+ */
+FspConnection* fsp_receive(FspConnection *conn, const uint8_t *data,
+  size_t length);
+
+/**
+ *  The peer acknowledged the last confirmed frame (or it failed).
+ */
+void fsp_confirm(FspConnection *conn);
+
+/**
+ *  The transport changed (e.g. fell back to another link) and frames
+ *  already sent may have been lost; a reply in progress restarts from
+ *  the beginning.
+ */
+void fsp_restartReply(FspConnection *conn);
+
+/**
+ *  Verifies (and decrypts) and parses a received message, then hands
+ *  it to the panels once it reaches the head of its queue; or runs the
+ *  pending handshake of %%conn%% if %%request%% is NULL. This is the
+ *  body of the message worker.
+ */
+void fsp_processRequest(FspConnection *conn, FspRequest *request);
+
+/**
+ *  Advances the outgoing reply of every connection. If %%woken%%, the
+ *  call was prompted by [[FspPlatform]] wake (or a transport event)
+ *  rather than a timeout.
+ *
+ *  Returns the number of milliseconds until it should be called again,
+ *  if nothing wakes the sender sooner.
+ */
+uint32_t fsp_poll(bool woken);
+
+/**
+ *  Wakes the sender; for transports, once a stall is cleared.
+ */
+void fsp_wake();
+
+
+// Panel API; see panel.h
+
+bool fsp_acceptMessage(uint32_t id, FfxCborCursor *params);
+bool fsp_buildReply(uint32_t id, FfxCborBuilder *result);
+bool fsp_sendErrorReply(uint32_t id, uint32_t code, char *message);
+bool fsp_sendReply(uint32_t id, FfxCborBuilder *result);
+bool fsp_sendPartialReply(uint32_t id, FfxCborBuilder *result);
+bool fsp_isSendingReply(uint32_t id);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __FSP_H__ */
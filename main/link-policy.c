@@ -0,0 +1,197 @@
+#include "link-policy.h"
+
+
+// How long the link must be quiet before falling back to idle (ms)
+#define IDLE_DELAY          (5000)
+
+// A requested update the stack never answered is given up on (ms)
+#define UPDATE_TIMEOUT      (10000)
+
+// How long before a mode the central rejected is requested again (ms)
+#define REJECT_BACKOFF      (30000)
+
+// Parameters for each mode; both are within the limits iOS accepts
+// (an interval of at least 15ms, interval * (latency + 1) under 2s
+// and a timeout of 2s to 6s)
+static const LinkParams modeParams[] = {
+    [LinkModeDefault] = { 0 },
+
+    // 15ms, no latency and a 4s timeout
+    [LinkModeActive] = {
+        .intervalMin = 12, .intervalMax = 12, .latency = 0, .timeout = 400
+    },
+
+    // 100ms to 120ms, skipping up to 4 events and a 6s timeout
+    [LinkModeIdle] = {
+        .intervalMin = 80, .intervalMax = 96, .latency = 4, .timeout = 600
+    },
+};
+
+
+void link_init(LinkPolicy *link, uint32_t now) {
+    *link = (LinkPolicy){
+        .phy = LINK_PHY_1M,
+        .dataLength = 27,
+        .mode = LinkModeDefault,
+        .activityTime = now,
+    };
+}
+
+// Whether %%mode%% was rejected recently
+static bool isBackingOff(const LinkPolicy *link, LinkMode mode,
+  uint32_t now) {
+    if (link->rejected == 0 || link->rejectedMode != mode) { return false; }
+    return (now - link->rejectedTime < REJECT_BACKOFF);
+}
+
+// The mode the link should be in
+static LinkMode desiredMode(const LinkPolicy *link, uint32_t now) {
+    if (now - link->activityTime < IDLE_DELAY) { return LinkModeActive; }
+    return LinkModeIdle;
+}
+
+// Whether the current parameters already suit %%mode%%
+static bool isSuited(const LinkPolicy *link, LinkMode mode) {
+    const LinkParams *params = &modeParams[mode];
+    if (link->interval < params->intervalMin) { return false; }
+    if (link->interval > params->intervalMax) { return false; }
+    return (link->latency == params->latency);
+}
+
+static void rejectMode(LinkPolicy *link, uint32_t now) {
+    link->pending = false;
+    link->rejectedMode = link->pendingMode;
+    link->rejectedTime = now;
+    link->rejected++;
+}
+
+bool link_activity(LinkPolicy *link, uint32_t now) {
+    link->activityTime = now;
+    if (link->mode == LinkModeActive || link->pending) { return false; }
+    return !isBackingOff(link, LinkModeActive, now);
+}
+
+void link_phyUpdated(LinkPolicy *link, int status, uint8_t phy) {
+    if (status) { return; }
+    link->phy = phy;
+}
+
+void link_dataLengthChanged(LinkPolicy *link, uint16_t dataLength) {
+    link->dataLength = dataLength;
+}
+
+void link_paramsUpdated(LinkPolicy *link, int status, uint16_t interval,
+  uint16_t latency, uint16_t timeout, uint32_t now) {
+
+    if (status) {
+        if (link->pending) { rejectMode(link, now); }
+        return;
+    }
+
+    link->interval = interval;
+    link->latency = latency;
+    link->timeout = timeout;
+
+    // The central may grant something else; either way it answered, so
+    // the request is not repeated
+    if (link->pending) {
+        link->mode = link->pendingMode;
+        link->pending = false;
+    }
+}
+
+uint32_t link_poll(LinkPolicy *link, uint32_t now, LinkParams *params) {
+    uint32_t actions = LinkActionNone;
+
+    if (!link->phyRequested) {
+        link->phyRequested = true;
+        if (link->phy != LINK_PHY_2M) { actions |= LinkActionPhy; }
+    }
+
+    if (!link->dataLengthRequested) {
+        link->dataLengthRequested = true;
+        if (link->dataLength < LINK_MAX_DATA_LENGTH) {
+            actions |= LinkActionDataLength;
+        }
+    }
+
+    // One update at a time; unless the stack lost track of it
+    if (link->pending) {
+        if (now - link->requestTime < UPDATE_TIMEOUT) { return actions; }
+        rejectMode(link, now);
+    }
+
+    LinkMode mode = desiredMode(link, now);
+    if (mode == link->mode) { return actions; }
+
+    if (isSuited(link, mode)) {
+        link->mode = mode;
+        return actions;
+    }
+
+    if (isBackingOff(link, mode, now)) { return actions; }
+
+    *params = modeParams[mode];
+
+    link->pending = true;
+    link->pendingMode = mode;
+    link->requestTime = now;
+    link->requests++;
+
+    return actions | LinkActionParams;
+}
+
+uint32_t link_timeout(const LinkPolicy *link, uint32_t now) {
+    if (!link->phyRequested || !link->dataLengthRequested) { return 0; }
+
+    if (link->pending) {
+        uint32_t elapsed = now - link->requestTime;
+        if (elapsed >= UPDATE_TIMEOUT) { return 0; }
+        return UPDATE_TIMEOUT - elapsed;
+    }
+
+    LinkMode mode = desiredMode(link, now);
+    if (mode != link->mode) {
+        if (!isBackingOff(link, mode, now)) { return 0; }
+        return REJECT_BACKOFF - (now - link->rejectedTime);
+    }
+
+    // Active; falls back to idle once quiet
+    uint32_t quiet = now - link->activityTime;
+    if (quiet < IDLE_DELAY) { return IDLE_DELAY - quiet; }
+
+    return REJECT_BACKOFF;
+}
+
+static size_t writeU16(uint8_t *output, uint16_t value) {
+    output[0] = value >> 8;
+    output[1] = value;
+    return 2;
+}
+
+size_t link_encodeStats(const LinkPolicy *link, uint8_t *output,
+  size_t length) {
+
+    if (length < LINK_STATS_LENGTH) { return 0; }
+
+    size_t offset = 0;
+    output[offset++] = link->mode;
+    output[offset++] = link->phy;
+    offset += writeU16(&output[offset], link->dataLength);
+    offset += writeU16(&output[offset], link->interval);
+    offset += writeU16(&output[offset], link->latency);
+    offset += writeU16(&output[offset], link->timeout);
+    offset += writeU16(&output[offset], link->requests);
+    offset += writeU16(&output[offset], link->rejected);
+
+    return offset;
+}
+
+const char* link_modeName(LinkMode mode) {
+    switch (mode) {
+        case LinkModeDefault: return "default";
+        case LinkModeActive: return "active";
+        case LinkModeIdle: return "idle";
+    }
+    return "unknown";
+}
@@ -0,0 +1,163 @@
+#ifndef __LINK_POLICY_H__
+#define __LINK_POLICY_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ *  Connection parameter and PHY policy for a BLE link.
+ *
+ *  While a transfer is active the link should be as fast as possible:
+ *  the 2M PHY, the largest LL data length and a short connection
+ *  interval. Once it has been quiet for a while, it falls back to a
+ *  long interval with peripheral latency, so an idle connection costs
+ *  little radio time.
+ *
+ *  This only decides. The BLE task reports activity and the link as
+ *  the stack updates it, calls [[link_poll]] periodically and requests
+ *  whatever it returns. Nothing here depends on the stack, so the
+ *  simulator (tools/fsp-sim) runs the same policy on a simulated link.
+ *
+ *  Intervals are in 1.25ms units, latency in connection events and
+ *  timeouts in 10ms units (as on the air).
+ */
+
+#define LINK_PHY_1M                 (1)
+#define LINK_PHY_2M                 (2)
+
+// Largest LL data length (octets), and the time to send it on 1M
+#define LINK_MAX_DATA_LENGTH        (251)
+#define LINK_MAX_DATA_TIME          (2120)
+
+// Length of the stats appended to CMD_QUERY (see link_encodeStats)
+#define LINK_STATS_LENGTH           (14)
+
+
+typedef enum LinkMode {
+    // The parameters the central chose; nothing requested yet
+    LinkModeDefault = 0,
+
+    // A transfer is in progress; short interval
+    LinkModeActive,
+
+    // Quiet; long interval with latency
+    LinkModeIdle,
+} LinkMode;
+
+typedef enum LinkAction {
+    LinkActionNone           = 0,
+
+    // Prefer the 2M PHY
+    LinkActionPhy            = (1 << 0),
+
+    // Use LINK_MAX_DATA_LENGTH (and LINK_MAX_DATA_TIME)
+    LinkActionDataLength     = (1 << 1),
+
+    // Request the connection parameters returned by [[link_poll]]
+    LinkActionParams         = (1 << 2),
+} LinkAction;
+
+typedef struct LinkParams {
+    uint16_t intervalMin;
+    uint16_t intervalMax;
+    uint16_t latency;
+    uint16_t timeout;
+} LinkParams;
+
+typedef struct LinkPolicy {
+    // The link as last reported by the stack
+    uint8_t phy;
+    uint16_t dataLength;
+    uint16_t interval;
+    uint16_t latency;
+    uint16_t timeout;
+
+    // The mode the current parameters were requested for, and the one
+    // requested but not yet updated (if pending)
+    LinkMode mode;
+    LinkMode pendingMode;
+    bool pending;
+    uint32_t requestTime;
+
+    // The last frame sent or received
+    uint32_t activityTime;
+
+    // The PHY and data length are only requested once per connection
+    bool phyRequested;
+    bool dataLengthRequested;
+
+    // A mode the central rejected is not requested again until then
+    LinkMode rejectedMode;
+    uint32_t rejectedTime;
+
+    // Parameter updates requested, and how many were rejected
+    uint16_t requests;
+    uint16_t rejected;
+} LinkPolicy;
+
+
+/**
+ *  Initializes %%link%% for a new connection at %%now%% (ms).
+ */
+void link_init(LinkPolicy *link, uint32_t now);
+
+/**
+ *  A frame was sent or received. Returns true if the link should be
+ *  polled soon (it is not yet fast).
+ */
+bool link_activity(LinkPolicy *link, uint32_t now);
+
+/**
+ *  The stack updated (or failed to update) the PHY; %%phy%% is the
+ *  transmit PHY.
+ */
+void link_phyUpdated(LinkPolicy *link, int status, uint8_t phy);
+
+void link_dataLengthChanged(LinkPolicy *link, uint16_t dataLength);
+
+/**
+ *  The connection parameters changed, or a requested update failed (if
+ *  %%status%%); either may be prompted by the central.
+ */
+void link_paramsUpdated(LinkPolicy *link, int status, uint16_t interval,
+  uint16_t latency, uint16_t timeout, uint32_t now);
+
+/**
+ *  Returns the [[LinkAction]] flags to request now. If it includes
+ *  LinkActionParams, %%params%% is populated.
+ */
+uint32_t link_poll(LinkPolicy *link, uint32_t now, LinkParams *params);
+
+/**
+ *  Returns the number of milliseconds until [[link_poll]] may have
+ *  something new to request, without further activity.
+ */
+uint32_t link_timeout(const LinkPolicy *link, uint32_t now);
+
+/**
+ *  Encodes the link and its policy into %%output%% (big-endian),
+ *  returning the number of bytes written (0 if %%length%% is less than
+ *  LINK_STATS_LENGTH):
+ *    - mode (1 byte)
+ *    - phy (1 byte)
+ *    - dataLength (2 bytes)
+ *    - interval, latency and timeout (2 bytes each)
+ *    - requests and rejected (2 bytes each)
+ */
+size_t link_encodeStats(const LinkPolicy *link, uint8_t *output,
+  size_t length);
+
+const char* link_modeName(LinkMode mode);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __LINK_POLICY_H__ */
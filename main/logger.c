@@ -0,0 +1,141 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "utils.h"
+
+#include "logger.h"
+
+
+// Records held before overflowing; must be a power of 2
+#define LOG_CAPACITY        (128)
+#define LOG_MASK            (LOG_CAPACITY - 1)
+
+// A bounded multi-producer queue (with a single consumer). Each slot's
+// sequence tracks its state for a given position: equal to the
+// position when free, position + 1 once written and position +
+// LOG_CAPACITY once drained (free for the next lap).
+typedef struct Slot {
+    atomic_uint_least32_t seq;
+    uint32_t time;
+    uint32_t a;
+    uint32_t b;
+    uint16_t event;
+} Slot;
+
+static Slot slots[LOG_CAPACITY];
+
+// The next position to write; claimed by producers
+static atomic_uint_least32_t head;
+
+// The next position to drain; only changed by the draining task
+static uint32_t tail = 0;
+
+static atomic_uint_least32_t overflow;
+
+
+void logger_init() {
+    for (uint32_t i = 0; i < LOG_CAPACITY; i++) {
+        atomic_init(&slots[i].seq, i);
+    }
+    atomic_init(&head, 0);
+    atomic_init(&overflow, 0);
+}
+
+void logger_record(LogEvent event, uint32_t a, uint32_t b) {
+    uint32_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+
+    Slot *slot = NULL;
+    while (1) {
+        slot = &slots[pos & LOG_MASK];
+        uint32_t seq = atomic_load_explicit(&slot->seq,
+          memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+
+        if (diff == 0) {
+            // Free; claim it (on failure pos is reloaded)
+            if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1,
+              memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+
+        } else if (diff < 0) {
+            // Still holds a record from the previous lap; full
+            atomic_fetch_add_explicit(&overflow, 1, memory_order_relaxed);
+            return;
+
+        } else {
+            // Another producer claimed it
+            pos = atomic_load_explicit(&head, memory_order_relaxed);
+        }
+    }
+
+    slot->time = ticks();
+    slot->event = event;
+    slot->a = a;
+    slot->b = b;
+
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+// Returns the next written slot, if any
+static Slot* nextSlot() {
+    Slot *slot = &slots[tail & LOG_MASK];
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq != tail + 1) { return NULL; }
+    return slot;
+}
+
+static void releaseSlot(Slot *slot) {
+    atomic_store_explicit(&slot->seq, tail + LOG_CAPACITY,
+      memory_order_release);
+    tail++;
+}
+
+static size_t writeU32(uint8_t *output, uint32_t value) {
+    output[0] = value >> 24;
+    output[1] = value >> 16;
+    output[2] = value >> 8;
+    output[3] = value;
+    return 4;
+}
+
+size_t logger_drain(uint8_t *output, size_t length) {
+    size_t offset = LOG_HEADER_SIZE;
+
+    while (offset + LOG_RECORD_SIZE <= length) {
+        Slot *slot = nextSlot();
+        if (slot == NULL) { break; }
+
+        offset += writeU32(&output[offset], slot->time);
+        output[offset++] = slot->event >> 8;
+        output[offset++] = slot->event;
+        offset += writeU32(&output[offset], slot->a);
+        offset += writeU32(&output[offset], slot->b);
+
+        releaseSlot(slot);
+    }
+
+    if (offset == LOG_HEADER_SIZE) { return 0; }
+
+    writeU32(output, atomic_load_explicit(&overflow, memory_order_relaxed));
+
+    return offset;
+}
+
+void logger_discard() {
+    uint32_t count = 0;
+
+    while (1) {
+        Slot *slot = nextSlot();
+        if (slot == NULL) { break; }
+        releaseSlot(slot);
+        count++;
+    }
+
+    logger_addOverflow(count);
+}
+
+void logger_addOverflow(uint32_t count) {
+    if (count == 0) { return; }
+    atomic_fetch_add_explicit(&overflow, count, memory_order_relaxed);
+}
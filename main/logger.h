@@ -0,0 +1,88 @@
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ *  Compact binary log, for diagnostics from hot paths (rendering, BLE
+ *  and USB transfers) where a printf to the UART would cost too much.
+ *
+ *  Records are added to a lock-free ring buffer from any task, and
+ *  drained in batches by the BLE task's logger, which notifies them on
+ *  the FSP logger characteristic. A record that finds the ring full,
+ *  or is drained with no one subscribed, is counted as overflow.
+ *
+ *  Each batch is encoded (all big-endian) as:
+ *    - overflow (4 bytes); records lost since boot
+ *    - records, each LOG_RECORD_SIZE bytes:
+ *      - time (4 bytes); ticks (ms) since boot
+ *      - event (2 bytes)
+ *      - a, b (4 bytes each); event specific
+ */
+
+#define LOG_RECORD_SIZE         (14)
+#define LOG_HEADER_SIZE         (4)
+
+typedef enum LogEvent {
+    LogEventNone               = 0x0000,
+
+    // BLE; a=connHandle
+    LogEventNotifyTx           = 0x0101,  // b=status | (indication << 16)
+    LogEventIndicateFail       = 0x0102,  // b=rc
+    LogEventL2capStalled       = 0x0103,
+    LogEventL2capSendFail      = 0x0104,  // b=rc
+    LogEventLinkRequest        = 0x0105,  // b=LinkAction | (mode << 8)
+    LogEventLinkUpdated        = 0x0106,  // b=interval | (latency << 16)
+
+    // BLE advertising
+    LogEventAdvertising        = 0x0107,  // a=AdvAction | (mode << 8), b=reason
+
+    // IO
+    LogEventFrameDropped       = 0x0201,  // a=behind (ms)
+
+    // USB
+    LogEventUsbDropped         = 0x0301,  // a=length, b=written
+} LogEvent;
+
+
+void logger_init();
+
+/**
+ *  Adds a record. This never blocks; if the ring is full the record is
+ *  counted as overflow.
+ */
+void logger_record(LogEvent event, uint32_t a, uint32_t b);
+
+/**
+ *  Removes as many records as fit into %%output%% (of %%length%%
+ *  bytes), encoding them as a batch. Returns the batch length, or 0 if
+ *  there are no records.
+ *
+ *  Only one task may drain.
+ */
+size_t logger_drain(uint8_t *output, size_t length);
+
+/**
+ *  Removes every record, counting each as overflow (e.g. when no one
+ *  is listening).
+ */
+void logger_discard();
+
+/**
+ *  Counts %%count%% drained records as overflow (e.g. a batch that
+ *  could not be sent).
+ */
+void logger_addOverflow(uint32_t count);
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __LOGGER_H__ */
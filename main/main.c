@@ -7,8 +7,10 @@
 #include "events-private.h"
 #include "task-ble.h"
 #include "task-io.h"
+#include "task-usb.h"
 
 #include "device-info.h"
+#include "logger.h"
 #include "utils.h"
 
 #include "panel-connect.h"
@@ -23,10 +25,14 @@ void app_main() {
 
     TaskHandle_t taskIoHandle = NULL;
     TaskHandle_t taskBleHandle = NULL;
+    TaskHandle_t taskUsbHandle = NULL;
 
     // Initialie the events
     events_init();
 
+    // Initialize the binary log (before any task may record to it)
+    logger_init();
+
     // Load NVS and eFuse provision data
     {
         DeviceStatus status = device_init();
@@ -53,7 +59,7 @@ void app_main() {
         // Pointer passed to taskReplFunc to notify us when REPL is ready
         uint32_t ready = 0; // @TODO: set this to 0 and set in the task
 
-        BaseType_t status = xTaskCreatePinnedToCore(&taskBleFunc, "ble", 5 * 1024, &ready, 2, &taskBleHandle, 0);
+        BaseType_t status = xTaskCreatePinnedToCore(&taskBleFunc, "ble", 6 * 1024, &ready, 2, &taskBleHandle, 0);
         printf("[main] start BLE task: status=%d\n", status);
         assert(taskBleHandle != NULL);
 
@@ -62,6 +68,19 @@ void app_main() {
         printf("[main] BLE ready\n");
     }
 
+    // Start the USB task (handles FSP over USB serial); after the BLE
+    // task, which sets up FSP
+    {
+        uint32_t ready = 0;
+
+        BaseType_t status = xTaskCreatePinnedToCore(&taskUsbFunc, "usb", 4096, &ready, 2, &taskUsbHandle, 0);
+        printf("[main] start USB task: status=%d\n", status);
+        assert(taskUsbHandle != NULL);
+
+        while (!ready) { delay(1); }
+        printf("[main] USB ready\n");
+    }
+
     // Start the App Process; this is started in the main task, so
     // has high-priority. Don't doddle.
     // @TODO: should we start a short-lived low-priority task to start this?
@@ -73,10 +92,11 @@ void app_main() {
     //pushPanelConnect(NULL);
 
     while (1) {
-        printf("[main] high-water: boot=%d io=%d, ble=%d freq=%ld\n",
+        printf("[main] high-water: boot=%d io=%d, ble=%d usb=%d freq=%ld\n",
             uxTaskGetStackHighWaterMark(NULL),
             uxTaskGetStackHighWaterMark(taskIoHandle),
             uxTaskGetStackHighWaterMark(taskBleHandle),
+            uxTaskGetStackHighWaterMark(taskUsbHandle),
             portTICK_PERIOD_MS);
         delay(60000);
     }
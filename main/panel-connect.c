@@ -16,31 +16,351 @@
 
 #include "panel-connect.h"
 
-typedef struct State {
+// Most transactions (or digests) signed by one signBatch
+#define MAX_BATCH           (64)
+
+// Most signatures sent in one (partial) reply; each is 77 bytes of
+// CBOR, and a reply is built in its request's 4 KB arena
+#define MAX_REPLY_SIGS      (48)
+
+// Largest serialized transaction
+#define MAX_RLP_LENGTH      (1024)
+
+// A confirmed batch is signed on its own task, so the panel keeps
+// handling events while the signatures are sent
+#define SIGN_STACK_SIZE     (4096)
+
+// Emitted to the panel by the signing task once a batch is replied to;
+// far above the ids task-io hands out for scene callbacks
+#define EVENT_BATCH_DONE    (EventNameCustom | 0x00ffffff)
+
+#define ERROR_BAD_PARAMS    (1)
+#define ERROR_SIGN_FAILED   (2)
+#define ERROR_NO_MEMORY     (3)
+#define ERROR_REJECTED      (4)
+#define ERROR_BUSY          (5)
+
+static const FfxCborKey keyR = FFX_CBOR_KEY("r");
+static const FfxCborKey keyS = FFX_CBOR_KEY("s");
+static const FfxCborKey keyV = FFX_CBOR_KEY("v");
+
+typedef struct State State;
+
+// A signBatch request, with its items hashed already
+typedef struct Batch {
+    State *state;
+    uint32_t messageId;
+    size_t count;
+    uint8_t digests[];
+} Batch;
+
+struct State {
     FfxScene scene;
     FfxNode panel;
+    FfxNode label;
+
+    // A batch waiting for the user to confirm it, and whether one is
+    // being signed (cleared by the signing task once it is replied to)
+    Batch *batch;
+    volatile bool signing;
 
     uint32_t ticks;
-} State;
+};
+
+// getBytes(id("test-foobar-running-moose-34"))
+static uint8_t privateKey[] = {
+    15, 254, 74, 18, 107, 9, 94, 32, 109, 87, 148, 60, 35, 251, 109, 95,
+    51, 98, 149, 196, 4, 13, 42, 18, 147, 178, 165, 40, 128, 78, 67, 99
+};
+
+static FfxCborStatus appendSignature(FfxCborBuilder *reply, uint8_t *sig) {
+    FfxCborStatus status = ffx_cbor_appendMap(reply, 3);
+    if (!status) { status = ffx_cbor_appendKey(reply, &keyR); }
+    if (!status) { status = ffx_cbor_appendData(reply, &sig[0], 32); }
+    if (!status) { status = ffx_cbor_appendKey(reply, &keyS); }
+    if (!status) { status = ffx_cbor_appendData(reply, &sig[32], 32); }
+    if (!status) { status = ffx_cbor_appendKey(reply, &keyV); }
+    if (!status) { status = ffx_cbor_appendNumber(reply, sig[64]); }
+    return status;
+}
+
+// Sends the signatures [ start, end ) (at most MAX_REPLY_SIGS) as an
+// Array; as a partial reply, unless they are the last
+static bool sendSignatures(uint32_t messageId, uint8_t *sigs, size_t start,
+  size_t end, bool partial) {
+
+    FfxCborBuilder reply;
+    if (!panel_buildReply(messageId, &reply)) { return false; }
+
+    FfxCborStatus status = ffx_cbor_appendArray(&reply, end - start);
+    for (size_t i = start; i < end && !status; i++) {
+        status = appendSignature(&reply,
+          &sigs[i * FFX_SECP256K1_SIGNATURE_LENGTH]);
+    }
+
+    // Never send a truncated result
+    if (status) {
+        printf("[connect] signatures do not fit: count=%zu status=%d\n",
+          end - start, status);
+        return false;
+    }
+
+    if (partial) { return panel_sendPartialReply(messageId, &reply); }
+    return panel_sendReply(messageId, &reply);
+}
+
+// Hashes each item of %%items%% (an unsigned transaction, or a digest
+// as Data) into %%digests%%, with one scratch buffer and context
+static bool hashBatch(FfxCborCursor *items, size_t count, uint8_t *digests) {
+    uint8_t *rlp = malloc(MAX_RLP_LENGTH);
+    if (rlp == NULL) { return false; }
+
+    FfxKeccak256Context ctx;
+
+    bool valid = true;
+    for (size_t i = 0; i < count && valid; i++) {
+        uint8_t *digest = &digests[i * FFX_KECCAK256_DIGEST_LENGTH];
+
+        FfxCborCursor item;
+        ffx_cbor_clone(&item, items);
+        if (ffx_cbor_followIndex(&item, i)) {
+            valid = false;
+            break;
+        }
+
+        switch (ffx_cbor_getType(&item)) {
+            case FfxCborTypeData: {
+                uint8_t *data = NULL;
+                size_t length = 0;
+                ffx_cbor_getData(&item, &data, &length);
+                if (length != FFX_KECCAK256_DIGEST_LENGTH) {
+                    valid = false;
+                    break;
+                }
+                memcpy(digest, data, length);
+                break;
+            }
+
+            case FfxCborTypeMap: {
+                size_t rlpLength = MAX_RLP_LENGTH;
+                if (ffx_tx_serializeUnsigned(&item, rlp, &rlpLength)) {
+                    valid = false;
+                    break;
+                }
+
+                ffx_hash_initKeccak256(&ctx);
+                ffx_hash_updateKeccak256(&ctx, rlp, rlpLength);
+                ffx_hash_finalKeccak256(&ctx, digest);
+                break;
+            }
+
+            default:
+                valid = false;
+                break;
+        }
+    }
+
+    free(rlp);
+
+    return valid;
+}
+
+static void setPrompt(State *state, const char *text) {
+    ffx_sceneLabel_setText(state->label, text);
+}
+
+// signBatch([ [ tx or digest, ... ] ]); every item is hashed and the
+// user is asked once to sign the whole batch
+static void requestBatch(State *state, uint32_t messageId,
+  FfxCborCursor *params) {
+
+    FfxCborCursor items;
+    ffx_cbor_clone(&items, params);
+
+    size_t count = 0;
+    if (ffx_cbor_followIndex(&items, 0) ||
+      ffx_cbor_getType(&items) != FfxCborTypeArray ||
+      ffx_cbor_getLength(&items, &count) || count == 0 ||
+      count > MAX_BATCH) {
+        panel_sendErrorReply(messageId, ERROR_BAD_PARAMS, "bad batch");
+        return;
+    }
+
+    if (state->batch || state->signing) {
+        panel_sendErrorReply(messageId, ERROR_BUSY, "batch pending");
+        return;
+    }
+
+    Batch *batch = malloc(sizeof(Batch) +
+      count * FFX_KECCAK256_DIGEST_LENGTH);
+    if (batch == NULL) {
+        panel_sendErrorReply(messageId, ERROR_NO_MEMORY, "no memory");
+        return;
+    }
+
+    // The params are overwritten by the first partial reply, so every
+    // item is hashed first
+    if (!hashBatch(&items, count, batch->digests)) {
+        free(batch);
+        panel_sendErrorReply(messageId, ERROR_BAD_PARAMS, "bad item");
+        return;
+    }
+
+    batch->state = state;
+    batch->messageId = messageId;
+    batch->count = count;
+    state->batch = batch;
+
+    char text[32];
+    snprintf(text, sizeof(text), "Sign %zu? OK / Cancel", count);
+    setPrompt(state, text);
+}
+
+// Signs a confirmed batch and replies with the signatures in order.
+// Each is streamed back (in a partial reply) once signed and the
+// previous partial reply is sent, so signing overlaps the transfer; the
+// reply carries whatever remains. No reply holds more than
+// MAX_REPLY_SIGS.
+//
+// This runs on the signing task (see signTask), which is the one left
+// waiting whenever a partial reply must be sent before the next.
+static void signBatch(uint32_t messageId, uint8_t *digests, size_t count) {
+    uint8_t *sigs = malloc(count * FFX_SECP256K1_SIGNATURE_LENGTH);
+
+    do {
+        if (sigs == NULL) {
+            panel_sendErrorReply(messageId, ERROR_NO_MEMORY, "no memory");
+            break;
+        }
+
+        size_t sent = 0;
+        bool failed = false;
+        for (size_t i = 0; i < count; i++) {
+            uint8_t *sig = &sigs[i * FFX_SECP256K1_SIGNATURE_LENGTH];
+            if (!ffx_pk_signSecp256k1(privateKey,
+              &digests[i * FFX_KECCAK256_DIGEST_LENGTH], sig)) {
+                failed = true;
+                break;
+            }
+
+            // The last signatures go in the reply
+            if (i + 1 == count || panel_isSendingReply(messageId)) {
+                continue;
+            }
+
+            size_t end = i + 1;
+            if (end - sent > MAX_REPLY_SIGS) { end = sent + MAX_REPLY_SIGS; }
+
+            if (!sendSignatures(messageId, sigs, sent, end, true)) {
+                failed = true;
+                break;
+            }
+            sent = end;
+        }
+
+        // Whatever remains beyond one reply is sent in partial replies
+        while (!failed && count - sent > MAX_REPLY_SIGS) {
+            while (panel_isSendingReply(messageId)) { delay(10); }
+
+            size_t end = sent + MAX_REPLY_SIGS;
+            if (!sendSignatures(messageId, sigs, sent, end, true)) {
+                failed = true;
+                break;
+            }
+            sent = end;
+        }
+
+        // Nothing can be sent until the last partial reply is
+        while (panel_isSendingReply(messageId)) { delay(10); }
+
+        printf("[connect] batch: id=%ld count=%zu sent=%zu failed=%d\n",
+          messageId, count, sent, failed);
+
+        if (failed || !sendSignatures(messageId, sigs, sent, count, false)) {
+            panel_sendErrorReply(messageId, ERROR_SIGN_FAILED,
+              "signing failed");
+            break;
+        }
+    } while (0);
+
+    free(sigs);
+}
+
+// Signs the batch handed over by keyChanged (and frees it), then lets
+// the panel know it may take another.
+static void signTask(void *arg) {
+    Batch *batch = arg;
+    State *state = batch->state;
+
+    signBatch(batch->messageId, batch->digests, batch->count);
+    free(batch);
+
+    state->signing = false;
+    panel_emitEvent(EVENT_BATCH_DONE, (EventPayloadProps){ 0 });
+
+    vTaskDelete(NULL);
+}
+
+static void batchDone(EventPayload event, void *_state) {
+    State *state = _state;
+    if (state->batch == NULL) { setPrompt(state, "Listening..."); }
+}
+
+static void keyChanged(EventPayload event, void *_state) {
+    State *state = _state;
+    Batch *batch = state->batch;
+    if (batch == NULL) { return; }
+
+    switch (event.props.keys.down) {
+        case KeyOk: {
+            state->batch = NULL;
+            state->signing = true;
+            setPrompt(state, "Signing...");
+
+            // The signing task owns the batch now
+            BaseType_t status = xTaskCreatePinnedToCore(&signTask,
+              "connect-sign", SIGN_STACK_SIZE, batch, 1, NULL, 0);
+            if (status == pdPASS) { return; }
+
+            state->signing = false;
+            panel_sendErrorReply(batch->messageId, ERROR_NO_MEMORY,
+              "no memory");
+            break;
+        }
+        case KeyCancel:
+            panel_sendErrorReply(batch->messageId, ERROR_REJECTED,
+              "rejected");
+            break;
+        default:
+            return;
+    }
+
+    free(batch);
+    state->batch = NULL;
+
+    setPrompt(state, "Listening...");
+}
 
 static void onMessage(EventPayload event, void* arg) {
-    // getBytes(id("test-foobar-running-moose-34"))
-    uint8_t privateKey[] = {
-        15, 254, 74, 18, 107, 9, 94, 32, 109, 87, 148, 60, 35, 251, 109, 95,
-        51, 98, 149, 196, 4, 13, 42, 18, 147, 178, 165, 40, 128, 78, 67, 99
-    };
+    State *state = arg;
 
     uint32_t messageId = event.props.message.id;
     const char* method = event.props.message.method;
 
+    // Until accepted, the request (and its params) may be discarded
+    if (!panel_acceptMessage(messageId, NULL)) {
+        printf("EEK!");
+        return;
+    }
+
     FfxCborCursor params;
     ffx_cbor_clone(&params, &event.props.message.params);
 
     printf("GOT MESSAGE: id=%ld, method=%s", messageId, method);
     ffx_cbor_dump(&params);
 
-    if (!panel_acceptMessage(messageId, NULL)) {
-        printf("EEK!");
+    if (strcmp(method, "signBatch") == 0) {
+        requestBatch(state, messageId, &params);
         return;
     }
 
@@ -68,21 +388,20 @@ static void onMessage(EventPayload event, void* arg) {
     int32_t status = ffx_pk_signSecp256k1(privateKey, digest, sig);
     printf("sig: status=%ld\n", status);
 
-    uint8_t *_reply = malloc(256);
+    // The signature is referenced, not copied, into the reply
     FfxCborBuilder reply;
-    ffx_cbor_build(&reply, _reply, 256);
+    if (!panel_buildReply(messageId, &reply)) { return; }
 
     ffx_cbor_appendMap(&reply, 3);
-    ffx_cbor_appendString(&reply, "r");
-    ffx_cbor_appendData(&reply, &sig[0], 32);
-    ffx_cbor_appendString(&reply, "s");
-    ffx_cbor_appendData(&reply, &sig[32], 32);
-    ffx_cbor_appendString(&reply, "v");
+    ffx_cbor_appendKey(&reply, &keyR);
+    ffx_cbor_appendDataRef(&reply, &sig[0], 32);
+    ffx_cbor_appendKey(&reply, &keyS);
+    ffx_cbor_appendDataRef(&reply, &sig[32], 32);
+    ffx_cbor_appendKey(&reply, &keyV);
     ffx_cbor_appendNumber(&reply, sig[64]);
 
     //panel_sendErrorReply(4242, "This is an error message...");
     panel_sendReply(messageId, &reply);
-    free(_reply);
 }
 
 static int _init(FfxScene scene, FfxNode panel, void* _state, void* arg) {
@@ -90,16 +409,19 @@ static int _init(FfxScene scene, FfxNode panel, void* _state, void* arg) {
     state->scene = scene;
     state->panel = panel;
 
-    FfxNode *label = ffx_scene_createLabel(scene, FfxFontMediumBold,
+    FfxNode label = ffx_scene_createLabel(scene, FfxFontMediumBold,
       "Listening...");
     ffx_sceneLabel_setAlign(label,
       FfxTextAlignMiddleBaseline | FfxTextAlignCenter);
     ffx_sceneLabel_setOutlineColor(label, COLOR_BLACK);
     ffx_sceneNode_setPosition(label, ffx_point(120, 120));
     ffx_sceneGroup_appendChild(panel, label);
+    state->label = label;
 
 
     panel_onEvent(EventNameMessage, onMessage, state);
+    panel_onEvent(EventNameKeysChanged | KeyOk | KeyCancel, keyChanged, state);
+    panel_onEvent(EVENT_BATCH_DONE, batchDone, state);
 
     return 0;
 }
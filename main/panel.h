@@ -45,9 +45,28 @@ void panel_setPixel(uint32_t pixel, color_ffxt color);
 // Message API
 
 bool panel_acceptMessage(uint32_t id, FfxCborCursor *params);
+
+// Initializes %%result%% for an accepted message, backed by a
+// per-request arena that grows as needed and is released once the
+// reply is sent.
+bool panel_buildReply(uint32_t id, FfxCborBuilder *result);
+
+// Replies to an accepted message, returning false if it could not be
+// sent (e.g. the host has gone). The message, its params and arena stay
+// valid until one of these is called, so a panel must always finish
+// with one.
 bool panel_sendErrorReply(uint32_t id, uint32_t code, char *message);
 bool panel_sendReply(uint32_t id, FfxCborBuilder *result);
 
+// Sends part of the result (as a partial reply) for an accepted
+// message, which must still be replied to. Until it is sent, no reply
+// can be built (see panel_isSendingReply). The reply is written over
+// the message, so its params must not be used afterwards.
+bool panel_sendPartialReply(uint32_t id, FfxCborBuilder *result);
+
+// Whether a partial reply is still being sent
+bool panel_isSendingReply(uint32_t id);
+
 // @TODO: Remvoe this and automatically register messages
 //        on message events
 bool panel_isMessageEnabled();
@@ -11,15 +11,21 @@
 #include "host/util/util.h"
 #include "console/console.h"
 #include "services/gap/ble_svc_gap.h"
-#include "services/gatt/ble_svc_gatt.h"
+#include "store/config/ble_store_config.h"
 
 #include "firefly-cbor.h"
 #include "firefly-hash.h"
 #include "firefly-tx.h"
 
+#include "adv-policy.h"
+#include "bond-store.h"
 #include "build-defs.h"
+#include "config.h"
 #include "device-info.h"
 #include "events.h"
+#include "fsp.h"
+#include "link-policy.h"
+#include "logger.h"
 #include "utils.h"
 
 #include "task-ble.h"
@@ -33,72 +39,140 @@ typedef struct Payload {
 #define STATE_CONNECTED         (1 << 0)
 #define STATE_SUBSCRIBED        (1 << 1)
 #define STATE_ENCRYPTED         (1 << 2)
+#define STATE_LOGGING           (1 << 3)
 
-typedef enum MessageState {
-    // Ready to receive data; data is rx
-    MessageStateReady     = 0,
+// Payload bytes per outgoing chunk over GATT (after the 3 byte chunk
+// header)
+#define CHUNK_SIZE          (506)
 
-    // Receiving data; data = rx
-    MessageStateReceiving,
+// L2CAP connection-oriented channel; the same commands and chunks are
+// carried in SDUs (up to L2CAP_MTU bytes) instead of GATT writes and
+// indications. The host learns the PSM from CMD_QUERY.
+#define L2CAP_PSM           (0x0081)
+#define L2CAP_MTU           (FSP_MAX_FRAME)
 
-    // Received data; data = rx
-    MessageStateReceived,
+// Payload bytes per outgoing chunk on the L2CAP channel
+#define L2CAP_CHUNK_SIZE    (L2CAP_MTU - 3)
 
-    // Processing data; data = tx
-    MessageStateProcessing,
+// Concurrent connections; each has its own FSP connection
+#define MAX_CONNECTIONS     (CONFIG_BT_NIMBLE_MAX_CONNECTIONS)
 
-    // Sending data; data = tx
-    MessageStateSending
-} MessageState;
+// Length of the Database Hash characteristic
+#define DB_HASH_LENGTH      (16)
 
+// How long before advertising that failed to start is tried again (ms)
+#define ADV_RETRY_DELAY     (1000)
 
-static uint32_t nextMessageId = 1;
+// Where the database hash of the last boot is kept
+#define NVS_NAMESPACE       ("ble")
+#define NVS_KEY_DB_HASH     ("db-hash")
 
-// Length of CBOR overhead for replys (@TODO: too big, resize)
-#define CBOR_HEADER         (128)
+// Client Supported Features bits the server keeps
+#define CLIENT_FEATURE_ROBUST_CACHING   (1 << 0)
 
-#define METHOD_LENGTH       (32)
+// ATT errors NimBLE has no names for
+#define ATT_ERR_DB_OUT_OF_SYNC          (0x12)
+#define ATT_ERR_VALUE_NOT_ALLOWED       (0x13)
+
+// What a host enabled in Client Supported Features, and the database
+// hash when it last saw the attribute table (change-aware); kept in
+// NVS for bonded hosts
+typedef struct ClientFeatures {
+    uint8_t features;
+    uint8_t dbHash[DB_HASH_LENGTH];
+} ClientFeatures;
 
 typedef struct Connection {
     uint32_t state;
 
+    // BLE connection handle
+    uint16_t conn_handle;
+
+    // The L2CAP channel, if the host opened one; while open, all
+    // traffic uses it instead of GATT
+    struct ble_l2cap_chan *chan;
+
+    // The FSP requests and transfers carried by this connection
+    FspConnection *fsp;
+
+    // Connection parameters and PHY, adapted to the traffic
+    LinkPolicy link;
+
+    // Robust Caching state, and the NVS key it is kept under once the
+    // host is bonded (empty otherwise)
+    ClientFeatures features;
+    char featuresKey[16];
+} Connection;
+
+// State shared by all connections
+typedef struct Server {
     // Task Handle to notify the BLE Task loop to wake up
     TaskHandle_t task;
 
+    // Task Handle of the message worker
+    TaskHandle_t worker;
+
+    // Task Handle of the log drain
+    TaskHandle_t drain;
+
     uint8_t address[6];
     uint8_t own_addr_type;
 
-    // BLE connection and characteristic handles
-    uint16_t conn_handle;
+    // Characteristic handles
     uint16_t content;
     uint16_t logger;
     uint16_t battery_handle;
+    uint16_t serviceChanged;
 
-    bool enabled;
+    // The GATT database hash; computed as the attributes are registered
+    // (again after a host reset)
+    FfxSha256Context dbHashContext;
+    bool hashing;
+    uint8_t dbHash[DB_HASH_LENGTH];
 
-    // An ID to reply with
-    uint32_t replyId;
+    // Whether the host and controller are synced (advertising is
+    // possible)
+    bool synced;
 
-    // Unique id for each message
-    uint32_t messageId;
+    // The advertising and scan response data; encoded once, and given
+    // to the controller on each sync
+    uint8_t advData[BLE_HS_ADV_MAX_SZ];
+    uint8_t advDataLength;
+    uint8_t scanRsp[BLE_HS_ADV_MAX_SZ];
+    uint8_t scanRspLength;
 
-    FfxCborCursor message;
-    char method[METHOD_LENGTH];
-    FfxCborCursor params;
+    // When to advertise, and how fast
+    AdvPolicy adv;
 
-    MessageState messageState;
+    // The command being handled, copied out of its mbuf; only the
+    // NimBLE host task handles commands, and its stack is too small
+    uint8_t frame[FSP_MAX_FRAME];
 
-    // The buffer to hold an incoming message
-    uint8_t data[MAX_MESSAGE_SIZE + CBOR_HEADER];
+    bool enabled;
+} Server;
 
-    // Next expected offset for the incoming message
-    size_t offset;
+static Server server = { 0 };
 
-    // Total expected message size
-    size_t length;
-} Connection;
+static Connection connections[MAX_CONNECTIONS] = { 0 };
+
+// Lock to acquire before changing a connection's request queue; it
+// is changed from the NimBLE host task, the BLE task, the message
+// worker and the panels. A mutex, so a low-priority panel holding it
+// inherits the priority of the host task waiting on it.
+static StaticSemaphore_t lockRequestsBuffer;
+static SemaphoreHandle_t lockRequests;
+
+// Received messages waiting to be verified and parsed by the worker
+typedef struct WorkItem {
+    FspConnection *conn;
+    FspRequest *request;
+} WorkItem;
+
+#define MAX_WORK_ITEMS      (FSP_MAX_CONNECTIONS * FSP_MAX_REQUESTS)
 
-static Connection conn = { 0 };
+static StaticQueue_t workQueueBuffer;
+static uint8_t workQueueStore[MAX_WORK_ITEMS * sizeof(WorkItem)];
+static QueueHandle_t workQueue;
 
 
 ///////////////////////////////
@@ -110,16 +184,6 @@ static void print_addr(const char *prefix, const void *addr) {
       u8p[5], u8p[4], u8p[3], u8p[2], u8p[1], u8p[0]);
 }
 
-static void dumpBuffer(char *header, uint8_t *buffer, size_t length) {
-    printf("%s (length=%d)", header, length);
-    for (int i = 0; i < length; i++) {
-        if ((i % 16) == 0) { printf("\n    "); }
-        printf("%02x", buffer[i]);
-        if ((i % 4) == 3) { printf("  "); }
-    }
-    printf("\n");
-}
-
 
 ///////////////////////////////
 // BLE Description
@@ -129,6 +193,17 @@ static void dumpBuffer(char *header, uint8_t *buffer, size_t length) {
 #define PRODUCT_ID      (0x0001)
 #define PRODUCT_VERSION (0x0006)
 
+// Generic Attribute Service; defined here rather than by ble_svc_gatt,
+// which has no Database Hash. Hosts compare the hash to the one they
+// cached the attribute table with, and skip discovery if it matches.
+// A host that enables Robust Caching (Client Supported Features) is
+// refused with Database Out Of Sync after a change, until it reads the
+// hash or confirms Service Changed.
+#define UUID_SVC_GATT                               (0x1801)
+#define UUID_CHR_SERVICE_CHANGED                    (0x2A05)
+#define UUID_CHR_CLIENT_SUPPORTED_FEATURES          (0x2B29)
+#define UUID_CHR_DATABASE_HASH                      (0x2B2A)
+
 // Device Information Service
 // https://www.bluetooth.com/specifications/specs/device-information-service-1-1/
 #define UUID_SVC_DEVICE_INFO                        (0x180A)
@@ -150,305 +225,400 @@ static void dumpBuffer(char *header, uint8_t *buffer, size_t length) {
 
 
 ///////////////////////////////
-// Protocol Description
-
-#define CMD_QUERY                                   (0x03)
-#define CMD_RESET                                   (0x02)
-#define CMD_START_MESSAGE                           (0x06)
-#define CMD_CONTINUE_MESSAGE                        (0x07)
-
-#define STATUS_OK                                   (0x00)
-#define ERROR_BUSY                                  (0x91)
-#define ERROR_UNSUPPORTED_VERSION                   (0x81)
-#define ERROR_BAD_COMMAND                           (0x82)
-#define ERROR_BUFFER_OVERRUN                        (0x84)
-#define ERROR_MISSING_MESSAGE                       (0x85)
-#define ERROR_UNKNOWN                               (0x8f)
-
-// Internal value used to skip responding; must not collide with
-// any other STATUS_* or ERROR_*. The ERROR bit is clear.
-#define STATUS_SKIP                                  (0x7f)
+// FSP Platform
 
+static uint32_t _now() {
+    return ticks() * portTICK_PERIOD_MS;
+}
 
-// See: main.c
-//void emitMessageEvents(uint32_t id, const char*method, FfxCborCursor *params);
+static uint32_t _random() {
+    return esp_random();
+}
 
-static void processMessage() {
-    conn.messageId = nextMessageId++;
+static void _lock() {
+    xSemaphoreTake(lockRequests, portMAX_DELAY);
+}
 
-    if (conn.length < 32) {
-        printf("TO SHORT: @TODO\n");
-        return;
-    }
+static void _unlock() {
+    xSemaphoreGive(lockRequests);
+}
 
-    dumpBuffer("Process Message", conn.data, conn.length);
+// Queue a received message for the message worker, so the
+// (comparatively slow) checksum and parsing happens off the NimBLE
+// host task.
+static void _process(FspConnection *conn, FspRequest *request) {
+    WorkItem item = { .conn = conn, .request = request };
+    xQueueSend(workQueue, &item, 0);
+}
 
-    uint8_t checksum[32];
-    FfxSha256Context ctx;
-    ffx_hash_initSha256(&ctx);
-    ffx_hash_updateSha256(&ctx, &conn.data[32], conn.length - 32);
-    ffx_hash_finalSha256(&ctx, checksum);
+static void _wake() {
+    xTaskNotifyGive(server.task);
+}
 
-    for (int i = 0; i < 32; i++) {
-        if (checksum[i] != conn.data[i]) {
-            printf("BAD CHECKSUM!\n");
-            return;
+static bool _emit(uint32_t id, const char *method, FfxCborCursor *params) {
+    // This gets cloned within the emitMessageEvents.
+    //emitMessageEvents(id, method, params);
+    return panel_emitEvent(EventNameMessage, (EventPayloadProps){
+        .message = {
+            .id = id,
+            .method = method,
+            .params = *params
         }
-    }
+    });
+}
 
-    ffx_cbor_init(&conn.message, &conn.data[32], conn.length - 32);
+// Signs each new encrypted session with the session key (which the
+// host checks against the device's attestation)
+static bool _attest(const uint8_t *digest, uint8_t *signature) {
+    return (device_signSession(digest, signature) == DeviceStatusOk);
+}
 
-    // Dump the CBOR data to the console
-    ffx_cbor_dump(&conn.message);
+static FspPlatform platform = {
+    .dump = DUMP_MESSAGES,
+    .now = _now,
+    .random = _random,
+    .attest = _attest,
+    .lock = _lock,
+    .unlock = _unlock,
+    .process = _process,
+    .wake = _wake,
+    .emit = _emit
+};
+
+static void _workerTask(void *arg) {
+    printf("[ble] Message Worker Started\n");
 
-    uint32_t replyId = 0;
-    do {
-        FfxCborCursor cursor;
-        ffx_cbor_clone(&cursor, &conn.message);
+    while (1) {
+        WorkItem item;
+        if (!xQueueReceive(workQueue, &item, portMAX_DELAY)) { continue; }
 
-        FfxCborStatus status = ffx_cbor_followKey(&cursor, "id");
-        if (status || ffx_cbor_getType(&cursor) != FfxCborTypeNumber) {
-            break;
-        }
+        fsp_processRequest(item.conn, item.request);
+    }
+}
 
-        uint64_t value;
-        status = ffx_cbor_getValue(&cursor, &value);
-        if (value == 0 || value > 0x7fffffff) { break; }
+///////////////////////////////
+// Connections
 
-        replyId = value;
-    } while(0);
+static const FspTransport transport;
 
-    do {
-        if (replyId == 0) { break; }
+static Connection* getConnection(uint16_t conn_handle) {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        Connection *conn = &connections[i];
+        if ((conn->state & STATE_CONNECTED) == 0) { continue; }
+        if (conn->conn_handle == conn_handle) { return conn; }
+    }
+    return NULL;
+}
 
-        FfxCborCursor cursor;
-        ffx_cbor_clone(&cursor, &conn.message);
+static Connection* openConnection(uint16_t conn_handle) {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        Connection *conn = &connections[i];
+        if (conn->state & STATE_CONNECTED) { continue; }
 
-        FfxCborStatus status = ffx_cbor_followKey(&cursor, "method");
-        if (status || ffx_cbor_getType(&cursor) != FfxCborTypeString) {
-            replyId = 0;
-            break;
-        }
+        FspConnection *fsp = fsp_openConnection(&transport, conn,
+          CHUNK_SIZE, true);
+        if (fsp == NULL) { return NULL; }
 
-        memset(conn.method, 0, METHOD_LENGTH);
-        size_t length = ffx_cbor_copyData(&cursor, (uint8_t*)conn.method,
-          METHOD_LENGTH - 1);
-        conn.method[length] = 0;
+        memset(conn, 0, sizeof(Connection));
+        conn->conn_handle = conn_handle;
+        conn->state = STATE_CONNECTED;
+        conn->fsp = fsp;
 
-        if (length == 0) {
-            replyId = 0;
-            break;
-        }
-    } while(0);
-
-    do {
-        if (replyId == 0) { break; }
+        link_init(&conn->link, _now());
 
-        FfxCborCursor *cursor = &conn.params;
-        ffx_cbor_clone(cursor, &conn.message);
+        // Until bonded, a host is change-aware on connecting
+        memcpy(conn->features.dbHash, server.dbHash, DB_HASH_LENGTH);
 
-        FfxCborStatus status = ffx_cbor_followKey(cursor, "params");
-        if (status || (ffx_cbor_getType(cursor) != FfxCborTypeArray &&
-          ffx_cbor_getType(cursor) != FfxCborTypeMap)) {
-            replyId = 0;
-            break;
+        // The parameters the central chose
+        struct ble_gap_conn_desc desc;
+        if (ble_gap_conn_find(conn_handle, &desc) == 0) {
+            link_paramsUpdated(&conn->link, 0, desc.conn_itvl,
+              desc.conn_latency, desc.supervision_timeout, _now());
         }
-    } while (0);
 
-    conn.replyId = replyId;
-
-    if (replyId) {
-        conn.messageState = MessageStateReceived;
+        return conn;
+    }
+    return NULL;
+}
 
-        // This gets cloned within the emitMessageEvents.
-        //emitMessageEvents(replyId, conn.method, &conn.params);
-        panel_emitEvent(EventNameMessage, (EventPayloadProps){
-            .message = {
-                .id = replyId,
-                .method = conn.method,
-                .params = conn.params
-            }
-        });
-    } else {
-        conn.messageState = MessageStateReady;
+static bool hasFreeConnection() {
+    if (!fsp_hasFreeConnection()) { return false; }
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if ((connections[i].state & STATE_CONNECTED) == 0) { return true; }
     }
+    return false;
 }
 
 ///////////////////////////////
 // BLE goop
 
-static int notify(uint8_t *data, size_t length) {
-    if ((conn.state & STATE_CONNECTED) == 0) {
+// Sends %%om%% as an SDU on the L2CAP channel. If the host has no
+// credits left, the SDU is held by the stack and sent once credits
+// arrive (BLE_L2CAP_EVENT_COC_TX_UNSTALLED); nothing else may be sent
+// until then. The mbuf is always consumed.
+static int sendSdu(Connection *conn, struct os_mbuf *om) {
+    if (conn->fsp->stalled) {
+        os_mbuf_free_chain(om);
+        return BLE_HS_EBUSY;
+    }
+
+    int rc = ble_l2cap_send(conn->chan, om);
+    if (rc == BLE_HS_ESTALLED) {
+        logger_record(LogEventL2capStalled, conn->conn_handle, 0);
+        conn->fsp->stalled = true;
+        return 0;
+    }
+
+    if (rc) {
+        logger_record(LogEventL2capSendFail, conn->conn_handle, rc);
+        os_mbuf_free_chain(om);
+    }
+
+    return rc;
+}
+
+// Sends %%om%% on the content characteristic as an indication, or for
+// windowed transfers (where the host acks using CMD_ACK instead) as a
+// notification. The mbuf is always consumed.
+static int sendMbuf(Connection *conn, struct os_mbuf *om, bool indicate) {
+    if ((conn->state & STATE_CONNECTED) == 0) {
         printf("Not connected; cannot notify\n");
+        os_mbuf_free_chain(om);
         return -1;
     }
 
-    struct os_mbuf *om = ble_hs_mbuf_from_flat(data, length);
-    int rc = ble_gatts_indicate_custom(conn.conn_handle, conn.content, om);
-    if (rc) { printf("[ble] indicate fail: handle=%d rc=%d\n", conn.content, rc); }
+    if (conn->chan) { return sendSdu(conn, om); }
+
+    int rc = 0;
+    if (indicate) {
+        rc = ble_gatts_indicate_custom(conn->conn_handle, server.content, om);
+        if (rc) {
+            logger_record(LogEventIndicateFail, conn->conn_handle, rc);
+        }
+    } else {
+        rc = ble_gatts_notify_custom(conn->conn_handle, server.content, om);
+    }
+
     return rc;
 }
 
-static int gattAccess(uint16_t conn_handle, uint16_t attr_handle,
-  struct ble_gatt_access_ctxt *ctx, void *arg) {
+// Sends an FSP frame. The frame is copied once, directly from the
+// header and payload into an mbuf chain from the host's pre-allocated
+// msys pools (with leading space already reserved for the ATT, L2CAP
+// and HCI headers), so there is no heap allocation or intermediate
+// buffer per chunk.
+static int _send(FspConnection *fsp, const uint8_t *header,
+  size_t headerLength, const uint8_t *payload, size_t payloadLength,
+  bool confirm) {
 
-    bool isWrite = false;
-    uint16_t uuid = 0;
-    switch (ctx->op) {
-        case BLE_GATT_ACCESS_OP_WRITE_CHR:
-            isWrite = true;
-            // Falls through
-        case BLE_GATT_ACCESS_OP_READ_CHR:
-            uuid = ble_uuid_u16(ctx->chr->uuid);
-            break;
-        case BLE_GATT_ACCESS_OP_WRITE_DSC:
-            isWrite = true;
-            // Falls through
-        case BLE_GATT_ACCESS_OP_READ_DSC:
-            uuid = ble_uuid_u16(ctx->dsc->uuid);
-            break;
+    Connection *conn = fsp->context;
+
+    link_activity(&conn->link, _now());
+
+    struct os_mbuf *om = ble_hs_mbuf_att_pkt();
+    if (om == NULL) { return BLE_HS_ENOMEM; }
+
+    int rc = os_mbuf_append(om, header, headerLength);
+    if (rc == 0 && payloadLength) {
+        rc = os_mbuf_append(om, payload, payloadLength);
+    }
+    if (rc) {
+        os_mbuf_free_chain(om);
+        return BLE_HS_ENOMEM;
     }
 
-    if (isWrite) {
-        ////////////////////
-        // Write operation (host-to-device)
+    return sendMbuf(conn, om, confirm);
+}
 
-        // @TODO: Check that length doesn't exceed 512 bytes
+// The PSM to open an L2CAP channel on, followed by the link stats (see
+// link_encodeStats)
+static size_t _query(FspConnection *fsp, uint8_t *output, size_t length) {
+    Connection *conn = fsp->context;
 
-        uint16_t length = os_mbuf_len(ctx->om);
-        uint8_t req[length];
-        int rc = os_mbuf_copydata(ctx->om, 0, length, req);
-        if (rc) { printf("[ble] write fail: rc=%d\n", rc); }
+    if (length < 2) { return 0; }
+    output[0] = L2CAP_PSM >> 8;
+    output[1] = L2CAP_PSM & 0xff;
 
-        // Response; maximum length is 14 bytes (include space for hash)
-        uint8_t resp[34] = { 0 };
-        resp[0] = STATUS_SKIP;
-        size_t offset = 1;
+    return 2 + link_encodeStats(&conn->link, &output[2], length - 2);
+}
 
-        do {
-            // Error copying request
-            if (rc) { break; }
+static void appendCounter(FfxCborBuilder *builder, char *key,
+  uint32_t value) {
+    ffx_cbor_appendString(builder, key);
+    ffx_cbor_appendNumber(builder, value);
+}
 
-            // No data to work with at all
-            if (length < 1) {
-                resp[0] = ERROR_BUFFER_OVERRUN;
-                break;
-            }
+// The link, as the stack last reported it
+static size_t _counters(FspConnection *fsp, FfxCborBuilder *builder) {
+    Connection *conn = fsp->context;
+    const LinkPolicy *link = &conn->link;
 
-            uint8_t cmd = req[0];
+    appendCounter(builder, "mtu", ble_att_mtu(conn->conn_handle));
+    appendCounter(builder, "phy", link->phy);
+    appendCounter(builder, "dataLength", link->dataLength);
+    appendCounter(builder, "interval", link->interval);
+    appendCounter(builder, "latency", link->latency);
+    appendCounter(builder, "timeout", link->timeout);
+    appendCounter(builder, "l2cap", conn->chan ? 1: 0);
 
-            resp[offset++] = cmd;
+    return 7;
+}
 
-            if (cmd == CMD_QUERY) {
-                resp[0] = STATUS_OK;
+static const FspTransport transport = {
+    .name = "ble",
+    .send = _send,
+    .query = _query,
+    .counters = _counters
+};
+
+// Handles a command from the host, received either as a write to the
+// content characteristic or as an SDU on the L2CAP channel.
+static void handleCommand(Connection *conn, struct os_mbuf *om) {
+    uint16_t length = os_mbuf_len(om);
+    if (length > FSP_MAX_FRAME) {
+        printf("[ble] command too long: length=%d\n", length);
+        return;
+    }
 
-                resp[offset++] = CMD_QUERY;
-                resp[offset++] = 0x01;
+    uint8_t *req = server.frame;
+    int rc = os_mbuf_copydata(om, 0, length, req);
+    if (rc) {
+        printf("[ble] write fail: rc=%d\n", rc);
+        return;
+    }
 
-                resp[offset++] = conn.offset >> 8;
-                resp[offset++] = conn.offset & 0xff;
+    // Speed up the link for the transfer
+    if (link_activity(&conn->link, _now())) { xTaskNotifyGive(server.task); }
 
-                resp[offset++] = conn.length >> 8;
-                resp[offset++] = conn.length & 0xff;
+    // Resuming a session moves this connection to the session's
+    conn->fsp = fsp_receive(conn->fsp, req, length);
+}
 
-                uint32_t v = device_modelNumber();
-                resp[offset++] = (v >> 24) & 0xff;
-                resp[offset++] = (v >> 16) & 0xff;
-                resp[offset++] = (v >> 8) & 0xff;
-                resp[offset++] = v & 0xff;
+// Robust Caching (Core, Vol 3, Part G, 2.5.2.1)
 
-                v = device_serialNumber();
-                resp[offset++] = (v >> 24) & 0xff;
-                resp[offset++] = (v >> 16) & 0xff;
-                resp[offset++] = (v >> 8) & 0xff;
-                resp[offset++] = v & 0xff;
+static bool isChangeUnaware(Connection *conn) {
+    if (!(conn->features.features & CLIENT_FEATURE_ROBUST_CACHING)) {
+        return false;
+    }
+    return memcmp(conn->features.dbHash, server.dbHash, DB_HASH_LENGTH);
+}
 
-            } else if (cmd == CMD_RESET) {
+static void storeClientFeatures(Connection *conn) {
+    if (conn->featuresKey[0] == 0) { return; }
 
-                // Not in a state ready to receive
-                if (conn.messageState != MessageStateReady &&
-                  conn.messageState != MessageStateReceiving) {
-                    resp[0] = ERROR_BUSY;
-                    break;
-                }
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) { return; }
+    nvs_set_blob(nvs, conn->featuresKey, &conn->features,
+      sizeof(ClientFeatures));
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
 
-                conn.replyId = 0;
-                conn.offset = 0;
-                conn.length = 0;
-                conn.messageState = MessageStateReady;
+static void getFeaturesKey(const ble_addr_t *addr, char *key) {
+    snprintf(key, 16, "f%d%02x%02x%02x%02x%02x%02x", addr->type,
+      addr->val[5], addr->val[4], addr->val[3], addr->val[2], addr->val[1],
+      addr->val[0]);
+}
 
-            } else if (cmd == CMD_START_MESSAGE) {
+// The host is bonded; restore what it enabled on earlier connections
+// (or keep what it just enabled, for next time)
+static void loadClientFeatures(Connection *conn, const ble_addr_t *addr) {
+    getFeaturesKey(addr, conn->featuresKey);
 
-                // Not ready to start a new message
-                if (conn.messageState != MessageStateReady) {
-                    resp[0] = ERROR_BUSY;
-                    break;
-                }
+    ClientFeatures stored;
+    size_t length = sizeof(stored);
 
-                // Missing length parameter
-                if (length < 3) {
-                    resp[0] = ERROR_BUFFER_OVERRUN;
-                    break;
-                }
+    nvs_handle_t nvs;
+    esp_err_t status = nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs);
+    if (status == ESP_OK) {
+        status = nvs_get_blob(nvs, conn->featuresKey, &stored, &length);
+        nvs_close(nvs);
+    }
 
-                uint16_t msgLen = (req[1] << 8) | req[2];
+    if (status == ESP_OK && length == sizeof(stored)) {
+        conn->features = stored;
+    } else if (conn->features.features) {
+        storeClientFeatures(conn);
+    }
+}
 
-                // No message or a message is already started
-                if (msgLen == 0 || length < 4 || conn.offset != 0) {
-                    resp[0] = ERROR_MISSING_MESSAGE;
-                    break;
-                }
+static void forgetClientFeatures(const ble_addr_t *addr) {
+    char key[16];
+    getFeaturesKey(addr, key);
 
-                // Update the message
-                conn.length = msgLen;
-                conn.offset = length - 1 - 2;
-                conn.messageState = MessageStateReceiving;
-                memcpy(conn.data, &req[3], length - 1 - 2);
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) { return; }
+    nvs_erase_key(nvs, key);
+    nvs_commit(nvs);
+    nvs_close(nvs);
+}
 
-                // Message ready to process!
-                if (conn.offset == conn.length) { processMessage(); }
+// The host has seen the current attribute table
+static void setChangeAware(Connection *conn) {
+    if (!isChangeUnaware(conn)) { return; }
+    memcpy(conn->features.dbHash, server.dbHash, DB_HASH_LENGTH);
+    storeClientFeatures(conn);
+}
 
-            } else if (cmd == CMD_CONTINUE_MESSAGE) {
-                if (conn.messageState != MessageStateReceiving) {
-                    resp[0] = ERROR_BUSY;
-                    break;
-                }
+// Bits a host set may not be cleared (Core, Vol 3, Part G, 7.2)
+static int writeClientFeatures(Connection *conn, struct os_mbuf *om) {
+    uint8_t value = 0;
+    if (OS_MBUF_PKTLEN(om) < 1 || os_mbuf_copydata(om, 0, 1, &value)) {
+        return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+    }
 
-                // Missing length parameter
-                if (length < 3) {
-                    resp[0] = ERROR_BUFFER_OVERRUN;
-                    break;
-                }
+    if (conn->features.features & ~value) {
+        return ATT_ERR_VALUE_NOT_ALLOWED;
+    }
 
-                // No message to continue
-                if (conn.offset == 0) {
-                    resp[0] = ERROR_MISSING_MESSAGE;
-                    break;
-                }
+    value &= CLIENT_FEATURE_ROBUST_CACHING;
+    if (value == conn->features.features) { return 0; }
 
-                uint16_t msgOffset = (req[1] << 8) | req[2];
+    conn->features.features = value;
+    storeClientFeatures(conn);
 
-                // Message offset is out of sync
-                if (length < 4 || msgOffset != conn.offset) {
-                    resp[0] = ERROR_MISSING_MESSAGE;
-                    break;
-                }
+    return 0;
+}
 
-                // Update the message
-                conn.offset += length - 1 - 2;
-                memcpy(&conn.data[msgOffset], &req[3], length - 1 - 2);
+static int gattAccess(uint16_t conn_handle, uint16_t attr_handle,
+  struct ble_gatt_access_ctxt *ctx, void *arg) {
 
-                // Message ready to process!
-                if (conn.offset == conn.length) { processMessage(); }
+    bool isWrite = false;
+    uint16_t uuid = 0;
+    switch (ctx->op) {
+        case BLE_GATT_ACCESS_OP_WRITE_CHR:
+            isWrite = true;
+            // Falls through
+        case BLE_GATT_ACCESS_OP_READ_CHR:
+            uuid = ble_uuid_u16(ctx->chr->uuid);
+            break;
+        case BLE_GATT_ACCESS_OP_WRITE_DSC:
+            isWrite = true;
+            // Falls through
+        case BLE_GATT_ACCESS_OP_READ_DSC:
+            uuid = ble_uuid_u16(ctx->dsc->uuid);
+            break;
+    }
 
-            } else {
-                resp[0] = ERROR_BAD_COMMAND;
-            }
+    // A change-unaware host must learn of the new attribute table before
+    // anything else; reading the hash is how
+    Connection *conn = getConnection(conn_handle);
+    if (conn && isChangeUnaware(conn)) {
+        if (uuid != UUID_CHR_DATABASE_HASH) { return ATT_ERR_DB_OUT_OF_SYNC; }
+        setChangeAware(conn);
+    }
+
+    if (isWrite) {
+        ////////////////////
+        // Write operation (host-to-device)
+
+        if (conn == NULL) { return BLE_ATT_ERR_UNLIKELY; }
 
-        } while (0);
+        if (uuid == UUID_CHR_CLIENT_SUPPORTED_FEATURES) {
+            return writeClientFeatures(conn, ctx->om);
+        }
 
-        // Send response if there is a response or error.
-        if (resp[0] != STATUS_SKIP) { notify(resp, offset); }
+        handleCommand(conn, ctx->om);
 
         return 0;
     }
@@ -456,6 +626,12 @@ static int gattAccess(uint16_t conn_handle, uint16_t attr_handle,
     ////////////////////
     // Read operation (device-to-host)
 
+    if (uuid == UUID_CHR_CLIENT_SUPPORTED_FEATURES) {
+        if (conn == NULL) { return BLE_ATT_ERR_UNLIKELY; }
+        int rc = os_mbuf_append(ctx->om, &conn->features.features, 1);
+        return (rc == 0) ? 0: BLE_ATT_ERR_INSUFFICIENT_RES;
+    }
+
     // Static content; just pass along the payload
     if (arg) {
         Payload *payload = arg;
@@ -469,7 +645,7 @@ static int gattAccess(uint16_t conn_handle, uint16_t attr_handle,
         // @TODO: does this still make sense? What should happen for
         //        an unsolicited read operation?
 
-        if (!conn.enabled) {
+        if (!server.enabled) {
             // { v: 1, e: "HUP" }
             uint8_t data[] = {
                 0x00, 162, 97, 118, 1, 97, 101, 99,  72, 85, 80
@@ -503,6 +679,153 @@ static int gattAccess(uint16_t conn_handle, uint16_t attr_handle,
     return (rc == 0) ? 0: BLE_ATT_ERR_INSUFFICIENT_RES;
 }
 
+///////////////////////////////
+// L2CAP
+
+// Provides the channel with a buffer for the next incoming SDU
+static int _l2capReady(struct ble_l2cap_chan *chan) {
+    struct os_mbuf *om = os_msys_get_pkt(L2CAP_MTU, 0);
+    if (om == NULL) { return BLE_HS_ENOMEM; }
+
+    int rc = ble_l2cap_recv_ready(chan, om);
+    if (rc) { os_mbuf_free_chain(om); }
+    return rc;
+}
+
+static int _l2capEvent(struct ble_l2cap_event *event, void *arg) {
+    switch (event->type) {
+        case BLE_L2CAP_EVENT_COC_ACCEPT: {
+            Connection *conn = getConnection(event->accept.conn_handle);
+            if (conn == NULL || conn->chan) { return BLE_HS_EREJECT; }
+            return _l2capReady(event->accept.chan);
+        }
+
+        case BLE_L2CAP_EVENT_COC_CONNECTED: {
+            printf("[ble] l2cap connected: status=%d connHandle=%d\n",
+              event->connect.status, event->connect.conn_handle);
+            if (event->connect.status) { return 0; }
+
+            Connection *conn = getConnection(event->connect.conn_handle);
+            if (conn == NULL) { return 0; }
+
+            struct ble_l2cap_chan_info info;
+            int rc = ble_l2cap_get_chan_info(event->connect.chan, &info);
+            if (rc) { return 0; }
+
+            // Chunks (with their 3 byte header) must fit the peer's SDU
+            size_t chunkSize = info.peer_coc_mtu - 3;
+            if (chunkSize > L2CAP_CHUNK_SIZE) { chunkSize = L2CAP_CHUNK_SIZE; }
+
+            // Streamed; the channel's credits pace it instead of acks
+            conn->fsp->chunkSize = chunkSize;
+            conn->fsp->confirmed = false;
+            conn->fsp->stalled = false;
+            conn->chan = event->connect.chan;
+
+            return 0;
+        }
+
+        case BLE_L2CAP_EVENT_COC_DISCONNECTED: {
+            printf("[ble] l2cap disconnected: connHandle=%d\n",
+              event->disconnect.conn_handle);
+
+            Connection *conn = getConnection(event->disconnect.conn_handle);
+            if (conn == NULL || conn->chan != event->disconnect.chan) {
+                return 0;
+            }
+
+            conn->chan = NULL;
+            conn->fsp->chunkSize = CHUNK_SIZE;
+            conn->fsp->confirmed = true;
+            conn->fsp->stalled = false;
+            conn->fsp->awaiting = false;
+
+            // Fall back to GATT; queued SDUs may have been lost, so any
+            // reply in progress restarts from the beginning
+            fsp_restartReply(conn->fsp);
+
+            return 0;
+        }
+
+        case BLE_L2CAP_EVENT_COC_DATA_RECEIVED: {
+            Connection *conn = getConnection(event->receive.conn_handle);
+            struct os_mbuf *om = event->receive.sdu_rx;
+
+            if (conn && om) { handleCommand(conn, om); }
+            if (om) { os_mbuf_free_chain(om); }
+
+            return _l2capReady(event->receive.chan);
+        }
+
+        case BLE_L2CAP_EVENT_COC_TX_UNSTALLED: {
+            Connection *conn = getConnection(event->tx_unstalled.conn_handle);
+            if (conn == NULL) { return 0; }
+
+            conn->fsp->stalled = false;
+            fsp_wake();
+
+            return 0;
+        }
+
+        default:
+            return 0;
+    }
+}
+
+// Adds an attribute (its handles, type and properties) to the database
+// hash. Hosts only compare the hash across connections, so anything
+// that changes with the layout will do; this is not the AES-CMAC the
+// spec computes, which needs every attribute value.
+static void hashAttribute(uint8_t op, uint16_t handle, uint16_t valueHandle,
+  const char *uuid, uint16_t flags) {
+
+    if (!server.hashing) {
+        ffx_hash_initSha256(&server.dbHashContext);
+        server.hashing = true;
+    }
+
+    uint8_t attr[] = {
+        op,
+        handle & 0xff, handle >> 8,
+        valueHandle & 0xff, valueHandle >> 8,
+        flags & 0xff, flags >> 8,
+    };
+    ffx_hash_updateSha256(&server.dbHashContext, attr, sizeof(attr));
+    ffx_hash_updateSha256(&server.dbHashContext, (const uint8_t*)uuid,
+      strlen(uuid));
+}
+
+// The attribute table is registered; if it differs from last boot (a
+// firmware update), bonded hosts hold a stale copy, so each is sent
+// Service Changed as it reconnects (NimBLE persists the pending
+// indication with the CCCD).
+static void finishDatabaseHash() {
+    if (!server.hashing) { return; }
+    server.hashing = false;
+
+    uint8_t digest[32];
+    ffx_hash_finalSha256(&server.dbHashContext, digest);
+    memcpy(server.dbHash, digest, DB_HASH_LENGTH);
+
+    nvs_handle_t nvs;
+    if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) { return; }
+
+    uint8_t previous[DB_HASH_LENGTH];
+    size_t length = sizeof(previous);
+    esp_err_t status = nvs_get_blob(nvs, NVS_KEY_DB_HASH, previous, &length);
+
+    if (status != ESP_OK || length != DB_HASH_LENGTH ||
+      memcmp(previous, server.dbHash, DB_HASH_LENGTH)) {
+        printf("[ble] database changed; bonded hosts rediscover\n");
+        ble_gatts_chr_updated(server.serviceChanged);
+
+        nvs_set_blob(nvs, NVS_KEY_DB_HASH, server.dbHash, DB_HASH_LENGTH);
+        nvs_commit(nvs);
+    }
+
+    nvs_close(nvs);
+}
+
 static void _svrRegister(struct ble_gatt_register_ctxt *ctxt, void *arg) {
     char buf[BLE_UUID_STR_LEN];
 
@@ -511,6 +834,8 @@ static void _svrRegister(struct ble_gatt_register_ctxt *ctxt, void *arg) {
             MODLOG_DFLT(DEBUG, "registered service %s with handle=%d\n",
                         ble_uuid_to_str(ctxt->svc.svc_def->uuid, buf),
                         ctxt->svc.handle);
+            hashAttribute(ctxt->op, ctxt->svc.handle, 0, buf,
+              ctxt->svc.svc_def->type);
             break;
 
         case BLE_GATT_REGISTER_OP_CHR:
@@ -519,12 +844,16 @@ static void _svrRegister(struct ble_gatt_register_ctxt *ctxt, void *arg) {
                         ble_uuid_to_str(ctxt->chr.chr_def->uuid, buf),
                         ctxt->chr.def_handle,
                         ctxt->chr.val_handle);
+            hashAttribute(ctxt->op, ctxt->chr.def_handle,
+              ctxt->chr.val_handle, buf, ctxt->chr.chr_def->flags);
             break;
 
         case BLE_GATT_REGISTER_OP_DSC:
             MODLOG_DFLT(DEBUG, "registering descriptor %s with handle=%d\n",
                         ble_uuid_to_str(ctxt->dsc.dsc_def->uuid, buf),
                         ctxt->dsc.handle);
+            hashAttribute(ctxt->op, ctxt->dsc.handle, 0, buf,
+              ctxt->dsc.dsc_def->att_flags);
             break;
 
         default:
@@ -535,77 +864,94 @@ static void _svrRegister(struct ble_gatt_register_ctxt *ctxt, void *arg) {
 
 static int _gapEvent(struct ble_gap_event *event, void *arg);
 
-static void _advertise() {
-    printf("ble_advertise\n");
-
-    struct ble_hs_adv_fields fields;
-    memset(&fields, 0, sizeof(fields));
+// Encodes the advertising and scan response data
+static void encodeAdvertisement() {
 
     // Advertise:
     //  - Discoverability in forthcoming advertisement (general)
     //  - BLE-only (BR/EDR unsupported)
-    fields.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
+    //  - The device name and the FSP service, which hosts filter on
+    {
+        struct ble_hs_adv_fields fields;
+        memset(&fields, 0, sizeof(fields));
 
-    // Include TX power
-    fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
-    fields.tx_pwr_lvl_is_present = 1;
+        fields.flags = BLE_HS_ADV_F_DISC_GEN | BLE_HS_ADV_F_BREDR_UNSUP;
 
-    // Set device name
-    const char *device_name = DEVICE_NAME;
-    fields.name = (uint8_t *)device_name;
-    fields.name_len = strlen(device_name);
-    fields.name_is_complete = 1;
+        const char *device_name = DEVICE_NAME;
+        fields.name = (uint8_t *)device_name;
+        fields.name_len = strlen(device_name);
+        fields.name_is_complete = 1;
 
-    fields.uuids16 = (ble_uuid16_t[]) {
-        BLE_UUID16_INIT(UUID_SVC_FSP),
-    };
-    fields.num_uuids16 = 1;
-    fields.uuids16_is_complete = 1;
+        fields.uuids16 = (ble_uuid16_t[]) {
+            BLE_UUID16_INIT(UUID_SVC_FSP),
+        };
+        fields.num_uuids16 = 1;
+        fields.uuids16_is_complete = 1;
 
-    // Configure the data to advertise
-    {
-        int rc = ble_gap_adv_set_fields(&fields);
-        if (rc != 0) {
-            MODLOG_DFLT(ERROR, "error setting advertisement data; rc=%d\n", rc);
-            return;
-        }
+        int rc = ble_hs_adv_set_fields(&fields, server.advData,
+          &server.advDataLength, sizeof(server.advData));
+        assert(rc == 0);
     }
 
-    // Advertisement
-    //  - Undirected-connectable
-    //  - general-discoverable
-    struct ble_gap_adv_params adv_params;
-    memset(&adv_params, 0, sizeof(adv_params));
-    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
-    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
-
-    // Begin advertising
+    // Scan response:
+    //  - TX power
     {
-        int rc = ble_gap_adv_start(conn.own_addr_type, NULL,
-          BLE_HS_FOREVER, &adv_params, _gapEvent, NULL);
+        struct ble_hs_adv_fields fields;
+        memset(&fields, 0, sizeof(fields));
 
-        if (rc != 0) {
-            MODLOG_DFLT(ERROR, "error enabling advertisement; rc=%d\n", rc);
-            return;
-        }
+        fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
+        fields.tx_pwr_lvl_is_present = 1;
+
+        int rc = ble_hs_adv_set_fields(&fields, server.scanRsp,
+          &server.scanRspLength, sizeof(server.scanRsp));
+        assert(rc == 0);
+    }
+}
+
+// Prompts fast advertising (if it is not already)
+static void boostAdvertising(AdvReason reason) {
+    if (adv_boost(&server.adv, reason, _now()) && server.task) {
+        xTaskNotifyGive(server.task);
     }
 }
 
+// Advertising stopped; it may need restarting (or continuing with a
+// connection slot freed)
+static void advertisingStopped() {
+    adv_stopped(&server.adv);
+    xTaskNotifyGive(server.task);
+}
+
 static void _onSync(void) {
     int rc;
 
-    rc = ble_hs_id_infer_auto(0, &conn.own_addr_type);
+    rc = ble_hs_id_infer_auto(0, &server.own_addr_type);
     assert(rc == 0);
 
-    rc = ble_hs_id_copy_addr(conn.own_addr_type, conn.address, NULL);
+    rc = ble_hs_id_copy_addr(server.own_addr_type, server.address, NULL);
+
+    print_addr("[ble] sync addr=", server.address);
+
+    finishDatabaseHash();
 
-    print_addr("[ble] sync addr=", conn.address);
+    // The controller forgets the advertising data on a reset
+    int rcData = ble_gap_adv_set_data(server.advData, server.advDataLength);
+    int rcRsp = ble_gap_adv_rsp_set_data(server.scanRsp,
+      server.scanRspLength);
+    if (rcData || rcRsp) {
+        printf("[ble] advertising data failed: rc=%d rc=%d\n", rcData, rcRsp);
+        return;
+    }
 
-    _advertise();
+    server.synced = true;
+    advertisingStopped();
 }
 
 static void _onReset(int reason) {
     printf("[ble] reset=%d\n", reason);
+
+    server.synced = false;
+    advertisingStopped();
 }
 
 // /Users/ricmoo/esp/esp-idf/components/bt//host/nimble/nimble/nimble/host/include/host/ble_gap.h
@@ -618,26 +964,66 @@ static int _gapEvent(struct ble_gap_event *event, void *_context) {
               event->connect.status == 0 ? "established" : "failed",
               event->connect.status);
 
-            //Connection failed; resume advertising
-            if (event->connect.status != 0) { _advertise(); }
-            conn.conn_handle = event->connect.conn_handle;
-            conn.state = STATE_CONNECTED;
+            // Connection failed; resume advertising
+            if (event->connect.status != 0) {
+                advertisingStopped();
+                return 0;
+            }
+
+            if (openConnection(event->connect.conn_handle) == NULL) {
+                printf("[ble] no free connection: connHandle=%d\n",
+                  event->connect.conn_handle);
+                ble_gap_terminate(event->connect.conn_handle,
+                  BLE_ERR_REM_USER_CONN_TERM);
+                return 0;
+            }
+
+            // Advertising stops on connect; keep accepting connections
+            // while there is room
+            advertisingStopped();
 
             return 0;
 
         case BLE_GAP_EVENT_DISCONNECT:
             printf("[ble] disconnect: reason=%d\n", event->disconnect.reason);
 
-            conn.state = 0;
-            conn.conn_handle = 0;
+            {
+                Connection *conn = getConnection(
+                  event->disconnect.conn.conn_handle);
+                if (conn) {
+                    // Requests in flight are kept for the host to resume
+                    fsp_detachConnection(conn->fsp);
+                    conn->fsp = NULL;
+                    conn->state = 0;
+                    conn->conn_handle = 0;
+                    conn->chan = NULL;
+                }
+            }
 
-            // Connection terminated; resume advertising
-            _advertise();
+            // Connection terminated; the host (or another) may be about
+            // to reconnect
+            boostAdvertising(AdvReasonDisconnect);
             return 0;
 
-        case BLE_GAP_EVENT_CONN_UPDATE:
+        case BLE_GAP_EVENT_CONN_UPDATE: {
             printf("[ble] conn_update: status=%d\n", event->conn_update.status);
+
+            Connection *conn = getConnection(event->conn_update.conn_handle);
+            if (conn == NULL) { return 0; }
+
+            struct ble_gap_conn_desc desc;
+            int rc = ble_gap_conn_find(event->conn_update.conn_handle, &desc);
+            if (rc) { return 0; }
+
+            link_paramsUpdated(&conn->link, event->conn_update.status,
+              desc.conn_itvl, desc.conn_latency, desc.supervision_timeout,
+              _now());
+
+            logger_record(LogEventLinkUpdated, conn->conn_handle,
+              desc.conn_itvl | (desc.conn_latency << 16));
+
             return 0;
+        }
 
         case BLE_GAP_EVENT_CONN_UPDATE_REQ:
             printf("[ble] conn_update_req\n");
@@ -647,7 +1033,7 @@ static int _gapEvent(struct ble_gap_event *event, void *_context) {
             printf("[ble] adv_complete: reason=%d\n",
               event->adv_complete.reason);
 
-            _advertise();
+            advertisingStopped();
 
             return 0;
 
@@ -658,18 +1044,50 @@ static int _gapEvent(struct ble_gap_event *event, void *_context) {
               event->subscribe.cur_notify, event->subscribe.prev_indicate,
               event->subscribe.cur_indicate);
 
-            conn.state |= STATE_SUBSCRIBED;
+            {
+                Connection *conn = getConnection(event->subscribe.conn_handle);
+                if (conn == NULL) { return 0; }
+
+                if (event->subscribe.attr_handle == server.logger) {
+                    if (event->subscribe.cur_notify) {
+                        conn->state |= STATE_LOGGING;
+                    } else {
+                        conn->state &= ~STATE_LOGGING;
+                    }
+                } else {
+                    conn->state |= STATE_SUBSCRIBED;
+                }
+            }
 
             return 0;
 
         case BLE_GAP_EVENT_NOTIFY_TX:
-            printf("[ble] notify_tx status=%d indication=%d\n",
-              event->notify_tx.status, event->notify_tx.indication);
+            // Log batches; recording these would feed the log forever
+            if (event->notify_tx.attr_handle == server.logger) { return 0; }
+
+            logger_record(LogEventNotifyTx, event->notify_tx.conn_handle,
+              event->notify_tx.status | (event->notify_tx.indication << 16));
+
+            // Service Changed confirmed; the host is change-aware (and
+            // it has nothing to do with FSP)
+            if (event->notify_tx.attr_handle == server.serviceChanged) {
+                Connection *conn = getConnection(event->notify_tx.conn_handle);
+                if (conn && event->notify_tx.status == BLE_HS_EDONE) {
+                    setChangeAware(conn);
+                }
+                return 0;
+            }
+
+            // Indication acknowledged (or failed) or notification sent
+            if (event->notify_tx.indication) {
+                if (event->notify_tx.status == 0) { return 0; }
 
-            if (event->notify_tx.status == BLE_HS_EDONE) {
-                xTaskNotifyGive(conn.task);
+                Connection *conn = getConnection(event->notify_tx.conn_handle);
+                if (conn) { fsp_confirm(conn->fsp); }
             }
 
+            xTaskNotifyGive(server.task);
+
             return 0;
 
         case BLE_GAP_EVENT_MTU:
@@ -687,6 +1105,7 @@ static int _gapEvent(struct ble_gap_event *event, void *_context) {
             int rc = ble_gap_conn_find(event->repeat_pairing.conn_handle, &desc);
             assert(rc == 0);
             ble_store_util_delete_peer(&desc.peer_id_addr);
+            forgetClientFeatures(&desc.peer_id_addr);
 
             // Request the host to continue pairing
             return BLE_GAP_REPEAT_PAIRING_RETRY;
@@ -739,15 +1158,49 @@ static int _gapEvent(struct ble_gap_event *event, void *_context) {
               event->authorize.is_read, event->authorize.out_response);
             return 0;
 
-        case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+        case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE: {
             printf("[ble] phy update complete: status=%d connHandle=%d txPhy=%d rxPhy=%d\n",
               event->phy_updated.status, event->phy_updated.conn_handle,
-              event->phy_updated.tx_phy, event->phy_updated.tx_phy);
+              event->phy_updated.tx_phy, event->phy_updated.rx_phy);
+
+            Connection *conn = getConnection(event->phy_updated.conn_handle);
+            if (conn == NULL) { return 0; }
+
+            uint8_t phy = LINK_PHY_1M;
+            if (event->phy_updated.tx_phy == BLE_GAP_LE_PHY_2M) {
+                phy = LINK_PHY_2M;
+            }
+            link_phyUpdated(&conn->link, event->phy_updated.status, phy);
+
             return 0;
+        }
 
         case BLE_GAP_EVENT_ENC_CHANGE:
             printf("[ble] enc change: status=%d connHandle=%d\n",
               event->enc_change.status, event->enc_change.conn_handle);
+            bond_dumpStats();
+
+            // A bonded peer; its Client Supported Features and FSP
+            // session tickets are bound to its identity address
+            if (event->enc_change.status == 0) {
+                Connection *conn = getConnection(
+                  event->enc_change.conn_handle);
+                if (conn == NULL) { return 0; }
+
+                struct ble_gap_conn_desc desc;
+                int rc = ble_gap_conn_find(event->enc_change.conn_handle,
+                  &desc);
+                if (rc || !desc.sec_state.bonded) { return 0; }
+
+                loadClientFeatures(conn, &desc.peer_id_addr);
+
+                if (conn->fsp == NULL) { return 0; }
+
+                conn->fsp->peer[0] = desc.peer_id_addr.type;
+                memcpy(&conn->fsp->peer[1], desc.peer_id_addr.val, 6);
+                conn->fsp->bonded = true;
+            }
+
             return 0;
 
         case BLE_GAP_EVENT_DATA_LEN_CHG:
@@ -758,6 +1211,15 @@ static int _gapEvent(struct ble_gap_event *event, void *_context) {
               event->data_len_chg.max_rx_octets,
               event->data_len_chg.max_rx_time);
 
+            {
+                Connection *conn = getConnection(
+                  event->data_len_chg.conn_handle);
+                if (conn == NULL) { return 0; }
+
+                link_dataLengthChanged(&conn->link,
+                  event->data_len_chg.max_tx_octets);
+            }
+
             return 0;
 
         case BLE_GAP_EVENT_LINK_ESTAB:
@@ -774,6 +1236,103 @@ static int _gapEvent(struct ble_gap_event *event, void *_context) {
     return 0;
 }
 
+// Requests whatever the link policy of each connection decides,
+// returning how long until it needs another look
+static uint32_t updateLinks() {
+    uint32_t now = _now();
+    uint32_t timeout = 0xffffffff;
+
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        Connection *conn = &connections[i];
+        if ((conn->state & STATE_CONNECTED) == 0) { continue; }
+
+        LinkParams params;
+        uint32_t actions = link_poll(&conn->link, now, &params);
+
+        if (actions) {
+            logger_record(LogEventLinkRequest, conn->conn_handle,
+              actions | (conn->link.pendingMode << 8));
+        }
+
+        if (actions & LinkActionPhy) {
+            int rc = ble_gap_set_prefered_le_phy(conn->conn_handle,
+              BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK,
+              BLE_GAP_LE_PHY_CODED_ANY);
+            if (rc) { printf("[ble] phy request failed: rc=%d\n", rc); }
+        }
+
+        if (actions & LinkActionDataLength) {
+            int rc = ble_gap_set_data_len(conn->conn_handle,
+              LINK_MAX_DATA_LENGTH, LINK_MAX_DATA_TIME);
+            if (rc) { printf("[ble] data length failed: rc=%d\n", rc); }
+        }
+
+        if (actions & LinkActionParams) {
+            struct ble_gap_upd_params update = {
+                .itvl_min = params.intervalMin,
+                .itvl_max = params.intervalMax,
+                .latency = params.latency,
+                .supervision_timeout = params.timeout,
+            };
+
+            int rc = ble_gap_update_params(conn->conn_handle, &update);
+            if (rc) {
+                link_paramsUpdated(&conn->link, rc, 0, 0, 0, now);
+            }
+        }
+
+        uint32_t linkTimeout = link_timeout(&conn->link, now);
+        if (linkTimeout < timeout) { timeout = linkTimeout; }
+    }
+
+    return timeout;
+}
+
+// Starts, stops or changes advertising as the schedule decides,
+// returning how long until it needs another look
+static uint32_t updateAdvertising() {
+    uint32_t now = _now();
+    bool available = server.synced && hasFreeConnection();
+
+    AdvParams params;
+    uint32_t actions = adv_poll(&server.adv, available, now, &params);
+    if (actions == AdvActionNone) { return adv_timeout(&server.adv, now); }
+
+    logger_record(LogEventAdvertising, actions | (server.adv.mode << 8),
+      server.adv.reason);
+
+    // The interval cannot change while advertising (and the stack may
+    // have stopped already)
+    if (ble_gap_adv_active()) {
+        int rc = ble_gap_adv_stop();
+        if (rc) { printf("[ble] advertising stop failed: rc=%d\n", rc); }
+    }
+
+    if (actions & AdvActionStart) {
+        printf("[ble] advertise: mode=%s interval=%d-%d\n",
+          adv_modeName(server.adv.mode), params.intervalMin,
+          params.intervalMax);
+
+        // Undirected-connectable and general-discoverable
+        struct ble_gap_adv_params advParams = {
+            .conn_mode = BLE_GAP_CONN_MODE_UND,
+            .disc_mode = BLE_GAP_DISC_MODE_GEN,
+            .itvl_min = params.intervalMin,
+            .itvl_max = params.intervalMax,
+        };
+
+        int rc = ble_gap_adv_start(server.own_addr_type, NULL,
+          BLE_HS_FOREVER, &advParams, _gapEvent, NULL);
+        if (rc) {
+            printf("[ble] advertising failed: rc=%d\n", rc);
+            adv_stopped(&server.adv);
+            return ADV_RETRY_DELAY;
+        }
+    }
+
+    return adv_timeout(&server.adv, now);
+}
+
 static void _runTask() {
     printf("[ble] BLE Host Task Started\n");
 
@@ -787,111 +1346,115 @@ static void _runTask() {
 }
 
 ///////////////////////////////
-// Panel API
+// Logger
 
-void panel_enableMessage(bool enable) {
-    conn.enabled = enable;
-}
-
-bool panel_isMessageEnabled() { return conn.enabled; }
+// How often the log is drained
+#define LOG_INTERVAL        (250)
 
+// Largest batch; a notification of the largest attribute value
+#define LOG_MAX_BATCH       (512)
 
-bool panel_acceptMessage(uint32_t id, FfxCborCursor *params) {
-    if (conn.messageState != MessageStateReceived || id == 0 ||
-      id != conn.messageId) { return false; }
-
-    conn.messageState = MessageStateProcessing;
+// Sends the log records in MTU-sized batches to every connection
+// subscribed to the logger characteristic. This runs at a low
+// priority, so records are batched while anything else is busy.
+static void _loggerTask(void *arg) {
+    printf("[ble] Log Drain Started\n");
 
-    if (params) { ffx_cbor_clone(params, &conn.message); }
+    static uint8_t batch[LOG_MAX_BATCH];
 
-    return true;
-}
+    while (1) {
+        delay(LOG_INTERVAL);
 
+        // Each batch must fit the smallest MTU of the subscribers
+        size_t length = sizeof(batch);
+        int subscribers = 0;
+        for (int i = 0; i < MAX_CONNECTIONS; i++) {
+            Connection *conn = &connections[i];
+            if ((conn->state & STATE_LOGGING) == 0) { continue; }
 
-static void sendMessage(FfxCborBuilder *builder) {
-    size_t cborLength = ffx_cbor_getBuildLength(builder);
+            uint16_t mtu = ble_att_mtu(conn->conn_handle);
+            if (mtu < 3 + LOG_HEADER_SIZE + LOG_RECORD_SIZE) { continue; }
+            if (mtu - 3 < length) { length = mtu - 3; }
 
-    conn.length = cborLength + 32;
-    conn.messageState = MessageStateSending;
-    conn.messageId = 0;
+            subscribers++;
+        }
 
-    FfxSha256Context ctx;
-    ffx_hash_initSha256(&ctx);
-    ffx_hash_updateSha256(&ctx, &conn.data[32], cborLength);
-    ffx_hash_finalSha256(&ctx, conn.data);
+        if (subscribers == 0) {
+            logger_discard();
+            continue;
+        }
 
-    uint8_t resetMessage[] = { CMD_RESET };
-    notify(resetMessage, sizeof(resetMessage));
-}
+        while (1) {
+            size_t batchLength = logger_drain(batch, length);
+            if (batchLength == 0) { break; }
 
-static void prepareReply(FfxCborBuilder *builder) {
-    memset(conn.data, 0, MAX_MESSAGE_SIZE + CBOR_HEADER);
+            int sent = 0;
+            for (int i = 0; i < MAX_CONNECTIONS; i++) {
+                Connection *conn = &connections[i];
+                if ((conn->state & STATE_LOGGING) == 0) { continue; }
 
-    ffx_cbor_build(builder, &conn.data[32],
-      MAX_MESSAGE_SIZE + CBOR_HEADER - 32);
+                struct os_mbuf *om = ble_hs_mbuf_from_flat(batch,
+                  batchLength);
+                if (om == NULL) { continue; }
 
-    ffx_cbor_appendMap(builder, 3);
-    {
-        ffx_cbor_appendString(builder, "v");
-        ffx_cbor_appendNumber(builder, 1);
+                int rc = ble_gatts_notify_custom(conn->conn_handle,
+                  server.logger, om);
+                if (rc == 0) { sent++; }
+            }
 
-        ffx_cbor_appendString(builder, "id");
-        ffx_cbor_appendNumber(builder, conn.replyId);
+            // No one received it (e.g. a transfer is using every mbuf);
+            // try again next time
+            if (sent == 0) {
+                logger_addOverflow((batchLength - LOG_HEADER_SIZE) /
+                  LOG_RECORD_SIZE);
+                break;
+            }
+        }
     }
-
-    conn.offset = 0;
 }
 
-bool panel_sendErrorReply(uint32_t id, uint32_t code, char *message) {
-    if (id == 0 || id != conn.messageId) { return false; }
 
-    size_t length = strlen(message);
-    if (length > 128) { return false; }
+///////////////////////////////
+// Panel API
 
-    if (conn.messageState != MessageStateProcessing) { return false; }
+void panel_enableMessage(bool enable) {
+    server.enabled = enable;
+}
 
-    FfxCborBuilder builder;
-    prepareReply(&builder);
+bool panel_isMessageEnabled() { return server.enabled; }
 
-    // Append the Error payload (error: { code, message })
-    ffx_cbor_appendString(&builder, "error");
-    ffx_cbor_appendMap(&builder, 2);
-    {
-        ffx_cbor_appendString(&builder, "code");
-        ffx_cbor_appendNumber(&builder, code);
 
-        ffx_cbor_appendString(&builder, "message");
-        ffx_cbor_appendString(&builder, message);
-    }
+bool panel_acceptMessage(uint32_t id, FfxCborCursor *params) {
+    return fsp_acceptMessage(id, params);
+}
 
-    sendMessage(&builder);
+bool panel_buildReply(uint32_t id, FfxCborBuilder *result) {
+    return fsp_buildReply(id, result);
+}
 
-    return true;
+bool panel_sendErrorReply(uint32_t id, uint32_t code, char *message) {
+    return fsp_sendErrorReply(id, code, message);
 }
 
 bool panel_sendReply(uint32_t id, FfxCborBuilder *result) {
-    if (id == 0 || id != conn.messageId) { return false; }
-
-    if (ffx_cbor_getBuildLength(result) > MAX_MESSAGE_SIZE) { return false; }
-    if (conn.messageState != MessageStateProcessing) { return false; }
-
-    FfxCborBuilder builder;
-    prepareReply(&builder);
-
-    // Append the payload
-    ffx_cbor_appendString(&builder, "result");
-    ffx_cbor_appendCborBuilder(&builder, result);
+    return fsp_sendReply(id, result);
+}
 
-    sendMessage(&builder);
+bool panel_sendPartialReply(uint32_t id, FfxCborBuilder *result) {
+    return fsp_sendPartialReply(id, result);
+}
 
-    return true;
+bool panel_isSendingReply(uint32_t id) {
+    return fsp_isSendingReply(id);
 }
 
+
 ///////////////////////////////
 // BLE Task API
 
-// TEMP
-void ble_store_config_init(void);
+void ble_boostAdvertising() {
+    boostAdvertising(AdvReasonButton);
+}
 
 void taskBleFunc(void* pvParameter) {
     uint32_t *ready = (uint32_t*)pvParameter;
@@ -899,7 +1462,45 @@ void taskBleFunc(void* pvParameter) {
 
     TaskStatus_t task;
     vTaskGetInfo(NULL, &task, pdFALSE, pdFALSE);
-    conn.task = task.xHandle;
+    server.task = task.xHandle;
+
+    // Start the message worker; received messages are verified and
+    // parsed there, keeping the NimBLE host task responsive
+    {
+        platform.modelNumber = device_modelNumber();
+        platform.serialNumber = device_serialNumber();
+        fsp_init(&platform);
+
+        // Hosts check each encrypted session against this key
+        uint8_t sessionKey[FSP_SECURE_PUBKEY_LENGTH];
+        if (device_getSessionPubkey(sessionKey) == DeviceStatusOk) {
+            printf("[ble] session key: ");
+            for (int i = 0; i < sizeof(sessionKey); i++) {
+                printf("%02x", sessionKey[i]);
+            }
+            printf("\n");
+        }
+
+        lockRequests = xSemaphoreCreateMutexStatic(&lockRequestsBuffer);
+
+        workQueue = xQueueCreateStatic(MAX_WORK_ITEMS, sizeof(WorkItem),
+          workQueueStore, &workQueueBuffer);
+        assert(workQueue != NULL);
+
+        BaseType_t status = xTaskCreatePinnedToCore(&_workerTask,
+          "ble-worker", 4096, NULL, 2, &server.worker, 0);
+        printf("[ble] start message worker: status=%d\n", status);
+        assert(server.worker != NULL);
+    }
+
+    // Start the log drain; below every other task, so records wait
+    // until nothing more important is running
+    {
+        BaseType_t status = xTaskCreatePinnedToCore(&_loggerTask,
+          "ble-logger", 2048, NULL, 1, &server.drain, 0);
+        printf("[ble] start log drain: status=%d\n", status);
+        assert(server.drain != NULL);
+    }
 
     // Device Information Service Data
 
@@ -943,9 +1544,47 @@ void taskBleFunc(void* pvParameter) {
         .data = batteryLevel, .length = sizeof(batteryLevel)
     };
 
+    // Generic Attribute Service Data
+
+    // Service Changed; always the entire range
+    uint8_t serviceChanged[] = { 0x01, 0x00, 0xff, 0xff };
+    Payload payloadServiceChanged = {
+        .data = serviceChanged, .length = sizeof(serviceChanged)
+    };
+
+    // Final once the attributes are registered, before any connection
+    Payload payloadDatabaseHash = {
+        .data = server.dbHash, .length = DB_HASH_LENGTH
+    };
+
     // Definitions
 
     const struct ble_gatt_svc_def services[] = { {
+        // Service: Generic Attribute
+        .type = BLE_GATT_SVC_TYPE_PRIMARY,
+        .uuid = BLE_UUID16_DECLARE(UUID_SVC_GATT),
+        .characteristics = (struct ble_gatt_chr_def[]) { {
+            // Characteristic: Service Changed
+            .uuid = BLE_UUID16_DECLARE(UUID_CHR_SERVICE_CHANGED),
+            .access_cb = gattAccess,
+            .arg = &payloadServiceChanged,
+            .val_handle = &server.serviceChanged,
+            .flags = BLE_GATT_CHR_F_INDICATE,
+        }, {
+            // Characteristic: Client Supported Features
+            .uuid = BLE_UUID16_DECLARE(UUID_CHR_CLIENT_SUPPORTED_FEATURES),
+            .access_cb = gattAccess,
+            .flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+        }, {
+            // Characteristic: Database Hash
+            .uuid = BLE_UUID16_DECLARE(UUID_CHR_DATABASE_HASH),
+            .access_cb = gattAccess,
+            .arg = &payloadDatabaseHash,
+            .flags = BLE_GATT_CHR_F_READ,
+        }, {
+            0, // No more characteristics in this service
+        } }
+    }, {
         // Service: Device Information
         .type = BLE_GATT_SVC_TYPE_PRIMARY,
         .uuid = BLE_UUID16_DECLARE(UUID_SVC_DEVICE_INFO),
@@ -984,7 +1623,7 @@ void taskBleFunc(void* pvParameter) {
             // Battery Level
             .uuid = BLE_UUID16_DECLARE(UUID_CHR_BATTERY_LEVEL),
             .access_cb = gattAccess,
-            .val_handle = &conn.battery_handle,
+            .val_handle = &server.battery_handle,
             .descriptors = (struct ble_gatt_dsc_def[]) { {
                 .uuid = BLE_UUID16_DECLARE(UUID_DSC_BATTERY_LEVEL),
                 .access_cb = gattAccess,
@@ -1005,14 +1644,15 @@ void taskBleFunc(void* pvParameter) {
             // Characteristic: Data
             .uuid = BLE_UUID16_DECLARE(UUID_CHR_FSP_CONTENT),
             .access_cb = gattAccess,
-            .val_handle = &conn.content,
+            .val_handle = &server.content,
             .flags = BLE_GATT_CHR_F_READ | BLE_ATT_F_READ_ENC
               | BLE_ATT_F_WRITE | BLE_ATT_F_WRITE_ENC | BLE_GATT_CHR_F_INDICATE
+              | BLE_GATT_CHR_F_NOTIFY
         }, {
             // Characteristic: Log
             .uuid = BLE_UUID16_DECLARE(UUID_CHR_FSP_LOGGER),
             .access_cb = gattAccess,
-            .val_handle = &conn.logger,
+            .val_handle = &server.logger,
             .flags = BLE_GATT_CHR_F_NOTIFY
         }, {
             0, // No more characteristics in this service
@@ -1057,7 +1697,6 @@ void taskBleFunc(void* pvParameter) {
     //ble_hs_cfg.sm_their_key_dist = BLE_SM_PAIR_KEY_DIST_ENC;
 
     ble_svc_gap_init();
-    ble_svc_gatt_init();
     assert(ble_gatts_count_cfg(services) == 0);
     assert(ble_gatts_add_svcs(services) == 0);
 
@@ -1065,9 +1704,23 @@ void taskBleFunc(void* pvParameter) {
     const char *device_name = DEVICE_NAME;
     assert(ble_svc_gap_device_name_set(device_name) == 0);
 
-    // TEMP
+    // Accept L2CAP channels for FSP
+    {
+        int rc = ble_l2cap_create_server(L2CAP_PSM, L2CAP_MTU, _l2capEvent,
+          NULL);
+        if (rc) { printf("[ble] l2cap server failed: rc=%d\n", rc); }
+    }
+
+    // Bonds are persisted to NVS by ble_store_config, and cached in RAM
+    // in front of it
     // See: components/bt//host/nimble/nimble/nimble/host/store/config/src/ble_store_config.c
     ble_store_config_init();
+    bond_init();
+
+    // Advertise fast from boot; the data never changes, so is only
+    // encoded once
+    encodeAdvertisement();
+    adv_init(&server.adv, _now());
 
     // Run forever
     nimble_port_freertos_init(_runTask);
@@ -1075,55 +1728,22 @@ void taskBleFunc(void* pvParameter) {
     // Unblock the bootstrap task
     *ready = 1;
 
-    uint8_t *buffer = NULL;
-
+    uint32_t woken = 0;
     while (1) {
-        if (buffer) {
-            free(buffer);
-            buffer = NULL;
-        }
+        // Advance every outgoing reply; windowed and L2CAP transfers
+        // need another look sooner (a missing ack or free mbufs)
+        uint32_t timeout = fsp_poll(woken);
 
-        // Wait for a notification
-        ulTaskNotifyTake(pdFALSE, 3000);
-
-        // If pending send message, send the next chunk
-        if (conn.messageState == MessageStateSending) {
+        // Adapt each link to its traffic
+        uint32_t linkTimeout = updateLinks();
+        if (linkTimeout < timeout) { timeout = linkTimeout; }
 
-            size_t length = conn.length - conn.offset;
-            if (length == 0) {
-                conn.offset = 0;
-                conn.length = 0;
-                conn.messageState = MessageStateReady;
-                continue;
-            }
+        // Advertise fast when someone is likely connecting, otherwise
+        // slow
+        uint32_t advTimeout = updateAdvertising();
+        if (advTimeout < timeout) { timeout = advTimeout; }
 
-            if (length > 506) { length = 506; }
-
-            buffer = malloc(512);
-
-            if (conn.offset == 0) {
-                buffer[0] = CMD_START_MESSAGE;
-                buffer[1] = conn.length >> 8;
-                buffer[2] = conn.length & 0xff;
-
-            } else {
-                buffer[0] = CMD_CONTINUE_MESSAGE;
-                buffer[1] = conn.offset >> 8;
-                buffer[2] = conn.offset & 0xff;
-            }
-
-            memcpy(&buffer[3], &conn.data[conn.offset], length);
-            conn.offset += length;
-
-            notify(buffer, length + 3);
-        }
-
-        /*
-        if (conn.state & STATE_SUBSCRIBED) {
-            char *ping = "ping";
-            notify(conn.logger, (uint8_t*)ping, sizeof(ping));
-        }
-        */
+        // Wait for a notification
+        woken = ulTaskNotifyTake(pdFALSE, pdMS_TO_TICKS(timeout));
     }
 }
-
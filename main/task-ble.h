@@ -8,13 +8,16 @@ extern "C" {
 #include <stdint.h>
 
 
-// 16kb
-#define MAX_MESSAGE_SIZE        (1 << 14)
-
 uint32_t ble_init();
 
 void taskBleFunc(void* pvParameter);
 
+/**
+ *  A user is interacting with the device (e.g. pressed a button), so
+ *  may be about to connect; advertise fast for a while.
+ */
+void ble_boostAdvertising();
+
 typedef void* TransportContext;
 
 typedef void (*MessageReceived)(TransportContext context,
@@ -23,12 +26,6 @@ typedef void (*MessageReceived)(TransportContext context,
 bool panel_isMessageEnabled();
 void panel_enableMessage(bool enable);
 
-//void transport_task(void* pvParameter);
-//uint32_t transport_send(TransportContext context,
-//    uint32_t command, uint8_t *data, size_t length);
-
-//uint32_t transport_wait(TransportContext context);
-
 size_t panel_copyMessage(uint32_t messageId, uint8_t *output);
 
 #ifdef __cplusplus
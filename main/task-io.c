@@ -13,7 +13,9 @@
 
 #include "panel.h"
 #include "events.h"
+#include "logger.h"
 #include "pixels.h"
+#include "task-ble.h"
 #include "utils.h"
 
 #include "images/image-background.h"
@@ -459,6 +461,9 @@ void taskIoFunc(void* pvParameter) {
 
             // Check for holding the reset sequence to start a timer
             if (keypad_didChange(&keypad, KeyAll)) {
+                // Someone is using the device; they may be connecting
+                if (keypad_read(&keypad)) { ble_boostAdvertising(); }
+
                 if (keypad_read(&keypad) == KeyReset) {
                     resetStart = ticks();
                 } else {
@@ -492,7 +497,8 @@ void taskIoFunc(void* pvParameter) {
 
             // We are falling behind, catch up by dropping frames
             if (didDelay == pdFALSE) {
-                //printf("Frame dropped dt=%ld\n", now - lastFrameTime);
+                uint32_t behind = ticks() - lastFrameTime;
+                logger_record(LogEventFrameDropped, behind, 0);
                 lastFrameTime = ticks();
             }
         }
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "freertos/stream_buffer.h"
+#include "freertos/task.h"
+
+#include "driver/usb_serial_jtag.h"
+
+#include "fsp.h"
+#include "fsp-serial.h"
+#include "logger.h"
+
+#include "task-usb.h"
+
+
+// FSP over the USB-Serial-JTAG port, with each frame wrapped by
+// fsp-serial. The port is a byte stream with its own flow control, so
+// the connection is streamed (like an L2CAP channel); reply chunks are
+// sent until the outgoing buffer is full. Replies are sent by the BLE
+// task, which polls every FSP connection.
+
+// Driver ring buffers
+#define USB_RX_BUFFER       (1024)
+#define USB_TX_BUFFER       (2048)
+
+// Outgoing frames, waiting for the writer task; whole frames are added
+// so a frame that does not fit is retried rather than truncated
+#define TX_BUFFER           (4 * (FSP_MAX_FRAME + FSP_SERIAL_OVERHEAD))
+
+// How long to wait for a host that is not reading, before dropping the
+// data (the host will resync on the next frame)
+#define WRITE_TIMEOUT       (100)
+
+
+static FspConnection *conn = NULL;
+
+static FspSerialDecoder decoder;
+
+// Lock to acquire before adding a frame to the outgoing buffer; frames
+// are added from the USB task (command responses) and the BLE task
+// (reply chunks).
+static StaticSemaphore_t lockSendBuffer;
+static SemaphoreHandle_t lockSend;
+
+static StaticStreamBuffer_t txStreamBuffer;
+static uint8_t txStreamStore[TX_BUFFER + 1];
+static StreamBufferHandle_t txStream;
+
+// A frame did not fit; wake FSP once the writer has made room
+static volatile bool txFull = false;
+
+static TaskHandle_t writer = NULL;
+
+
+///////////////////////////////
+// Transport
+
+static int _send(FspConnection *conn, const uint8_t *header,
+  size_t headerLength, const uint8_t *payload, size_t payloadLength,
+  bool confirm) {
+
+    size_t length = headerLength + payloadLength;
+
+    uint8_t prefix[FSP_SERIAL_PREFIX_LENGTH];
+    fsp_serial_encodePrefix(prefix, length);
+
+    uint8_t suffix[FSP_SERIAL_SUFFIX_LENGTH];
+    fsp_serial_encodeSuffix(suffix, header, headerLength, payload,
+      payloadLength);
+
+    xSemaphoreTake(lockSend, portMAX_DELAY);
+
+    int rc = 0;
+    if (xStreamBufferSpacesAvailable(txStream) <
+      length + FSP_SERIAL_OVERHEAD) {
+        txFull = true;
+        rc = -1;
+    } else {
+        xStreamBufferSend(txStream, prefix, sizeof(prefix), 0);
+        xStreamBufferSend(txStream, header, headerLength, 0);
+        if (payloadLength) {
+            xStreamBufferSend(txStream, payload, payloadLength, 0);
+        }
+        xStreamBufferSend(txStream, suffix, sizeof(suffix), 0);
+    }
+
+    xSemaphoreGive(lockSend);
+
+    return rc;
+}
+
+static const FspTransport transport = {
+    .name = "usb",
+    .send = _send
+};
+
+static void _onFrame(void *arg, const uint8_t *frame, size_t length) {
+    // The host may resume a session (e.g. one started over BLE)
+    conn = fsp_receive(conn, frame, length);
+}
+
+static void _writerTask(void *arg) {
+    printf("[usb] Writer Started\n");
+
+    static uint8_t data[USB_TX_BUFFER];
+
+    while (1) {
+        size_t length = xStreamBufferReceive(txStream, data, sizeof(data),
+          portMAX_DELAY);
+        if (length == 0) { continue; }
+
+        int written = usb_serial_jtag_write_bytes(data, length,
+          pdMS_TO_TICKS(WRITE_TIMEOUT));
+        if (written < length) {
+            logger_record(LogEventUsbDropped, length, written);
+        }
+
+        if (txFull) {
+            txFull = false;
+            fsp_wake();
+        }
+    }
+}
+
+
+///////////////////////////////
+// USB Task API
+
+void taskUsbFunc(void* pvParameter) {
+    uint32_t *ready = (uint32_t*)pvParameter;
+    vTaskSetApplicationTaskTag( NULL, (void*)NULL);
+
+    do {
+        usb_serial_jtag_driver_config_t config = {
+            .rx_buffer_size = USB_RX_BUFFER,
+            .tx_buffer_size = USB_TX_BUFFER
+        };
+
+        esp_err_t err = usb_serial_jtag_driver_install(&config);
+        if (err) {
+            printf("[usb] failed to install driver: err=%d\n", err);
+            break;
+        }
+
+        lockSend = xSemaphoreCreateBinaryStatic(&lockSendBuffer);
+        xSemaphoreGive(lockSend);
+
+        txStream = xStreamBufferCreateStatic(TX_BUFFER, 1, txStreamStore,
+          &txStreamBuffer);
+        assert(txStream != NULL);
+
+        // The link is always present (whether or not a host is
+        // attached), so it holds one FSP connection for good
+        conn = fsp_openConnection(&transport, NULL, FSP_MAX_CHUNK_SIZE,
+          false);
+        if (conn == NULL) {
+            printf("[usb] no free FSP connection\n");
+            break;
+        }
+
+        BaseType_t status = xTaskCreatePinnedToCore(&_writerTask,
+          "usb-writer", 2048, NULL, 2, &writer, 0);
+        printf("[usb] start writer: status=%d\n", status);
+        assert(writer != NULL);
+
+        fsp_serial_initDecoder(&decoder);
+    } while (0);
+
+    *ready = 1;
+
+    if (conn == NULL) {
+        vTaskDelete(NULL);
+        return;
+    }
+
+    uint8_t data[128];
+
+    while (1) {
+        int length = usb_serial_jtag_read_bytes(data, sizeof(data),
+          portMAX_DELAY);
+        if (length <= 0) { continue; }
+
+        fsp_serial_decode(&decoder, data, length, _onFrame, NULL);
+    }
+}
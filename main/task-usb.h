@@ -0,0 +1,20 @@
+#ifndef __TASK_USB_H__
+#define __TASK_USB_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+#include <stdint.h>
+
+
+
+void taskUsbFunc(void* pvParameter);
+
+
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __TASK_USB_H__ */
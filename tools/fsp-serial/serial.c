@@ -0,0 +1,1245 @@
+// FSP over a serial link
+//
+// Runs a minimal FSP client over the byte-stream framing in
+// main/fsp-serial.c, either against the firmware's FSP module over a
+// pseudo-terminal (loopback; the default) or against a device on a
+// serial port. See README.md.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "firefly-cbor.h"
+#include "firefly-crypto.h"
+#include "firefly-hash.h"
+
+#include "aead.h"
+#include "compress.h"
+#include "fsp.h"
+#include "fsp-secure.h"
+#include "fsp-serial.h"
+
+
+#define CMD_QUERY                   (0x03)
+#define CMD_RESET                   (0x02)
+#define CMD_START_MESSAGE           (0x06)
+#define CMD_CONTINUE_MESSAGE        (0x07)
+#define CMD_SESSION                 (0x09)
+
+#define QUERY_COUNTERS              (0x10)
+
+#define SESSION_NEW                 (0x01)
+#define SESSION_RESUME              (0x02)
+
+#define CAPS_COMPRESSED             (1 << 1)
+
+#define ERROR_SESSION_FAILED        (0x87)
+
+#define CHECKSUM_LENGTH             (32)
+
+// How long the host waits for the device before giving up
+#define READ_TIMEOUT                (2000)
+
+#define MAX_WORK_ITEMS              (FSP_MAX_CONNECTIONS * FSP_MAX_REQUESTS)
+
+typedef struct Config {
+    const char *port;
+    const char *method;
+    bool compressed;
+    bool secure;
+    bool noise;
+    bool text;
+    size_t requestSize;
+    size_t replySize;
+    uint32_t count;
+    uint32_t seed;
+
+    // Query the counters (after the loopback, or every this many ms)
+    bool counters;
+    uint32_t interval;
+
+    // Partial replies the loopback panel sends before each reply
+    uint32_t partials;
+
+    // The device's session key (compressed), which must sign each
+    // handshake
+    uint8_t deviceKey[FSP_SECURE_PUBKEY_LENGTH];
+    bool hasDeviceKey;
+
+    // Only check the crypto against known answers
+    bool selftest;
+} Config;
+
+static Config config;
+
+static uint8_t requestData[MAX_MESSAGE_SIZE];
+static uint8_t replyData[MAX_MESSAGE_SIZE];
+
+
+///////////////////////////////
+// Utilities
+
+static uint32_t nextRandom() {
+    // xorshift32; deterministic for a given seed
+    uint32_t x = config.seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    config.seed = x;
+    return x;
+}
+
+static void fillPayload(uint8_t *data, size_t length, bool text) {
+    static const char *words[] = {
+        "firefly ", "transfer ", "message ", "signature ", "address ",
+        "0x00000000 ", "value ", "nonce ", "chain ", "\"params\": ",
+    };
+
+    if (!text) {
+        for (size_t i = 0; i < length; i++) { data[i] = nextRandom(); }
+        return;
+    }
+
+    size_t offset = 0;
+    while (offset < length) {
+        const char *word = words[nextRandom() % 10];
+        for (size_t i = 0; word[i] && offset < length; i++) {
+            data[offset++] = word[i];
+        }
+    }
+}
+
+// Key material; unlike nextRandom, not reproducible
+static void fillSecure(uint8_t *data, size_t length) {
+    if (getrandom(data, length, 0) != length) {
+        printf("[serial] getrandom failed: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+static uint64_t nowMicros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void writeAll(int fd, const uint8_t *data, size_t length) {
+    while (length) {
+        ssize_t count = write(fd, data, length);
+        if (count < 0) {
+            if (errno == EINTR || errno == EAGAIN) { continue; }
+            printf("[serial] write failed: %s\n", strerror(errno));
+            exit(1);
+        }
+        data += count;
+        length -= count;
+    }
+}
+
+// Writes one FSP frame with the fsp-serial framing
+static void writeFrame(int fd, const uint8_t *header, size_t headerLength,
+  const uint8_t *payload, size_t payloadLength) {
+
+    uint8_t prefix[FSP_SERIAL_PREFIX_LENGTH];
+    fsp_serial_encodePrefix(prefix, headerLength + payloadLength);
+
+    uint8_t suffix[FSP_SERIAL_SUFFIX_LENGTH];
+    fsp_serial_encodeSuffix(suffix, header, headerLength, payload,
+      payloadLength);
+
+    writeAll(fd, prefix, sizeof(prefix));
+    writeAll(fd, header, headerLength);
+    if (payloadLength) { writeAll(fd, payload, payloadLength); }
+    writeAll(fd, suffix, sizeof(suffix));
+}
+
+// Puts a terminal into raw mode, so every byte passes through as is
+static void makeRaw(int fd) {
+    struct termios tio;
+    if (tcgetattr(fd, &tio)) {
+        printf("[serial] tcgetattr failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+}
+
+
+///////////////////////////////
+// Device; the FSP module under test (loopback only)
+
+typedef struct WorkItem {
+    FspConnection *conn;
+    FspRequest *request;
+} WorkItem;
+
+typedef struct Device {
+    int fd;
+    FspConnection *conn;
+    FspSerialDecoder decoder;
+
+    volatile bool stop;
+    bool woken;
+
+    WorkItem work[MAX_WORK_ITEMS];
+    int workCount;
+
+    uint32_t panels[MAX_WORK_ITEMS];
+    int panelCount;
+
+    // A panel streaming partial replies, and how many it has sent
+    uint32_t streamId;
+    uint32_t streamed;
+
+    // The last message event, checked by the host
+    uint32_t eventId;
+    char eventMethod[FSP_METHOD_LENGTH];
+    bool eventMatched;
+} Device;
+
+static Device device;
+
+static uint32_t _now() {
+    return nowMicros() / 1000;
+}
+
+static uint32_t _random() {
+    uint32_t value;
+    fillSecure((uint8_t*)&value, sizeof(value));
+    return value;
+}
+
+static void _process(FspConnection *conn, FspRequest *request) {
+    device.work[device.workCount++] = (WorkItem){
+        .conn = conn,
+        .request = request
+    };
+}
+
+static void _wake() {
+    device.woken = true;
+}
+
+// The same event a panel receives as EventNameMessage
+static bool _emit(uint32_t id, const char *method, FfxCborCursor *params) {
+    device.eventId = id;
+    snprintf(device.eventMethod, sizeof(device.eventMethod), "%s", method);
+
+    // The params must be exactly what the host sent
+    FfxCborCursor cursor;
+    ffx_cbor_clone(&cursor, params);
+
+    uint8_t *data = NULL;
+    size_t length = 0;
+    device.eventMatched =
+      ffx_cbor_followIndex(&cursor, 0) == FfxCborStatusOK &&
+      ffx_cbor_getData(&cursor, &data, &length) == FfxCborStatusOK &&
+      length == config.requestSize &&
+      memcmp(data, requestData, length) == 0;
+
+    device.panels[device.panelCount++] = id;
+
+    return true;
+}
+
+// The loopback device's session key (see device_signSession)
+static uint8_t sessionKey[FFX_PRIVKEY_LENGTH] = {
+    0x5e, 0x1f, 0x2a, 0x77, 0x90, 0x3c, 0x41, 0xd8,
+    0x6b, 0x02, 0xe4, 0x19, 0xaf, 0x53, 0x8c, 0x36,
+    0x17, 0xc2, 0x4e, 0x95, 0x0d, 0x68, 0xb1, 0x23,
+    0xfa, 0x74, 0x39, 0x8e, 0x50, 0xcd, 0x06, 0x9b
+};
+
+static bool _attest(const uint8_t *digest, uint8_t *signature) {
+    return ffx_pk_signSecp256k1(sessionKey, (uint8_t*)digest, signature);
+}
+
+static FspPlatform platform = {
+    .modelNumber = 1,
+    .serialNumber = 1,
+    .now = _now,
+    .random = _random,
+    .attest = _attest,
+    .process = _process,
+    .wake = _wake,
+    .emit = _emit
+};
+
+// Sends replySize bytes, as a partial reply or the reply
+static void panelReply(uint32_t id, bool partial) {
+    FfxCborBuilder result;
+    fsp_buildReply(id, &result);
+    ffx_cbor_appendDataRef(&result, replyData, config.replySize);
+
+    bool sent = partial ? fsp_sendPartialReply(id, &result):
+      fsp_sendReply(id, &result);
+    if (!sent) {
+        printf("[serial] reply failed: id=%d partial=%d\n", id, partial);
+        exit(1);
+    }
+}
+
+// Replies to a request, as a panel would; after any partial replies
+static void runPanel(uint32_t id) {
+    if (!fsp_acceptMessage(id, NULL)) {
+        printf("[serial] accept failed: id=%d\n", id);
+        exit(1);
+    }
+
+    if (config.partials == 0) {
+        panelReply(id, false);
+        return;
+    }
+
+    panelReply(id, true);
+    device.streamId = id;
+    device.streamed = 1;
+}
+
+// Sends the next partial reply (or the reply) once the last is sent
+static void runStream() {
+    uint32_t id = device.streamId;
+    if (id == 0 || fsp_isSendingReply(id)) { return; }
+
+    if (device.streamed < config.partials) {
+        panelReply(id, true);
+        device.streamed++;
+    } else {
+        panelReply(id, false);
+        device.streamId = 0;
+    }
+}
+
+static int _send(FspConnection *conn, const uint8_t *header,
+  size_t headerLength, const uint8_t *payload, size_t payloadLength,
+  bool confirm) {
+
+    writeFrame(device.fd, header, headerLength, payload, payloadLength);
+    return 0;
+}
+
+static const FspTransport transport = {
+    .name = "pty",
+    .send = _send
+};
+
+static void _deviceFrame(void *arg, const uint8_t *frame, size_t length) {
+    device.conn = fsp_receive(device.conn, frame, length);
+}
+
+// The USB task, worker and panels of the firmware, on one thread
+static void* deviceThread(void *arg) {
+    // Like the USB link, the pty is not bonded; so unless testing
+    // plaintext, every message must be encrypted
+    platform.plaintext = config.secure ? FspPlaintextBonded: FspPlaintextAny;
+    fsp_init(&platform);
+    device.conn = fsp_openConnection(&transport, NULL, FSP_MAX_CHUNK_SIZE,
+      false);
+    fsp_serial_initDecoder(&device.decoder);
+
+    while (!device.stop) {
+        for (int i = 0; i < device.workCount; i++) {
+            fsp_processRequest(device.work[i].conn, device.work[i].request);
+        }
+        device.workCount = 0;
+
+        for (int i = 0; i < device.panelCount; i++) {
+            runPanel(device.panels[i]);
+        }
+        device.panelCount = 0;
+
+        runStream();
+
+        bool woken = device.woken;
+        device.woken = false;
+        uint32_t timeout = fsp_poll(woken);
+        if (device.woken || device.workCount || device.panelCount) {
+            timeout = 0;
+        }
+        if (device.streamId && !fsp_isSendingReply(device.streamId)) {
+            timeout = 0;
+        }
+
+        // Wake periodically to notice stop
+        if (timeout > 100) { timeout = 100; }
+
+        struct pollfd pfd = { .fd = device.fd, .events = POLLIN };
+        if (poll(&pfd, 1, timeout) <= 0) { continue; }
+
+        uint8_t data[512];
+        ssize_t count = read(device.fd, data, sizeof(data));
+        if (count <= 0) { continue; }
+
+        fsp_serial_decode(&device.decoder, data, count, _deviceFrame, NULL);
+    }
+
+    return NULL;
+}
+
+
+///////////////////////////////
+// Host; a minimal FSP client
+
+typedef struct Host {
+    int fd;
+    FspSerialDecoder decoder;
+
+    bool queried;
+    uint8_t caps;
+
+    uint8_t message[MAX_MESSAGE_SIZE];
+    size_t length;
+    uint32_t id;
+
+    uint8_t reply[MAX_MESSAGE_SIZE];
+    size_t replyLength;
+    size_t received;
+    bool replying;
+    bool replied;
+
+    // Partial replies received (and checked) before the reply
+    uint32_t partials;
+
+    // The encrypted session, and the ticket to resume it with
+    FspSecure secure;
+    uint8_t ticket[FSP_SECURE_TICKET_LENGTH];
+    uint8_t resumption[FSP_SECURE_SECRET_LENGTH];
+
+    // The last CMD_SESSION response
+    uint8_t session[128];
+    size_t sessionLength;
+    bool handshaken;
+
+    // A plaintext message was refused
+    bool refused;
+
+    // The last counters (a CBOR Map), and their values at the previous
+    // poll
+    uint8_t counters[FSP_COUNTERS_LENGTH];
+    size_t countersLength;
+    bool counted;
+    uint64_t previous[32];
+
+    uint32_t errors;
+} Host;
+
+static Host host;
+
+// Writes a few lines of console output between frames, as a booting
+// device might
+static void hostNoise() {
+    if (!config.noise) { return; }
+
+    char line[64];
+    int length = snprintf(line, sizeof(line), "I (%d) boot: noise %08x\n",
+      nextRandom() % 10000, nextRandom());
+    writeAll(host.fd, (uint8_t*)line, length);
+}
+
+static void hostWrite(const uint8_t *header, size_t headerLength,
+  const uint8_t *payload, size_t payloadLength) {
+    hostNoise();
+    writeFrame(host.fd, header, headerLength, payload, payloadLength);
+}
+
+// Verifies (and decrypts) the reply just received
+static void hostOpenReply() {
+    uint8_t checksum[32];
+    FfxSha256Context ctx;
+    ffx_hash_initSha256(&ctx);
+    ffx_hash_updateSha256(&ctx, &host.reply[CHECKSUM_LENGTH],
+      host.replyLength - CHECKSUM_LENGTH);
+    ffx_hash_finalSha256(&ctx, checksum);
+
+    if (memcmp(checksum, host.reply, 32)) {
+        printf("[serial] bad reply checksum\n");
+        exit(1);
+    }
+
+    if (host.secure.established) {
+        if (!fsp_secure_open(&host.secure, &host.reply[CHECKSUM_LENGTH],
+          host.replyLength - CHECKSUM_LENGTH)) {
+            printf("[serial] reply failed to authenticate\n");
+            exit(1);
+        }
+        host.replyLength -= FSP_SECURE_TAG_LENGTH;
+    }
+}
+
+// Checks a partial reply (the next one, carrying the loopback result)
+// and returns true, or returns false for the reply
+static bool hostPartial() {
+    FfxCborCursor cursor;
+    ffx_cbor_init(&cursor, &host.reply[CHECKSUM_LENGTH],
+      host.replyLength - CHECKSUM_LENGTH);
+
+    FfxCborCursor partial;
+    ffx_cbor_clone(&partial, &cursor);
+    if (ffx_cbor_followKey(&partial, "partial")) { return false; }
+
+    uint64_t index = 0;
+    ffx_cbor_getValue(&partial, &index);
+
+    uint8_t *result = NULL;
+    size_t resultLength = 0;
+    ffx_cbor_followKey(&cursor, "result");
+    ffx_cbor_getData(&cursor, &result, &resultLength);
+
+    if (index != host.partials || resultLength != config.replySize ||
+      memcmp(result, replyData, resultLength)) {
+        printf("[serial] partial reply mismatch: index=%" PRIu64
+          " length=%zu\n",
+          index, resultLength);
+        host.errors++;
+    }
+
+    host.partials++;
+    return true;
+}
+
+static void hostReceiveChunk(const uint8_t *data, size_t length) {
+    uint8_t cmd = data[0];
+    size_t value = (data[1] << 8) | data[2];
+
+    if (cmd == CMD_START_MESSAGE) {
+        host.replyLength = value;
+        host.received = 0;
+        host.replying = true;
+    } else if (!host.replying || value != host.received) {
+        printf("[serial] unexpected chunk: offset=%zu received=%zu\n",
+          value, host.received);
+        host.errors++;
+        return;
+    }
+
+    size_t count = length - 3;
+    if (host.caps & CAPS_COMPRESSED) {
+        CompressStatus status = compress_decode(&data[3], length - 3,
+          host.reply, host.received, host.replyLength, &count);
+        if (status) {
+            printf("[serial] decompress failed: status=%d\n", status);
+            exit(1);
+        }
+    } else {
+        if (host.received + count > host.replyLength) {
+            printf("[serial] chunk overruns reply\n");
+            exit(1);
+        }
+        memcpy(&host.reply[host.received], &data[3], count);
+    }
+    host.received += count;
+
+    // Partial replies are checked as they arrive; the next may follow
+    // immediately
+    if (host.received == host.replyLength) {
+        host.replying = false;
+        hostOpenReply();
+        if (!hostPartial()) { host.replied = true; }
+    }
+}
+
+static void _hostFrame(void *arg, const uint8_t *data, size_t length) {
+    if (data[0] == CMD_START_MESSAGE || data[0] == CMD_CONTINUE_MESSAGE) {
+        if (length < 4) { return; }
+        hostReceiveChunk(data, length);
+        return;
+    }
+
+    if (data[0] == CMD_RESET) { return; }
+
+    // Response to a handshake (or its failure)
+    if (length >= 2 && data[1] == CMD_SESSION) {
+        if (length > sizeof(host.session)) { length = sizeof(host.session); }
+        memcpy(host.session, data, length);
+        host.sessionLength = length;
+        host.handshaken = true;
+        return;
+    }
+
+    // Response to a counters query
+    if (data[0] == 0x00 && length >= 3 && data[1] == CMD_QUERY &&
+      data[2] == QUERY_COUNTERS) {
+        length -= 3;
+        if (length > sizeof(host.counters)) { length = sizeof(host.counters); }
+        memcpy(host.counters, &data[3], length);
+        host.countersLength = length;
+        host.counted = true;
+        return;
+    }
+
+    // Response to the capabilities query
+    if (data[0] == 0x00 && length >= 20 && data[1] == CMD_QUERY) {
+        host.caps = data[17];
+        host.queried = true;
+        return;
+    }
+
+    if (data[0] == ERROR_SESSION_FAILED && length >= 2 &&
+      data[1] == CMD_START_MESSAGE) {
+        host.refused = true;
+        return;
+    }
+
+    if (data[0] & 0x80) {
+        printf("[serial] error response: status=0x%02x cmd=0x%02x\n",
+          data[0], data[1]);
+        host.errors++;
+    }
+}
+
+// Reads from the device until %%done%% is set
+static void hostWait(volatile bool *done) {
+    while (!*done) {
+        struct pollfd pfd = { .fd = host.fd, .events = POLLIN };
+        if (poll(&pfd, 1, READ_TIMEOUT) <= 0) {
+            printf("[serial] timed out waiting for the device\n");
+            exit(1);
+        }
+
+        uint8_t data[4096];
+        ssize_t count = read(host.fd, data, sizeof(data));
+        if (count <= 0) { continue; }
+
+        fsp_serial_decode(&host.decoder, data, count, _hostFrame, NULL);
+    }
+}
+
+static void hostQuery() {
+    uint8_t query[] = {
+        CMD_QUERY, config.compressed ? CAPS_COMPRESSED: 0, 0
+    };
+    hostWrite(query, sizeof(query), NULL, 0);
+    hostWait(&host.queried);
+}
+
+// Queries the counters of the connection, returning the CBOR Map
+static FfxCborCursor hostCounters() {
+    uint8_t query[] = { CMD_QUERY, QUERY_COUNTERS };
+
+    host.counted = false;
+    hostWrite(query, sizeof(query), NULL, 0);
+    hostWait(&host.counted);
+
+    FfxCborCursor cursor;
+    ffx_cbor_init(&cursor, host.counters, host.countersLength);
+    return cursor;
+}
+
+// Returns the counter named %%name%%, or 0 if missing
+static uint64_t hostCounter(FfxCborCursor *counters, const char *name) {
+    FfxCborCursor cursor;
+    ffx_cbor_clone(&cursor, counters);
+
+    uint64_t value = 0;
+    if (ffx_cbor_followKey(&cursor, name)) { return 0; }
+    if (ffx_cbor_getValue(&cursor, &value)) { return 0; }
+    return value;
+}
+
+// Prints each counter, and how much it grew since the last call
+static void hostPrintCounters(FfxCborCursor *counters) {
+    FfxCborCursor cursor, key;
+    ffx_cbor_clone(&cursor, counters);
+
+    size_t index = 0;
+    FfxCborStatus status = ffx_cbor_firstValue(&cursor, &key);
+    while (status == FfxCborStatusOK) {
+        char name[32] = { 0 };
+        ffx_cbor_copyData(&key, (uint8_t*)name, sizeof(name) - 1);
+
+        uint64_t value = 0;
+        if (ffx_cbor_getType(&cursor) == FfxCborTypeNumber &&
+          index < 32) {
+            ffx_cbor_getValue(&cursor, &value);
+            printf("  %-14s %10" PRIu64 "  (+%" PRIu64 ")\n", name, value,
+              value - host.previous[index]);
+            host.previous[index] = value;
+
+        } else if (ffx_cbor_getType(&cursor) == FfxCborTypeArray) {
+            // The round-trip histogram; bucket i is under 8 << i ms
+            printf("  %-14s", name);
+
+            FfxCborCursor item;
+            ffx_cbor_clone(&item, &cursor);
+            FfxCborStatus itemStatus = ffx_cbor_firstValue(&item, NULL);
+            while (itemStatus == FfxCborStatusOK) {
+                ffx_cbor_getValue(&item, &value);
+                printf(" %" PRIu64, value);
+                itemStatus = ffx_cbor_nextValue(&item, NULL);
+            }
+            printf("\n");
+        }
+
+        index++;
+        status = ffx_cbor_nextValue(&cursor, &key);
+    }
+}
+
+// Sends a CMD_SESSION handshake and waits for its response, returning
+// the response payload (after the status and command)
+static const uint8_t* hostHandshake(const uint8_t *req, size_t length,
+  size_t expected) {
+
+    host.handshaken = false;
+    hostWrite(req, length, NULL, 0);
+    hostWait(&host.handshaken);
+
+    if (host.session[0] != 0x00 || host.sessionLength != 2 + expected) {
+        printf("[serial] handshake failed: status=0x%02x\n",
+          host.session[0]);
+        exit(1);
+    }
+
+    return &host.session[2];
+}
+
+// Establishes an encrypted session with a new ECDH key exchange
+static void hostSecure() {
+    uint8_t privkey[FFX_PRIVKEY_LENGTH];
+    uint8_t point[64];
+    do {
+        fillSecure(privkey, sizeof(privkey));
+    } while (!ffx_pk_computePubkeySecp256k1(privkey, point));
+
+    uint8_t req[2 + FSP_SECURE_PUBKEY_LENGTH + FSP_SECURE_NONCE_LENGTH];
+    req[0] = CMD_SESSION;
+    req[1] = SESSION_NEW;
+    ffx_pk_compressPubkeySecp256k1(point, &req[2]);
+
+    const uint8_t *hostNonce = &req[2 + FSP_SECURE_PUBKEY_LENGTH];
+    fillSecure((uint8_t*)hostNonce, FSP_SECURE_NONCE_LENGTH);
+
+    const uint8_t *resp = hostHandshake(req, sizeof(req),
+      FSP_SECURE_PUBKEY_LENGTH + FSP_SECURE_NONCE_LENGTH +
+      FSP_SECURE_TICKET_LENGTH + FSP_SECURE_SIGNATURE_LENGTH);
+
+    const uint8_t *deviceNonce = &resp[FSP_SECURE_PUBKEY_LENGTH];
+    const uint8_t *ticket = &deviceNonce[FSP_SECURE_NONCE_LENGTH];
+    const uint8_t *signature = &ticket[FSP_SECURE_TICKET_LENGTH];
+
+    // The device's ephemeral key must be signed by its session key
+    uint8_t digest[FSP_SECURE_DIGEST_LENGTH];
+    fsp_secure_computeTranscript(&req[2], hostNonce, resp, deviceNonce,
+      ticket, digest);
+
+    uint8_t deviceKey[64];
+    ffx_pk_decompressPubkeySecp256k1(config.deviceKey, deviceKey);
+    if (!ffx_pk_verifySecp256k1(deviceKey, digest, (uint8_t*)signature)) {
+        printf("[serial] handshake not signed by the device\n");
+        exit(1);
+    }
+
+    uint8_t devicePoint[64];
+    ffx_pk_decompressPubkeySecp256k1((uint8_t*)resp, devicePoint);
+
+    uint8_t secret[FFX_SHARED_SECRET_LENGTH];
+    if (!ffx_pk_isValidPubkeySecp256k1(devicePoint) ||
+      !ffx_pk_computeSharedSecretSecp256k1(privkey, devicePoint, secret)) {
+        printf("[serial] invalid device key\n");
+        exit(1);
+    }
+
+    fsp_secure_derive(&host.secure, secret, hostNonce, deviceNonce, true,
+      host.resumption);
+    memcpy(host.ticket, ticket, FSP_SECURE_TICKET_LENGTH);
+}
+
+// Resumes the encrypted session with the last ticket
+static void hostResume() {
+    uint8_t req[2 + FSP_SECURE_TICKET_LENGTH + FSP_SECURE_NONCE_LENGTH +
+      FSP_SECURE_BINDER_LENGTH];
+    req[0] = CMD_SESSION;
+    req[1] = SESSION_RESUME;
+
+    uint8_t *ticket = &req[2];
+    uint8_t *hostNonce = &ticket[FSP_SECURE_TICKET_LENGTH];
+    uint8_t *binder = &hostNonce[FSP_SECURE_NONCE_LENGTH];
+
+    memcpy(ticket, host.ticket, FSP_SECURE_TICKET_LENGTH);
+    fillSecure(hostNonce, FSP_SECURE_NONCE_LENGTH);
+    fsp_secure_computeBinder(host.resumption, ticket, hostNonce, binder);
+
+    const uint8_t *resp = hostHandshake(req, sizeof(req),
+      FSP_SECURE_NONCE_LENGTH + FSP_SECURE_TICKET_LENGTH);
+
+    uint8_t secret[FSP_SECURE_SECRET_LENGTH];
+    memcpy(secret, host.resumption, sizeof(secret));
+    fsp_secure_derive(&host.secure, secret, hostNonce, resp, true,
+      host.resumption);
+    memcpy(host.ticket, &resp[FSP_SECURE_NONCE_LENGTH],
+      FSP_SECURE_TICKET_LENGTH);
+}
+
+static void hostBuildMessage(const char *method, bool withData) {
+    static const FfxCborKey keyV = FFX_CBOR_KEY("v");
+    static const FfxCborKey keyId = FFX_CBOR_KEY("id");
+    static const FfxCborKey keyMethod = FFX_CBOR_KEY("method");
+    static const FfxCborKey keyParams = FFX_CBOR_KEY("params");
+
+    host.id++;
+
+    FfxCborBuilder builder;
+    ffx_cbor_build(&builder, &host.message[CHECKSUM_LENGTH],
+      sizeof(host.message) - CHECKSUM_LENGTH);
+    ffx_cbor_appendMap(&builder, 4);
+    ffx_cbor_appendKey(&builder, &keyV);
+    ffx_cbor_appendNumber(&builder, 1);
+    ffx_cbor_appendKey(&builder, &keyId);
+    ffx_cbor_appendNumber(&builder, host.id);
+    ffx_cbor_appendKey(&builder, &keyMethod);
+    ffx_cbor_appendString(&builder, (char*)method);
+    ffx_cbor_appendKey(&builder, &keyParams);
+    if (withData) {
+        ffx_cbor_appendArray(&builder, 1);
+        ffx_cbor_appendData(&builder, requestData, config.requestSize);
+    } else {
+        ffx_cbor_appendArray(&builder, 0);
+    }
+
+    size_t length = ffx_cbor_getBuildLength(&builder);
+
+    // The checksum covers the ciphertext and tag
+    if (host.secure.established) {
+        fsp_secure_seal(&host.secure, &host.message[CHECKSUM_LENGTH], length);
+        length += FSP_SECURE_TAG_LENGTH;
+    }
+
+    FfxSha256Context ctx;
+    ffx_hash_initSha256(&ctx);
+    ffx_hash_updateSha256(&ctx, &host.message[CHECKSUM_LENGTH], length);
+    ffx_hash_finalSha256(&ctx, host.message);
+
+    host.length = CHECKSUM_LENGTH + length;
+}
+
+// Sends the message as back-to-back chunks; the link has its own flow
+// control
+static void hostSendMessage() {
+    CompressEncoder encoder;
+    compress_initEncoder(&encoder);
+
+    size_t offset = 0;
+    while (offset < host.length) {
+        uint8_t header[3];
+        if (offset == 0) {
+            header[0] = CMD_START_MESSAGE;
+            header[1] = host.length >> 8;
+            header[2] = host.length & 0xff;
+        } else {
+            header[0] = CMD_CONTINUE_MESSAGE;
+            header[1] = offset >> 8;
+            header[2] = offset & 0xff;
+        }
+
+        size_t length = host.length - offset;
+        if (length > FSP_MAX_CHUNK_SIZE) { length = FSP_MAX_CHUNK_SIZE; }
+
+        // Ciphertext does not compress; it is only stored
+        if (host.caps & CAPS_COMPRESSED) {
+            uint8_t payload[FSP_MAX_CHUNK_SIZE];
+            size_t payloadLength;
+            if (host.secure.established) {
+                payloadLength = compress_store(host.message, offset,
+                  host.length, payload, FSP_MAX_CHUNK_SIZE, &length);
+            } else {
+                payloadLength = compress_encode(&encoder, host.message,
+                  offset, host.length, payload, FSP_MAX_CHUNK_SIZE, &length);
+            }
+            hostWrite(header, 3, payload, payloadLength);
+        } else {
+            hostWrite(header, 3, &host.message[offset], length);
+        }
+
+        offset += length;
+    }
+}
+
+// Sends the message and waits for its reply, returning the reply's
+// CBOR payload
+static FfxCborCursor hostTransact() {
+    host.replied = false;
+    host.partials = 0;
+    hostSendMessage();
+    hostWait(&host.replied);
+
+    FfxCborCursor cursor;
+    ffx_cbor_init(&cursor, &host.reply[CHECKSUM_LENGTH],
+      host.replyLength - CHECKSUM_LENGTH);
+    return cursor;
+}
+
+
+///////////////////////////////
+// Known answers; the crypto against the RFCs' test vectors
+
+static size_t fromHex(const char *hex, uint8_t *output) {
+    size_t length = strlen(hex) / 2;
+    for (size_t i = 0; i < length; i++) {
+        unsigned int byte;
+        sscanf(&hex[2 * i], "%2x", &byte);
+        output[i] = byte;
+    }
+    return length;
+}
+
+static bool checkBytes(const char *name, const uint8_t *data,
+  const char *expected) {
+
+    uint8_t want[256];
+    size_t length = fromHex(expected, want);
+    if (memcmp(data, want, length) == 0) { return true; }
+
+    printf("[serial] %s does not match the test vector\n", name);
+    return false;
+}
+
+// RFC 8439, section 2.8.2
+static bool checkAead() {
+    static const char plaintext[] = "Ladies and Gentlemen of the class "
+      "of '99: If I could offer you only one tip for the future, "
+      "sunscreen would be it.";
+
+    uint8_t key[AEAD_KEY_LENGTH], nonce[AEAD_NONCE_LENGTH], aad[12];
+    for (int i = 0; i < AEAD_KEY_LENGTH; i++) { key[i] = 0x80 + i; }
+    fromHex("070000004041424344454647", nonce);
+    fromHex("50515253c0c1c2c3c4c5c6c7", aad);
+
+    size_t length = strlen(plaintext);
+    uint8_t data[128], tag[AEAD_TAG_LENGTH];
+    memcpy(data, plaintext, length);
+
+    aead_seal(key, nonce, aad, sizeof(aad), data, length, tag);
+    if (!checkBytes("ChaCha20-Poly1305 ciphertext", data,
+      "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+      "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+      "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+      "3ff4def08e4b7a9de576d26586cec64b6116")) { return false; }
+    if (!checkBytes("ChaCha20-Poly1305 tag", tag,
+      "1ae10b594f09e26a7e902ecbd0600691")) { return false; }
+
+    if (!aead_open(key, nonce, aad, sizeof(aad), data, length, tag) ||
+      memcmp(data, plaintext, length)) {
+        printf("[serial] ChaCha20-Poly1305 test vector did not open\n");
+        return false;
+    }
+
+    tag[0] ^= 1;
+    if (aead_open(key, nonce, aad, sizeof(aad), data, length, tag)) {
+        printf("[serial] ChaCha20-Poly1305 opened a forged tag\n");
+        return false;
+    }
+
+    return true;
+}
+
+// RFC 5869, test cases 1 and 3 (no salt or info)
+static bool checkHkdf() {
+    uint8_t ikm[22], salt[13], info[10], okm[42];
+    memset(ikm, 0x0b, sizeof(ikm));
+    for (int i = 0; i < sizeof(salt); i++) { salt[i] = i; }
+    for (int i = 0; i < sizeof(info); i++) { info[i] = 0xf0 + i; }
+
+    fsp_secure_hkdf(salt, sizeof(salt), ikm, sizeof(ikm), info,
+      sizeof(info), okm, sizeof(okm));
+    if (!checkBytes("HKDF (test case 1)", okm,
+      "3cb25f25faacd57a90434f64d0362f2a2d2d0a90cf1a5a4c5db02d56ecc4c5bf"
+      "34007208d5b887185865")) { return false; }
+
+    fsp_secure_hkdf(NULL, 0, ikm, sizeof(ikm), NULL, 0, okm, sizeof(okm));
+    if (!checkBytes("HKDF (test case 3)", okm,
+      "8da4e775a563c18f715f802a063c5a31b8a11f5c5ee1879ec3454e5f3c738d2d"
+      "9d201395faa4b61a96c8")) { return false; }
+
+    return true;
+}
+
+static int runSelftest() {
+    if (!checkAead() || !checkHkdf()) { return 1; }
+    printf("[serial] ChaCha20-Poly1305 and HKDF match the test vectors\n");
+    return 0;
+}
+
+
+///////////////////////////////
+// Command line
+
+// Round-trips count messages through the FSP module over a pty pair,
+// checking each message event and reply
+static int runLoopback() {
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) || unlockpt(master)) {
+        printf("[serial] failed to open pty: %s\n", strerror(errno));
+        return 1;
+    }
+
+    int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        printf("[serial] failed to open %s: %s\n", ptsname(master),
+          strerror(errno));
+        return 1;
+    }
+    makeRaw(slave);
+
+    // The device holds the pty master; the host the terminal, as it
+    // would a USB serial port
+    device.fd = master;
+    host.fd = slave;
+
+    fillPayload(requestData, config.requestSize, config.text);
+    fillPayload(replyData, config.replySize, config.text);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, deviceThread, NULL);
+
+    fsp_serial_initDecoder(&host.decoder);
+    hostQuery();
+
+    uint64_t handshake = 0, resume = 0;
+    if (config.secure) {
+        uint8_t point[64];
+        ffx_pk_computePubkeySecp256k1(sessionKey, point);
+        ffx_pk_compressPubkeySecp256k1(point, config.deviceKey);
+
+        // Plaintext is refused, rather than accepted for lack of a
+        // session
+        host.refused = false;
+        hostBuildMessage("bench", false);
+        hostSendMessage();
+        hostWait(&host.refused);
+
+        // It never reached the panels (or took a message id)
+        host.id--;
+
+        uint64_t start = nowMicros();
+        hostSecure();
+        handshake = nowMicros() - start;
+    }
+
+    uint64_t start = nowMicros();
+    size_t bytes = 0;
+
+    for (uint32_t i = 0; i < config.count; i++) {
+
+        // Halfway, as a reconnecting host would
+        if (config.secure && i == config.count / 2) {
+            uint64_t start = nowMicros();
+            hostResume();
+            resume = nowMicros() - start;
+        }
+
+        hostBuildMessage("bench", true);
+        FfxCborCursor cursor = hostTransact();
+
+        if (device.eventId != host.id ||
+          strcmp(device.eventMethod, "bench") || !device.eventMatched) {
+            printf("[serial] message event mismatch: id=%d method=%s\n",
+              device.eventId, device.eventMethod);
+            return 1;
+        }
+
+        uint64_t id = 0;
+        FfxCborCursor idCursor;
+        ffx_cbor_clone(&idCursor, &cursor);
+        ffx_cbor_followKey(&idCursor, "id");
+        ffx_cbor_getValue(&idCursor, &id);
+
+        uint8_t *result = NULL;
+        size_t resultLength = 0;
+        ffx_cbor_followKey(&cursor, "result");
+        ffx_cbor_getData(&cursor, &result, &resultLength);
+
+        if (id != host.id || resultLength != config.replySize ||
+          memcmp(result, replyData, resultLength)) {
+            printf("[serial] reply mismatch: id=%" PRIu64 " length=%zu\n", id,
+              resultLength);
+            return 1;
+        }
+
+        if (host.partials != config.partials) {
+            printf("[serial] partial replies mismatch: %d of %d\n",
+              host.partials, config.partials);
+            return 1;
+        }
+
+        bytes += host.length + (host.partials + 1) * host.replyLength;
+    }
+
+    double seconds = (nowMicros() - start) / 1000000.0;
+
+    // Every message was verified once, and none failed
+    if (config.counters) {
+        FfxCborCursor counters = hostCounters();
+        hostPrintCounters(&counters);
+
+        if (hostCounter(&counters, "processed") != config.count ||
+          hostCounter(&counters, "badChecksums") ||
+          hostCounter(&counters, "framesIn") == 0) {
+            printf("[serial] counters mismatch\n");
+            host.errors++;
+        }
+    }
+
+    device.stop = true;
+    pthread_join(thread, NULL);
+
+    printf("%d messages in %.3fs; %.0f bytes/s, %d dropped frames, "
+      "%d errors\n", config.count, seconds, bytes / seconds,
+      device.decoder.dropped + host.decoder.dropped, host.errors);
+
+    if (config.secure) {
+        printf("encrypted; handshake %.1fms, resume %.1fms\n",
+          handshake / 1000.0, resume / 1000.0);
+    }
+
+    return host.errors ? 1: 0;
+}
+
+// Sends a single request to a device and dumps its reply
+static int runPort() {
+    host.fd = open(config.port, O_RDWR | O_NOCTTY);
+    if (host.fd < 0) {
+        printf("[serial] failed to open %s: %s\n", config.port,
+          strerror(errno));
+        return 1;
+    }
+    makeRaw(host.fd);
+    fsp_serial_initDecoder(&host.decoder);
+
+    hostQuery();
+
+    // Poll the counters until interrupted
+    if (config.interval) {
+        while (1) {
+            FfxCborCursor counters = hostCounters();
+            printf("counters:\n");
+            hostPrintCounters(&counters);
+            usleep(config.interval * 1000);
+        }
+    }
+
+    if (config.secure) {
+        if (!config.hasDeviceKey) {
+            printf("[serial] --secure needs the device's --device-key\n");
+            return 1;
+        }
+        hostSecure();
+    }
+
+    hostBuildMessage(config.method, false);
+    FfxCborCursor cursor = hostTransact();
+    ffx_cbor_dump(&cursor);
+
+    return 0;
+}
+
+static void usage() {
+    printf("Usage: fsp-serial [options]\n"
+      "\n"
+      "  --selftest           check the crypto against the RFC test\n"
+      "                       vectors\n"
+      "  --port=PATH          serial port of a device; otherwise run the\n"
+      "                       FSP module over a pty (loopback)\n"
+      "  --method=NAME        method to send to the device (default: ping)\n"
+      "  --compressed         negotiate CAPS_COMPRESSED\n"
+      "  --secure             encrypt messages (and resume the session\n"
+      "                       halfway through the loopback)\n"
+      "  --device-key=HEX     the device's session key (compressed),\n"
+      "                       which must sign the handshake\n"
+      "  --noise              write console text between frames\n"
+      "  --request=N          loopback request payload bytes (default: 256)\n"
+      "  --reply=N            loopback reply payload bytes (default: 8192)\n"
+      "  --count=N            loopback messages (default: 100)\n"
+      "  --text               compressible payloads\n"
+      "  --seed=N             random seed (default: 1)\n"
+      "  --counters[=MS]      print the transport counters after the\n"
+      "                       loopback, or poll a device every MS ms\n"
+      "  --partials=N         loopback partial replies before each reply\n"
+      "                       (default: 0)\n");
+}
+
+static bool parseOption(const char *arg) {
+    const char *value = strchr(arg, '=');
+    value = value ? value + 1: "";
+
+    #define OPTION(name)    (strncmp(arg, name, strlen(name)) == 0)
+
+    if (OPTION("--selftest")) {
+        config.selftest = true;
+    } else if (OPTION("--port=")) {
+        config.port = value;
+    } else if (OPTION("--method=")) {
+        config.method = value;
+    } else if (OPTION("--compressed")) {
+        config.compressed = true;
+    } else if (OPTION("--secure")) {
+        config.secure = true;
+    } else if (OPTION("--device-key=")) {
+        if (strlen(value) != 2 * FSP_SECURE_PUBKEY_LENGTH) { return false; }
+        for (int i = 0; i < FSP_SECURE_PUBKEY_LENGTH; i++) {
+            unsigned int byte;
+            if (sscanf(&value[2 * i], "%2x", &byte) != 1) { return false; }
+            config.deviceKey[i] = byte;
+        }
+        config.hasDeviceKey = true;
+    } else if (OPTION("--noise")) {
+        config.noise = true;
+    } else if (OPTION("--request=")) {
+        config.requestSize = atoi(value);
+    } else if (OPTION("--reply=")) {
+        config.replySize = atoi(value);
+    } else if (OPTION("--count=")) {
+        config.count = atoi(value);
+    } else if (OPTION("--text")) {
+        config.text = true;
+    } else if (OPTION("--seed=")) {
+        config.seed = atoi(value);
+    } else if (OPTION("--partials=")) {
+        config.partials = atoi(value);
+    } else if (OPTION("--counters")) {
+        config.counters = true;
+        config.interval = atoi(value);
+    } else {
+        return false;
+    }
+
+    #undef OPTION
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    config = (Config){
+        .method = "ping",
+        .requestSize = 256,
+        .replySize = 8192,
+        .count = 100,
+        .seed = 1,
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (!parseOption(argv[i])) {
+            usage();
+            return 1;
+        }
+    }
+
+    if (config.requestSize > MAX_MESSAGE_SIZE - 256 ||
+      config.replySize > MAX_MESSAGE_SIZE - 256) {
+        printf("request and reply must be at most %d bytes\n",
+          MAX_MESSAGE_SIZE - 256);
+        return 1;
+    }
+
+    if (config.selftest) { return runSelftest(); }
+    if (config.port) { return runPort(); }
+    return runLoopback();
+}
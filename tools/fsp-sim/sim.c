@@ -0,0 +1,1396 @@
+// FSP transport simulator
+//
+// Runs the firmware's FSP module (main/fsp.c) against a host client over
+// a simulated BLE link, reporting the effective throughput and latency
+// of each transfer scheme. See README.md.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "firefly-cbor.h"
+#include "firefly-hash.h"
+
+#include "compress.h"
+#include "fsp.h"
+#include "link-policy.h"
+
+
+#define CMD_QUERY                   (0x03)
+#define CMD_RESET                   (0x02)
+#define CMD_START_MESSAGE           (0x06)
+#define CMD_CONTINUE_MESSAGE        (0x07)
+#define CMD_ACK                     (0x08)
+
+#define QUERY_STATE_RECEIVING       (0x01)
+#define QUERY_STATE_PROCESSING      (0x02)
+#define QUERY_STATE_SENDING         (0x03)
+
+#define CAPS_WINDOWED               (1 << 0)
+#define CAPS_COMPRESSED             (1 << 1)
+
+#define CHECKSUM_LENGTH             (32)
+
+// ATT opcode and handle
+#define ATT_HEADER                  (3)
+
+// L2CAP basic header, and the SDU length of the first K-frame
+#define L2CAP_HEADER                (4)
+#define SDU_HEADER                  (2)
+
+// Bytes of an L2CAP signaling packet (LE Flow Control Credit)
+#define CREDIT_PACKET               (12)
+
+// LL packet overhead on air (preamble, access address, header, MIC
+// and CRC), and the time of the inter-frame spaces and the empty
+// packet answering each data packet
+#define LL_OVERHEAD                 (14)
+#define LL_TURNAROUND               (2 * 150 + 80)
+
+#define MAX_FRAMES                  (64)
+#define MAX_EVENTS                  (32)
+#define MAX_SAMPLES                 (1024)
+
+// Give up on a transfer after this much simulated time (us)
+#define STALL_LIMIT                 (60 * 1000000ULL)
+
+// Connection events until a PHY, data length or connection parameter
+// update takes effect (the procedure's instant)
+#define LINK_PROCEDURE_EVENTS       (6)
+
+
+typedef enum Scheme {
+    // One chunk per indication, each waiting for its confirmation
+    SchemeIndicate = 0,
+
+    // Notifications, paced by CMD_ACK credits (CAPS_WINDOWED)
+    SchemeWindowed,
+
+    // SDUs on an L2CAP channel, paced by channel credits
+    SchemeL2cap,
+} Scheme;
+
+static const char* schemeNames[] = { "indicate", "windowed", "l2cap" };
+
+typedef struct Config {
+    Scheme scheme;
+    bool compressed;
+
+    // ATT MTU, L2CAP channel MTU and MPS, and the K-frame credits the
+    // host initially grants the device
+    size_t mtu;
+    size_t l2capMtu;
+    size_t mps;
+    uint32_t credits;
+
+    // LL data length (27 to 251), PHY (1 or 2 Mbps), connection
+    // interval (us) and the maximum packets per direction in each
+    // connection event
+    size_t dataLength;
+    uint32_t phy;
+    uint32_t interval;
+    uint32_t packets;
+
+    // Probability each LL packet is lost (and retransmitted in the
+    // next connection event)
+    double loss;
+
+    // How long (us) a stack takes to acknowledge; a write response,
+    // an indication confirmation, returned credits or a CMD_ACK
+    uint32_t ackLatency;
+
+    // How long (us) the panel takes to reply
+    uint32_t processTime;
+
+    uint8_t window;
+
+    size_t requestSize;
+    size_t replySize;
+    int count;
+
+    // Fill payloads with text (compressible) rather than noise
+    bool text;
+
+    // How often (us) the link drops (0 for never), and how long until
+    // the host reconnects and resumes its session
+    uint32_t drop;
+    uint32_t reconnect;
+
+    // Run the link policy (main/link-policy.c), which updates the PHY,
+    // data length and connection parameters (starting from the above)
+    bool policy;
+
+    // How long (us) the host waits between messages
+    uint32_t idle;
+
+    uint32_t seed;
+} Config;
+
+typedef enum FrameKind {
+    // An FSP frame; a write, indication, notification or SDU
+    FrameKindCommand = 0,
+
+    // ATT Write Response
+    FrameKindWriteResponse,
+
+    // ATT Handle Value Confirmation
+    FrameKindConfirm,
+
+    // L2CAP LE Flow Control Credit
+    FrameKindCredits,
+} FrameKind;
+
+typedef struct Frame {
+    FrameKind kind;
+
+    // An indication, which the host must confirm
+    bool indicate;
+
+    uint32_t credits;
+
+    // Earliest time it may be sent (the stack's latency)
+    uint64_t ready;
+
+    // LL packets needed, and already sent
+    uint32_t packets;
+    uint32_t sent;
+
+    size_t length;
+    uint8_t data[FSP_MAX_FRAME];
+} Frame;
+
+typedef struct FrameQueue {
+    Frame frames[MAX_FRAMES];
+    size_t head;
+    size_t count;
+} FrameQueue;
+
+typedef enum EventType {
+    EventTypePoll = 0,
+    EventTypeWorker,
+    EventTypePanel,
+    EventTypeDrop,
+    EventTypeReconnect,
+    EventTypeLink,
+    EventTypeHost,
+} EventType;
+
+typedef struct Event {
+    bool active;
+    EventType type;
+    uint64_t time;
+
+    FspConnection *conn;
+    FspRequest *request;
+    uint32_t id;
+} Event;
+
+typedef struct Host {
+    bool ready;
+
+    // The session to resume after the link drops
+    uint32_t session;
+
+    // A message is in flight (from its upload until its reply is
+    // complete)
+    bool active;
+
+    // Waiting to start the next message
+    bool waiting;
+
+    // A write (or SDU) is awaiting its response (or credit)
+    bool writing;
+
+    // The message being uploaded
+    uint8_t message[MAX_MESSAGE_SIZE + 64];
+    size_t length;
+    size_t offset;
+    uint64_t started;
+    CompressEncoder encoder;
+
+    // The reply being downloaded
+    uint8_t reply[MAX_MESSAGE_SIZE + FSP_CBOR_HEADER];
+    size_t replyLength;
+    size_t received;
+    bool replying;
+
+    // Windowed; credits owed to the device
+    uint32_t owed;
+
+    int completed;
+    size_t bytes;
+    uint64_t latencies[MAX_SAMPLES];
+} Host;
+
+typedef struct Sim {
+    Config config;
+    uint64_t now;
+
+    FrameQueue toHost;
+    FrameQueue toDevice;
+
+    // L2CAP; the device's credits, and an SDU held for lack of them
+    uint32_t deviceCredits;
+    Frame held;
+    bool holding;
+
+    Event events[MAX_EVENTS];
+    uint64_t nextConnectionEvent;
+
+    FspConnection *conn;
+    FspConnection *detached;
+    bool connected;
+    Host host;
+
+    // The link policy, and the parameters of its pending update
+    LinkPolicy link;
+    LinkParams linkParams;
+
+    // Peripheral latency; with nothing to send, the device only
+    // listens every latency + 1 connection events
+    uint32_t latency;
+    uint64_t connectionEvents;
+    uint64_t radioEvents;
+
+    uint32_t seed;
+    uint32_t lost;
+    uint32_t errors;
+    uint32_t drops;
+    uint32_t resumes;
+} Sim;
+
+static Sim sim;
+
+static uint8_t replyData[MAX_MESSAGE_SIZE];
+
+
+///////////////////////////////
+// Utilities
+
+static uint32_t nextRandom() {
+    // xorshift32; deterministic for a given seed
+    uint32_t x = sim.seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim.seed = x;
+    return x;
+}
+
+static void fillPayload(uint8_t *data, size_t length, bool text) {
+    static const char *words[] = {
+        "firefly ", "transfer ", "message ", "signature ", "address ",
+        "0x00000000 ", "value ", "nonce ", "chain ", "\"params\": ",
+    };
+
+    if (!text) {
+        for (size_t i = 0; i < length; i++) { data[i] = nextRandom(); }
+        return;
+    }
+
+    size_t offset = 0;
+    while (offset < length) {
+        const char *word = words[nextRandom() % 10];
+        for (size_t i = 0; word[i] && offset < length; i++) {
+            data[offset++] = word[i];
+        }
+    }
+}
+
+static size_t divideCeil(size_t a, size_t b) {
+    return (a + b - 1) / b;
+}
+
+// LL packets needed to carry an L2CAP payload of %%length%% bytes
+static uint32_t llPackets(size_t length) {
+    return divideCeil(length, sim.config.dataLength);
+}
+
+// K-frames (and channel credits) needed for an SDU
+static uint32_t sduCredits(size_t length) {
+    return divideCeil(length + SDU_HEADER, sim.config.mps);
+}
+
+static uint32_t framePackets(Frame *frame) {
+    switch (frame->kind) {
+        case FrameKindCommand:
+            if (sim.config.scheme == SchemeL2cap) {
+                size_t credits = sduCredits(frame->length);
+                size_t length = frame->length + SDU_HEADER;
+                return llPackets(length + credits * L2CAP_HEADER);
+            }
+            return llPackets(frame->length + ATT_HEADER + L2CAP_HEADER);
+        case FrameKindWriteResponse:
+        case FrameKindConfirm:
+            return 1;
+        case FrameKindCredits:
+            return llPackets(CREDIT_PACKET);
+    }
+    return 1;
+}
+
+static bool pushFrame(FrameQueue *queue, FrameKind kind,
+  const uint8_t *header, size_t headerLength, const uint8_t *payload,
+  size_t payloadLength, uint64_t ready) {
+
+    if (queue->count == MAX_FRAMES) { return false; }
+
+    Frame *frame = &queue->frames[(queue->head + queue->count) % MAX_FRAMES];
+    frame->kind = kind;
+    frame->indicate = false;
+    frame->credits = 0;
+    frame->ready = ready;
+    frame->sent = 0;
+
+    if (header) { memcpy(frame->data, header, headerLength); }
+    if (payload) { memcpy(&frame->data[headerLength], payload, payloadLength); }
+    frame->length = headerLength + payloadLength;
+
+    frame->packets = framePackets(frame);
+
+    queue->count++;
+    return true;
+}
+
+static Frame* lastFrame(FrameQueue *queue) {
+    return &queue->frames[(queue->head + queue->count - 1) % MAX_FRAMES];
+}
+
+
+///////////////////////////////
+// Events
+
+static void schedule(EventType type, uint64_t time, FspConnection *conn,
+  FspRequest *request, uint32_t id) {
+
+    for (int i = 0; i < MAX_EVENTS; i++) {
+        Event *event = &sim.events[i];
+        if (event->active) { continue; }
+
+        event->active = true;
+        event->type = type;
+        event->time = time;
+        event->conn = conn;
+        event->request = request;
+        event->id = id;
+        return;
+    }
+
+    printf("[sim] too many events\n");
+    exit(1);
+}
+
+// Polls are coalesced; only the earliest is kept
+static void schedulePoll(uint64_t time) {
+    for (int i = 0; i < MAX_EVENTS; i++) {
+        Event *event = &sim.events[i];
+        if (!event->active || event->type != EventTypePoll) { continue; }
+        if (event->time > time) { event->time = time; }
+        return;
+    }
+    schedule(EventTypePoll, time, NULL, NULL, 0);
+}
+
+static Event* nextEvent() {
+    Event *next = NULL;
+    for (int i = 0; i < MAX_EVENTS; i++) {
+        Event *event = &sim.events[i];
+        if (!event->active) { continue; }
+        if (next == NULL || event->time < next->time) { next = event; }
+    }
+    return next;
+}
+
+
+///////////////////////////////
+// Device; the FSP module under test
+
+static uint32_t _now() {
+    return sim.now / 1000;
+}
+
+static void _process(FspConnection *conn, FspRequest *request) {
+    schedule(EventTypeWorker, sim.now, conn, request, 0);
+}
+
+static void _wake() {
+    schedulePoll(sim.now);
+}
+
+// The panel accepts the request as soon as it is given it (as its event
+// loop would), then replies once it has processed it
+static bool _emit(uint32_t id, const char *method, FfxCborCursor *params) {
+    if (!fsp_acceptMessage(id, NULL)) {
+        printf("[sim] accept failed: id=%d\n", id);
+        exit(1);
+    }
+
+    schedule(EventTypePanel, sim.now + sim.config.processTime, NULL, NULL,
+      id);
+
+    return true;
+}
+
+static const FspPlatform platform = {
+    .modelNumber = 1,
+    .serialNumber = 1,
+    .now = _now,
+    .process = _process,
+    .wake = _wake,
+    .emit = _emit
+};
+
+// Replies to a request with replySize bytes, as a panel would
+static void runPanel(uint32_t id) {
+    FfxCborBuilder result;
+    fsp_buildReply(id, &result);
+    ffx_cbor_appendDataRef(&result, replyData, sim.config.replySize);
+
+    if (!fsp_sendReply(id, &result)) {
+        printf("[sim] reply failed: id=%d\n", id);
+        exit(1);
+    }
+}
+
+static int _send(FspConnection *conn, const uint8_t *header,
+  size_t headerLength, const uint8_t *payload, size_t payloadLength,
+  bool confirm) {
+
+    bool l2cap = (sim.config.scheme == SchemeL2cap);
+
+    if (sim.config.policy) { link_activity(&sim.link, _now()); }
+
+    // The stack holds one SDU while the channel is stalled
+    if (l2cap && conn->stalled) { return -1; }
+
+    if (!pushFrame(&sim.toHost, FrameKindCommand, header, headerLength,
+      payload, payloadLength, sim.now)) {
+        return -1;
+    }
+
+    Frame *frame = lastFrame(&sim.toHost);
+    frame->indicate = (confirm && !l2cap);
+
+    if (l2cap) {
+        uint32_t credits = sduCredits(frame->length);
+        if (credits > sim.deviceCredits) {
+            // Accepted, but held until the host grants credits
+            sim.held = *frame;
+            sim.holding = true;
+            sim.toHost.count--;
+            conn->stalled = true;
+        } else {
+            sim.deviceCredits -= credits;
+        }
+    }
+
+    return 0;
+}
+
+static const FspTransport transport = {
+    .name = "sim",
+    .send = _send
+};
+
+static void deviceReceive(Frame *frame) {
+    switch (frame->kind) {
+        case FrameKindCommand:
+            if (sim.config.policy && link_activity(&sim.link, _now())) {
+                schedulePoll(sim.now);
+            }
+
+            sim.conn = fsp_receive(sim.conn, frame->data, frame->length);
+
+            // A write response, or the channel credit for the next SDU
+            if (sim.config.scheme == SchemeL2cap) {
+                pushFrame(&sim.toHost, FrameKindCredits, NULL, 0, NULL, 0,
+                  sim.now + sim.config.ackLatency);
+                lastFrame(&sim.toHost)->credits = 1;
+            } else {
+                pushFrame(&sim.toHost, FrameKindWriteResponse, NULL, 0,
+                  NULL, 0, sim.now + sim.config.ackLatency);
+            }
+            break;
+
+        case FrameKindConfirm:
+            fsp_confirm(sim.conn);
+            fsp_wake();
+            break;
+
+        case FrameKindCredits:
+            sim.deviceCredits += frame->credits;
+
+            if (sim.holding) {
+                uint32_t credits = sduCredits(sim.held.length);
+                if (credits > sim.deviceCredits) { break; }
+
+                sim.deviceCredits -= credits;
+                Frame *queued = &sim.toHost.frames[(sim.toHost.head +
+                  sim.toHost.count) % MAX_FRAMES];
+                *queued = sim.held;
+                queued->ready = sim.now;
+                sim.toHost.count++;
+                sim.holding = false;
+
+                sim.conn->stalled = false;
+                fsp_wake();
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+///////////////////////////////
+// Host; a minimal FSP client
+
+static size_t hostChunkSize() {
+    if (sim.config.scheme == SchemeL2cap) { return sim.config.l2capMtu - 3; }
+    return sim.config.mtu - ATT_HEADER - 3;
+}
+
+static void hostWrite(const uint8_t *header, size_t headerLength,
+  const uint8_t *payload, size_t payloadLength, uint64_t ready) {
+
+    if (!pushFrame(&sim.toDevice, FrameKindCommand, header, headerLength,
+      payload, payloadLength, ready)) {
+        printf("[sim] host queue full\n");
+        exit(1);
+    }
+    sim.host.writing = true;
+}
+
+static void hostBuildMessage() {
+    Host *host = &sim.host;
+
+    static const FfxCborKey keyV = FFX_CBOR_KEY("v");
+    static const FfxCborKey keyId = FFX_CBOR_KEY("id");
+    static const FfxCborKey keyMethod = FFX_CBOR_KEY("method");
+    static const FfxCborKey keyParams = FFX_CBOR_KEY("params");
+
+    static uint8_t payload[MAX_MESSAGE_SIZE];
+    fillPayload(payload, sim.config.requestSize, sim.config.text);
+
+    FfxCborBuilder builder;
+    ffx_cbor_build(&builder, &host->message[CHECKSUM_LENGTH],
+      sizeof(host->message) - CHECKSUM_LENGTH);
+    ffx_cbor_appendMap(&builder, 4);
+    ffx_cbor_appendKey(&builder, &keyV);
+    ffx_cbor_appendNumber(&builder, 1);
+    ffx_cbor_appendKey(&builder, &keyId);
+    ffx_cbor_appendNumber(&builder, host->completed + 1);
+    ffx_cbor_appendKey(&builder, &keyMethod);
+    ffx_cbor_appendString(&builder, "bench");
+    ffx_cbor_appendKey(&builder, &keyParams);
+    ffx_cbor_appendArray(&builder, 1);
+    ffx_cbor_appendData(&builder, payload, sim.config.requestSize);
+
+    size_t length = ffx_cbor_getBuildLength(&builder);
+
+    FfxSha256Context ctx;
+    ffx_hash_initSha256(&ctx);
+    ffx_hash_updateSha256(&ctx, &host->message[CHECKSUM_LENGTH], length);
+    ffx_hash_finalSha256(&ctx, host->message);
+
+    host->length = CHECKSUM_LENGTH + length;
+    host->offset = 0;
+    host->started = sim.now;
+    host->active = true;
+    host->replying = false;
+}
+
+// Sends the next chunk of the message, if any
+static void hostSendChunk() {
+    Host *host = &sim.host;
+    if (host->offset == host->length) { return; }
+
+    size_t chunkSize = hostChunkSize();
+
+    uint8_t header[3];
+    if (host->offset == 0) {
+        header[0] = CMD_START_MESSAGE;
+        header[1] = host->length >> 8;
+        header[2] = host->length & 0xff;
+    } else {
+        header[0] = CMD_CONTINUE_MESSAGE;
+        header[1] = host->offset >> 8;
+        header[2] = host->offset & 0xff;
+    }
+
+    size_t length = host->length - host->offset;
+    if (length > chunkSize) { length = chunkSize; }
+
+    if (sim.config.compressed) {
+        uint8_t payload[FSP_MAX_CHUNK_SIZE];
+        size_t payloadLength = compress_encode(&host->encoder, host->message,
+          host->offset, host->length, payload, chunkSize, &length);
+        hostWrite(header, 3, payload, payloadLength, sim.now);
+    } else {
+        hostWrite(header, 3, &host->message[host->offset], length, sim.now);
+    }
+
+    host->offset += length;
+}
+
+static void hostSendAck() {
+    Host *host = &sim.host;
+
+    uint32_t credits = host->owed;
+    if (credits > 0xff) { credits = 0xff; }
+
+    uint8_t ack[] = {
+        CMD_ACK, host->received >> 8, host->received & 0xff, credits
+    };
+    hostWrite(ack, sizeof(ack), NULL, 0, sim.now + sim.config.ackLatency);
+
+    host->owed -= credits;
+}
+
+// The host may write again; acks go first, then the upload
+static void hostNext() {
+    Host *host = &sim.host;
+    if (host->writing || !host->ready) { return; }
+
+    if (host->owed) {
+        hostSendAck();
+        return;
+    }
+
+    hostSendChunk();
+}
+
+static void hostStartMessage() {
+    if (sim.host.completed == sim.config.count) { return; }
+    hostBuildMessage();
+    hostNext();
+}
+
+// The next message starts after the idle time (if any)
+static void hostFinishMessage() {
+    if (sim.config.idle == 0) {
+        hostStartMessage();
+        return;
+    }
+
+    sim.host.waiting = true;
+    schedule(EventTypeHost, sim.now + sim.config.idle, NULL, NULL, 0);
+}
+
+static void hostWake() {
+    Host *host = &sim.host;
+    host->waiting = false;
+
+    // Otherwise it starts once reconnected
+    if (host->ready) { hostStartMessage(); }
+}
+
+static void hostCompleteReply() {
+    Host *host = &sim.host;
+
+    uint8_t checksum[32];
+    FfxSha256Context ctx;
+    ffx_hash_initSha256(&ctx);
+    ffx_hash_updateSha256(&ctx, &host->reply[CHECKSUM_LENGTH],
+      host->replyLength - CHECKSUM_LENGTH);
+    ffx_hash_finalSha256(&ctx, checksum);
+
+    if (memcmp(checksum, host->reply, 32)) {
+        printf("[sim] bad reply checksum\n");
+        exit(1);
+    }
+
+    if (host->completed < MAX_SAMPLES) {
+        host->latencies[host->completed] = sim.now - host->started;
+    }
+    host->bytes += host->length + host->replyLength;
+    host->completed++;
+    host->replying = false;
+    host->active = false;
+
+    hostFinishMessage();
+}
+
+// Negotiates capabilities, offering the session to resume (if any)
+static void hostQuery() {
+    Host *host = &sim.host;
+
+    uint8_t caps = 0;
+    if (sim.config.scheme == SchemeWindowed) { caps |= CAPS_WINDOWED; }
+    if (sim.config.compressed) { caps |= CAPS_COMPRESSED; }
+
+    uint8_t query[] = {
+        CMD_QUERY, caps, sim.config.window,
+        host->session >> 24, host->session >> 16, host->session >> 8,
+        host->session
+    };
+    hostWrite(query, sizeof(query), NULL, 0, sim.now);
+}
+
+// Picks up where the last connection left off if the device resumed
+// the session, otherwise starts the message in flight over
+static void hostQueried(const uint8_t *data) {
+    Host *host = &sim.host;
+    if (host->ready) { return; }
+    host->ready = true;
+
+    size_t offset = (data[4] << 8) | data[5];
+    size_t length = (data[6] << 8) | data[7];
+    uint32_t session = (data[21] << 24) | (data[22] << 16) |
+      (data[23] << 8) | data[24];
+    uint8_t state = data[25];
+
+    bool resumed = (host->session == session);
+    host->session = session;
+
+    if (!resumed) {
+        host->offset = 0;
+        host->replying = false;
+        state = 0;
+    } else {
+        sim.resumes++;
+    }
+
+    switch (state) {
+        case QUERY_STATE_RECEIVING:
+            host->offset = offset;
+            host->replying = false;
+            break;
+
+        case QUERY_STATE_PROCESSING:
+            host->offset = host->length;
+            break;
+
+        case QUERY_STATE_SENDING: {
+            // Continue the reply from the contiguous bytes received; a
+            // reply already complete only needs finishing
+            size_t received = length;
+            if (host->active) {
+                received = host->replying ? host->received: 0;
+            }
+            host->offset = host->length;
+
+            uint8_t resume[] = {
+                CMD_CONTINUE_MESSAGE, received >> 8, received & 0xff
+            };
+            hostWrite(resume, sizeof(resume), NULL, 0, sim.now);
+            break;
+        }
+    }
+
+    if (host->active) {
+        hostNext();
+    } else if (!host->waiting) {
+        hostStartMessage();
+    }
+}
+
+static void hostReceiveChunk(const uint8_t *data, size_t length) {
+    Host *host = &sim.host;
+
+    uint8_t cmd = data[0];
+    size_t value = (data[1] << 8) | data[2];
+
+    if (cmd == CMD_START_MESSAGE) {
+        host->replyLength = value;
+        host->received = 0;
+        host->replying = true;
+    } else if (!host->replying || value != host->received) {
+        // A resent (or out of order) chunk
+        return;
+    }
+
+    size_t count = length - 3;
+    if (sim.config.compressed) {
+        CompressStatus status = compress_decode(&data[3], length - 3,
+          host->reply, host->received, host->replyLength, &count);
+        if (status) {
+            printf("[sim] decompress failed: status=%d\n", status);
+            exit(1);
+        }
+    } else {
+        memcpy(&host->reply[host->received], &data[3], count);
+    }
+    host->received += count;
+
+    if (host->received == host->replyLength) { hostCompleteReply(); }
+}
+
+static void hostReceive(Frame *frame) {
+    Host *host = &sim.host;
+
+    switch (frame->kind) {
+        case FrameKindWriteResponse:
+        case FrameKindCredits:
+            host->writing = false;
+            hostNext();
+            return;
+
+        case FrameKindConfirm:
+            return;
+
+        case FrameKindCommand:
+            break;
+    }
+
+    if (frame->indicate) {
+        pushFrame(&sim.toDevice, FrameKindConfirm, NULL, 0, NULL, 0,
+          sim.now + sim.config.ackLatency);
+    }
+
+    if (sim.config.scheme == SchemeL2cap) {
+        pushFrame(&sim.toDevice, FrameKindCredits, NULL, 0, NULL, 0,
+          sim.now + sim.config.ackLatency);
+        lastFrame(&sim.toDevice)->credits = sduCredits(frame->length);
+    }
+
+    uint8_t *data = frame->data;
+
+    if (data[0] == CMD_START_MESSAGE || data[0] == CMD_CONTINUE_MESSAGE) {
+        if (frame->length < 4) { return; }
+
+        hostReceiveChunk(data, frame->length);
+
+        if (sim.config.scheme == SchemeWindowed) {
+            host->owed++;
+            hostNext();
+        }
+        return;
+    }
+
+    if (data[0] == CMD_RESET) { return; }
+
+    // Response to the capabilities query
+    if (data[0] == 0x00 && frame->length > 25 && data[1] == CMD_QUERY) {
+        hostQueried(data);
+        return;
+    }
+
+    if (data[0] & 0x80) {
+        printf("[sim] error response: status=0x%02x cmd=0x%02x\n", data[0],
+          data[1]);
+        sim.errors++;
+    }
+}
+
+
+///////////////////////////////
+// Link
+
+// Airtime of one LL data packet (and its turnaround), in us
+static uint32_t packetTime() {
+    return ((sim.config.dataLength + LL_OVERHEAD) * 8) / sim.config.phy +
+      LL_TURNAROUND;
+}
+
+// Sends up to a connection event's worth of packets from %%queue%%,
+// delivering each completed frame
+static void transmit(FrameQueue *queue, void (*deliver)(Frame*)) {
+    uint32_t budget = sim.config.interval / packetTime();
+    if (budget > sim.config.packets) { budget = sim.config.packets; }
+    if (budget == 0) { budget = 1; }
+
+    while (budget && queue->count) {
+        Frame *frame = &queue->frames[queue->head];
+        if (frame->ready > sim.now) { break; }
+
+        budget--;
+
+        // A lost packet closes the connection event; it is resent in
+        // the next one
+        if (sim.config.loss > 0 &&
+          (nextRandom() % 1000000) < sim.config.loss * 1000000) {
+            sim.lost++;
+            break;
+        }
+
+        frame->sent++;
+        if (frame->sent < frame->packets) { continue; }
+
+        Frame delivered = *frame;
+        queue->head = (queue->head + 1) % MAX_FRAMES;
+        queue->count--;
+
+        deliver(&delivered);
+    }
+}
+
+static void runConnectionEvent() {
+    if (!sim.connected) { return; }
+
+    sim.connectionEvents++;
+
+    // Peripheral latency; the device may skip events with nothing to send
+    bool listening = (sim.toHost.count > 0 || sim.holding ||
+      (sim.connectionEvents % (sim.latency + 1)) == 0);
+    if (!listening) { return; }
+
+    sim.radioEvents++;
+
+    transmit(&sim.toDevice, deviceReceive);
+    transmit(&sim.toHost, hostReceive);
+}
+
+// Starts the procedures the link policy asks for, returning how long
+// (us) until it needs another look. The simulated central accepts
+// every update.
+static uint64_t updateLink() {
+    uint32_t actions = link_poll(&sim.link, _now(), &sim.linkParams);
+
+    uint64_t instant = sim.now + LINK_PROCEDURE_EVENTS * sim.config.interval;
+    for (uint32_t action = 1; action <= LinkActionParams; action <<= 1) {
+        if (actions & action) {
+            schedule(EventTypeLink, instant, NULL, NULL, action);
+        }
+    }
+
+    return link_timeout(&sim.link, _now()) * 1000ULL;
+}
+
+// A procedure reached its instant
+static void applyLink(uint32_t action) {
+    switch (action) {
+        case LinkActionPhy:
+            sim.config.phy = LINK_PHY_2M;
+            link_phyUpdated(&sim.link, 0, LINK_PHY_2M);
+            break;
+
+        case LinkActionDataLength:
+            sim.config.dataLength = LINK_MAX_DATA_LENGTH;
+            link_dataLengthChanged(&sim.link, LINK_MAX_DATA_LENGTH);
+            break;
+
+        case LinkActionParams: {
+            LinkParams *params = &sim.linkParams;
+            sim.config.interval = params->intervalMin * 1250;
+            sim.latency = params->latency;
+            link_paramsUpdated(&sim.link, 0, params->intervalMin,
+              params->latency, params->timeout, _now());
+            break;
+        }
+    }
+
+    schedulePoll(sim.now);
+}
+
+static void initLink() {
+    link_init(&sim.link, _now());
+    link_phyUpdated(&sim.link, 0, sim.config.phy);
+    link_dataLengthChanged(&sim.link, sim.config.dataLength);
+    link_paramsUpdated(&sim.link, 0, sim.config.interval / 1250,
+      sim.latency, 400, _now());
+}
+
+static size_t deviceChunkSize() {
+    if (sim.config.scheme == SchemeL2cap) { return sim.config.l2capMtu - 3; }
+    return sim.config.mtu - ATT_HEADER - 3;
+}
+
+// The link drops; anything in flight is lost
+static void dropLink() {
+    sim.drops++;
+    sim.connected = false;
+
+    sim.toHost.count = 0;
+    sim.toDevice.count = 0;
+    sim.holding = false;
+
+    fsp_detachConnection(sim.conn);
+    sim.detached = sim.conn;
+    sim.conn = NULL;
+
+    Host *host = &sim.host;
+    host->ready = false;
+    host->writing = false;
+    host->owed = 0;
+
+    schedule(EventTypeReconnect, sim.now + sim.config.reconnect, NULL, NULL,
+      0);
+}
+
+static void reconnectLink() {
+    sim.connected = true;
+    if (sim.config.policy) { initLink(); }
+
+    sim.conn = fsp_openConnection(&transport, NULL, deviceChunkSize(),
+      sim.config.scheme != SchemeL2cap);
+
+    // The same bonded host each time (so it may resume its session)
+    memset(sim.conn->peer, 0x5a, FSP_SECURE_PEER_LENGTH);
+    sim.conn->bonded = true;
+
+    sim.deviceCredits = sim.config.credits;
+
+    hostQuery();
+
+    if (sim.config.drop) {
+        schedule(EventTypeDrop, sim.now + sim.config.drop, NULL, NULL, 0);
+    }
+}
+
+
+///////////////////////////////
+// Simulation
+
+typedef struct Result {
+    double seconds;
+    double throughput;
+    double latencyAvg;
+    double latencyMin;
+    double latencyMax;
+    int completed;
+} Result;
+
+static int compareSamples(const void *a, const void *b) {
+    uint64_t va = *(const uint64_t*)a, vb = *(const uint64_t*)b;
+    return (va > vb) - (va < vb);
+}
+
+// Releases the connection, or the session left detached by a drop
+static void closeLink() {
+    if (sim.conn) {
+        fsp_closeConnection(sim.conn);
+    } else if (sim.detached) {
+        fsp_closeConnection(sim.detached);
+    }
+    sim.conn = NULL;
+    sim.detached = NULL;
+}
+
+static bool simulate(const Config *config, Result *result) {
+    static bool initialized = false;
+
+    memset(&sim, 0, sizeof(sim));
+    sim.config = *config;
+    sim.seed = config->seed ? config->seed: 1;
+
+    fillPayload(replyData, config->replySize, config->text);
+
+    if (!initialized) {
+        fsp_init(&platform);
+        initialized = true;
+    }
+
+    compress_initEncoder(&sim.host.encoder);
+
+    reconnectLink();
+
+    uint64_t lastProgress = 0;
+    int lastCompleted = 0;
+    uint64_t start = 0;
+
+    sim.nextConnectionEvent = 0;
+    schedulePoll(0);
+
+    while (sim.host.completed < config->count) {
+        Event *event = nextEvent();
+
+        if (event && event->time <= sim.nextConnectionEvent) {
+            sim.now = event->time;
+            event->active = false;
+
+            switch (event->type) {
+                case EventTypePoll: {
+                    uint64_t timeout = fsp_poll(true) * 1000ULL;
+                    if (sim.config.policy && sim.connected) {
+                        uint64_t linkTimeout = updateLink();
+                        if (linkTimeout < timeout) { timeout = linkTimeout; }
+                    }
+                    schedulePoll(sim.now + timeout);
+                    break;
+                }
+                case EventTypeWorker:
+                    fsp_processRequest(event->conn, event->request);
+                    break;
+                case EventTypePanel:
+                    runPanel(event->id);
+                    break;
+                case EventTypeDrop:
+                    dropLink();
+                    break;
+                case EventTypeReconnect:
+                    reconnectLink();
+                    break;
+                case EventTypeLink:
+                    if (sim.connected) { applyLink(event->id); }
+                    break;
+                case EventTypeHost:
+                    hostWake();
+                    break;
+            }
+            continue;
+        }
+
+        sim.now = sim.nextConnectionEvent;
+        sim.nextConnectionEvent += sim.config.interval;
+
+        if (sim.host.ready && start == 0) { start = sim.now; }
+
+        runConnectionEvent();
+
+        if (sim.host.completed != lastCompleted) {
+            lastCompleted = sim.host.completed;
+            lastProgress = sim.now;
+        } else if (sim.now - lastProgress > STALL_LIMIT) {
+            printf("[sim] stalled: completed=%d\n", sim.host.completed);
+            closeLink();
+            return false;
+        }
+    }
+
+    closeLink();
+
+    Host *host = &sim.host;
+
+    int samples = host->completed;
+    if (samples > MAX_SAMPLES) { samples = MAX_SAMPLES; }
+    qsort(host->latencies, samples, sizeof(uint64_t), compareSamples);
+
+    uint64_t total = 0;
+    for (int i = 0; i < samples; i++) { total += host->latencies[i]; }
+
+    result->completed = host->completed;
+    result->seconds = (sim.now - start) / 1e6;
+    result->throughput = host->bytes / result->seconds;
+    result->latencyAvg = total / 1e3 / samples;
+    result->latencyMin = host->latencies[0] / 1e3;
+    result->latencyMax = host->latencies[samples - 1] / 1e3;
+
+    return true;
+}
+
+static void printHeader() {
+    printf("%-9s %-5s %6s %6s %8s %6s %10s %9s %9s %9s\n", "scheme",
+      "comp", "req", "reply", "interval", "loss", "bytes/s", "avg(ms)",
+      "min(ms)", "max(ms)");
+}
+
+static void printResult(const Config *config, const Result *result) {
+    printf("%-9s %-5s %6zu %6zu %8.1f %6.3f %10.0f %9.1f %9.1f %9.1f\n",
+      schemeNames[config->scheme], config->compressed ? "yes": "no",
+      config->requestSize, config->replySize, config->interval / 1e3,
+      config->loss, result->throughput, result->latencyAvg,
+      result->latencyMin, result->latencyMax);
+}
+
+
+///////////////////////////////
+// Command line
+
+static void usage() {
+    printf("Usage: fsp-sim [options]\n"
+      "\n"
+      "  --scheme=NAME        indicate, windowed or l2cap (default: indicate)\n"
+      "  --compressed         negotiate CAPS_COMPRESSED\n"
+      "  --mtu=N              ATT MTU (default: 512)\n"
+      "  --l2cap-mtu=N        L2CAP channel MTU (default: 1024)\n"
+      "  --mps=N              L2CAP MPS (default: 247)\n"
+      "  --credits=N          initial L2CAP credits (default: 10)\n"
+      "  --data-length=N      LL data length (default: 251)\n"
+      "  --phy=N              PHY in Mbps; 1 or 2 (default: 2)\n"
+      "  --interval=MS        connection interval (default: 15)\n"
+      "  --packets=N          packets per connection event (default: 6)\n"
+      "  --loss=P             LL packet loss probability (default: 0)\n"
+      "  --ack-latency=MS     stack acknowledgement latency (default: 1)\n"
+      "  --process=MS         panel processing time (default: 0)\n"
+      "  --window=N           windowed chunks in flight (default: 6)\n"
+      "  --request=N          request payload bytes (default: 256)\n"
+      "  --reply=N            reply payload bytes (default: 4096)\n"
+      "  --count=N            messages (default: 20)\n"
+      "  --text               compressible payloads\n"
+      "  --seed=N             random seed (default: 1)\n"
+      "  --drop=MS            drop the link this often (default: never)\n"
+      "  --reconnect=MS       time to reconnect after a drop (default: 500)\n"
+      "  --policy             adapt the PHY, data length and interval\n"
+      "  --idle=MS            host idle time between messages (default: 0)\n"
+      "  --bench              compare every scheme over a range of links\n");
+}
+
+static bool parseOption(Config *config, const char *arg, bool *bench) {
+    const char *value = strchr(arg, '=');
+    value = value ? value + 1: "";
+
+    #define OPTION(name)    (strncmp(arg, name, strlen(name)) == 0)
+
+    if (OPTION("--scheme=")) {
+        if (strcmp(value, "indicate") == 0) {
+            config->scheme = SchemeIndicate;
+        } else if (strcmp(value, "windowed") == 0) {
+            config->scheme = SchemeWindowed;
+        } else if (strcmp(value, "l2cap") == 0) {
+            config->scheme = SchemeL2cap;
+        } else {
+            return false;
+        }
+    } else if (OPTION("--compressed")) {
+        config->compressed = true;
+    } else if (OPTION("--mtu=")) {
+        config->mtu = atoi(value);
+    } else if (OPTION("--l2cap-mtu=")) {
+        config->l2capMtu = atoi(value);
+    } else if (OPTION("--mps=")) {
+        config->mps = atoi(value);
+    } else if (OPTION("--credits=")) {
+        config->credits = atoi(value);
+    } else if (OPTION("--data-length=")) {
+        config->dataLength = atoi(value);
+    } else if (OPTION("--phy=")) {
+        config->phy = atoi(value);
+    } else if (OPTION("--interval=")) {
+        config->interval = atof(value) * 1000;
+    } else if (OPTION("--packets=")) {
+        config->packets = atoi(value);
+    } else if (OPTION("--loss=")) {
+        config->loss = atof(value);
+    } else if (OPTION("--ack-latency=")) {
+        config->ackLatency = atof(value) * 1000;
+    } else if (OPTION("--process=")) {
+        config->processTime = atof(value) * 1000;
+    } else if (OPTION("--window=")) {
+        config->window = atoi(value);
+    } else if (OPTION("--request=")) {
+        config->requestSize = atoi(value);
+    } else if (OPTION("--reply=")) {
+        config->replySize = atoi(value);
+    } else if (OPTION("--count=")) {
+        config->count = atoi(value);
+    } else if (OPTION("--text")) {
+        config->text = true;
+    } else if (OPTION("--seed=")) {
+        config->seed = atoi(value);
+    } else if (OPTION("--drop=")) {
+        config->drop = atof(value) * 1000;
+    } else if (OPTION("--reconnect=")) {
+        config->reconnect = atof(value) * 1000;
+    } else if (OPTION("--policy")) {
+        config->policy = true;
+    } else if (OPTION("--idle=")) {
+        config->idle = atof(value) * 1000;
+    } else if (OPTION("--bench")) {
+        *bench = true;
+    } else {
+        return false;
+    }
+
+    #undef OPTION
+
+    return true;
+}
+
+static bool validate(const Config *config) {
+    if (config->mtu < 23 || config->mtu > FSP_MAX_FRAME + ATT_HEADER) {
+        printf("mtu must be 23 to %d\n", FSP_MAX_FRAME + ATT_HEADER);
+        return false;
+    }
+    if (config->l2capMtu < 23 || config->l2capMtu > FSP_MAX_FRAME) {
+        printf("l2cap-mtu must be 23 to %d\n", FSP_MAX_FRAME);
+        return false;
+    }
+    if (config->dataLength < 27 || config->dataLength > 251) {
+        printf("data-length must be 27 to 251\n");
+        return false;
+    }
+    if (config->phy != 1 && config->phy != 2) {
+        printf("phy must be 1 or 2\n");
+        return false;
+    }
+    if (config->requestSize + 64 > MAX_MESSAGE_SIZE ||
+      config->replySize + 64 > MAX_MESSAGE_SIZE) {
+        printf("request and reply must be under %d\n", MAX_MESSAGE_SIZE - 64);
+        return false;
+    }
+    if (config->count < 1 || config->interval == 0 || config->mps == 0) {
+        printf("count, interval and mps must be positive\n");
+        return false;
+    }
+    if (config->credits < divideCeil(config->l2capMtu + SDU_HEADER,
+      config->mps)) {
+        printf("credits must cover one SDU\n");
+        return false;
+    }
+    return true;
+}
+
+static int bench(const Config *base) {
+    uint32_t intervals[] = { 7500, 15000, 30000 };
+    double losses[] = { 0, 0.02 };
+
+    printHeader();
+
+    for (int l = 0; l < 2; l++) {
+        for (int i = 0; i < 3; i++) {
+            for (int s = 0; s < 3; s++) {
+                for (int c = 0; c < 2; c++) {
+                    Config config = *base;
+                    config.scheme = s;
+                    config.compressed = c;
+                    config.interval = intervals[i];
+                    config.loss = losses[l];
+
+                    Result result;
+                    if (!simulate(&config, &result)) { return 1; }
+                    printResult(&config, &result);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Config config = {
+        .scheme = SchemeIndicate,
+        .mtu = 512,
+        .l2capMtu = 1024,
+        .mps = 247,
+        .credits = 10,
+        .dataLength = 251,
+        .phy = 2,
+        .interval = 15000,
+        .packets = 6,
+        .ackLatency = 1000,
+        .window = 6,
+        .requestSize = 256,
+        .replySize = 4096,
+        .count = 20,
+        .seed = 1,
+        .reconnect = 500000,
+    };
+
+    bool runBench = false;
+    for (int i = 1; i < argc; i++) {
+        if (!parseOption(&config, argv[i], &runBench)) {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!validate(&config)) { return 1; }
+
+    if (runBench) { return bench(&config); }
+
+    Result result;
+    if (!simulate(&config, &result)) { return 1; }
+
+    printHeader();
+    printResult(&config, &result);
+    printf("\n%d messages in %.3fs; %u packets lost, %u error responses\n",
+      result.completed, result.seconds, sim.lost, sim.errors);
+    if (config.drop) {
+        printf("%u link drops, %u sessions resumed\n", sim.drops,
+          sim.resumes);
+    }
+    if (config.policy) {
+        LinkPolicy *link = &sim.link;
+        printf("link %s: phy=%dM dataLength=%d interval=%.2fms latency=%d; "
+          "%d updates (%d rejected), %llu of %llu events used\n",
+          link_modeName(link->mode), link->phy, link->dataLength,
+          link->interval * 1.25, link->latency, link->requests,
+          link->rejected, (unsigned long long)sim.radioEvents,
+          (unsigned long long)sim.connectionEvents);
+    }
+
+    return 0;
+}